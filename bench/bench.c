@@ -0,0 +1,410 @@
+/*
+** Copyright 2014 Guillaume Filion, Eduard Valera Zorita and Pol Cusco.
+**
+** License:
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+*/
+
+// Benchmark harness for the starcode pipeline. Generates synthetic
+// datasets with controllable read length, error rate and abundance
+// skew, then times each phase of the pipeline in isolation: parsing,
+// sorting, trie construction, search throughput at tau 1-4, the
+// three clustering algorithms and the output. The results are
+// printed as tab-separated records
+//
+//    scenario <TAB> phase <TAB> seconds <TAB> max_rss_kb
+//
+// so that runs of different releases can be diffed or plotted
+// directly. The RSS column is the high-water mark of the process at
+// the end of the phase (it only grows), not a per-phase figure.
+//
+// Usage: ./runbench [-N reads] [-L length] [-c centroids]
+//                   [-e error rate] [-k skew] [-t threads] [-s seed]
+//
+// Without arguments, three canned scenarios are run (short reads,
+// long reads, skewed abundances). Passing any dataset option runs a
+// single custom scenario instead.
+
+#define _GNU_SOURCE
+#include <math.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "starcode.c"
+
+#define BENCH_INPUT "bench_input.txt"
+
+static double
+now
+(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+
+static long
+maxrss_kb
+(void)
+{
+   struct rusage ru;
+   getrusage(RUSAGE_SELF, &ru);
+   return ru.ru_maxrss;
+}
+
+
+static void
+report
+(
+   const char * scenario,
+   const char * phase,
+   double       seconds
+)
+{
+   fprintf(stdout, "%s\t%s\t%.4f\t%ld\n", scenario, phase, seconds,
+         maxrss_kb());
+   fflush(stdout);
+}
+
+
+static void
+generate_reads
+(
+   const char * path,
+         int    nreads,
+         int    ncentroids,
+         int    seqlen,
+         double error_rate,
+         double skew,
+   unsigned int seed
+)
+// SYNOPSIS:
+//   Writes 'nreads' raw sequences to 'path'. The reads are noisy
+//   copies of 'ncentroids' random centroids: every position is
+//   substituted with probability 'error_rate', and the centroids
+//   are drawn with Zipf-like weights 1/rank^'skew' (0 is uniform).
+{
+
+   char **centroids = malloc(ncentroids * sizeof(char *));
+   double *cumw = malloc(ncentroids * sizeof(double));
+   if (centroids == NULL || cumw == NULL) {
+      alert();
+      krash();
+   }
+
+   double total = 0.0;
+   for (int i = 0 ; i < ncentroids ; i++) {
+      centroids[i] = malloc(seqlen + 1);
+      if (centroids[i] == NULL) {
+         alert();
+         krash();
+      }
+      for (int j = 0 ; j < seqlen ; j++) {
+         centroids[i][j] = "ACGT"[rand_r(&seed) % 4];
+      }
+      centroids[i][seqlen] = '\0';
+      total += 1.0 / pow(i+1, skew);
+      cumw[i] = total;
+   }
+
+   FILE *f = fopen(path, "w");
+   if (f == NULL) {
+      alert();
+      krash();
+   }
+
+   char read[M] = {0};
+   for (int r = 0 ; r < nreads ; r++) {
+      // Draw a centroid by its cumulative weight.
+      double x = total * ((double) rand_r(&seed) / RAND_MAX);
+      int lo = 0;
+      int hi = ncentroids - 1;
+      while (lo < hi) {
+         int mid = (lo + hi) / 2;
+         if (cumw[mid] < x) lo = mid + 1;
+         else               hi = mid;
+      }
+      memcpy(read, centroids[lo], seqlen + 1);
+      for (int j = 0 ; j < seqlen ; j++) {
+         if ((double) rand_r(&seed) / RAND_MAX < error_rate) {
+            read[j] = "ACGT"[rand_r(&seed) % 4];
+         }
+      }
+      fprintf(f, "%s\n", read);
+   }
+
+   fclose(f);
+   for (int i = 0 ; i < ncentroids ; i++) free(centroids[i]);
+   free(centroids);
+   free(cumw);
+
+}
+
+
+static void
+reset_clustering
+(
+   gstack_t * uSQ
+)
+// Clears the cluster assignments so that another algorithm can run
+// on the same match records.
+{
+   for (int i = 0 ; i < uSQ->nitems ; i++) {
+      useq_t *u = (useq_t *) uSQ->items[i];
+      u->canonical = NULL;
+      u->sphere_c = 0;
+      u->sphere_d = 0;
+   }
+}
+
+
+static void
+reset_matches
+(
+   gstack_t * uSQ
+)
+// Destroys the match records so that the search can run again at
+// another tau on the same sequences.
+{
+   for (int i = 0 ; i < uSQ->nitems ; i++) {
+      useq_t *u = (useq_t *) uSQ->items[i];
+      if (u->matches != NULL) {
+         destroy_tower(u->matches);
+         u->matches = NULL;
+      }
+   }
+   reset_clustering(uSQ);
+}
+
+
+static void
+run_scenario
+(
+   const char * name,
+         int    nreads,
+         int    ncentroids,
+         int    seqlen,
+         double error_rate,
+         double skew,
+         int    thrmax,
+   unsigned int seed
+)
+{
+
+   double t0;
+
+   // Generate the dataset.
+   t0 = now();
+   generate_reads(BENCH_INPUT, nreads, ncentroids, seqlen,
+         error_rate, skew, seed);
+   report(name, "generate", now() - t0);
+
+   // Parse (includes the on-the-fly deduplication of the readers).
+   FILE *f = fopen(BENCH_INPUT, "r");
+   if (f == NULL) {
+      alert();
+      krash();
+   }
+   t0 = now();
+   gstack_t *uSQ = read_file(f, NULL, 0, thrmax);
+   report(name, "read_file", now() - t0);
+   fclose(f);
+
+   // Sort/reduce.
+   t0 = now();
+   uSQ->nitems = seqsort((useq_t **) uSQ->items, uSQ->nitems, thrmax);
+   report(name, "seqsort", now() - t0);
+
+   int ntries = 3 * thrmax + (thrmax % 2 == 0);
+   if (uSQ->nitems < ntries) {
+      ntries = 1;
+      thrmax = 1;
+   }
+
+   // Pad sequences.
+   int med = -1;
+   t0 = now();
+   int height = pad_useq(uSQ, &med);
+   report(name, "pad_useq", now() - t0);
+
+   // Trie construction alone: one bulk-built trie over all the
+   // sequences, as in the build jobs of the plan.
+   t0 = now();
+   long nnodes = count_trie_nodes((useq_t **) uSQ->items,
+         0, uSQ->nitems);
+   ctrie_t *trie = new_ctrie(height, nnodes+1, uSQ->nitems);
+   if (trie == NULL) {
+      alert();
+      krash();
+   }
+   const char *prev = NULL;
+   uint32_t spine[M];
+   for (int i = 0 ; i < uSQ->nitems ; i++) {
+      useq_t *u = (useq_t *) uSQ->items[i];
+      void **data = insert_string_ctrie_sorted(trie, u->seq,
+            prev, spine);
+      if (data == NULL) {
+         alert();
+         krash();
+      }
+      *data = u;
+      prev = u->seq;
+   }
+   report(name, "trie_build", now() - t0);
+   destroy_ctrie(trie, NULL);
+
+   // Search throughput at tau 1-4 (build plus all-pairs query, as
+   // in the pipeline).
+   CLUSTERALG = MP_CLUSTER;
+   for (int tau = 1 ; tau <= 4 ; tau++) {
+      char phase[32];
+      snprintf(phase, 32, "search_tau%d", tau);
+      t0 = now();
+      mtplan_t *mtplan = plan_mt(tau, med, ntries, uSQ);
+      run_plan(mtplan, 0, thrmax);
+      report(name, phase, now() - t0);
+      reset_matches(uSQ);
+   }
+
+   // Clustering algorithms, each on fresh match records built at
+   // the tau of the "auto" mode (the builds are not timed). The
+   // spheres and components algorithms share bidirectional records;
+   // message passing runs last because it transfers the counts.
+   int tau = med > 160 ? 8 : 2 + med/30;
+
+   CLUSTERALG = SPHERES_CLUSTER;
+   mtplan_t *mtplan = plan_mt(tau, med, ntries, uSQ);
+   run_plan(mtplan, 0, thrmax);
+
+   t0 = now();
+   sphere_clustering(uSQ);
+   report(name, "cluster_spheres", now() - t0);
+   reset_clustering(uSQ);
+
+   CLUSTERALG = COMPONENTS_CLUSTER;
+   t0 = now();
+   gstack_t *clusters = compute_clusters(uSQ);
+   report(name, "cluster_components", now() - t0);
+   for (int i = 0 ; i < clusters->nitems ; i++) {
+      free(clusters->items[i]);
+   }
+   free(clusters);
+   reset_matches(uSQ);
+
+   // The spheres sort changed the order of the stack: restore the
+   // sort order before building a new plan.
+   uSQ->nitems = seqsort((useq_t **) uSQ->items, uSQ->nitems, thrmax);
+
+   CLUSTERALG = MP_CLUSTER;
+   mtplan = plan_mt(tau, med, ntries, uSQ);
+   run_plan(mtplan, 0, thrmax);
+
+   t0 = now();
+   message_passing_clustering(uSQ, thrmax);
+   report(name, "cluster_mp", now() - t0);
+
+   // Output of the clusters (written to the void).
+   unpad_useq(uSQ);
+   qsort(uSQ->items, uSQ->nitems, sizeof(useq_t *), canonical_order);
+   FILE *out = fopen("/dev/null", "w");
+   if (out == NULL) {
+      alert();
+      krash();
+   }
+   t0 = now();
+   useq_t *canonical = NULL;
+   for (int i = 0 ; i < uSQ->nitems ; i++) {
+      useq_t *u = (useq_t *) uSQ->items[i];
+      if (u->canonical == NULL) break;
+      if (u->canonical != canonical) {
+         canonical = u->canonical;
+         fprintf(out, "%s%s\t%d\t%s", i == 0 ? "" : "\n",
+               canonical->seq, canonical->count, u->seq);
+      }
+      else {
+         fprintf(out, ",%s", u->seq);
+      }
+   }
+   fprintf(out, "\n");
+   report(name, "output", now() - t0);
+   fclose(out);
+
+   // Clean.
+   for (int i = 0 ; i < uSQ->nitems ; i++) {
+      destroy_useq(uSQ->items[i]);
+   }
+   free(uSQ);
+   unlink(BENCH_INPUT);
+
+}
+
+
+int
+main
+(
+   int argc,
+   char **argv
+)
+{
+
+   int nreads = 50000;
+   int ncentroids = 1000;
+   int seqlen = 20;
+   double error_rate = 0.02;
+   double skew = 1.0;
+   int thrmax = 4;
+   unsigned int seed = 123;
+   int custom = 0;
+
+   int c;
+   while ((c = getopt(argc, argv, "N:L:c:e:k:t:s:h")) != -1) {
+      switch (c) {
+      case 'N': nreads = atoi(optarg); custom = 1; break;
+      case 'L': seqlen = atoi(optarg); custom = 1; break;
+      case 'c': ncentroids = atoi(optarg); custom = 1; break;
+      case 'e': error_rate = atof(optarg); custom = 1; break;
+      case 'k': skew = atof(optarg); custom = 1; break;
+      case 't': thrmax = atoi(optarg); break;
+      case 's': seed = (unsigned int) atoi(optarg); break;
+      default:
+         fprintf(stderr, "usage: %s [-N reads] [-L length] "
+               "[-c centroids] [-e error rate] [-k skew] "
+               "[-t threads] [-s seed]\n", argv[0]);
+         return 1;
+      }
+   }
+
+   if (nreads < 1 || ncentroids < 1 || seqlen < 1 ||
+         seqlen > MAXBRCDLEN || thrmax < 1) {
+      fprintf(stderr, "invalid benchmark parameters\n");
+      return 1;
+   }
+
+   fprintf(stdout, "# %s\n", VERSION);
+   fprintf(stdout, "# scenario\tphase\tseconds\tmax_rss_kb\n");
+
+   if (custom) {
+      run_scenario("custom", nreads, ncentroids, seqlen,
+            error_rate, skew, thrmax, seed);
+      return 0;
+   }
+
+   run_scenario("short", 50000, 1000, 20, 0.02, 1.0, thrmax, seed);
+   run_scenario("long", 20000, 500, 100, 0.01, 1.0, thrmax, seed);
+   run_scenario("skewed", 50000, 3000, 30, 0.03, 2.0, thrmax, seed);
+
+   return 0;
+
+}
@@ -21,17 +21,21 @@
 **
 */
 
+#define _GNU_SOURCE
 #include <execinfo.h>
 #include <getopt.h>
 #include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <zlib.h>
 #include "starcode.h"
 
 #define ERRM "starcode error:"
 
 // Prototypes for utilities of the main.
+FILE * fopen_output (const char *);
 char * outname (char *);
 void   say_usage (void);
 void   say_version (void);
@@ -47,6 +51,10 @@ char *USAGE =
 "    -t --threads: number of concurrent threads (default 1)\n"
 "    -q --quiet: quiet output (default verbose)\n"
 "    -v --version: display version and exit\n"
+"       --stats: print phase timings and search statistics\n"
+"       --max-mem: parse memory budget, e.g. 500M or 4G; unique\n"
+"               sequences over the budget are spilled to temporary\n"
+"               files and merged back in a streaming pass\n"
 "\n"
 "  cluster options: (default algorithm: message passing)\n"
 "    -r --cluster-ratio: min size ratio for merging clusters in\n"
@@ -69,7 +77,53 @@ char *USAGE =
 "  output format options\n"
 "       --non-redundant: remove redundant sequences from input file(s)\n"
 "       --print-clusters: outputs cluster compositions\n"
-"       --seq-id: print sequence id numbers (1-based)\n";
+"       --seq-id: print sequence id numbers (1-based)\n"
+"\n"
+"  UMI demultiplexing options\n"
+"       --umi-len: length of the UMI at the beginning of the\n"
+"              reads; enables the combined workflow that clusters\n"
+"              the UMIs and the sequences separately and pairs\n"
+"              the clusters (single-end input only)\n"
+"       --umi-d: maximum Levenshtein distance between UMIs\n"
+"              (default 0)\n"
+"       --seq-trim: cluster only this many characters of the\n"
+"              sequences, 0 to disable trimming (default 50)\n"
+"\n"
+"  reference matching options (no clustering)\n"
+"       --ref: match the input against this reference file and\n"
+"              print the best reference of every input sequence\n"
+"              (output: sequence, reference, distance)\n"
+"       --save-index: with --ref, save the reference trie to\n"
+"              this file after building it\n"
+"       --load-index: with --ref, read the reference trie from\n"
+"              this file instead of building it\n"
+"\n"
+"  incremental clustering options (message passing only)\n"
+"       --state: read the clustering state saved by a previous\n"
+"              run and merge the input into it\n"
+"       --save-state: write the updated clustering state to\n"
+"              this file\n"
+"       --max-drift: fraction of novel sequences above which the\n"
+"              clusters are recomputed from scratch (default 0.1)\n"
+"\n"
+"  sharded clustering options (message passing only)\n"
+"       --shard-dir: directory holding the shard files (required\n"
+"              by the three options below)\n"
+"       --shard-prep: split the sorted input into this many shard\n"
+"              files plus a manifest\n"
+"       --shard-worker: search this shard against itself and the\n"
+"              later shards, recording the match edges (workers\n"
+"              are independent processes and may run on separate\n"
+"              machines over a shared directory)\n"
+"       --shard-merge: stitch the recorded edges and cluster\n"
+"\n"
+"  checkpoint options (plain clustering only)\n"
+"       --checkpoint: write the sorted unique sequences, then the\n"
+"              match edges, to this file as the phases complete\n"
+"       --resume: load a checkpoint file and skip the completed\n"
+"              phases; when the match edges are present only the\n"
+"              clustering is re-run, so the cluster algorithm and\n"
+"              ratio may differ from the original run\n";
 
 
 void say_usage(void) { fprintf(stderr, "%s\n", USAGE); }
@@ -119,6 +173,54 @@ outname
 }
 
 
+// Glue between 'gzwrite()' and the stream functions so that the
+// output can go through the regular fprintf() calls of starcode().
+static ssize_t
+gz_cookie_write
+(
+   void       * cookie,
+   const char * buf,
+   size_t       len
+)
+{
+   int n = gzwrite((gzFile) cookie, buf, len);
+   return n > 0 ? n : -1;
+}
+
+static int
+gz_cookie_close
+(
+   void * cookie
+)
+{
+   return gzclose((gzFile) cookie) == Z_OK ? 0 : EOF;
+}
+
+
+FILE *
+fopen_output
+(
+   const char * path
+)
+// Opens an output file for writing, compressing on the fly when the
+// name ends with ".gz". Returns NULL on failure, like fopen().
+{
+   size_t len = strlen(path);
+   if (len > 3 && strcmp(path + len - 3, ".gz") == 0) {
+      gzFile gz = gzopen(path, "w");
+      if (gz == NULL) return NULL;
+      cookie_io_functions_t io = {
+         .write = gz_cookie_write,
+         .close = gz_cookie_close,
+      };
+      FILE *f = fopencookie(gz, "w", io);
+      if (f == NULL) gzclose(gz);
+      return f;
+   }
+   return fopen(path, "w");
+}
+
+
 int
 main(
    int argc,
@@ -135,6 +237,7 @@ main(
    static int cl_flag = 0;
    static int id_flag = 0;
    static int cp_flag = 0;
+   static int st_flag = 0;
 
    // Unset flags (value -1).
    int dist = -1;
@@ -149,6 +252,25 @@ main(
    char * output  = UNSET;
    char * output1 = UNSET;
    char * output2 = UNSET;
+   char * ref     = UNSET;
+   char * saveidx = UNSET;
+   char * loadidx = UNSET;
+   char * state   = UNSET;
+   char * savest  = UNSET;
+   char * sharddir = UNSET;
+   char * maxmem  = UNSET;
+
+   double max_drift = -1;
+   int shard_prep = -1;
+   int shard_worker = -1;
+   static int sm_flag = 0;
+
+   int umi_len = -1;
+   int umi_d = -1;
+   int seq_trim = -1;
+
+   char * chkpt  = UNSET;
+   char * resume = UNSET;
 
 
    if (argc == 1 && isatty(0)) {
@@ -177,6 +299,23 @@ main(
          {"threads",           required_argument,        0, 't'},
          {"output1",           required_argument,        0, '3'},
          {"output2",           required_argument,        0, '4'},
+         {"ref",               required_argument,        0, '5'},
+         {"save-index",        required_argument,        0, '6'},
+         {"load-index",        required_argument,        0, '7'},
+         {"state",             required_argument,        0, '8'},
+         {"save-state",        required_argument,        0, '9'},
+         {"max-drift",         required_argument,        0, '0'},
+         {"shard-dir",         required_argument,        0, 'A'},
+         {"shard-prep",        required_argument,        0, 'B'},
+         {"shard-worker",      required_argument,        0, 'C'},
+         {"shard-merge",       no_argument,       &sm_flag,  1 },
+         {"stats",             no_argument,       &st_flag,  1 },
+         {"max-mem",           required_argument,        0, 'D'},
+         {"umi-len",           required_argument,        0, 'E'},
+         {"umi-d",             required_argument,        0, 'F'},
+         {"seq-trim",          required_argument,        0, 'G'},
+         {"checkpoint",        required_argument,        0, 'H'},
+         {"resume",            required_argument,        0, 'I'},
 
          {0, 0, 0, 0}
       };
@@ -237,6 +376,224 @@ main(
          break;
 
 
+      case '5':
+         if (ref == UNSET) {
+            ref = optarg;
+         }
+         else {
+            fprintf(stderr, "%s --ref set more than once\n", ERRM);
+            say_usage();
+            return EXIT_FAILURE;
+         }
+         break;
+
+      case '6':
+         if (saveidx == UNSET) {
+            saveidx = optarg;
+         }
+         else {
+            fprintf(stderr,
+                  "%s --save-index set more than once\n", ERRM);
+            say_usage();
+            return EXIT_FAILURE;
+         }
+         break;
+
+      case '7':
+         if (loadidx == UNSET) {
+            loadidx = optarg;
+         }
+         else {
+            fprintf(stderr,
+                  "%s --load-index set more than once\n", ERRM);
+            say_usage();
+            return EXIT_FAILURE;
+         }
+         break;
+
+      case '8':
+         if (state == UNSET) {
+            state = optarg;
+         }
+         else {
+            fprintf(stderr, "%s --state set more than once\n", ERRM);
+            say_usage();
+            return EXIT_FAILURE;
+         }
+         break;
+
+      case '9':
+         if (savest == UNSET) {
+            savest = optarg;
+         }
+         else {
+            fprintf(stderr,
+                  "%s --save-state set more than once\n", ERRM);
+            say_usage();
+            return EXIT_FAILURE;
+         }
+         break;
+
+      case '0':
+         if (max_drift < 0) {
+            max_drift = atof(optarg);
+            if (max_drift <= 0 || max_drift > 1) {
+               fprintf(stderr, "%s --max-drift must be between "
+                     "0 and 1\n", ERRM);
+               say_usage();
+               return EXIT_FAILURE;
+            }
+         }
+         else {
+            fprintf(stderr,
+                  "%s --max-drift set more than once\n", ERRM);
+            say_usage();
+            return EXIT_FAILURE;
+         }
+         break;
+
+      case 'A':
+         if (sharddir == UNSET) {
+            sharddir = optarg;
+         }
+         else {
+            fprintf(stderr,
+                  "%s --shard-dir set more than once\n", ERRM);
+            say_usage();
+            return EXIT_FAILURE;
+         }
+         break;
+
+      case 'B':
+         if (shard_prep < 0) {
+            shard_prep = atoi(optarg);
+            if (shard_prep < 1) {
+               fprintf(stderr, "%s --shard-prep must be a positive "
+                     "integer\n", ERRM);
+               say_usage();
+               return EXIT_FAILURE;
+            }
+         }
+         else {
+            fprintf(stderr,
+                  "%s --shard-prep set more than once\n", ERRM);
+            say_usage();
+            return EXIT_FAILURE;
+         }
+         break;
+
+      case 'C':
+         if (shard_worker < 0) {
+            shard_worker = atoi(optarg);
+            if (shard_worker < 0 || strspn(optarg, "0123456789") !=
+                  strlen(optarg)) {
+               fprintf(stderr, "%s --shard-worker must be a "
+                     "non-negative integer\n", ERRM);
+               say_usage();
+               return EXIT_FAILURE;
+            }
+         }
+         else {
+            fprintf(stderr,
+                  "%s --shard-worker set more than once\n", ERRM);
+            say_usage();
+            return EXIT_FAILURE;
+         }
+         break;
+
+      case 'D':
+         if (maxmem == UNSET) {
+            maxmem = optarg;
+         }
+         else {
+            fprintf(stderr,
+                  "%s --max-mem set more than once\n", ERRM);
+            say_usage();
+            return EXIT_FAILURE;
+         }
+         break;
+
+      case 'E':
+         if (umi_len < 0) {
+            umi_len = atoi(optarg);
+            if (umi_len < 1) {
+               fprintf(stderr, "%s --umi-len must be a positive "
+                     "integer\n", ERRM);
+               say_usage();
+               return EXIT_FAILURE;
+            }
+         }
+         else {
+            fprintf(stderr, "%s --umi-len set more than once\n", ERRM);
+            say_usage();
+            return EXIT_FAILURE;
+         }
+         break;
+
+      case 'F':
+         if (umi_d < 0) {
+            umi_d = atoi(optarg);
+            if (umi_d < 0 || strspn(optarg, "0123456789") !=
+                  strlen(optarg)) {
+               fprintf(stderr, "%s --umi-d must be a non-negative "
+                     "integer\n", ERRM);
+               say_usage();
+               return EXIT_FAILURE;
+            }
+            if (umi_d > STARCODE_MAX_TAU) {
+               fprintf(stderr, "%s --umi-d cannot exceed %d\n",
+                     ERRM, STARCODE_MAX_TAU);
+               return EXIT_FAILURE;
+            }
+         }
+         else {
+            fprintf(stderr, "%s --umi-d set more than once\n", ERRM);
+            say_usage();
+            return EXIT_FAILURE;
+         }
+         break;
+
+      case 'G':
+         if (seq_trim < 0) {
+            seq_trim = atoi(optarg);
+            if (seq_trim < 0 || strspn(optarg, "0123456789") !=
+                  strlen(optarg)) {
+               fprintf(stderr, "%s --seq-trim must be a non-negative "
+                     "integer\n", ERRM);
+               say_usage();
+               return EXIT_FAILURE;
+            }
+         }
+         else {
+            fprintf(stderr, "%s --seq-trim set more than once\n", ERRM);
+            say_usage();
+            return EXIT_FAILURE;
+         }
+         break;
+
+      case 'H':
+         if (chkpt == UNSET) {
+            chkpt = optarg;
+         }
+         else {
+            fprintf(stderr,
+                  "%s --checkpoint set more than once\n", ERRM);
+            say_usage();
+            return EXIT_FAILURE;
+         }
+         break;
+
+      case 'I':
+         if (resume == UNSET) {
+            resume = optarg;
+         }
+         else {
+            fprintf(stderr, "%s --resume set more than once\n", ERRM);
+            say_usage();
+            return EXIT_FAILURE;
+         }
+         break;
+
       case 'd':
          if (dist < 0) {
             dist = atoi(optarg);
@@ -391,6 +748,152 @@ main(
       say_usage();
       return EXIT_FAILURE;
    }
+   if (ref != UNSET && (input1 != UNSET || input2 != UNSET)) {
+      fprintf(stderr, "%s --ref does not support paired-end "
+            "input\n", ERRM);
+      say_usage();
+      return EXIT_FAILURE;
+   }
+   if (ref != UNSET && (nr_flag || cl_flag || id_flag ||
+            sp_flag || cp_flag)) {
+      fprintf(stderr, "%s --ref is incompatible with the cluster "
+            "and output format options\n", ERRM);
+      say_usage();
+      return EXIT_FAILURE;
+   }
+   if (ref == UNSET && (saveidx != UNSET || loadidx != UNSET)) {
+      fprintf(stderr, "%s --save-index and --load-index require "
+            "--ref\n", ERRM);
+      say_usage();
+      return EXIT_FAILURE;
+   }
+   if (saveidx != UNSET && loadidx != UNSET) {
+      fprintf(stderr, "%s --save-index and --load-index are "
+            "incompatible\n", ERRM);
+      say_usage();
+      return EXIT_FAILURE;
+   }
+   if ((state != UNSET || savest != UNSET) &&
+         (input1 != UNSET || input2 != UNSET)) {
+      fprintf(stderr, "%s --state and --save-state do not support "
+            "paired-end input\n", ERRM);
+      say_usage();
+      return EXIT_FAILURE;
+   }
+   if ((state != UNSET || savest != UNSET) && (ref != UNSET ||
+            nr_flag || cl_flag || id_flag || sp_flag || cp_flag)) {
+      fprintf(stderr, "%s --state and --save-state are incompatible "
+            "with --ref and the cluster and output format options\n",
+            ERRM);
+      say_usage();
+      return EXIT_FAILURE;
+   }
+   if (max_drift >= 0 && state == UNSET && savest == UNSET) {
+      fprintf(stderr, "%s --max-drift requires --state or "
+            "--save-state\n", ERRM);
+      say_usage();
+      return EXIT_FAILURE;
+   }
+   int nshardopts = (shard_prep >= 0) + (shard_worker >= 0) + sm_flag;
+   if (nshardopts > 1) {
+      fprintf(stderr, "%s --shard-prep, --shard-worker and "
+            "--shard-merge are incompatible\n", ERRM);
+      say_usage();
+      return EXIT_FAILURE;
+   }
+   if (nshardopts == 1 && sharddir == UNSET) {
+      fprintf(stderr, "%s the shard options require --shard-dir\n",
+            ERRM);
+      say_usage();
+      return EXIT_FAILURE;
+   }
+   if (sharddir != UNSET && nshardopts == 0) {
+      fprintf(stderr, "%s --shard-dir requires --shard-prep, "
+            "--shard-worker or --shard-merge\n", ERRM);
+      say_usage();
+      return EXIT_FAILURE;
+   }
+   if (nshardopts == 1 && (ref != UNSET || state != UNSET ||
+            savest != UNSET || input1 != UNSET || input2 != UNSET ||
+            nr_flag || cl_flag || id_flag || sp_flag || cp_flag)) {
+      fprintf(stderr, "%s the shard options are incompatible with "
+            "--ref, --state and the cluster and output format "
+            "options\n", ERRM);
+      say_usage();
+      return EXIT_FAILURE;
+   }
+   if ((umi_d >= 0 || seq_trim >= 0) && umi_len < 0) {
+      fprintf(stderr, "%s --umi-d and --seq-trim require "
+            "--umi-len\n", ERRM);
+      say_usage();
+      return EXIT_FAILURE;
+   }
+   if (umi_len >= 0 && (ref != UNSET || state != UNSET ||
+            savest != UNSET || nshardopts == 1 || input1 != UNSET ||
+            input2 != UNSET || maxmem != UNSET || nr_flag ||
+            cl_flag)) {
+      fprintf(stderr, "%s --umi-len applies to plain single-end "
+            "clustering only (--seq-id and the -d, -r, -s, -c, -t "
+            "options are supported)\n", ERRM);
+      say_usage();
+      return EXIT_FAILURE;
+   }
+   if (maxmem != UNSET && (ref != UNSET || state != UNSET ||
+            savest != UNSET || nshardopts == 1 || input1 != UNSET ||
+            input2 != UNSET || nr_flag)) {
+      // The spill drops the 'info' field (headers), which the
+      // paired-end and non-redundant outputs need, and the other
+      // modes have their own pipelines.
+      fprintf(stderr, "%s --max-mem applies to plain clustering "
+            "only (not --ref, --state, the shard options, "
+            "paired-end input or --non-redundant)\n", ERRM);
+      say_usage();
+      return EXIT_FAILURE;
+   }
+
+   if ((chkpt != UNSET || resume != UNSET) && (ref != UNSET ||
+            state != UNSET || savest != UNSET || nshardopts == 1 ||
+            input1 != UNSET || input2 != UNSET || umi_len >= 0 ||
+            nr_flag)) {
+      fprintf(stderr, "%s --checkpoint and --resume apply to plain "
+            "single-end clustering only\n", ERRM);
+      say_usage();
+      return EXIT_FAILURE;
+   }
+   if (resume != UNSET && (input != UNSET || maxmem != UNSET)) {
+      fprintf(stderr, "%s --resume replaces the input and is "
+            "incompatible with --input and --max-mem\n", ERRM);
+      say_usage();
+      return EXIT_FAILURE;
+   }
+   if (chkpt != UNSET && resume != UNSET &&
+         strcmp(chkpt, resume) == 0) {
+      fprintf(stderr, "%s --checkpoint and --resume cannot use the "
+            "same file\n", ERRM);
+      say_usage();
+      return EXIT_FAILURE;
+   }
+
+   // Parse the memory budget (the K, M and G suffixes stand for
+   // binary kilo, mega and gigabytes).
+   size_t max_mem = 0;
+   if (maxmem != UNSET) {
+      char *end;
+      double value = strtod(maxmem, &end);
+      size_t unit = 1;
+      switch (*end) {
+         case 'k': case 'K': unit = 1024UL; end++; break;
+         case 'm': case 'M': unit = 1024UL * 1024; end++; break;
+         case 'g': case 'G': unit = 1024UL * 1024 * 1024; end++; break;
+      }
+      if (value <= 0 || *end != '\0') {
+         fprintf(stderr, "%s invalid --max-mem value (use e.g. "
+               "500M or 4G)\n", ERRM);
+         say_usage();
+         return EXIT_FAILURE;
+      }
+      max_mem = (size_t) (value * unit);
+   }
 
    // Set output type. //
    int output_type;
@@ -439,7 +942,7 @@ main(
    }
 
    if (output != UNSET) {
-      outputf1 = fopen(output, "w");
+      outputf1 = fopen_output(output);
       if (outputf1 == NULL) {
          fprintf(stderr, "%s cannot write to file %s\n", ERRM, output);
          say_usage();
@@ -450,10 +953,10 @@ main(
       // Set default names as inputX-starcode.fastq
       if (output1 == UNSET) {
          output1 = outname(input1);
-         outputf1 = fopen(output1, "w");
+         outputf1 = fopen_output(output1);
          free(output1);
       } else {
-         outputf1 = fopen(output1, "w");
+         outputf1 = fopen_output(output1);
       }
 
       if (outputf1 == NULL) {
@@ -465,10 +968,10 @@ main(
 
       if (output2 == UNSET) {
          output2 = outname(input2);
-         outputf2 = fopen(output2, "w");
+         outputf2 = fopen_output(output2);
          free(output2);
       } else {
-         outputf2 = fopen(output2, "w");
+         outputf2 = fopen_output(output2);
       }
 
       if (outputf2 == NULL) {
@@ -482,35 +985,186 @@ main(
       outputf1 = stdout;
    }
 
+   // Set reference and index file(s). //
+   FILE *reff = NULL;
+   FILE *indexf = NULL;
+
+   if (ref != UNSET) {
+      reff = fopen(ref, "r");
+      if (reff == NULL) {
+         fprintf(stderr, "%s cannot open file %s\n", ERRM, ref);
+         say_usage();
+         return EXIT_FAILURE;
+      }
+      if (saveidx != UNSET) {
+         indexf = fopen(saveidx, "w");
+         if (indexf == NULL) {
+            fprintf(stderr,
+                  "%s cannot write to file %s\n", ERRM, saveidx);
+            say_usage();
+            return EXIT_FAILURE;
+         }
+      }
+      else if (loadidx != UNSET) {
+         indexf = fopen(loadidx, "r");
+         if (indexf == NULL) {
+            fprintf(stderr, "%s cannot open file %s\n", ERRM, loadidx);
+            say_usage();
+            return EXIT_FAILURE;
+         }
+      }
+   }
+
+   // Set checkpoint file(s). //
+   FILE *chkptf = NULL;
+   FILE *resumef = NULL;
+
+   if (chkpt != UNSET) {
+      chkptf = fopen(chkpt, "w");
+      if (chkptf == NULL) {
+         fprintf(stderr, "%s cannot write to file %s\n", ERRM, chkpt);
+         say_usage();
+         return EXIT_FAILURE;
+      }
+   }
+   if (resume != UNSET) {
+      resumef = fopen(resume, "r");
+      if (resumef == NULL) {
+         fprintf(stderr, "%s cannot open file %s\n", ERRM, resume);
+         say_usage();
+         return EXIT_FAILURE;
+      }
+   }
+
+   // Set state file(s). //
+   FILE *statef = NULL;
+   FILE *newstatef = NULL;
+
+   if (state != UNSET) {
+      statef = fopen(state, "r");
+      if (statef == NULL) {
+         fprintf(stderr, "%s cannot open file %s\n", ERRM, state);
+         say_usage();
+         return EXIT_FAILURE;
+      }
+   }
+   if (savest != UNSET) {
+      newstatef = fopen(savest, "w");
+      if (newstatef == NULL) {
+         fprintf(stderr, "%s cannot write to file %s\n", ERRM, savest);
+         say_usage();
+         return EXIT_FAILURE;
+      }
+   }
+
    // Set remaining default options.
    if (threads < 0) threads = 1;
    if (cluster_ratio < 0) cluster_ratio = 5;
+   if (umi_len >= 0) {
+      if (umi_d < 0) umi_d = 0;
+      if (seq_trim < 0) seq_trim = 50;
+   }
 
    if (cluster_ratio == 1.0 && vb_flag) {
       fprintf(stderr, "warning: setting cluster-ratio to 1.0" \
 	    " may result in arbitrary cluster breaks.\n");
    }
 
-   int exitcode =
-   starcode(
-       inputf1,
-       inputf2,
-       outputf1,
-       outputf2,
-       dist,
-       vb_flag,
-       threads,
-       cluster_alg,
-       cluster_ratio,
-       cl_flag,
-       id_flag,
-       output_type
-   );
+   int exitcode;
+   if (ref != UNSET) {
+      exitcode =
+      starcode_ref(
+          reff,
+          inputf1,
+          outputf1,
+          dist,
+          vb_flag,
+          threads,
+          indexf,
+          saveidx != UNSET
+      );
+   }
+   else if (shard_prep >= 0) {
+      exitcode =
+      starcode_shard_prep(
+          inputf1,
+          sharddir,
+          shard_prep,
+          dist,
+          vb_flag,
+          threads,
+          cluster_ratio
+      );
+   }
+   else if (shard_worker >= 0) {
+      exitcode = starcode_shard_worker(sharddir, shard_worker, vb_flag);
+   }
+   else if (sm_flag) {
+      exitcode =
+      starcode_shard_merge(sharddir, outputf1, vb_flag, threads);
+   }
+   else if (umi_len >= 0) {
+      exitcode =
+      starcode_umi(
+          inputf1,
+          outputf1,
+          umi_len,
+          umi_d,
+          dist,
+          seq_trim,
+          vb_flag,
+          threads,
+          cluster_alg,
+          cluster_ratio,
+          id_flag
+      );
+   }
+   else if (state != UNSET || savest != UNSET) {
+      exitcode =
+      starcode_inc(
+          statef,
+          inputf1,
+          outputf1,
+          newstatef,
+          dist,
+          vb_flag,
+          threads,
+          cluster_ratio,
+          max_drift
+      );
+   }
+   else {
+      exitcode =
+      starcode(
+          inputf1,
+          inputf2,
+          outputf1,
+          outputf2,
+          dist,
+          vb_flag,
+          threads,
+          cluster_alg,
+          cluster_ratio,
+          cl_flag,
+          id_flag,
+          output_type,
+          st_flag,
+          max_mem,
+          chkptf,
+          resumef
+      );
+   }
 
    if (inputf1 != stdin)   fclose(inputf1);
    if (inputf2 != NULL)    fclose(inputf2);
    if (outputf1 != stdout) fclose(outputf1);
    if (outputf2 != NULL)   fclose(outputf2);
+   if (reff != NULL)       fclose(reff);
+   if (indexf != NULL)     fclose(indexf);
+   if (statef != NULL)     fclose(statef);
+   if (newstatef != NULL)  fclose(newstatef);
+   if (chkptf != NULL)     fclose(chkptf);
+   if (resumef != NULL)    fclose(resumef);
 
    return exitcode;
 
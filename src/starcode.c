@@ -25,16 +25,27 @@
 #include <ctype.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
 #include "trie.h"
 #include "starcode.h"
 
 #define alert() fprintf(stderr, "error `%s' in %s() (%s:%d)\n",\
                      strerror(errno), __func__, __FILE__, __LINE__)
 
-#define MAX_K_FOR_LOOKUP 14
+#define MAX_K_FOR_LOOKUP 16
+#define MAX_K_DIRECT_LOOKUP 14
+
+#define OUTBUF_SIZE (1 << 23)   // Output format buffer (8 MB).
 
 #define BISECTION_START  1
 #define BISECTION_END    -1
@@ -96,11 +107,24 @@ typedef struct match_t match_t;
 typedef struct mtplan_t mtplan_t;
 typedef struct mttrie_t mttrie_t;
 typedef struct mtjob_t mtjob_t;
+typedef struct mtworker_t mtworker_t;
 typedef struct lookup_t lookup_t;
 typedef struct propt_t propt_t;
 typedef struct idstack_t idstack_t;
 
-typedef struct sortargs_t sortargs_t;
+typedef struct umirec_t umirec_t;
+
+typedef struct edge_t edge_t;
+typedef struct edgebuf_t edgebuf_t;
+typedef struct edgemerge_t edgemerge_t;
+typedef struct mprange_t mprange_t;
+typedef struct outbuf_t outbuf_t;
+typedef struct radixsort_t radixsort_t;
+typedef struct radixtask_t radixtask_t;
+typedef struct readchunk_t readchunk_t;
+typedef struct refjob_t refjob_t;
+typedef struct spillrun_t spillrun_t;
+typedef struct useqhash_t useqhash_t;
 
 
 // The field 'seqid' is either an id number for
@@ -114,6 +138,7 @@ struct useq_t {
   int              sphere_c;    // Centroid: Size of the sphere.
   int              sphere_d;    // Distance to current sphere centroid. / MP: Ambiguous flag.
   char          *  seq;         // Sequence
+  uint64_t      *  pack;        // 2-bit packed sequence (see 'pack_useq')
   char          *  info;        // Multi-function text field
   gstack_t      ** matches;     // Matches stratified by distance
   struct useq_t *  canonical;   // Pointer to canonical sequence
@@ -124,22 +149,116 @@ struct lookup_t {
             int    slen;
             int    kmers;
             int  * klen;
+            int  * hash;     // Nonzero if table i is hashed.
    unsigned char * lut[];
 };
 
 
-struct sortargs_t {
-   useq_t ** buf0;
-   useq_t ** buf1;
-   int     size;
-   int     b;
-   int     thread;
-   int     repeats;
+struct mprange_t {
+   useq_t ** items;             // Count-sorted sequences.
+   int       from;              // First index of the range.
+   int       to;                // One past the last index.
+};
+
+// Buffered output with an asynchronous writer thread. Records are
+// formatted into a large buffer; full buffers are handed over to a
+// dedicated thread that writes them to the stream in order, so the
+// formatting pass does not stall on I/O.
+struct outbuf_t {
+   char            * data;      // Buffer being filled.
+   size_t            len;       // Bytes in 'data'.
+   FILE            * file;      // Destination stream.
+   char            * pending;   // Buffer handed to the writer.
+   size_t            pendlen;   // Bytes in 'pending'.
+   int               done;      // No more buffers will come.
+   pthread_mutex_t   mutex;
+   pthread_cond_t    cond;
+   pthread_t         writer;
+};
+
+struct readchunk_t {
+   const char * buf1;            // Chunk of the (first) input file.
+   size_t       size1;
+   const char * buf2;            // Chunk of the mate file (PE only).
+   size_t       size2;
+   useqhash_t * uh;              // Private dedup table of the chunk.
+};
+
+// Open-addressing hash table keyed on the sequence, used by the
+// readers to merge the duplicate reads while parsing. The records
+// of the sort and of the per-read allocations are then the unique
+// sequences instead of the reads, which dominates the peak memory
+// of deep datasets (e.g. UMI runs). The duplicates left between
+// the chunks of the multithreaded readers are merged by the sort.
+struct useqhash_t {
+   useq_t  ** slots;             // Hash slots (linear probing).
+   size_t     nslots;            // Allocated slots (power of two).
+   size_t     nitems;            // Used slots.
+   gstack_t * useqS;             // Unique sequences in parse order.
+   int        nreads;            // Records parsed (1-based ids).
+   size_t     bytes;             // Approximate heap bytes held, to
+                                 // trigger the spill of '--max-mem'.
+};
+
+// Cursor over one sorted run file written by the '--max-mem'
+// spill, used by the streaming merge of 'merge_spill_runs()'.
+// 'seq' is NULL once the run is exhausted.
+struct spillrun_t {
+   FILE         * file;          // Temporary run file.
+   char         * line;          // Line buffer of 'getline()'.
+   size_t         sz;            // Size of the line buffer.
+   char         * seq;           // Head record: the sequence...
+   int            len;           //   ...its length...
+   int            count;         //   ...its read count...
+   char         * ids;           //   ...and its id list (text).
+   unsigned int   nids;          // Entries of the id list.
+};
+
+// One independent slice of the radix sort: the sequences in
+// 'data[start..start+size)' share their length 'len' and their
+// first 'pos' characters.
+struct radixtask_t {
+   int   start;
+   int   size;
+   int   pos;
+   int   len;
+};
+
+struct radixsort_t {
+   useq_t      ** data;         // Array being sorted (in place).
+   useq_t      ** aux;          // Scratch buffer for distribution.
+   radixtask_t  * tasks;        // Independent slices to sort.
+   int            ntasks;
+   int            nexttask;     // Shared cursor (atomic increment).
+};
+
+// One match found during the query phase. Matches are recorded
+// in per-worker append-only buffers and merged into the match
+// records of the sequences once the queries are done (see
+// 'merge_matches()'), so the inner hit loop takes no lock.
+struct edge_t {
+   useq_t * to;       // Sequence whose match record receives it.
+   useq_t * from;     // Matching sequence.
+   int      dist;     // Distance between the two.
+};
+
+struct edgebuf_t {
+   edge_t * edges;
+   size_t   nedges;
+   size_t   size;
+};
+
+struct edgemerge_t {
+   edgebuf_t * bufs;     // Buffers of all the workers.
+   int         nbufs;
+   int         tau;
+   int         nparts;   // Number of merge threads.
+   int         part;     // Partition handled by this thread.
 };
 
 struct mtplan_t {
-   char              active;
    int               ntries;
+   int               njobs;    // Total jobs over all the tries.
    int		     jobsdone;
    struct mttrie_t * tries;
    pthread_mutex_t * mutex;
@@ -150,6 +269,8 @@ struct mttrie_t {
    char              flag;
    int               currentjob;
    int               njobs;
+   int               owner;    // Worker that built the trie (-1
+                               // before the build job is claimed).
    struct mtjob_t  * jobs;
 };
 
@@ -158,17 +279,30 @@ struct mtjob_t {
    int                end;
    int                tau;
    int                build;
-   int                queryid;
-   int                trieid;
+   int                ref;     // Reference mode: record assignments.
    gstack_t         * useqS;
-   trie_t           * trie;
-   node_t           * node_pos;
+   ctrie_t          * trie;
    lookup_t         * lut;
-   pthread_mutex_t  * mutex;
-   pthread_cond_t   * monitor;
-   int	    	    * jobsdone;
-   char             * trieflag;
-   char             * active;
+};
+
+// Argument of the query threads of the reference mode, where the
+// tries cover the whole reference set so each query block goes to
+// exactly one thread and no scheduling is needed (see
+// 'starcode_ref()').
+struct refjob_t {
+   mtjob_t      job;
+   edgebuf_t  * edges;
+   gstack_t  ** hits;
+};
+
+struct mtworker_t {
+   int               id;       // Index of the worker in the pool.
+   int               offset;
+   int               verbose;
+   double            busy;     // Time spent in jobs (see --stats).
+   struct mtplan_t * plan;
+   edgebuf_t       * edges;
+   gstack_t       ** hits;     // Recycled hit tower of the worker.
 };
 
 struct propt_t {
@@ -184,10 +318,22 @@ struct idstack_t {
    int    * elm;
 };
 
+// One unique read of the combined UMI + sequence workflow, with its
+// cluster assignment in both columns (see 'starcode_umi()').
+struct umirec_t {
+   int          seqrank;   // Output rank of the sequence cluster.
+   int          umirank;   // Output rank of the UMI cluster.
+   useq_t     * ucanon;    // Canonical of the UMI column.
+   useq_t     * scanon;    // Canonical of the sequence column.
+   const char * tail;      // Read beyond the clustered prefix.
+   useq_t     * read;      // The unique read itself.
+};
+
 int        size_order (const void *a, const void *b);
 int        addmatch (useq_t*, useq_t*, int, int);
 int        bisection (int, int, char *, useq_t **, int, int);
 int        canonical_order (const void*, const void*);
+int        chk_edge_order (const void *, const void *);
 int        cluster_count (const void *, const void *);
 gstack_t * compute_clusters (gstack_t *);
 void       connected_components (useq_t *, gstack_t **);
@@ -195,48 +341,316 @@ long int   count_trie_nodes (useq_t **, int, int);
 int        sphere_size_order (const void *, const void *);
 int        count_order (const void *, const void *);
 int        count_order_spheres (const void *, const void *);
+void       destroy_outbuf (outbuf_t *);
 void       destroy_useq (useq_t *);
+gstack_t * destroy_useqhash (useqhash_t *);
 void       destroy_lookup (lookup_t *);
-void     * do_query (void*);
+void     * do_jobs (void*);
+void       do_query (mtjob_t *, edgebuf_t *, gstack_t **);
+void       edge_append (edgebuf_t *, useq_t *, useq_t *, int);
+char     * get_input_buffer (FILE *, size_t *, int *);
+char     * inflate_gz (const char *, size_t, size_t *);
 void       idstack_free(idstack_t *);
 idstack_t* idstack_new(size_t);
 void       idstack_push(int *, size_t, idstack_t *);
 int        int_ascending (const void*, const void*);
 void       krash (void) __attribute__ ((__noreturn__));
-int        lut_insert (lookup_t *, useq_t *); 
-int        lut_search (lookup_t *, useq_t *); 
-void       message_passing_clustering (gstack_t*);
+int        len_median (gstack_t *, int *);
+gstack_t * merge_spill_runs (gstack_t *);
+int        lut_insert (lookup_t *, useq_t *, int);
+int64_t    lut_bit (lookup_t *, int, int64_t);
+int        lut_search (lookup_t *, useq_t *, int);
+void     * merge_assignments (void *);
+void     * merge_matches (void *);
+void       message_passing_clustering (gstack_t*, int);
 void       mp_resolve_ambiguous(useq_t*);
+char     * map_file (FILE *, size_t *);
 lookup_t * new_lookup (int, int, int);
+outbuf_t * new_outbuf (FILE *);
 useq_t   * new_useq (int, char *, char *);
+useqhash_t * new_useqhash (void);
+useq_t   * new_useq_len (int, const char *, size_t, const char *, size_t);
+int        next_map_line (const char *, size_t, size_t *,
+                 const char **, size_t *);
+size_t     next_line_start (const char *, size_t, size_t);
+size_t     next_record_start (const char *, size_t, size_t);
+void       obflush (outbuf_t *);
+void       obprintf (outbuf_t *, const char *, ...)
+                 __attribute__ ((format(printf,2,3)));
+void       obwrite (outbuf_t *, const char *, size_t);
 int        pad_useq (gstack_t*, int*);
-mtplan_t * plan_mt (int, int, int, int, gstack_t *);
+void       pad_useq_len (gstack_t *, int);
+void       pack_useq (useq_t *, int);
+int        pair_dist (const char *, const char *);
+mtplan_t * plan_mt (int, int, int, gstack_t *);
+int        query_in_trie (int, int, const int *, const int *,
+                  const int *, int);
+void       radix_insertion (useq_t **, int, int, int);
+void       radix_merge_run (useq_t **, int, int);
+void       radix_sort_slice (useq_t **, useq_t **, int, int, int, int);
+void       radix_split (useq_t **, useq_t **, int, int, int, int *);
+void     * radix_do_tasks (void *);
+void     * query_ref_trie (void *);
 void       sort_and_print_ids (idstack_t  *);
 void       run_plan (mtplan_t *, int, int);
-gstack_t * read_rawseq (FILE *, gstack_t *);
-gstack_t * read_fasta (FILE *, gstack_t *);
-gstack_t * read_fastq (FILE *, gstack_t *);
-gstack_t * read_file (FILE *, FILE *, int);
-gstack_t * read_PE_fastq (FILE *, FILE *, gstack_t *);
-int        seq2id (char *, int);
+void       read_rawseq (FILE *, useqhash_t *);
+void       read_rawseq_map (const char *, size_t, useqhash_t *);
+void       read_fasta (FILE *, useqhash_t *);
+void       read_fasta_map (const char *, size_t, useqhash_t *);
+void       read_fastq (FILE *, useqhash_t *);
+void       read_fastq_map (const char *, size_t, useqhash_t *);
+void     * read_chunk_mt (void *);
+gstack_t * read_checkpoint (FILE *, int *, int *);
+gstack_t * read_file (FILE *, FILE *, int, int);
+gstack_t * read_shard (const char *, int);
+int        read_shard_manifest (const char *, int *, int *, int *,
+                  int *, double *);
+gstack_t * read_state (FILE *, int *);
+gstack_t * read_map_mt (const char *, size_t, const char *, size_t,
+                 gstack_t *, int);
+void       read_PE_fastq (FILE *, FILE *, useqhash_t *);
+void       read_PE_fastq_map (const char *, size_t, const char *,
+                 size_t, useqhash_t *);
+int64_t    seq2id (char *, int);
+int64_t    seq2id_pack (useq_t *, int, int, int);
 gstack_t * seq2useq (gstack_t*, int);
 int        seqsort (useq_t **, int, int);
+void       spill_run_next (spillrun_t *);
+void       spill_useqS (gstack_t *);
+double     stats_now (void);
+void       stats_phase (const char *, double *);
 void       sphere_clustering (gstack_t *);
+int        state_find (useq_t **, int, const char *);
+int        state_seq_order (const void *, const void *);
 void       transfer_counts_and_update_canonicals (useq_t*);
+void     * transfer_counts_batch (void *);
+void     * replay_transfer_calls (void *);
 void       transfer_sorted_useq_ids (useq_t *, useq_t *);
 void       transfer_useq_ids (useq_t *, useq_t *);
+void       umi_cluster_column (gstack_t *, int, int, const int,
+                  const char *);
+int        umi_record_order (const void *, const void *);
+int        umi_tail_order (const void *, const void *);
 void       unpad_useq (gstack_t*);
-void     * nukesort (void *); 
+void       useqhash_spill (useqhash_t *);
+useq_t   * useqhash_store (useqhash_t *, const char *, size_t,
+                  const char *, size_t, int);
+void     * write_buffers (void *);
+void       write_checkpoint_edges (FILE *);
+void       write_checkpoint_uniq (FILE *, gstack_t *, int);
+void       write_state (FILE *, gstack_t *, const int *, int);
 
 
 //    Global variables    //
-static FILE     * OUTPUTF1      = NULL;           // output file 1
-static FILE     * OUTPUTF2      = NULL;           // output file 2
+static outbuf_t * OUTPUTB1      = NULL;           // output buffer 1
+static outbuf_t * OUTPUTB2      = NULL;           // output buffer 2
 static format_t   FORMAT        = UNSET;          // input format
 static output_t   OUTPUTT       = DEFAULT_OUTPUT; // output type
 static cluster_t  CLUSTERALG    = MP_CLUSTER;     // cluster algorithm
 static double     CLUSTER_RATIO = 5.0;            // min parent/child ratio
                                                   // to link clusters
+static long       LUT_CALLS     = 0;              // queries gated by the
+static long       LUT_SKIPS     = 0;              // prefilter / suppressed
+static int        STATS         = 0;              // --stats instrumentation
+static long       POUCET_VISITS = 0;              // trie nodes visited
+static long       POUCET_HITS   = 0;              // hits returned
+static size_t     MAX_MEM       = 0;              // parse budget of
+                                                  // --max-mem (0: off)
+static edgebuf_t  CHK_EDGES     = {0};            // raw match edges of a
+static int        CHK_RECORD    = 0;              // --checkpoint run and
+                                                  // the recording flag
+static pthread_mutex_t CHK_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static gstack_t * SPILL_RUNS    = NULL;           // run files spilled by
+                                                  // the parse
+
+
+double
+stats_now
+(void)
+// Monotonic wall clock of the --stats instrumentation.
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+
+void
+stats_phase
+(
+   const char * phase,
+   double     * t0
+)
+// Prints the wall time of a pipeline phase and the peak RSS of the
+// process so far (the high-water mark only grows), then restarts
+// the clock for the next phase.
+{
+   struct rusage ru;
+   getrusage(RUSAGE_SELF, &ru);
+   double t1 = stats_now();
+   fprintf(stderr, "stats: %-8s%8.3f s  rss %ld MB\n",
+         phase, t1 - *t0, ru.ru_maxrss / 1024);
+   *t0 = t1;
+}
+
+
+void *
+write_buffers
+(
+   void * arg
+)
+// Writer thread of an 'outbuf_t': writes the full buffers handed
+// over by 'obflush()' to the destination stream, in order.
+{
+   outbuf_t *ob = (outbuf_t *) arg;
+   pthread_mutex_lock(&ob->mutex);
+   for (;;) {
+      while (ob->pending == NULL && !ob->done) {
+         pthread_cond_wait(&ob->cond, &ob->mutex);
+      }
+      if (ob->pending == NULL) break;
+      char *buf = ob->pending;
+      size_t len = ob->pendlen;
+      pthread_mutex_unlock(&ob->mutex);
+      if (fwrite(buf, 1, len, ob->file) != len) {
+         alert();
+         krash();
+      }
+      free(buf);
+      pthread_mutex_lock(&ob->mutex);
+      ob->pending = NULL;
+      pthread_cond_signal(&ob->cond);
+   }
+   pthread_mutex_unlock(&ob->mutex);
+   return NULL;
+}
+
+
+outbuf_t *
+new_outbuf
+(
+   FILE * file
+)
+{
+   outbuf_t *ob = calloc(1, sizeof(outbuf_t));
+   if (ob == NULL) {
+      alert();
+      krash();
+   }
+   ob->data = malloc(OUTBUF_SIZE);
+   if (ob->data == NULL) {
+      alert();
+      krash();
+   }
+   ob->file = file;
+   pthread_mutex_init(&ob->mutex, NULL);
+   pthread_cond_init(&ob->cond, NULL);
+   if (pthread_create(&ob->writer, NULL, write_buffers, ob)) {
+      alert();
+      krash();
+   }
+   return ob;
+}
+
+
+void
+obflush
+(
+   outbuf_t * ob
+)
+// Hands the current buffer over to the writer thread and installs a
+// fresh one. Waits if the writer still holds the previous buffer.
+{
+   if (ob->len == 0) return;
+   pthread_mutex_lock(&ob->mutex);
+   while (ob->pending != NULL) {
+      pthread_cond_wait(&ob->cond, &ob->mutex);
+   }
+   ob->pending = ob->data;
+   ob->pendlen = ob->len;
+   pthread_cond_signal(&ob->cond);
+   pthread_mutex_unlock(&ob->mutex);
+   ob->data = malloc(OUTBUF_SIZE);
+   if (ob->data == NULL) {
+      alert();
+      krash();
+   }
+   ob->len = 0;
+}
+
+
+void
+destroy_outbuf
+(
+   outbuf_t * ob
+)
+{
+   obflush(ob);
+   pthread_mutex_lock(&ob->mutex);
+   ob->done = 1;
+   pthread_cond_signal(&ob->cond);
+   pthread_mutex_unlock(&ob->mutex);
+   pthread_join(ob->writer, NULL);
+   fflush(ob->file);
+   free(ob->data);
+   free(ob);
+}
+
+
+void
+obwrite
+(
+   outbuf_t   * ob,
+   const char * s,
+   size_t       len
+)
+{
+   while (len > 0) {
+      size_t room = OUTBUF_SIZE - ob->len;
+      if (room == 0) {
+         obflush(ob);
+         continue;
+      }
+      size_t n = len < room ? len : room;
+      memcpy(ob->data + ob->len, s, n);
+      ob->len += n;
+      s += n;
+      len -= n;
+   }
+}
+
+
+void
+obprintf
+(
+   outbuf_t   * ob,
+   const char * fmt,
+   ...
+)
+{
+   va_list ap;
+   va_start(ap, fmt);
+   int n = vsnprintf(ob->data + ob->len, OUTBUF_SIZE - ob->len,
+         fmt, ap);
+   va_end(ap);
+   if (n < 0) {
+      alert();
+      krash();
+   }
+   if ((size_t) n >= OUTBUF_SIZE - ob->len) {
+      // Record did not fit in the remaining space: flush and
+      // format again at the start of the empty buffer.
+      obflush(ob);
+      va_start(ap, fmt);
+      n = vsnprintf(ob->data, OUTBUF_SIZE, fmt, ap);
+      va_end(ap);
+      if (n < 0 || n >= OUTBUF_SIZE) {
+         alert();
+         krash();
+      }
+   }
+   ob->len += n;
+}
 
 
 void
@@ -250,12 +664,12 @@ head_default
    useq_t * cncal = u->canonical;
    char * seq = propt.pe_fastq ? cncal->info : cncal->seq;
 
-   fprintf(OUTPUTF1, "%s%s\t%d",
+   obprintf(OUTPUTB1, "%s%s\t%d",
          propt.first, seq, cncal->count);
 
    if (propt.showclusters) {
       char * seq = propt.pe_fastq ? u->info : u->seq;
-      fprintf(OUTPUTF1, "\t%s", seq);
+      obprintf(OUTPUTB1, "\t%s", seq);
    }
 
 }
@@ -270,7 +684,7 @@ members_mp_default
 
    if (!propt.showclusters) return;
    char * seq = propt.pe_fastq ? u->info : u->seq;
-   fprintf(OUTPUTF1, ",%s", seq);
+   obprintf(OUTPUTB1, ",%s", seq);
 
 }
 
@@ -292,7 +706,7 @@ members_sc_default
          useq_t *match = (useq_t *) hits->items[k];
          if (match->canonical != u) continue;
          char *seq = propt.pe_fastq ? match->seq : u->seq;
-         fprintf(OUTPUTF1, ",%s", seq);
+         obprintf(OUTPUTB1, ",%s", seq);
       }
    }
 
@@ -308,9 +722,9 @@ sort_and_print_ids
    // Sort sequence of integers.
    qsort(stack->elm, stack->pos, sizeof(int), int_ascending);
    // Print ids.
-   fprintf(OUTPUTF1, "\t%u", stack->elm[0]);
+   obprintf(OUTPUTB1, "\t%u", stack->elm[0]);
    for (unsigned int k = 1; k < stack->pos; k++) {
-      fprintf(OUTPUTF1, ",%u", stack->elm[k]);
+      obprintf(OUTPUTB1, ",%u", stack->elm[k]);
    }
 }
 
@@ -322,7 +736,7 @@ print_nr_raw
    propt_t   propt
 )
 {
-   fprintf(OUTPUTF1, "%s\n", u->seq);
+   obprintf(OUTPUTB1, "%s\n", u->seq);
 }
 
 
@@ -333,7 +747,7 @@ print_nr_fasta
    propt_t   propt
 )
 {
-   fprintf(OUTPUTF1, "%s\n%s\n", u->info, u->seq);
+   obprintf(OUTPUTB1, "%s\n%s\n", u->info, u->seq);
 }
 
 
@@ -344,11 +758,12 @@ print_nr_fastq
    propt_t   propt
 )
 {
-   char header[M] = {0};
-   char quality[M] = {0};
-   sscanf(u->info, "%s\n%s", header, quality);
-   fprintf(OUTPUTF1, "%s\n%s\n+\n%s\n",
-           header, u->seq, quality);
+   // The 'info' field holds "header\nquality": print the two
+   // slices directly, no reparsing needed.
+   char *nl = strchr(u->info, '\n');
+   size_t hlen = nl == NULL ? strlen(u->info) : (size_t) (nl - u->info);
+   obwrite(OUTPUTB1, u->info, hlen);
+   obprintf(OUTPUTB1, "\n%s\n+\n%s\n", u->seq, nl == NULL ? "" : nl+1);
 }
    
 
@@ -359,32 +774,27 @@ print_nr_pe_fastq
    propt_t   propt
 )
 {
-   char head1[M] = {0};
-   char head2[M] = {0};
-   char qual1[M] = {0};
-   char qual2[M] = {0};
-   char seq1[M] = {0};
-   char seq2[M] = {0};
-
-   // Split the sequences.
+   // Split the sequences around the dash separator.
    char *c = strrchr(u->seq, '-');
-   strncpy(seq1, u->seq, c-u->seq - STARCODE_MAX_TAU);
-   strcpy(seq2, c+1);
+   size_t len1 = c - u->seq - STARCODE_MAX_TAU;
+   char *seq2 = c + 1;
 
-   // Split the info field.
-   {
-      char *c = u->info;
-      strcpy(head1, strsep(&c, "\n"));
-      strcpy(qual1, strsep(&c, "\n"));
-      strcpy(head2, strsep(&c, "\n"));
-      strcpy(qual2, strsep(&c, "\n"));
-   }
+   // The 'info' field holds "head1\nqual1\nhead2\nqual2": print
+   // the slices directly, no strsep() reparsing (which also used
+   // to clobber 'u->info').
+   char *head1 = u->info;
+   char *qual1 = strchr(head1, '\n') + 1;
+   char *head2 = strchr(qual1, '\n') + 1;
+   char *qual2 = strchr(head2, '\n') + 1;
 
    // Print to separate files.
-   fprintf(OUTPUTF1, "%s\n%s\n+\n%s\n",
-           head1, seq1, qual1);
-   fprintf(OUTPUTF2, "%s\n%s\n+\n%s\n",
-           head2, seq2, qual2);
+   obwrite(OUTPUTB1, head1, qual1 - head1);
+   obwrite(OUTPUTB1, u->seq, len1);
+   obwrite(OUTPUTB1, "\n+\n", 3);
+   obwrite(OUTPUTB1, qual1, head2 - qual1 - 1);
+   obwrite(OUTPUTB1, "\n", 1);
+   obwrite(OUTPUTB2, head2, qual2 - head2);
+   obprintf(OUTPUTB2, "%s\n+\n%s\n", seq2, qual2);
 }
 
 
@@ -402,30 +812,72 @@ starcode
          double parent_to_child,
    const int showclusters,
    const int showids,
-   const int outputt
+   const int outputt,
+   const int showstats,
+   const size_t max_mem,
+   FILE *chkf,
+   FILE *resumef
 )
 {
 
-   OUTPUTF1 = outputf1;
-   OUTPUTF2 = outputf2;
+   OUTPUTB1 = new_outbuf(outputf1);
+   OUTPUTB2 = outputf2 == NULL ? NULL : new_outbuf(outputf2);
    OUTPUTT = outputt;
    CLUSTERALG = clusteralg;
    CLUSTER_RATIO = parent_to_child;
+   STATS = showstats;
+   MAX_MEM = max_mem;
+
+   double stt = STATS ? stats_now() : 0.0;
 
    if (verbose) {
       fprintf(stderr, "running starcode with %d thread%s\n",
            thrmax, thrmax > 1 ? "s" : "");
       fprintf(stderr, "reading input files\n");
    }
-   gstack_t *uSQ = read_file(inputf1, inputf2, verbose);
-   if (uSQ == NULL || uSQ->nitems < 1) {
-      fprintf(stderr, "input file empty\n");
-      return 1;
+   gstack_t *uSQ = NULL;
+   int skip_query = 0;
+   if (resumef != NULL) {
+      // Resume from a checkpoint instead of parsing the input.
+      if (verbose) fprintf(stderr, "reading checkpoint\n");
+      int chktau = -1;
+      uSQ = read_checkpoint(resumef, &chktau, &skip_query);
+      if (tau >= 0 && tau != chktau) {
+         fprintf(stderr, "error: the checkpoint was taken at dist "
+               "%d\n", chktau);
+         abort();
+      }
+      tau = chktau;
+      // Only raw sequences go through a checkpoint.
+      FORMAT = RAW;
+      if (verbose && skip_query) {
+         fprintf(stderr, "match edges found, skipping the query "
+               "phase\n");
+      }
+      if (STATS) stats_phase("resume", &stt);
    }
+   else {
+      uSQ = read_file(inputf1, inputf2, verbose, thrmax);
+      if (uSQ == NULL || uSQ->nitems < 1) {
+         fprintf(stderr, "input file empty\n");
+         destroy_outbuf(OUTPUTB1);
+         if (OUTPUTB2 != NULL) destroy_outbuf(OUTPUTB2);
+         OUTPUTB1 = NULL;
+         OUTPUTB2 = NULL;
+         return 1;
+      }
 
-   // Sort/reduce.
-   if (verbose) fprintf(stderr, "sorting\n");
-   uSQ->nitems = seqsort((useq_t **) uSQ->items, uSQ->nitems, thrmax);
+      if (STATS) stats_phase("parse", &stt);
+
+      // Sort/reduce.
+      if (verbose) fprintf(stderr, "sorting\n");
+      uSQ->nitems = seqsort((useq_t **) uSQ->items, uSQ->nitems,
+            thrmax);
+
+      if (STATS) stats_phase("sort", &stt);
+   }
+
+   if (!skip_query) {
 
    // Get number of tries.
    int ntries = 3 * thrmax + (thrmax % 2 == 0);
@@ -434,10 +886,11 @@ starcode
       thrmax = 1;
    }
 
-   // Pad sequences (and return the median size).
-   // Compute 'tau' from it in "auto" mode.
+   // Length statistics: the median picks 'tau' in "auto" mode and
+   // sizes the k-mers of the prefilter. The sequences are not
+   // padded: the tries are stratified by length (see 'plan_mt()').
    int med = -1;
-   int height = pad_useq(uSQ, &med);
+   len_median(uSQ, &med);
    if (tau < 0) {
       tau = med > 160 ? 8 : 2 + med/30;
       if (verbose) {
@@ -445,15 +898,66 @@ starcode
       }
    }
 
+   // The unique table is final here: checkpoint it before the
+   // query phase and start recording the match edges.
+   if (chkf != NULL) {
+      if (verbose) fprintf(stderr, "checkpointing unique sequences\n");
+      write_checkpoint_uniq(chkf, uSQ, tau);
+      CHK_RECORD = 1;
+   }
+
+   // Pack the sequences for the prefilter (see 'seq2id_pack()').
+   for (int i = 0 ; i < uSQ->nitems ; i++) {
+      useq_t *u = (useq_t *) uSQ->items[i];
+      pack_useq(u, strlen(u->seq));
+   }
+
+   if (STATS) stats_phase("pack", &stt);
+
    // Make multithreading plan.
-   mtplan_t *mtplan = plan_mt(tau, height, med, ntries, uSQ);
+   mtplan_t *mtplan = plan_mt(tau, med, ntries, uSQ);
 
    // Run the query.
+   LUT_CALLS = 0;
+   LUT_SKIPS = 0;
+   POUCET_VISITS = 0;
+   POUCET_HITS = 0;
    run_plan(mtplan, verbose, thrmax);
-   if (verbose) fprintf(stderr, "progress: 100.00%%\n");
+   if (verbose) {
+      fprintf(stderr, "progress: 100.00%%\n");
+      fprintf(stderr, "prefilter skipped %ld of %ld searches "
+            "(%.1f%%)\n", LUT_SKIPS, LUT_CALLS,
+            LUT_CALLS > 0 ? 100.0 * LUT_SKIPS / LUT_CALLS : 0.0);
+   }
+   if (STATS) {
+      stats_phase("query", &stt);
+      fprintf(stderr, "stats: prefilter skipped %ld of %ld searches "
+            "(%.1f%%)\n", LUT_SKIPS, LUT_CALLS,
+            LUT_CALLS > 0 ? 100.0 * LUT_SKIPS / LUT_CALLS : 0.0);
+      fprintf(stderr, "stats: poucet visited %ld nodes for %ld hits\n",
+            POUCET_VISITS, POUCET_HITS);
+   }
 
-   // Remove padding characters.
-   unpad_useq(uSQ);
+   // The packed sequences of the prefilter are stale from here on.
+   for (int i = 0 ; i < uSQ->nitems ; i++) {
+      useq_t *u = (useq_t *) uSQ->items[i];
+      free(u->pack);
+      u->pack = NULL;
+   }
+
+   if (chkf != NULL) {
+      if (verbose) fprintf(stderr, "checkpointing match edges\n");
+      CHK_RECORD = 0;
+      write_checkpoint_edges(chkf);
+   }
+
+   }
+   else if (chkf != NULL) {
+      // The checkpoint being resumed is already complete: copy the
+      // unique table only (the raw edges are not retained once the
+      // match records are built).
+      write_checkpoint_uniq(chkf, uSQ, tau);
+   }
 
    //
    //  MESSAGE PASSING ALGORITHM
@@ -471,17 +975,25 @@ starcode
       if (verbose) fprintf(stderr, "message passing clustering\n");
 
       // Cluster the pairs.
-      message_passing_clustering(uSQ);
+      message_passing_clustering(uSQ, thrmax);
       // Sort in canonical order.
       qsort(uSQ->items, uSQ->nitems, sizeof(useq_t *), canonical_order);
 
+      if (STATS) stats_phase("cluster", &stt);
+
       if (OUTPUTT == DEFAULT_OUTPUT) {
 
          useq_t *first = (useq_t *) uSQ->items[0];
          useq_t *canonical = first->canonical;
 
          // If the first canonical is NULL, then they all are.
-         if (first->canonical == NULL) return 0;
+         if (first->canonical == NULL) {
+            destroy_outbuf(OUTPUTB1);
+            if (OUTPUTB2 != NULL) destroy_outbuf(OUTPUTB2);
+            OUTPUTB1 = NULL;
+            OUTPUTB2 = NULL;
+            return 0;
+         }
          head_default(first, propt);
 
          // Use newline separator.
@@ -524,7 +1036,7 @@ starcode
 	    sort_and_print_ids(idstack);
 	    idstack_free(idstack);
 	 }
-         fprintf(OUTPUTF1, "\n");
+         obprintf(OUTPUTB1, "\n");
 	 
 
       }
@@ -541,6 +1053,8 @@ starcode
       // Sort in count order.
       qsort(uSQ->items, uSQ->nitems, sizeof(useq_t *), sphere_size_order);
 
+      if (STATS) stats_phase("cluster", &stt);
+
       // Default output.
       if (OUTPUTT == DEFAULT_OUTPUT) {
 	 // Sequence id stack.
@@ -550,12 +1064,12 @@ starcode
             useq_t *u = (useq_t *) uSQ->items[i];
             if (u->canonical != u) break;
 
-            fprintf(OUTPUTF1, "%s\t", u->seq);
+            obprintf(OUTPUTB1, "%s\t", u->seq);
             if (showclusters) {
-               fprintf(OUTPUTF1, "%d\t%s", u->sphere_c, u->seq);
+               obprintf(OUTPUTB1, "%d\t%s", u->sphere_c, u->seq);
             }
             else {
-               fprintf(OUTPUTF1, "%d", u->sphere_c);
+               obprintf(OUTPUTB1, "%d", u->sphere_c);
             }
 	    // Reset stack and add canonical ids.
 	    if (showids) {
@@ -570,14 +1084,14 @@ starcode
                   for (int k = 0 ; k < hits->nitems ; k++) {
                      useq_t *match = (useq_t *) hits->items[k];
                      if (match->canonical != u) continue;
-                     if (showclusters) fprintf(OUTPUTF1, ",%s", match->seq);
+                     if (showclusters) obprintf(OUTPUTB1, ",%s", match->seq);
 		     if (showids) idstack_push(match->seqid, match->nids, idstack);
                   }
                }
             }
             // Print cluster seqIDs.
             if (showids) sort_and_print_ids(idstack);
-            fprintf(OUTPUTF1, "\n");
+            obprintf(OUTPUTB1, "\n");
          }
 	 if (showids) idstack_free(idstack);
       }
@@ -594,6 +1108,8 @@ starcode
       // stored in centroid->count.
       gstack_t * clusters = compute_clusters(uSQ);
 
+      if (STATS) stats_phase("cluster", &stt);
+
       // Default output.
       if (OUTPUTT == DEFAULT_OUTPUT) {
 	 idstack_t  * idstack = NULL;
@@ -603,21 +1119,21 @@ starcode
             // Get canonical.
             useq_t * canonical = (useq_t *) cluster->items[0];
             // Print canonical and cluster count.
-            fprintf(OUTPUTF1, "%s\t%d", canonical->seq, canonical->count);
+            obprintf(OUTPUTB1, "%s\t%d", canonical->seq, canonical->count);
             if (showclusters || showids) {
-               fprintf (OUTPUTF1, "\t%s", canonical->seq);
+               obprintf (OUTPUTB1, "\t%s", canonical->seq);
 	       if (showids) {
 		  idstack->pos = 0;
 		  idstack_push(canonical->seqid, canonical->nids, idstack);
 	       }
                for (int k = 1; k < cluster->nitems; k++) {
 		  useq_t * u = (useq_t *) cluster->items[k];
-                  if (showclusters) fprintf (OUTPUTF1, ",%s", u->seq);
+                  if (showclusters) obprintf (OUTPUTB1, ",%s", u->seq);
 		  if (showids) idstack_push(u->seqid, u->nids, idstack);
                }
 	       if (showids) sort_and_print_ids(idstack);
             }
-            fprintf(OUTPUTF1, "\n");
+            obprintf(OUTPUTB1, "\n");
          }
 	 if (showids) idstack_free(idstack);
       } else if (OUTPUTT == NRED_OUTPUT) {
@@ -653,989 +1169,4670 @@ starcode
 
    }
 
-   // Do not free anything.
-   OUTPUTF1 = NULL;
-   OUTPUTF2 = NULL;
+   // Flush the output and stop the writer threads.
+   destroy_outbuf(OUTPUTB1);
+   if (OUTPUTB2 != NULL) destroy_outbuf(OUTPUTB2);
+   OUTPUTB1 = NULL;
+   OUTPUTB2 = NULL;
+
+   if (STATS) stats_phase("output", &stt);
+
    return 0;
 
 }
 
-void
-run_plan
+
+int
+starcode_umi
 (
-   mtplan_t *mtplan,
+   FILE *inputf,
+   FILE *outputf,
+   const int umilen,
+   const int umitau,
+         int seqtau,
+   const int seqtrim,
    const int verbose,
-   const int thrmax
+         int thrmax,
+   const int clusteralg,
+         double parent_to_child,
+   const int showids
 )
+// SYNOPSIS:
+//   Combined UMI + sequence workflow, the native version of the
+//   'starcode-umi' wrapper script. Every read starts with a UMI of
+//   'umilen' characters followed by the sequence proper; the two
+//   columns carry independent errors, so they are clustered
+//   separately ('umitau' and 'seqtau' mismatches) and the final
+//   clusters pair one sequence cluster with one UMI cluster.
+//
+//   The input is parsed once. The reads are split in memory and the
+//   columns go through the middle of the 'starcode()' pipeline one
+//   after the other, joined back by the record ids of the reads
+//   (the wrapper instead runs two starcode processes and feeds the
+//   full data set to each of them).
+//
+//   Only the first 'seqtrim' characters of the sequence enter the
+//   clustering (0 disables the trimming, as in the wrapper); the
+//   output restores the most frequent tail of the cluster. Each
+//   output line is the canonical UMI, the canonical sequence, the
+//   total read count and optionally the sorted record ids, in the
+//   format of the default output of 'starcode()'.
+//
+// RETURN:
+//   0 on success, 1 if the input is empty.
 {
-   // Count total number of jobs.
-   int njobs = mtplan->ntries * (mtplan->ntries+1) / 2;
 
-   // Thread Scheduler
-   int triedone = 0;
-   int idx = -1;
+   OUTPUTB1 = new_outbuf(outputf);
+   CLUSTERALG = clusteralg;
+   CLUSTER_RATIO = parent_to_child;
 
-   while (triedone < mtplan->ntries) { 
-      // Cycle through the tries in turn.
-      idx = (idx+1) % mtplan->ntries;
-      mttrie_t *mttrie = mtplan->tries + idx;
-      pthread_mutex_lock(mtplan->mutex);     
+   if (verbose) {
+      fprintf(stderr, "running starcode with %d thread%s\n",
+           thrmax, thrmax > 1 ? "s" : "");
+      fprintf(stderr, "reading input files\n");
+   }
+   gstack_t *reads = read_file(inputf, NULL, verbose, thrmax);
+   if (reads == NULL || reads->nitems < 1) {
+      fprintf(stderr, "input file empty\n");
+      destroy_outbuf(OUTPUTB1);
+      OUTPUTB1 = NULL;
+      return 1;
+   }
 
-      // Check whether trie is idle and there are available threads.
-      if (mttrie->flag == TRIE_FREE && mtplan->active < thrmax) {
+   // Split every unique read into its UMI and sequence columns. The
+   // columns inherit the record ids of the read; identical UMIs (or
+   // sequences) coming from different reads are merged by
+   // 'seqsort()' during the clustering, which concatenates the ids.
+   gstack_t *uUMI = new_gstack();
+   gstack_t *uSEQ = new_gstack();
+   if (uUMI == NULL || uSEQ == NULL) {
+      alert();
+      krash();
+   }
+   int nreads = 0;
+   for (int i = 0 ; i < reads->nitems ; i++) {
+      useq_t *r = (useq_t *) reads->items[i];
+      int len = strlen(r->seq);
+      if (len <= umilen) {
+         fprintf(stderr, "sequence not longer than the UMI "
+               "(%d characters): %s\n", umilen, r->seq);
+         abort();
+      }
+      int slen = len - umilen;
+      int clen = (seqtrim > 0 && slen > seqtrim) ? seqtrim : slen;
+      useq_t *umi = new_useq_len(r->count, r->seq, umilen, NULL, 0);
+      useq_t *seq = new_useq_len(r->count, r->seq + umilen, clen,
+            NULL, 0);
+      umi->seqid = malloc(r->nids * sizeof(int));
+      seq->seqid = malloc(r->nids * sizeof(int));
+      if (umi->seqid == NULL || seq->seqid == NULL) {
+         alert();
+         krash();
+      }
+      memcpy(umi->seqid, r->seqid, r->nids * sizeof(int));
+      memcpy(seq->seqid, r->seqid, r->nids * sizeof(int));
+      umi->nids = seq->nids = r->nids;
+      push(umi, &uUMI);
+      push(seq, &uSEQ);
+      for (unsigned int k = 0 ; k < r->nids ; k++) {
+         if (r->seqid[k] > nreads) nreads = r->seqid[k];
+      }
+   }
 
-         // No more jobs on this trie.
-         if (mttrie->currentjob == mttrie->njobs) {
-            mttrie->flag = TRIE_DONE;
-            triedone++;
-         }
+   // Cluster the two columns in turn.
+   umi_cluster_column(uUMI, umitau, thrmax, verbose, "UMIs");
+   umi_cluster_column(uSEQ, seqtau, thrmax, verbose, "sequences");
 
-         // Some more jobs to do.
-         else {
-            mttrie->flag = TRIE_BUSY;
-            mtplan->active++;
-            mtjob_t *job = mttrie->jobs + mttrie->currentjob++;
-            pthread_t thread;
-            // Start job and detach thread.
-            if (pthread_create(&thread, NULL, do_query, job)) {
-               alert();
-               krash();
+   // Map every record id to its canonical in both columns.
+   useq_t **umi_of = calloc(nreads + 1, sizeof(useq_t *));
+   useq_t **seq_of = calloc(nreads + 1, sizeof(useq_t *));
+   if (umi_of == NULL || seq_of == NULL) {
+      alert();
+      krash();
+   }
+   for (int i = 0 ; i < uUMI->nitems ; i++) {
+      useq_t *u = (useq_t *) uUMI->items[i];
+      for (unsigned int k = 0 ; k < u->nids ; k++) {
+         umi_of[u->seqid[k]] = u->canonical;
+      }
+   }
+   for (int i = 0 ; i < uSEQ->nitems ; i++) {
+      useq_t *u = (useq_t *) uSEQ->items[i];
+      for (unsigned int k = 0 ; k < u->nids ; k++) {
+         seq_of[u->seqid[k]] = u->canonical;
+      }
+   }
+
+   // All the ids of a unique read carry the same pair of
+   // canonicals, so the merge works at the granularity of unique
+   // reads: one record per read, sorted by (sequence cluster, UMI
+   // cluster) to make the final clusters contiguous.
+   umirec_t *recs = malloc(reads->nitems * sizeof(umirec_t));
+   if (recs == NULL) {
+      alert();
+      krash();
+   }
+   int nrec = 0;
+   for (int i = 0 ; i < reads->nitems ; i++) {
+      useq_t *r = (useq_t *) reads->items[i];
+      useq_t *ucanon = umi_of[r->seqid[0]];
+      useq_t *scanon = seq_of[r->seqid[0]];
+      // Drop the reads left unassigned in either column (message
+      // passing does not assign the ambiguous sequences).
+      if (ucanon == NULL || scanon == NULL) continue;
+      int slen = strlen(r->seq) - umilen;
+      recs[nrec++] = (umirec_t) {
+         .seqrank = scanon->sphere_c,
+         .umirank = ucanon->sphere_c,
+         .ucanon  = ucanon,
+         .scanon  = scanon,
+         .tail    = seqtrim > 0 && slen > seqtrim ?
+                       r->seq + umilen + seqtrim : "",
+         .read    = r,
+      };
+   }
+   qsort(recs, nrec, sizeof(umirec_t), umi_record_order);
+
+   if (verbose) fprintf(stderr, "merging clusters\n");
+
+   umirec_t *scratch = malloc((nrec > 0 ? nrec : 1)*sizeof(umirec_t));
+   if (scratch == NULL) {
+      alert();
+      krash();
+   }
+   idstack_t *idstack = showids ? idstack_new(64) : NULL;
+   int i = 0;
+   while (i < nrec) {
+      // The records of one sequence cluster are contiguous.
+      int j = i;
+      while (j < nrec && recs[j].seqrank == recs[i].seqrank) j++;
+      // Recover the most frequent tail of the sequence cluster
+      // (count-weighted, ties resolved in favor of the smallest
+      // tail so that the output does not depend on the merge
+      // order).
+      const char *tail = "";
+      if (seqtrim > 0) {
+         memcpy(scratch, recs + i, (j-i) * sizeof(umirec_t));
+         qsort(scratch, j-i, sizeof(umirec_t), umi_tail_order);
+         int best = 0;
+         for (int a = 0 ; a < j-i ; ) {
+            int b = a;
+            int weight = 0;
+            while (b < j-i &&
+                  strcmp(scratch[b].tail, scratch[a].tail) == 0) {
+               weight += scratch[b].read->count;
+               b++;
             }
-            pthread_detach(thread);
-            if (verbose) {
-               fprintf(stderr, "progress: %.2f%% \r",
-                     100*(float)(mtplan->jobsdone)/njobs);
+            if (weight > best) {
+               best = weight;
+               tail = scratch[a].tail;
             }
+            a = b;
          }
       }
-
-      // If max thread number is reached, wait for a thread.
-      while (mtplan->active == thrmax) {
-         pthread_cond_wait(mtplan->monitor, mtplan->mutex);
+      // Split the sequence cluster by UMI cluster.
+      while (i < j) {
+         int count = 0;
+         if (showids) idstack->pos = 0;
+         int k = i;
+         while (k < j && recs[k].umirank == recs[i].umirank) {
+            count += recs[k].read->count;
+            if (showids) {
+               idstack_push(recs[k].read->seqid,
+                     recs[k].read->nids, idstack);
+            }
+            k++;
+         }
+         obprintf(OUTPUTB1, "%s%s%s\t%d", recs[i].ucanon->seq,
+               recs[i].scanon->seq, tail, count);
+         if (showids) sort_and_print_ids(idstack);
+         obprintf(OUTPUTB1, "\n");
+         i = k;
       }
+   }
 
-      pthread_mutex_unlock(mtplan->mutex);
-
+   if (showids) idstack_free(idstack);
+   free(scratch);
+   free(recs);
+   free(umi_of);
+   free(seq_of);
+   for (int i = 0 ; i < uUMI->nitems ; i++) {
+      destroy_useq(uUMI->items[i]);
+   }
+   for (int i = 0 ; i < uSEQ->nitems ; i++) {
+      destroy_useq(uSEQ->items[i]);
    }
+   for (int i = 0 ; i < reads->nitems ; i++) {
+      destroy_useq(reads->items[i]);
+   }
+   free(uUMI);
+   free(uSEQ);
+   free(reads);
 
-   return;
+   // Flush the output and stop the writer thread.
+   destroy_outbuf(OUTPUTB1);
+   OUTPUTB1 = NULL;
+
+   return 0;
 
 }
 
 
-void *
-do_query
+void
+umi_cluster_column
 (
-   void * args
-)  
+   gstack_t   * uSQ,
+         int    tau,
+         int    thrmax,
+   const int    verbose,
+   const char * what
+)
+// SYNOPSIS:
+//   Runs the middle of the 'starcode()' pipeline (sort, search,
+//   cluster) on one column of the combined UMI + sequence workflow.
+//   On return the unique sequences are sorted in output order, the
+//   field 'canonical' points to the canonical of their cluster
+//   (NULL for the sequences that message passing leaves
+//   unassigned) and the canonicals hold the 1-based output rank of
+//   their cluster in 'sphere_c' (free after clustering).
 {
-   // Unpack arguments.
-   mtjob_t  * job    = (mtjob_t*) args;
-   gstack_t * useqS  = job->useqS;
-   trie_t   * trie   = job->trie;
-   lookup_t * lut    = job->lut;
-   const int  tau    = job->tau;
-   node_t * node_pos = job->node_pos;
 
-   // Create local hit stack.
-   gstack_t **hits = new_tower(tau+1);
-   if (hits == NULL) {
-      alert();
-      krash();
+   if (verbose) fprintf(stderr, "sorting %s\n", what);
+   uSQ->nitems = seqsort((useq_t **) uSQ->items, uSQ->nitems, thrmax);
+
+   // Get number of tries.
+   int ntries = 3 * thrmax + (thrmax % 2 == 0);
+   if (uSQ->nitems < ntries) {
+      ntries = 1;
+      thrmax = 1;
    }
 
-   // Define a constant to help the compiler recognize
-   // that only one of the two cases will ever be used
-   // in the loop below.
-   const int bidir_match = (CLUSTERALG == SPHERES_CLUSTER || CLUSTERALG == COMPONENTS_CLUSTER);
-   useq_t * last_query = NULL;
+   int med = -1;
+   len_median(uSQ, &med);
+   if (tau < 0) {
+      tau = med > 160 ? 8 : 2 + med/30;
+      if (verbose) {
+         fprintf(stderr, "setting %s dist to %d\n", what, tau);
+      }
+   }
 
-   for (int i = job->start ; i <= job->end ; i++) {
-      useq_t *query = (useq_t *) useqS->items[i];
-      int do_search = lut_search(lut, query) == 1;
+   // Pack the sequences for the prefilter (see 'seq2id_pack()').
+   for (int i = 0 ; i < uSQ->nitems ; i++) {
+      useq_t *u = (useq_t *) uSQ->items[i];
+      pack_useq(u, strlen(u->seq));
+   }
 
-      // Insert the new sequence in the lut and trie, but let
-      // the last pointer to NULL so that the query does not
-      // find itself upon search.
-      void **data = NULL;
-      if (job->build) {
-         if (lut_insert(lut, query)) {
-            alert();
-            krash();
-         }
-         data = insert_string_wo_malloc(trie, query->seq, &node_pos);
-         if (data == NULL || *data != NULL) {
-            alert();
-            krash();
+   // Make multithreading plan and run the query.
+   mtplan_t *mtplan = plan_mt(tau, med, ntries, uSQ);
+   run_plan(mtplan, verbose, thrmax);
+   if (verbose) fprintf(stderr, "progress: 100.00%%\n");
+
+   // The packed sequences of the prefilter are stale from here on.
+   for (int i = 0 ; i < uSQ->nitems ; i++) {
+      useq_t *u = (useq_t *) uSQ->items[i];
+      free(u->pack);
+      u->pack = NULL;
+   }
+
+   if (verbose) fprintf(stderr, "clustering %s\n", what);
+   if (CLUSTERALG == MP_CLUSTER) {
+      message_passing_clustering(uSQ, thrmax);
+      qsort(uSQ->items, uSQ->nitems, sizeof(useq_t *),
+            canonical_order);
+   }
+   else if (CLUSTERALG == SPHERES_CLUSTER) {
+      sphere_clustering(uSQ);
+      qsort(uSQ->items, uSQ->nitems, sizeof(useq_t *),
+            sphere_size_order);
+   }
+   else if (CLUSTERALG == COMPONENTS_CLUSTER) {
+      gstack_t *clusters = compute_clusters(uSQ);
+      // Refill the stack in cluster order and point every member to
+      // the centroid of its cluster so that the assignments can be
+      // read the same way for all the algorithms.
+      uSQ->nitems = 0;
+      for (int i = 0 ; i < clusters->nitems ; i++) {
+         gstack_t *cluster = (gstack_t *) clusters->items[i];
+         useq_t *canonical = (useq_t *) cluster->items[0];
+         for (int k = 0 ; k < cluster->nitems ; k++) {
+            useq_t *u = (useq_t *) cluster->items[k];
+            u->canonical = canonical;
+            push(u, &uSQ);
          }
+         free(cluster);
       }
+      free(clusters);
+   }
 
-      if (do_search) {
-         int trail = 0;
-         if (i < job->end) {
-            useq_t *next_query = (useq_t *) useqS->items[i+1];
-            // The 'while' condition is guaranteed to be false
-            // before the end of the 'char' arrays because all
-            // the queries have the same length and are different.
-            while (query->seq[trail] == next_query->seq[trail]) {
-               trail++;
-            }
-         }
+   // Rank the clusters in output order.
+   for (int i = 0 ; i < uSQ->nitems ; i++) {
+      ((useq_t *) uSQ->items[i])->sphere_c = 0;
+   }
+   int rank = 0;
+   for (int i = 0 ; i < uSQ->nitems ; i++) {
+      useq_t *canon = ((useq_t *) uSQ->items[i])->canonical;
+      if (canon == NULL) continue;
+      if (canon->sphere_c == 0) canon->sphere_c = ++rank;
+   }
 
-         // Compute start height.
-         int start = 0;
-         if (last_query != NULL) {
-            while(query->seq[start] == last_query->seq[start]) start++;
-         }
+   return;
 
-         // Clear hit stack. //
-         for (int j = 0 ; hits[j] != TOWER_TOP ; j++) {
-            hits[j]->nitems = 0;
-         }
+}
 
-         // Search the trie. //
-         int err = search(trie, query->seq, tau, hits, start, trail);
-         if (err) {
-            alert();
-            krash();
-         }
 
-         for (int j = 0 ; hits[j] != TOWER_TOP ; j++) {
-            if (hits[j]->nitems > hits[j]->nslots) {
-               fprintf(stderr, "warning: incomplete search (%s)\n",
-                       query->seq);
-               break;
-            }
-         }
+int
+umi_record_order
+(
+   const void *a,
+   const void *b
+)
+// Merge order of the unique reads: sequence cluster, then UMI
+// cluster, then first record id.
+{
+   const umirec_t *ra = (const umirec_t *) a;
+   const umirec_t *rb = (const umirec_t *) b;
+   if (ra->seqrank != rb->seqrank) return ra->seqrank - rb->seqrank;
+   if (ra->umirank != rb->umirank) return ra->umirank - rb->umirank;
+   return ra->read->seqid[0] - rb->read->seqid[0];
+}
 
-         // Link matching pairs for clustering.
-         // Skip dist = 0, as this would be self.
-         for (int dist = 1 ; dist < tau+1 ; dist++) {
-         for (int j = 0 ; j < hits[dist]->nitems ; j++) {
 
-            useq_t *match = (useq_t *) hits[dist]->items[j];
-            if (bidir_match) {
-               // Make a bidirectional match reference.
-               // Add reference from query to matched node.
-               pthread_mutex_lock(job->mutex + job->queryid);
-               if (addmatch(query, match, dist, tau)) {
-                  fprintf(stderr,
-                        "Please contact guillaume.filion@gmail.com "
-                        "for support with this issue.\n");
-                  abort();
-               }
-               pthread_mutex_unlock(job->mutex + job->queryid);
-               // Add reference from matched node to query.
-               pthread_mutex_lock(job->mutex + job->trieid);
-               if (addmatch(match, query, dist, tau)) {
-                  fprintf(stderr,
-                        "Please contact guillaume.filion@gmail.com "
-                        "for support with this issue.\n");
-                  abort();
-               }
-               pthread_mutex_unlock(job->mutex + job->trieid);
-            }
+int
+umi_tail_order
+(
+   const void *a,
+   const void *b
+)
+// Groups the identical tails of a sequence cluster for the count.
+{
+   const umirec_t *ra = (const umirec_t *) a;
+   const umirec_t *rb = (const umirec_t *) b;
+   int cmp = strcmp(ra->tail, rb->tail);
+   if (cmp != 0) return cmp;
+   return ra->read->seqid[0] - rb->read->seqid[0];
+}
 
-            else {
-               // The parent is the sequence with highest count.
-               // For ties, parent is the query and child is the match.
-               // Matches are stored in child only (i.e. children
-               // know their parents).
-               useq_t *parent = match->count > query->count ? match : query;
-               useq_t *child  = match->count > query->count ? query : match;
-               // If clustering is done by message passing, do not link
-               // pair if counts are on the same order of magnitude.
-               int mincount = child->count;
-               int maxcount = parent->count;
-               if (maxcount < CLUSTER_RATIO * mincount) continue;
-	       // In case CLUSTER_RATIO is set to 1, set parent to the
-	       // lexicographically smaller. This will avoid circular
-	       // parent references that produce infinite loops when
-	       // clustering.
-	       if (maxcount == mincount) {
-		  if (strcmp(parent->seq, child->seq) > 0) {
-		     useq_t * t = parent;
-		     parent = child;
-		     child = t;
-		  }
-	       }
-               // The child is modified, use the child mutex.
-	       int mutexid = parent == query ? job->trieid : job->queryid;
-               pthread_mutex_lock(job->mutex + mutexid);
-               if (addmatch(child, parent, dist, tau)) {
-                  fprintf(stderr,
-                        "Please contact guillaume.filion@gmail.com "
-                        "for support with this issue.\n");
-                  abort();
-               }
-               pthread_mutex_unlock(job->mutex + mutexid);
-            }
-         }
-         }
 
-         last_query = query;
+int
+starcode_ref
+(
+   FILE *reff,
+   FILE *queryf,
+   FILE *outputf,
+         int tau,
+   const int verbose,
+         int thrmax,
+   FILE *indexf,
+   const int saveindex
+)
+// SYNOPSIS:
+//   Reference mode: builds the trie from a fixed reference set,
+//   streams the queries through the search without inserting them
+//   and prints the best matching reference of every query. There
+//   is no clustering phase, so this replaces the all-pairs search
+//   of 'starcode()' when the sequences must only be assigned to a
+//   known list (e.g. a barcode whitelist).
+//
+//   The output is tab separated: query sequence, best matching
+//   reference and distance ("NA" and "-" when no reference lies
+//   within 'tau'). The best match is the closest reference; ties
+//   are broken by the highest count, then by the lexicographically
+//   smallest sequence (see 'merge_assignments()').
+//
+//   When 'indexf' is not NULL, the reference trie is saved to it
+//   after the build ('saveindex' set) or loaded from it instead of
+//   being built ('saveindex' unset, see 'load_ctrie()').
+{
 
-      }
+   OUTPUTB1 = new_outbuf(outputf);
+   OUTPUTB2 = NULL;
 
-      if (job->build) {
-         // Finally set the pointer of the inserted tail node.
-         *data = query;
-      }
+   if (verbose) {
+      fprintf(stderr, "running starcode with %d thread%s\n",
+           thrmax, thrmax > 1 ? "s" : "");
+      fprintf(stderr, "reading input files\n");
+   }
+   gstack_t *refS = read_file(reff, NULL, verbose, thrmax);
+   gstack_t *uSQ = read_file(queryf, NULL, verbose, thrmax);
+   if (refS == NULL || refS->nitems < 1 ||
+         uSQ == NULL || uSQ->nitems < 1) {
+      fprintf(stderr, "input file empty\n");
+      destroy_outbuf(OUTPUTB1);
+      OUTPUTB1 = NULL;
+      return 1;
    }
-   
-   destroy_tower(hits);
 
-   // Flag trie, update thread count and signal scheduler.
-   // Use the general mutex. (job->mutex[0])
-   pthread_mutex_lock(job->mutex);
-   *(job->active) -= 1;
-   *(job->jobsdone) += 1;
-   *(job->trieflag) = TRIE_FREE;
-   pthread_cond_signal(job->monitor);
-   pthread_mutex_unlock(job->mutex);
+   // Sort/reduce.
+   if (verbose) fprintf(stderr, "sorting\n");
+   refS->nitems = seqsort((useq_t **) refS->items, refS->nitems, thrmax);
+   uSQ->nitems = seqsort((useq_t **) uSQ->items, uSQ->nitems, thrmax);
 
-   return NULL;
+   // The references and the queries are padded to a common length
+   // so that the queries have the height of the trie. The median
+   // is taken over both sets, like the single set of 'starcode()'.
+   int maxlen = 0;
+   for (int i = 0 ; i < refS->nitems ; i++) {
+      int len = strlen(((useq_t *) refS->items[i])->seq);
+      if (len > maxlen) maxlen = len;
+   }
+   for (int i = 0 ; i < uSQ->nitems ; i++) {
+      int len = strlen(((useq_t *) uSQ->items[i])->seq);
+      if (len > maxlen) maxlen = len;
+   }
+   int *count = calloc((maxlen + 1), sizeof(int));
+   if (count == NULL) {
+      alert();
+      krash();
+   }
+   for (int i = 0 ; i < refS->nitems ; i++) {
+      count[strlen(((useq_t *) refS->items[i])->seq)]++;
+   }
+   for (int i = 0 ; i < uSQ->nitems ; i++) {
+      count[strlen(((useq_t *) uSQ->items[i])->seq)]++;
+   }
+   int med = 0;
+   int ccount = 0;
+   do {
+      ccount += count[++med];
+   } while (ccount < (refS->nitems + uSQ->nitems) / 2);
+   free(count);
 
-}
+   pad_useq_len(refS, maxlen);
+   pad_useq_len(uSQ, maxlen);
 
+   if (tau < 0) {
+      tau = med > 160 ? 8 : 2 + med/30;
+      if (verbose) {
+         fprintf(stderr, "setting dist to %d\n", tau);
+      }
+   }
 
-mtplan_t *
-plan_mt
-(
-    int       tau,
-    int       height,
-    int       medianlen,
-    int       ntries,
-    gstack_t *useqS
-)
-// SYNOPSIS:                                                              
-//   The scheduler makes the key assumption that the number of tries is   
-//   an odd number, which allows to distribute the jobs among as in the   
-//   example shown below. The rows indicate blocks of query strings and   
-//   the columns are distinct tries. An circle (o) indicates a build job, 
-//   a cross (x) indicates a query job, and a dot (.) indicates that the  
-//   block is not queried in the given trie.                              
-//                                                                        
-//                            --- Tries ---                               
-//                            1  2  3  4  5                               
-//                         1  o  .  .  x  x                               
-//                         2  x  o  .  .  x                               
-//                         3  x  x  o  .  .                               
-//                         4  .  x  x  o  .                               
-//                         5  .  .  x  x  o                               
-//                                                                        
-//   This simple schedule ensures that each trie is built from one query  
-//   block and that each block is queried against every other exactly one 
-//   time (a query of block i in trie j is the same as a query of block j 
-//   in trie i).                                                          
-{
-   // Initialize plan.
-   mtplan_t *mtplan = malloc(sizeof(mtplan_t));
-   if (mtplan == NULL) {
-      alert();
-      krash();
+   // Build (or load) the reference trie.
+   ctrie_t *trie = NULL;
+   if (indexf != NULL && !saveindex) {
+      if (verbose) fprintf(stderr, "loading index\n");
+      trie = load_ctrie(indexf);
+      if (trie == NULL) {
+         fprintf(stderr, "error: could not load index\n");
+         abort();
+      }
+      if ((int) trie->height != maxlen) {
+         fprintf(stderr, "error: index height (%d) does not match "
+               "the sequence length (%d)\n", trie->height, maxlen);
+         abort();
+      }
+   }
+   else {
+      // Presized with the node count of the sorted references,
+      // plus one for the root.
+      long nnodes = count_trie_nodes((useq_t **) refS->items,
+            0, refS->nitems);
+      trie = new_ctrie(maxlen, nnodes+1, refS->nitems);
+      if (trie == NULL) {
+         alert();
+         krash();
+      }
    }
 
-   // Initialize mutex.
-   pthread_mutex_t *mutex = malloc((ntries + 1) * sizeof(pthread_mutex_t));
-   pthread_cond_t *monitor = malloc(sizeof(pthread_cond_t));
-   if (mutex == NULL || monitor == NULL) {
+   lookup_t *lut = new_lookup(med, maxlen, tau);
+   if (lut == NULL) {
       alert();
       krash();
    }
-   for (int i = 0; i < ntries + 1; i++) pthread_mutex_init(mutex + i,NULL);
-   pthread_cond_init(monitor,NULL);
 
-   // Initialize 'mttries'.
-   mttrie_t *mttries = malloc(ntries * sizeof(mttrie_t));
-   if (mttries == NULL) {
+   // Insert the references, in bulk since they are sorted. On a
+   // loaded index the insertions create no node: they return the
+   // existing data slots, which rebinds the serialized trie to
+   // the reference sequences.
+   const char *prev_seq = NULL;
+   uint32_t spine[M];
+   for (int i = 0 ; i < refS->nitems ; i++) {
+      useq_t *ref = (useq_t *) refS->items[i];
+      if (lut_insert(lut, ref, 0)) {
+         alert();
+         krash();
+      }
+      void **data = insert_string_ctrie_sorted(trie, ref->seq,
+            prev_seq, spine);
+      if (data == NULL) {
+         if (trie->map != NULL) {
+            fprintf(stderr, "error: the references do not match "
+                  "the index\n");
+            abort();
+         }
+         alert();
+         krash();
+      }
+      *data = ref;
+      prev_seq = ref->seq;
+   }
+
+   if (indexf != NULL && saveindex) {
+      if (verbose) fprintf(stderr, "saving index\n");
+      if (save_ctrie(trie, indexf)) {
+         fprintf(stderr, "error: could not save index\n");
+         abort();
+      }
+   }
+
+   // Query phase. The trie covers the whole reference set so the
+   // blocks of queries are independent: each worker gets its own
+   // block — and its own clone of the trie, because the searches
+   // write to the node caches and to the pebbles.
+   if (verbose) fprintf(stderr, "searching\n");
+   LUT_CALLS = 0;
+   LUT_SKIPS = 0;
+   int nthreads = min(thrmax, uSQ->nitems);
+   pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+   refjob_t *rjobs = malloc(nthreads * sizeof(refjob_t));
+   edgebuf_t *ebufs = calloc(nthreads, sizeof(edgebuf_t));
+   if (threads == NULL || rjobs == NULL || ebufs == NULL) {
       alert();
       krash();
    }
 
-   // Boundaries of the query blocks.
-   int Q = useqS->nitems / ntries;
-   int R = useqS->nitems % ntries;
-   int *bounds = malloc((ntries+1) * sizeof(int));
-   for (int i = 0 ; i < ntries+1 ; i++) bounds[i] = Q*i + min(i, R);
-
-   // Preallocated tries.
-   // Count with maxlen-1
-   long *nnodes = malloc(ntries * sizeof(long));
-   for (int i = 0; i < ntries; i++) nnodes[i] =
-      count_trie_nodes((useq_t **)useqS->items, bounds[i], bounds[i+1]);
-
-   // Create jobs for the tries.
-   for (int i = 0 ; i < ntries; i++) {
-      // Remember that 'ntries' is odd.
-      int njobs = (ntries+1)/2;
-      trie_t *local_trie  = new_trie(height);
-      node_t *local_nodes = (node_t *) malloc(nnodes[i] * sizeof(node_t));
-      mtjob_t *jobs = malloc(njobs * sizeof(mtjob_t));
-      if (local_trie == NULL || jobs == NULL) {
+   int Q = uSQ->nitems / nthreads;
+   int R = uSQ->nitems % nthreads;
+   for (int t = 0 ; t < nthreads ; t++) {
+      rjobs[t].job.start = Q*t + min(t, R);
+      rjobs[t].job.end   = Q*(t+1) + min(t+1, R) - 1;
+      rjobs[t].job.tau   = tau;
+      rjobs[t].job.build = 0;
+      rjobs[t].job.ref   = 1;
+      rjobs[t].job.useqS = uSQ;
+      rjobs[t].job.trie  = t == 0 ? trie : clone_ctrie(trie);
+      rjobs[t].job.lut   = lut;
+      rjobs[t].edges     = ebufs + t;
+      rjobs[t].hits      = new_tower(tau+1);
+      if (rjobs[t].job.trie == NULL || rjobs[t].hits == NULL) {
          alert();
          krash();
       }
-
-      // Allocate lookup struct.
-      // TODO: Try only one lut as well. (It will always return 1
-      // in the query step though). #
-      lookup_t * local_lut = new_lookup(medianlen, height, tau);
-      if (local_lut == NULL) {
+      if (pthread_create(threads + t, NULL, query_ref_trie, rjobs + t)) {
          alert();
          krash();
       }
+   }
+   for (int t = 0 ; t < nthreads ; t++) {
+      pthread_join(threads[t], NULL);
+   }
+   if (verbose) {
+      fprintf(stderr, "prefilter skipped %ld of %ld searches "
+            "(%.1f%%)\n", LUT_SKIPS, LUT_CALLS,
+            LUT_CALLS > 0 ? 100.0 * LUT_SKIPS / LUT_CALLS : 0.0);
+   }
 
-      mttries[i].flag       = TRIE_FREE;
-      mttries[i].currentjob = 0;
-      mttries[i].njobs      = njobs;
-      mttries[i].jobs       = jobs;
-
-      for (int j = 0 ; j < njobs ; j++) {
-         // Shift boundaries in a way that every trie is built
-         // exactly once and that no redundant jobs are allocated.
-         int idx = (i+j) % ntries;
-         int only_if_first_job = j == 0;
-         // Specifications of j-th job of the local trie.
-         jobs[j].start    = bounds[idx];
-         jobs[j].end      = bounds[idx+1]-1;
-         jobs[j].tau      = tau;
-         jobs[j].build    = only_if_first_job;
-         jobs[j].useqS    = useqS;
-         jobs[j].trie     = local_trie;
-         jobs[j].node_pos = local_nodes;
-         jobs[j].lut      = local_lut;
-         jobs[j].mutex    = mutex;
-         jobs[j].monitor  = monitor;
-         jobs[j].jobsdone = &(mtplan->jobsdone);
-         jobs[j].trieflag = &(mttries[i].flag);
-         jobs[j].active   = &(mtplan->active);
-         // Mutex ids. (mutex[0] is reserved for general mutex)
-         jobs[j].queryid  = idx + 1;
-         jobs[j].trieid   = i + 1;
+   // Pick the best assignment of every query from the recorded
+   // candidates. Partitioned on the address of the query like
+   // 'merge_matches()' so each record is updated by exactly one
+   // thread and no lock is needed.
+   edgemerge_t *margs = malloc(nthreads * sizeof(edgemerge_t));
+   if (margs == NULL) {
+      alert();
+      krash();
+   }
+   for (int t = 0 ; t < nthreads ; t++) {
+      margs[t].bufs   = ebufs;
+      margs[t].nbufs  = nthreads;
+      margs[t].tau    = tau;
+      margs[t].nparts = nthreads;
+      margs[t].part   = t;
+      if (pthread_create(threads + t, NULL, merge_assignments,
+               margs + t)) {
+         alert();
+         krash();
       }
    }
+   for (int t = 0 ; t < nthreads ; t++) {
+      pthread_join(threads[t], NULL);
+   }
 
-   free(bounds);
-   free(nnodes);
+   for (int t = 1 ; t < nthreads ; t++) {
+      destroy_ctrie(rjobs[t].job.trie, NULL);
+   }
+   destroy_ctrie(trie, NULL);
+   destroy_lookup(lut);
+   for (int t = 0 ; t < nthreads ; t++) {
+      destroy_tower(rjobs[t].hits);
+      free(ebufs[t].edges);
+   }
+   free(ebufs);
+   free(margs);
+   free(rjobs);
+   free(threads);
 
-   mtplan->active = 0;
-   mtplan->ntries = ntries;
-   mtplan->jobsdone = 0;
-   mtplan->mutex = mutex;
-   mtplan->monitor = monitor;
-   mtplan->tries = mttries;
+   // Remove padding characters.
+   unpad_useq(refS);
+   unpad_useq(uSQ);
 
-   return mtplan;
+   // Print the assignments.
+   for (int i = 0 ; i < uSQ->nitems ; i++) {
+      useq_t *query = (useq_t *) uSQ->items[i];
+      if (query->canonical != NULL) {
+         obprintf(OUTPUTB1, "%s\t%s\t%d\n", query->seq,
+               query->canonical->seq, query->sphere_d);
+      }
+      else {
+         obprintf(OUTPUTB1, "%s\tNA\t-\n", query->seq);
+      }
+   }
+
+   // Flush the output and stop the writer thread.
+   destroy_outbuf(OUTPUTB1);
+   OUTPUTB1 = NULL;
+   return 0;
 
 }
 
-long
-count_trie_nodes
+
+int
+starcode_inc
 (
- useq_t ** seqs,
- int     start,
- int     end
+   FILE *statef,
+   FILE *inputf,
+   FILE *outputf,
+   FILE *newstatef,
+         int tau,
+   const int verbose,
+         int thrmax,
+         double parent_to_child,
+         double max_drift
 )
+// SYNOPSIS:
+//   Incremental mode: merges a new batch of reads into the state
+//   saved by a previous run instead of reclustering the cumulative
+//   dataset from scratch. The state records every unique sequence
+//   with its count and its canonical (see 'write_state()').
+//
+//   Sequences already in the state keep their assignment and only
+//   receive the counts of the new batch. The novel sequences are
+//   searched against a trie holding the old and the new sequences
+//   and adopt the canonical of their best eligible parent (closest
+//   match whose count passes the 'parent_to_child' ratio, like the
+//   message passing linkage). This is an approximation: it never
+//   revisits old assignments, so when the fraction of novel unique
+//   sequences exceeds 'max_drift' (or when 'tau' changed) the
+//   clusters are recomputed from scratch with the regular message
+//   passing pipeline.
+//
+//   The output is one cluster per line (canonical sequence and
+//   total count). When 'statef' is NULL the run starts from an
+//   empty state; when 'newstatef' is not NULL the updated state is
+//   written to it.
 {
-   int  seqlen = strlen(seqs[start]->seq) - 1;
-   long count = seqlen;
-   for (int i = start+1; i < end; i++) {
-      char * a = seqs[i-1]->seq;
-      char * b  = seqs[i]->seq;
-      int prefix = 0;
-      while (a[prefix] == b[prefix]) prefix++;
-      count += seqlen - prefix;
+
+   OUTPUTB1 = new_outbuf(outputf);
+   OUTPUTB2 = NULL;
+   CLUSTER_RATIO = parent_to_child > 0 ? parent_to_child : 5.0;
+   if (max_drift <= 0) max_drift = 0.1;
+
+   if (verbose) {
+      fprintf(stderr, "running starcode with %d thread%s\n",
+           thrmax, thrmax > 1 ? "s" : "");
+      fprintf(stderr, "reading input files\n");
+   }
+   gstack_t *uSQ = read_file(inputf, NULL, verbose, thrmax);
+   if (uSQ == NULL) uSQ = new_gstack();
+   if (uSQ->nitems < 1 && statef == NULL) {
+      fprintf(stderr, "input file empty\n");
+      destroy_outbuf(OUTPUTB1);
+      OUTPUTB1 = NULL;
+      return 1;
    }
-   return count;
-}
 
-void
-connected_components
-(
- useq_t * useq,
- gstack_t ** cluster
-)
-{
-   // Flag claimed.
-   useq->canonical = useq;
-   // Add myself to cluster.
-   push(useq, cluster);
-   // Recursive call on edges.
-   if (useq->matches == NULL) return;
-   gstack_t * matches;
-   for (int j = 0;  (matches = useq->matches[j]) != TOWER_TOP; j++) {
-      for (int k = 0; k < matches->nitems; k++) {
-         useq_t * match = (useq_t *) matches->items[k];
-         if (match->canonical != NULL) continue;
-         connected_components(match, cluster);
+   // Sort/reduce the new batch.
+   if (verbose) fprintf(stderr, "sorting\n");
+   uSQ->nitems = seqsort((useq_t **) uSQ->items, uSQ->nitems, thrmax);
+
+   // Read the previous state.
+   gstack_t *stS = NULL;
+   int stau = -1;
+   if (statef != NULL) {
+      if (verbose) fprintf(stderr, "reading state\n");
+      stS = read_state(statef, &stau);
+   }
+
+   // Merge the counts of the known sequences into the state and
+   // collect the novel ones.
+   gstack_t *deltaS = new_gstack();
+   if (deltaS == NULL) {
+      alert();
+      krash();
+   }
+   for (int i = 0 ; i < uSQ->nitems ; i++) {
+      useq_t *u = (useq_t *) uSQ->items[i];
+      int idx = stS == NULL ? -1 :
+         state_find((useq_t **) stS->items, stS->nitems, u->seq);
+      if (idx < 0) {
+         push(u, &deltaS);
+      }
+      else {
+         ((useq_t *) stS->items[idx])->count += u->count;
+         destroy_useq(u);
       }
    }
-}
 
-gstack_t *
-compute_clusters
-(
- gstack_t    * uSQ
-)
-{
-   gstack_t * clusters = new_gstack();
-   for (int i = 0; i < uSQ->nitems; i++) {
-      useq_t * useq = (useq_t *) uSQ->items[i];
+   int nstate = stS == NULL ? 0 : stS->nitems;
+   double drift = nstate + deltaS->nitems == 0 ? 0.0 :
+      (double) deltaS->nitems / (nstate + deltaS->nitems);
+   int recompute = stS == NULL || drift > max_drift ||
+      (tau >= 0 && tau != stau);
+   if (tau < 0) tau = stau;
+   if (verbose && stS != NULL) {
+      fprintf(stderr, "%d novel sequence%s (drift %.3f): %s\n",
+            deltaS->nitems, deltaS->nitems == 1 ? "" : "s", drift,
+            recompute ? "recomputing from scratch" :
+            "updating incrementally");
+   }
 
-      // Check sequence flag.
-      if (useq->canonical != NULL) continue;
+   // Pool the state and the novel sequences.
+   gstack_t *allS = new_gstack();
+   if (allS == NULL) {
+      alert();
+      krash();
+   }
+   for (int i = 0 ; i < nstate ; i++) {
+      push(stS->items[i], &allS);
+   }
+   for (int i = 0 ; i < deltaS->nitems ; i++) {
+      push(deltaS->items[i], &allS);
+   }
+   // The two sets are disjoint so nothing is merged here.
+   allS->nitems = seqsort((useq_t **) allS->items, allS->nitems,
+         thrmax);
+
+   if (recompute) {
+
+      // Full recompute: forget the stored assignments and run the
+      // regular pipeline on the pooled sequences. Snapshot the
+      // counts first: message passing transfers them to the
+      // canonicals and the state records the count of every
+      // unique sequence.
+      int *counts = malloc(allS->nitems * sizeof(int));
+      if (counts == NULL) {
+         alert();
+         krash();
+      }
+      for (int i = 0 ; i < allS->nitems ; i++) {
+         useq_t *u = (useq_t *) allS->items[i];
+         u->canonical = NULL;
+         counts[i] = u->count;
+      }
 
-      // Create new cluster.
-      gstack_t * cluster = new_gstack();
+      int ntries = 3 * thrmax + (thrmax % 2 == 0);
+      if (allS->nitems < ntries) {
+         ntries = 1;
+         thrmax = 1;
+      }
 
-      // Recursively gather connected components.
-      connected_components(useq, &cluster);
+      int med = -1;
+      pad_useq(allS, &med);
+      if (tau < 0) {
+         tau = med > 160 ? 8 : 2 + med/30;
+         if (verbose) {
+            fprintf(stderr, "setting dist to %d\n", tau);
+         }
+      }
 
-      // Find centroid. (max: #counts THEN #edges).
-      // Count useq edges.
-      int edge_count = 0;
-      if (useq->matches != NULL) {
-         gstack_t * matches;
-         for (int j = 0; (matches = useq->matches[j]) != TOWER_TOP; j++)
-            edge_count += matches->nitems;
+      mtplan_t *mtplan = plan_mt(tau, med, ntries, allS);
+      LUT_CALLS = 0;
+      LUT_SKIPS = 0;
+      run_plan(mtplan, verbose, thrmax);
+      if (verbose) {
+         fprintf(stderr, "progress: 100.00%%\n");
       }
+      unpad_useq(allS);
 
-      // Find centroid among cluster seqs.
-      size_t cluster_count = useq->count;
-      for (int k = 1; k < cluster->nitems; k++) {
-         useq_t * s = (useq_t *) cluster->items[k];
-         cluster_count += s->count;
-         // Select centroid by count.
-         if (s->count > useq->count) {
-            // Count centroid edges.
-            int cnt = 0;
-            gstack_t * matches;
-            for (int j = 0; (matches = s->matches[j]) != TOWER_TOP; j++)
-               cnt += matches->nitems;
-            // Store centroid at index 0.
-            cluster->items[0] = s;
-            cluster->items[k] = useq;
-            useq = s;
-            // Save centroid edge count.
-            edge_count = cnt;
+      if (verbose) fprintf(stderr, "message passing clustering\n");
+      message_passing_clustering(allS, thrmax);
+
+      // Save the state before the sort below reorders the items
+      // under the snapshot of the counts.
+      if (newstatef != NULL) {
+         if (verbose) fprintf(stderr, "saving state\n");
+         write_state(newstatef, allS, counts, tau);
+      }
+      free(counts);
+
+      qsort(allS->items, allS->nitems, sizeof(useq_t *),
+            canonical_order);
+
+      // Print the clusters.
+      useq_t *canonical = NULL;
+      for (int i = 0 ; i < allS->nitems ; i++) {
+         useq_t *u = (useq_t *) allS->items[i];
+         if (u->canonical == NULL) break;
+         if (u->canonical != canonical) {
+            canonical = u->canonical;
+            obprintf(OUTPUTB1, "%s\t%d\n", canonical->seq,
+                  canonical->count);
          }
-         // If same count, select by edge count.
-         else if (s->count == useq->count && s->matches != NULL) {
-            int cnt = 0;
-            gstack_t * matches;
-            for (int j = 0; (matches = s->matches[j]) != TOWER_TOP; j++)
-               cnt += matches->nitems;
-            if (cnt > edge_count) {
-               // Store centroid at index 0.
-               cluster->items[0] = s;
-               cluster->items[k] = useq;
-               useq = s;
-               // Save centroid edge count.
-               edge_count = cnt;
+      }
+
+   }
+
+   else if (deltaS->nitems > 0) {
+
+      // Incremental update: search only the novel sequences. The
+      // delta is small so this phase is sequential.
+      if (verbose) fprintf(stderr, "searching the delta\n");
+
+      int med = -1;
+      int height = pad_useq(allS, &med);
+
+      // Build the trie over the pooled sequences, in bulk since
+      // they are sorted.
+      long nnodes = count_trie_nodes((useq_t **) allS->items,
+            0, allS->nitems);
+      ctrie_t *trie = new_ctrie(height, nnodes+1, allS->nitems);
+      if (trie == NULL) {
+         alert();
+         krash();
+      }
+      const char *prev_seq = NULL;
+      uint32_t spine[M];
+      for (int i = 0 ; i < allS->nitems ; i++) {
+         useq_t *u = (useq_t *) allS->items[i];
+         void **data = insert_string_ctrie_sorted(trie, u->seq,
+               prev_seq, spine);
+         if (data == NULL) {
+            alert();
+            krash();
+         }
+         *data = u;
+         prev_seq = u->seq;
+      }
 
+      // Assign the novel sequences in decreasing count order so
+      // that when the best parent of a novel sequence is itself
+      // novel, its canonical is already settled.
+      qsort(deltaS->items, deltaS->nitems, sizeof(useq_t *),
+            count_order);
+      gstack_t **hits = new_tower(tau+1);
+      if (hits == NULL) {
+         alert();
+         krash();
+      }
+      for (int i = 0 ; i < deltaS->nitems ; i++) {
+         useq_t *q = (useq_t *) deltaS->items[i];
+         for (int j = 0 ; hits[j] != TOWER_TOP ; j++) {
+            hits[j]->nitems = 0;
+         }
+         if (search_ctrie(trie, q->seq, tau, hits, 0, 0)) {
+            alert();
+            krash();
+         }
+         for (int j = 0 ; hits[j] != TOWER_TOP ; j++) {
+            if (hits[j]->nitems > hits[j]->nslots) {
+               fprintf(stderr, "warning: incomplete search (%s)\n",
+                       q->seq);
+               break;
+            }
+         }
+         // Best eligible parent: closest match passing the count
+         // ratio; ties broken by the highest count, then by the
+         // lexicographically smallest sequence.
+         useq_t *best = NULL;
+         for (int dist = 1 ; dist < tau+1 && best == NULL ; dist++) {
+            for (int j = 0 ; j < hits[dist]->nitems ; j++) {
+               useq_t *match = (useq_t *) hits[dist]->items[j];
+               if (match == q) continue;
+               if (match->count < CLUSTER_RATIO * q->count) continue;
+               if (match->count == q->count &&
+                     strcmp(match->seq, q->seq) > 0) continue;
+               if (best == NULL || match->count > best->count ||
+                     (match->count == best->count &&
+                      strcmp(match->seq, best->seq) < 0)) {
+                  best = match;
+               }
             }
          }
+         if (best == NULL) {
+            q->canonical = q;
+         }
+         else {
+            if (best->canonical == NULL) best->canonical = best;
+            q->canonical = best->canonical;
+         }
       }
-      useq->count = cluster_count;
-      // Store cluster.
-      push(cluster, &clusters);
+      destroy_tower(hits);
+      destroy_ctrie(trie, NULL);
+      unpad_useq(allS);
+
    }
 
-   // Sort clusters by size (counts).
-   qsort(clusters->items, clusters->nitems, sizeof(gstack_t *), cluster_count);
+   if (!recompute) {
+
+      // Total the counts per canonical ('sphere_c' is free in this
+      // mode) and print the clusters in decreasing total order.
+      for (int i = 0 ; i < allS->nitems ; i++) {
+         ((useq_t *) allS->items[i])->sphere_c = 0;
+      }
+      for (int i = 0 ; i < allS->nitems ; i++) {
+         useq_t *u = (useq_t *) allS->items[i];
+         useq_t *canonical = u->canonical == NULL ? u : u->canonical;
+         canonical->sphere_c += u->count;
+      }
+      gstack_t *canonS = new_gstack();
+      if (canonS == NULL) {
+         alert();
+         krash();
+      }
+      for (int i = 0 ; i < allS->nitems ; i++) {
+         useq_t *u = (useq_t *) allS->items[i];
+         if (u->canonical == NULL || u->canonical == u) {
+            push(u, &canonS);
+         }
+      }
+      qsort(canonS->items, canonS->nitems, sizeof(useq_t *),
+            sphere_size_order);
+      for (int i = 0 ; i < canonS->nitems ; i++) {
+         useq_t *u = (useq_t *) canonS->items[i];
+         obprintf(OUTPUTB1, "%s\t%d\n", u->seq, u->sphere_c);
+      }
+      free(canonS);
+
+      // The counts were not transferred in this mode, so the state
+      // takes them straight from the records.
+      if (newstatef != NULL) {
+         if (verbose) fprintf(stderr, "saving state\n");
+         write_state(newstatef, allS, NULL, tau);
+      }
+
+   }
+
+   free(uSQ);
+   free(deltaS);
+   if (stS != NULL) free(stS);
+
+   // Flush the output and stop the writer thread.
+   destroy_outbuf(OUTPUTB1);
+   OUTPUTB1 = NULL;
+   return 0;
 
-   return clusters;
 }
 
 
-void
-sphere_clustering
+gstack_t *
+read_state
 (
- gstack_t *useqS
+   FILE * statef,
+   int  * tau
 )
+// SYNOPSIS:
+//   Reads a state file written by 'write_state()' into a stack of
+//   'useq_t' sorted in sequence order (see 'state_seq_order()'),
+//   with the canonical pointers resolved. The distance of the run
+//   that produced the state is returned through 'tau'.
 {
-   // Sort in count order.
-   qsort(useqS->items, useqS->nitems, sizeof(useq_t *), count_order_spheres);
+   char line[2*M + 32];
+   if (fgets(line, sizeof(line), statef) == NULL ||
+         sscanf(line, "#starcode-state\t%d", tau) != 1 ||
+         *tau < 0 || *tau > STARCODE_MAX_TAU) {
+      fprintf(stderr, "error: not a starcode state file\n");
+      abort();
+   }
 
-   for (int i = 0 ; i < useqS->nitems ; i++) {
-      useq_t *useq = (useq_t *) useqS->items[i];
-      if (useq->canonical != NULL) continue;
-      useq->canonical = useq;
-      useq->sphere_c  = useq->count;
-      useq->sphere_d  = 0;
-      if (useq->matches == NULL) continue;
-      // Bidirectional edge references simplifie the algorithm.
-      // Directly proceed to claim neighbor counts.
-      gstack_t *matches;
-      for (int j = 0 ; (matches = useq->matches[j]) != TOWER_TOP ; j++) {
-         for (int k = 0 ; k < matches->nitems ; k++) {
-            useq_t *match = (useq_t *) matches->items[k];
-            // If a sequence has been already claimed, remove it from list.
-            if (match->canonical != NULL) {
-	       // Steal sequence from the other sphere if it is closer to this centroid.
-	       if (j < match->sphere_d) {
-		  // Update other sphere size.
-		  match->canonical->sphere_c -= match->count;
-	       } else {
-		  matches->items[k--] = matches->items[--matches->nitems];
-		  continue;
-	       }
-	    }		  
-	    // Claim the sequence.
-	    useq->sphere_c += match->count;
-	    match->canonical = useq;
-	    match->sphere_d = j;
+   gstack_t *stS = new_gstack();
+   if (stS == NULL) {
+      alert();
+      krash();
+   }
+   while (fgets(line, sizeof(line), statef) != NULL) {
+      char *tab1 = strchr(line, '\t');
+      char *tab2 = tab1 == NULL ? NULL : strchr(tab1+1, '\t');
+      char *end  = tab2 == NULL ? NULL : strchr(tab2+1, '\n');
+      int count  = tab1 == NULL ? 0 : atoi(tab1+1);
+      if (end == NULL || count < 1) {
+         fprintf(stderr, "error: invalid state file (line %d)\n",
+               stS->nitems + 2);
+         abort();
+      }
+      for (char *c = line ; c < tab1 ; c++) {
+         if (!valid_DNA_char[(uint8_t) *c]) {
+            fprintf(stderr, "error: invalid state file (line %d)\n",
+                  stS->nitems + 2);
+            abort();
          }
       }
+      // Stash the canonical sequence in the free 'info' field
+      // until all the entries are read.
+      useq_t *new = new_useq_len(count, line, tab1 - line,
+            tab2 + 1, end - tab2 - 1);
+      if (new == NULL) {
+         alert();
+         krash();
+      }
+      push(new, &stS);
    }
 
-   return;
+   qsort(stS->items, stS->nitems, sizeof(useq_t *), state_seq_order);
+
+   // Resolve the canonical pointers.
+   for (int i = 0 ; i < stS->nitems ; i++) {
+      useq_t *u = (useq_t *) stS->items[i];
+      int idx = state_find((useq_t **) stS->items, stS->nitems,
+            u->info);
+      if (idx < 0) {
+         fprintf(stderr, "error: invalid state file (canonical "
+               "%s is not in the state)\n", u->info);
+         abort();
+      }
+      u->canonical = (useq_t *) stS->items[idx];
+      free(u->info);
+      u->info = NULL;
+   }
+
+   return stS;
 
 }
 
 
 void
-message_passing_clustering
+write_state
 (
- gstack_t *useqS
+   FILE      * statef,
+   gstack_t  * useqS,
+   const int * counts,
+   int         tau
 )
+// SYNOPSIS:
+//   Writes the clustering state: a header with the distance of the
+//   run, then one line per unique sequence with its count and its
+//   canonical sequence. 'counts' holds the counts snapshot taken
+//   before they were transferred by the clustering (NULL when the
+//   'count' fields are still intact).
 {
-   // Transfer counts to parents recursively.
-   for (int i = 0 ; i < useqS->nitems ; i++) {
-      useq_t *u = (useq_t *) useqS->items[i];
-      transfer_counts_and_update_canonicals(u);
-   }
-
-   // Resolve ambiguous assignments.
+   fprintf(statef, "#starcode-state\t%d\n", tau);
    for (int i = 0 ; i < useqS->nitems ; i++) {
       useq_t *u = (useq_t *) useqS->items[i];
-      mp_resolve_ambiguous(u);
+      useq_t *canonical = u->canonical == NULL ? u : u->canonical;
+      fprintf(statef, "%s\t%d\t%s\n", u->seq,
+            counts == NULL ? u->count : counts[i], canonical->seq);
    }
+}
 
 
-   return;
-
+int
+state_seq_order
+(
+   const void *a,
+   const void *b
+)
+// Sequence order of 'seqsort()': by length, then lexicographic.
+{
+   useq_t *u1 = *((useq_t **) a);
+   useq_t *u2 = *((useq_t **) b);
+   int l1 = strlen(u1->seq);
+   int l2 = strlen(u2->seq);
+   if (l1 != l2) return l1 < l2 ? -1 : 1;
+   return strcmp(u1->seq, u2->seq);
 }
 
 
 int
-seqsort
+state_find
 (
- useq_t ** data,
- int       numels,
- int       thrmax
+   useq_t     ** items,
+   int           nitems,
+   const char  * seq
 )
-// SYNOPSIS:                                                              
-//   Recursive merge sort for 'useq_t' arrays, tailored for the
-//   problem of sorting merging identical sequences. When two
-//   identical sequences are detected during the sort, they are
-//   merged into a single one with more counts, and one of them
-//   is destroyed (freed). See 'nukesort()' for a description of
-//   the sort order.
-//
-// PARAMETERS:                                                            
-//   data:       an array of pointers to each element.                    
-//   numels:     number of elements, i.e. size of 'data'.                 
-//   thrmax: number of threads.                                       
-//                                                                        
-// RETURN:                                                                
-//   Number of unique elements.                               
-//                                                                        
-// SIDE EFFECTS:                                                          
-//   Pointers to repeated elements are set to NULL.
-{
-   // Copy to buffer.
-   useq_t **buffer = malloc(numels * sizeof(useq_t *));
-   memcpy(buffer, data, numels * sizeof(useq_t *));
-
-   // Prepare args struct.
-   sortargs_t args;
-   args.buf0   = data;
-   args.buf1   = buffer;
-   args.size   = numels;
-   // There are two alternating buffers for the merge step.
-   // 'args.b' alternates on every call to 'nukesort()' to
-   // keep track of which is the source and which is the
-   // destination. It has to be initialized to 0 so that
-   // sorted elements end in 'data' and not in 'buffer'.
-   args.b      = 0;
-   args.thread = 0;
-   args.repeats = 0;
-
-   // Allocate a number of threads that is a power of 2.
-   while ((thrmax >> (args.thread + 1)) > 0) args.thread++;
-
-   nukesort(&args);
-
-   free(buffer);
-   return numels - args.repeats;
-
+// SYNOPSIS:
+//   Binary search of 'seq' in an array sorted in the order of
+//   'state_seq_order()'. Returns the index, or -1 if absent.
+{
+   int len = strlen(seq);
+   int lo = 0;
+   int hi = nitems - 1;
+   while (lo <= hi) {
+      int mid = (lo + hi) / 2;
+      const char *s = ((useq_t *) items[mid])->seq;
+      int slen = strlen(s);
+      int cmp = len != slen ? len - slen : strcmp(seq, s);
+      if (cmp == 0) return mid;
+      if (cmp < 0) hi = mid - 1;
+      else         lo = mid + 1;
+   }
+   return -1;
 }
 
-void *
-nukesort
+
+void
+write_checkpoint_uniq
 (
- void * args
+   FILE     * chkf,
+   gstack_t * useqS,
+   int        tau
 )
 // SYNOPSIS:
-//   Recursive part of 'seqsort'. The code of 'nukesort()' is
-//   dangerous and should not be reused. It uses a very special
-//   sort order designed for starcode, it destroys some elements
-//   and sets them to NULL as it sorts. The sort order is based
-//   on the sequences and is such that a < b if a is shorter
-//   than b or if a has the same length as b and lower lexical
-//   order. When a is the same as b, the useq containing b is
-//   destroyed (freed) and replaced by NULL.
-//
-// ARGUMENTS:
-//   args: a sortargs_t struct (see private header file).
-//
-// RETURN:
-//   NULL pointer, regardless of the input
-//
-// SIDE EFFECTS:
-//   Sorts the array of 'useq_t' specified in 'args'.
-{
-
-   sortargs_t * sortargs = (sortargs_t *) args;
-   if (sortargs->size < 2) return NULL;
-
-   // Next level params.
-   sortargs_t arg1 = *sortargs, arg2 = *sortargs;
-   arg1.size /= 2;
-   arg2.size = arg1.size + arg2.size % 2;
-   arg2.buf0 += arg1.size;
-   arg2.buf1 += arg1.size;
-   arg1.b = arg2.b = (arg1.b + 1) % 2;
-
-   // Either run threads or DIY.
-   if (arg1.thread) {
-      // Decrease one level.
-      arg1.thread = arg2.thread = arg1.thread - 1;
-      // Create threads.
-      pthread_t thread1, thread2;
-      if ( pthread_create(&thread1, NULL, nukesort, &arg1) ||
-           pthread_create(&thread2, NULL, nukesort, &arg2) ) {
-         alert();
-         krash();
+//   Writes the header and the unique sequence table of a
+//   checkpoint file: the distance of the run, then one line per
+//   unique sequence with its count and its record ids, in sorted
+//   order. The match edges of the query phase are appended later
+//   by 'write_checkpoint_edges()'; a file without them can still
+//   be resumed, skipping the parse and sort phases.
+{
+   fprintf(chkf, "#starcode-checkpoint\t%d\n", tau);
+   fprintf(chkf, "#uniq\t%d\n", useqS->nitems);
+   for (int i = 0 ; i < useqS->nitems ; i++) {
+      useq_t *u = (useq_t *) useqS->items[i];
+      fprintf(chkf, "%s\t%d\t", u->seq, u->count);
+      for (unsigned int k = 0 ; k < u->nids ; k++) {
+         fprintf(chkf, "%s%d", k > 0 ? "," : "", u->seqid[k]);
       }
-      // Wait for threads.
-      pthread_join(thread1, NULL);
-      pthread_join(thread2, NULL);
+      fprintf(chkf, "\n");
    }
-   else {
-      nukesort(&arg1);
-      nukesort(&arg2);
+   fflush(chkf);
+}
+
+
+void
+write_checkpoint_edges
+(
+   FILE * chkf
+)
+// SYNOPSIS:
+//   Appends the match edges recorded during the query phase (see
+//   the hook in 'do_query()') and the end marker. The edges are
+//   raw pairs: the parent/child orientation and the cluster ratio
+//   filter are applied by 'read_checkpoint()', so a checkpoint can
+//   be re-clustered with a different algorithm or ratio. The
+//   workers record the edges in claim order and which side was the
+//   query depends on the block schedule, so the pairs are
+//   canonicalized and sorted to make the file independent of the
+//   thread count.
+{
+   for (size_t k = 0 ; k < CHK_EDGES.nedges ; k++) {
+      edge_t *e = CHK_EDGES.edges + k;
+      int cmp = strlen(e->to->seq) - strlen(e->from->seq);
+      if (cmp == 0) cmp = strcmp(e->to->seq, e->from->seq);
+      if (cmp > 0) {
+         useq_t *t = e->to;
+         e->to = e->from;
+         e->from = t;
+      }
+   }
+   qsort(CHK_EDGES.edges, CHK_EDGES.nedges, sizeof(edge_t),
+         chk_edge_order);
+   fprintf(chkf, "#edges\t%zu\n", CHK_EDGES.nedges);
+   for (size_t k = 0 ; k < CHK_EDGES.nedges ; k++) {
+      edge_t *e = CHK_EDGES.edges + k;
+      fprintf(chkf, "%s\t%s\t%d\n", e->to->seq, e->from->seq,
+            e->dist);
+   }
+   fprintf(chkf, "#done\n");
+   fflush(chkf);
+   free(CHK_EDGES.edges);
+   CHK_EDGES = (edgebuf_t) {0};
+}
+
+
+int
+chk_edge_order
+(
+   const void *a,
+   const void *b
+)
+// Checkpoint order of the edges: both sequences in the order of
+// 'seqsort()', then the distance.
+{
+   const edge_t *e1 = (const edge_t *) a;
+   const edge_t *e2 = (const edge_t *) b;
+   int l1 = strlen(e1->to->seq);
+   int l2 = strlen(e2->to->seq);
+   if (l1 != l2) return l1 - l2;
+   int cmp = strcmp(e1->to->seq, e2->to->seq);
+   if (cmp != 0) return cmp;
+   l1 = strlen(e1->from->seq);
+   l2 = strlen(e2->from->seq);
+   if (l1 != l2) return l1 - l2;
+   cmp = strcmp(e1->from->seq, e2->from->seq);
+   if (cmp != 0) return cmp;
+   return e1->dist - e2->dist;
+}
+
+
+gstack_t *
+read_checkpoint
+(
+   FILE * chkf,
+   int  * tau,
+   int  * has_edges
+)
+// SYNOPSIS:
+//   Reads a checkpoint file written by 'write_checkpoint_uniq()'
+//   (and possibly completed by 'write_checkpoint_edges()') into a
+//   stack of unique sequences in the order of 'seqsort()', with
+//   the counts and record ids restored. If the edge section is
+//   complete, the match records are rebuilt for the current
+//   clustering algorithm and ratio and 'has_edges' is set, letting
+//   the caller skip the query phase; otherwise only the parse and
+//   sort phases are skipped.
+{
+   char *line = NULL;
+   size_t sz = 0;
+
+   int nuniq = -1;
+   if (getline(&line, &sz, chkf) < 0 ||
+         sscanf(line, "#starcode-checkpoint\t%d", tau) != 1 ||
+         *tau < 0 || *tau > STARCODE_MAX_TAU ||
+         getline(&line, &sz, chkf) < 0 ||
+         sscanf(line, "#uniq\t%d", &nuniq) != 1 || nuniq < 1) {
+      fprintf(stderr, "error: not a starcode checkpoint file\n");
+      abort();
+   }
+
+   gstack_t *uSQ = new_gstack();
+   if (uSQ == NULL) {
+      alert();
+      krash();
+   }
+   for (int i = 0 ; i < nuniq ; i++) {
+      ssize_t len = getline(&line, &sz, chkf);
+      char *tab1 = len < 0 ? NULL : strchr(line, '\t');
+      char *tab2 = tab1 == NULL ? NULL : strchr(tab1+1, '\t');
+      char *end  = tab2 == NULL ? NULL : strchr(tab2+1, '\n');
+      int count  = tab1 == NULL ? 0 : atoi(tab1+1);
+      if (end == NULL || count < 1) {
+         fprintf(stderr, "error: incomplete checkpoint (%d of %d "
+               "unique sequences)\n", i, nuniq);
+         abort();
+      }
+      for (char *c = line ; c < tab1 ; c++) {
+         if (!valid_DNA_char[(uint8_t) *c]) {
+            fprintf(stderr, "error: invalid checkpoint file "
+                  "(line %d)\n", i + 3);
+            abort();
+         }
+      }
+      useq_t *new = new_useq_len(count, line, tab1 - line, NULL, 0);
+      if (new == NULL) {
+         alert();
+         krash();
+      }
+      // Restore the record ids.
+      unsigned int nids = 1;
+      for (char *c = tab2 + 1 ; c < end ; c++) {
+         if (*c == ',') nids++;
+      }
+      new->seqid = malloc(nids * sizeof(int));
+      if (new->seqid == NULL) {
+         alert();
+         krash();
+      }
+      char *c = tab2 + 1;
+      for (unsigned int k = 0 ; k < nids ; k++) {
+         new->seqid[k] = (int) strtol(c, &c, 10);
+         c++;   // Skip the comma.
+      }
+      new->nids = nids;
+      push(new, &uSQ);
+   }
+   qsort(uSQ->items, uSQ->nitems, sizeof(useq_t *), state_seq_order);
+
+   // The edge section is used only if it is complete: a run
+   // preempted while writing it leaves no end marker, and partial
+   // match records would corrupt the clustering.
+   *has_edges = 0;
+   long nedges = -1;
+   long offset = ftell(chkf);
+   if (getline(&line, &sz, chkf) >= 0 &&
+         sscanf(line, "#edges\t%ld", &nedges) == 1 && nedges >= 0) {
+      long checked = 0;
+      int done = 0;
+      while (getline(&line, &sz, chkf) >= 0) {
+         if (strcmp(line, "#done\n") == 0) {
+            done = checked == nedges;
+            break;
+         }
+         checked++;
+      }
+      if (done) {
+         if (fseek(chkf, offset, SEEK_SET) < 0) {
+            alert();
+            krash();
+         }
+         getline(&line, &sz, chkf);   // The "#edges" line.
+         for (long k = 0 ; k < nedges ; k++) {
+            getline(&line, &sz, chkf);
+            char *tab1 = strchr(line, '\t');
+            char *tab2 = tab1 == NULL ? NULL : strchr(tab1+1, '\t');
+            int dist = tab2 == NULL ? 0 : atoi(tab2+1);
+            if (tab2 == NULL || dist < 1 || dist > *tau) {
+               fprintf(stderr, "error: invalid checkpoint edge "
+                     "(line %ld)\n", nuniq + k + 4);
+               abort();
+            }
+            *tab1 = '\0';
+            *tab2 = '\0';
+            int ia = state_find((useq_t **) uSQ->items, uSQ->nitems,
+                  line);
+            int ib = state_find((useq_t **) uSQ->items, uSQ->nitems,
+                  tab1 + 1);
+            if (ia < 0 || ib < 0) {
+               fprintf(stderr, "error: checkpoint edge does not "
+                     "match the unique sequences (line %ld)\n",
+                     nuniq + k + 4);
+               abort();
+            }
+            useq_t *ua = (useq_t *) uSQ->items[ia];
+            useq_t *ub = (useq_t *) uSQ->items[ib];
+            if (CLUSTERALG == MP_CLUSTER) {
+               // Replicate the orientation and the ratio filter of
+               // the hit loop of 'do_query()'.
+               useq_t *parent = ub->count > ua->count ? ub : ua;
+               useq_t *child  = ub->count > ua->count ? ua : ub;
+               if (parent->count < CLUSTER_RATIO * child->count) {
+                  continue;
+               }
+               if (parent->count == child->count &&
+                     strcmp(parent->seq, child->seq) > 0) {
+                  useq_t *t = parent;
+                  parent = child;
+                  child = t;
+               }
+               if (addmatch(child, parent, dist, *tau)) {
+                  alert();
+                  krash();
+               }
+            }
+            else {
+               // The bidirectional algorithms record the match in
+               // both sequences.
+               if (addmatch(ua, ub, dist, *tau) ||
+                     addmatch(ub, ua, dist, *tau)) {
+                  alert();
+                  krash();
+               }
+            }
+         }
+         *has_edges = 1;
+      }
+   }
+
+   free(line);
+   return uSQ;
+
+}
+
+
+int
+starcode_shard_prep
+(
+   FILE *inputf,
+   const char *dir,
+         int nshards,
+         int tau,
+   const int verbose,
+         int thrmax,
+         double parent_to_child
+)
+// SYNOPSIS:
+//   Partition step of the sharded mode: reads and sorts the input,
+//   splits the unique sequences into 'nshards' contiguous slices
+//   of the sorted order and writes one shard file per slice, plus
+//   a manifest with the parameters shared by the workers (number
+//   of shards, distance, padded length, median length and cluster
+//   ratio). The slices are disjoint and sorted, so any pair of
+//   shards can be searched independently: the worker processes
+//   (see 'starcode_shard_worker()') each hold only two shards in
+//   memory and can run on separate machines over a shared
+//   directory. The match edges they record are stitched together
+//   before clustering by 'starcode_shard_merge()'.
+{
+
+   if (verbose) {
+      fprintf(stderr, "running starcode with %d thread%s\n",
+           thrmax, thrmax > 1 ? "s" : "");
+      fprintf(stderr, "reading input files\n");
+   }
+   gstack_t *uSQ = read_file(inputf, NULL, verbose, thrmax);
+   if (uSQ == NULL || uSQ->nitems < 1) {
+      fprintf(stderr, "input file empty\n");
+      return 1;
+   }
+
+   // Sort/reduce.
+   if (verbose) fprintf(stderr, "sorting\n");
+   uSQ->nitems = seqsort((useq_t **) uSQ->items, uSQ->nitems, thrmax);
+   if (nshards > uSQ->nitems) nshards = uSQ->nitems;
+
+   // Compute the padded length and the median, like 'starcode()'.
+   int maxlen = 0;
+   for (int i = 0 ; i < uSQ->nitems ; i++) {
+      int len = strlen(((useq_t *) uSQ->items[i])->seq);
+      if (len > maxlen) maxlen = len;
+   }
+   int *count = calloc((maxlen + 1), sizeof(int));
+   if (count == NULL) {
+      alert();
+      krash();
+   }
+   for (int i = 0 ; i < uSQ->nitems ; i++) {
+      count[strlen(((useq_t *) uSQ->items[i])->seq)]++;
+   }
+   int med = 0;
+   int ccount = 0;
+   do {
+      ccount += count[++med];
+   } while (ccount < uSQ->nitems / 2);
+   free(count);
+
+   if (tau < 0) {
+      tau = med > 160 ? 8 : 2 + med/30;
+      if (verbose) {
+         fprintf(stderr, "setting dist to %d\n", tau);
+      }
+   }
+
+   // Write the manifest.
+   char path[1024];
+   if (strlen(dir) > sizeof(path) - 32) {
+      fprintf(stderr, "error: shard directory name too long\n");
+      abort();
+   }
+   sprintf(path, "%s/shards.txt", dir);
+   FILE *manifest = fopen(path, "w");
+   if (manifest == NULL) {
+      fprintf(stderr, "error: cannot write %s\n", path);
+      abort();
+   }
+   fprintf(manifest, "#starcode-shards\t%d\t%d\t%d\t%d\t%f\n",
+         nshards, tau, maxlen, med,
+         parent_to_child > 0 ? parent_to_child : 5.0);
+   fclose(manifest);
+
+   // Write the shards.
+   if (verbose) fprintf(stderr, "writing %d shards\n", nshards);
+   for (int s = 0 ; s < nshards ; s++) {
+      sprintf(path, "%s/shard_%d.txt", dir, s);
+      FILE *shardf = fopen(path, "w");
+      if (shardf == NULL) {
+         fprintf(stderr, "error: cannot write %s\n", path);
+         abort();
+      }
+      int from = (int) ((long) uSQ->nitems * s / nshards);
+      int to   = (int) ((long) uSQ->nitems * (s+1) / nshards);
+      for (int i = from ; i < to ; i++) {
+         useq_t *u = (useq_t *) uSQ->items[i];
+         fprintf(shardf, "%s\t%d\n", u->seq, u->count);
+      }
+      fclose(shardf);
+   }
+
+   return 0;
+
+}
+
+
+int
+starcode_shard_worker
+(
+   const char *dir,
+   const int ishard,
+   const int verbose
+)
+// SYNOPSIS:
+//   Worker step of the sharded mode: builds the trie of shard
+//   'ishard' (recording the within-shard matches on the way, like
+//   the build jobs of 'plan_mt()') then streams every later shard
+//   through it without insertion. Only two shards are in memory at
+//   any time. The matches are appended to the edge file of the
+//   shard as unpadded sequence pairs with their distance, to be
+//   stitched by 'starcode_shard_merge()'. Earlier shards are not
+//   queried: the worker of every pair with a lower index finds
+//   those matches, so each pair is searched exactly once.
+{
+
+   int nshards, tau, maxlen, med;
+   double ratio;
+   if (read_shard_manifest(dir, &nshards, &tau, &maxlen, &med,
+            &ratio)) {
+      abort();
+   }
+   if (ishard < 0 || ishard >= nshards) {
+      fprintf(stderr, "error: no shard %d (%d shards)\n",
+            ishard, nshards);
+      abort();
+   }
+   CLUSTERALG = MP_CLUSTER;
+   CLUSTER_RATIO = ratio;
+
+   if (verbose) {
+      fprintf(stderr, "shard %d of %d (dist %d)\n",
+            ishard, nshards, tau);
+   }
+   gstack_t *shardI = read_shard(dir, ishard);
+   pad_useq_len(shardI, maxlen);
+
+   // Presized with the node count of the sorted shard, plus one
+   // for the root.
+   long nnodes = count_trie_nodes((useq_t **) shardI->items,
+         0, shardI->nitems);
+   ctrie_t *trie = new_ctrie(maxlen, nnodes+1, shardI->nitems);
+   lookup_t *lut = new_lookup(med, maxlen, tau);
+   gstack_t **hits = new_tower(tau+1);
+   if (trie == NULL || lut == NULL || hits == NULL) {
+      alert();
+      krash();
+   }
+
+   char path[1024];
+   sprintf(path, "%s/edges_%d.txt", dir, ishard);
+   FILE *edgef = fopen(path, "w");
+   if (edgef == NULL) {
+      fprintf(stderr, "error: cannot write %s\n", path);
+      abort();
+   }
+
+   // Build the trie from the own shard; this records the
+   // within-shard matches.
+   edgebuf_t eb = {0};
+   mtjob_t job = {
+      .start = 0,
+      .end   = shardI->nitems - 1,
+      .tau   = tau,
+      .build = 1,
+      .ref   = 0,
+      .useqS = shardI,
+      .trie  = trie,
+      .lut   = lut,
+   };
+   do_query(&job, &eb, hits);
+
+   // Stream the later shards through the trie. The shards hold
+   // distinct sequences so the queries cannot match themselves
+   // and are not inserted.
+   for (int j = ishard ; j < nshards ; j++) {
+
+      gstack_t *shardJ = NULL;
+      if (j > ishard) {
+         if (verbose) {
+            fprintf(stderr, "querying shard %d\n", j);
+         }
+         shardJ = read_shard(dir, j);
+         pad_useq_len(shardJ, maxlen);
+         job.start = 0;
+         job.end   = shardJ->nitems - 1;
+         job.build = 0;
+         job.useqS = shardJ;
+         do_query(&job, &eb, hits);
+      }
+
+      // Flush the recorded matches before the queried shard is
+      // released. The sequences are written unpadded (the padding
+      // characters are leading spaces).
+      for (size_t k = 0 ; k < eb.nedges ; k++) {
+         edge_t *e = eb.edges + k;
+         const char *child  = e->to->seq;
+         const char *parent = e->from->seq;
+         while (*child == ' ')  child++;
+         while (*parent == ' ') parent++;
+         fprintf(edgef, "%s\t%s\t%d\n", child, parent, e->dist);
+      }
+      eb.nedges = 0;
+
+      if (shardJ != NULL) {
+         for (int i = 0 ; i < shardJ->nitems ; i++) {
+            destroy_useq(shardJ->items[i]);
+         }
+         free(shardJ);
+      }
+
+   }
+
+   fclose(edgef);
+   destroy_tower(hits);
+   destroy_ctrie(trie, NULL);
+   destroy_lookup(lut);
+   free(eb.edges);
+   for (int i = 0 ; i < shardI->nitems ; i++) {
+      destroy_useq(shardI->items[i]);
+   }
+   free(shardI);
+
+   return 0;
+
+}
+
+
+int
+starcode_shard_merge
+(
+   const char *dir,
+   FILE *outputf,
+   const int verbose,
+         int thrmax
+)
+// SYNOPSIS:
+//   Merge step of the sharded mode: pools the shard files back
+//   into one sequence set, stitches the match edges recorded by
+//   the workers into the match records and runs the message
+//   passing clustering. The output is one cluster per line
+//   (canonical sequence and total count), like the incremental
+//   mode.
+{
+
+   OUTPUTB1 = new_outbuf(outputf);
+   OUTPUTB2 = NULL;
+
+   int nshards, tau, maxlen, med;
+   double ratio;
+   if (read_shard_manifest(dir, &nshards, &tau, &maxlen, &med,
+            &ratio)) {
+      abort();
+   }
+   CLUSTERALG = MP_CLUSTER;
+   CLUSTER_RATIO = ratio;
+
+   // Pool the shards.
+   if (verbose) fprintf(stderr, "reading %d shards\n", nshards);
+   gstack_t *allS = new_gstack();
+   if (allS == NULL) {
+      alert();
+      krash();
+   }
+   for (int s = 0 ; s < nshards ; s++) {
+      gstack_t *shard = read_shard(dir, s);
+      for (int i = 0 ; i < shard->nitems ; i++) {
+         push(shard->items[i], &allS);
+      }
+      free(shard);
+   }
+   // The shards are disjoint so nothing is merged here.
+   allS->nitems = seqsort((useq_t **) allS->items, allS->nitems,
+         thrmax);
+
+   // Stitch the match edges.
+   if (verbose) fprintf(stderr, "stitching match edges\n");
+   char path[1024];
+   char line[2*M + 32];
+   for (int s = 0 ; s < nshards ; s++) {
+      sprintf(path, "%s/edges_%d.txt", dir, s);
+      FILE *edgef = fopen(path, "r");
+      if (edgef == NULL) {
+         fprintf(stderr, "error: cannot open %s "
+               "(did all the shard workers run?)\n", path);
+         abort();
+      }
+      while (fgets(line, sizeof(line), edgef) != NULL) {
+         char *tab1 = strchr(line, '\t');
+         char *tab2 = tab1 == NULL ? NULL : strchr(tab1+1, '\t');
+         int dist   = tab2 == NULL ? 0 : atoi(tab2+1);
+         if (tab2 == NULL || dist < 1 || dist > tau) {
+            fprintf(stderr, "error: invalid edge file %s\n", path);
+            abort();
+         }
+         *tab1 = '\0';
+         *tab2 = '\0';
+         int ic = state_find((useq_t **) allS->items, allS->nitems,
+               line);
+         int ip = state_find((useq_t **) allS->items, allS->nitems,
+               tab1 + 1);
+         if (ic < 0 || ip < 0) {
+            fprintf(stderr, "error: edge file %s does not match "
+                  "the shards\n", path);
+            abort();
+         }
+         if (addmatch((useq_t *) allS->items[ic],
+                  (useq_t *) allS->items[ip], dist, tau)) {
+            alert();
+            krash();
+         }
+      }
+      fclose(edgef);
+   }
+
+   if (verbose) fprintf(stderr, "message passing clustering\n");
+   message_passing_clustering(allS, thrmax);
+   qsort(allS->items, allS->nitems, sizeof(useq_t *),
+         canonical_order);
+
+   // Print the clusters.
+   useq_t *canonical = NULL;
+   for (int i = 0 ; i < allS->nitems ; i++) {
+      useq_t *u = (useq_t *) allS->items[i];
+      if (u->canonical == NULL) break;
+      if (u->canonical != canonical) {
+         canonical = u->canonical;
+         obprintf(OUTPUTB1, "%s\t%d\n", canonical->seq,
+               canonical->count);
+      }
+   }
+
+   // Flush the output and stop the writer thread.
+   destroy_outbuf(OUTPUTB1);
+   OUTPUTB1 = NULL;
+   return 0;
+
+}
+
+
+int
+read_shard_manifest
+(
+   const char *dir,
+   int *nshards,
+   int *tau,
+   int *maxlen,
+   int *med,
+   double *ratio
+)
+// Reads the manifest written by 'starcode_shard_prep()'. Returns
+// 0 on success and 1 on failure, with an error message printed.
+{
+   char path[1024];
+   if (strlen(dir) > sizeof(path) - 32) {
+      fprintf(stderr, "error: shard directory name too long\n");
+      return 1;
+   }
+   sprintf(path, "%s/shards.txt", dir);
+   FILE *manifest = fopen(path, "r");
+   if (manifest == NULL) {
+      fprintf(stderr, "error: cannot open %s "
+            "(did the shard prep run?)\n", path);
+      return 1;
+   }
+   int nread = fscanf(manifest, "#starcode-shards\t%d\t%d\t%d\t%d\t%lf",
+         nshards, tau, maxlen, med, ratio);
+   fclose(manifest);
+   if (nread != 5 || *nshards < 1 || *tau < 0 ||
+         *tau > STARCODE_MAX_TAU || *maxlen < 1 ||
+         *maxlen > MAXBRCDLEN || *med < 1 || *ratio < 1) {
+      fprintf(stderr, "error: invalid manifest %s\n", path);
+      return 1;
+   }
+   return 0;
+}
+
+
+gstack_t *
+read_shard
+(
+   const char *dir,
+   int ishard
+)
+// Reads one shard file written by 'starcode_shard_prep()' into a
+// stack of 'useq_t' (the shards are written in sorted order).
+{
+   char path[1024];
+   sprintf(path, "%s/shard_%d.txt", dir, ishard);
+   FILE *shardf = fopen(path, "r");
+   if (shardf == NULL) {
+      fprintf(stderr, "error: cannot open %s\n", path);
+      abort();
+   }
+   gstack_t *shard = new_gstack();
+   if (shard == NULL) {
+      alert();
+      krash();
+   }
+   char line[2*M + 32];
+   while (fgets(line, sizeof(line), shardf) != NULL) {
+      char *tab = strchr(line, '\t');
+      char *end = tab == NULL ? NULL : strchr(tab+1, '\n');
+      int count = tab == NULL ? 0 : atoi(tab+1);
+      if (end == NULL || count < 1) {
+         fprintf(stderr, "error: invalid shard file %s (line %d)\n",
+               path, shard->nitems + 1);
+         abort();
+      }
+      useq_t *new = new_useq_len(count, line, tab - line, NULL, 0);
+      if (new == NULL) {
+         alert();
+         krash();
+      }
+      push(new, &shard);
+   }
+   fclose(shardf);
+   return shard;
+}
+
+
+// In-process API (libstarcode). The context is a thin wrapper
+// around the stack of unique sequences: 'starcode_add_sequence()'
+// plays the role of the file readers, 'starcode_cluster()' runs the
+// middle of the 'starcode()' pipeline (sort, pad, search, cluster)
+// and the output sections are replaced by 'starcode_result()'.
+
+struct starcode_ctx_t {
+   gstack_t * useqS;            // Sequences fed so far.
+   int        nreads;           // Feed calls (gives the 1-based ids).
+   int        clustered;        // Nonzero once clustered.
+};
+
+
+starcode_ctx_t *
+starcode_ctx_new
+(void)
+{
+   starcode_ctx_t *ctx = calloc(1, sizeof(starcode_ctx_t));
+   if (ctx == NULL) {
+      alert();
+      krash();
+   }
+   ctx->useqS = new_gstack();
+   return ctx;
+}
+
+
+void
+starcode_ctx_free
+(
+   starcode_ctx_t *ctx
+)
+{
+   if (ctx == NULL) return;
+   for (int i = 0 ; i < ctx->useqS->nitems ; i++) {
+      destroy_useq(ctx->useqS->items[i]);
+   }
+   free(ctx->useqS);
+   free(ctx);
+}
+
+
+int
+starcode_add_sequence
+(
+   starcode_ctx_t *ctx,
+   const char *seq,
+   size_t len,
+   int count
+)
+// SYNOPSIS:
+//   Feeds one sequence of 'len' characters (no terminator needed)
+//   seen 'count' times. The sequence receives the next 1-based id,
+//   as if it were the next record of an input file.
+//
+// RETURN:
+//   0 on success, 1 if the sequence is rejected (invalid character,
+//   empty, too long, bad count, or the context was already
+//   clustered).
+{
+   if (ctx == NULL || seq == NULL || ctx->clustered) return 1;
+   if (len < 1 || len > MAXBRCDLEN || count < 1) return 1;
+   for (size_t i = 0 ; i < len ; i++) {
+      if (!valid_DNA_char[(uint8_t) seq[i]]) return 1;
+   }
+
+   useq_t *new = new_useq_len(count, seq, len, NULL, 0);
+   if (new == NULL) return 1;
+   // Assign the id the way the file readers do.
+   new->nids = 1;
+   new->seqid = malloc(sizeof(int));
+   if (new->seqid == NULL) {
+      alert();
+      krash();
+   }
+   new->seqid[0] = ++ctx->nreads;
+   push(new, &ctx->useqS);
+
+   return 0;
+
+}
+
+
+int
+starcode_cluster
+(
+   starcode_ctx_t *ctx,
+         int tau,
+         int thrmax,
+   const int clusteralg,
+         double parent_to_child
+)
+// SYNOPSIS:
+//   Clusters the sequences fed so far. Same semantics as the
+//   corresponding command line options: 'tau' < 0 means "auto",
+//   'clusteralg' is one of the 'cluster_t' constants and
+//   'parent_to_child' is the minimum count ratio of the message
+//   passing algorithm (values <= 0 select the default).
+//
+// RETURN:
+//   0 on success, 1 on failure (no sequence was fed, unknown
+//   algorithm, or the context was already clustered).
+{
+   if (ctx == NULL || ctx->clustered) return 1;
+   if (clusteralg != MP_CLUSTER && clusteralg != SPHERES_CLUSTER &&
+         clusteralg != COMPONENTS_CLUSTER) return 1;
+   gstack_t *uSQ = ctx->useqS;
+   if (uSQ->nitems < 1) return 1;
+   if (thrmax < 1) thrmax = 1;
+
+   CLUSTERALG = clusteralg;
+   CLUSTER_RATIO = parent_to_child > 0 ? parent_to_child : 5.0;
+
+   // Sort/reduce.
+   uSQ->nitems = seqsort((useq_t **) uSQ->items, uSQ->nitems, thrmax);
+
+   // Get number of tries.
+   int ntries = 3 * thrmax + (thrmax % 2 == 0);
+   if (uSQ->nitems < ntries) {
+      ntries = 1;
+      thrmax = 1;
+   }
+
+   // Pad sequences (and return the median size).
+   // Compute 'tau' from it in "auto" mode.
+   int med = -1;
+   pad_useq(uSQ, &med);
+   if (tau < 0) tau = med > 160 ? 8 : 2 + med/30;
+
+   // Make multithreading plan and run the query.
+   mtplan_t *mtplan = plan_mt(tau, med, ntries, uSQ);
+   run_plan(mtplan, 0, thrmax);
+
+   // Remove padding characters.
+   unpad_useq(uSQ);
+
+   if (CLUSTERALG == MP_CLUSTER) {
+      message_passing_clustering(uSQ, thrmax);
+      qsort(uSQ->items, uSQ->nitems, sizeof(useq_t *), canonical_order);
+   }
+   else if (CLUSTERALG == SPHERES_CLUSTER) {
+      sphere_clustering(uSQ);
+      qsort(uSQ->items, uSQ->nitems, sizeof(useq_t *), sphere_size_order);
+   }
+   else if (CLUSTERALG == COMPONENTS_CLUSTER) {
+      gstack_t *clusters = compute_clusters(uSQ);
+      // Refill the stack in cluster order and point every member to
+      // the centroid of its cluster so that the results can be read
+      // the same way for all the algorithms.
+      uSQ->nitems = 0;
+      for (int i = 0 ; i < clusters->nitems ; i++) {
+         gstack_t *cluster = (gstack_t *) clusters->items[i];
+         useq_t *canonical = (useq_t *) cluster->items[0];
+         for (int k = 0 ; k < cluster->nitems ; k++) {
+            useq_t *u = (useq_t *) cluster->items[k];
+            u->canonical = canonical;
+            push(u, &uSQ);
+         }
+         free(cluster);
+      }
+      free(clusters);
+   }
+
+   ctx->useqS = uSQ;
+   ctx->clustered = 1;
+
+   return 0;
+
+}
+
+
+int
+starcode_nresults
+(
+   starcode_ctx_t *ctx
+)
+{
+   if (ctx == NULL || !ctx->clustered) return 0;
+   return ctx->useqS->nitems;
+}
+
+
+int
+starcode_result
+(
+   starcode_ctx_t *ctx,
+   int i,
+   starcode_result_t *result
+)
+// SYNOPSIS:
+//   Fills 'result' with the 'i'-th unique sequence and its cluster
+//   assignment. Sequences without a canonical (message passing can
+//   leave ambiguous sequences unassigned) are reported as their own
+//   canonical. The pointers of the struct belong to the context and
+//   are valid until 'starcode_ctx_free()'.
+//
+// RETURN:
+//   0 on success, 1 if 'i' is out of range or the context was not
+//   clustered.
+{
+   if (ctx == NULL || result == NULL || !ctx->clustered) return 1;
+   if (i < 0 || i >= ctx->useqS->nitems) return 1;
+
+   useq_t *u = (useq_t *) ctx->useqS->items[i];
+   useq_t *canonical = u->canonical == NULL ? u : u->canonical;
+   result->seq       = u->seq;
+   result->canonical = canonical->seq;
+   result->count     = u->count;
+   result->dist      = canonical == u ? 0 :
+                          pair_dist(u->seq, canonical->seq);
+   result->nids      = u->nids;
+   result->ids       = u->seqid;
+
+   return 0;
+
+}
+
+
+int
+pair_dist
+(
+   const char *a,
+   const char *b
+)
+// SYNOPSIS:
+//   Plain Levenshtein distance between two sequences, used to
+//   report the distance to the canonical (it is not recorded during
+//   the search). Sequences are at most 'MAXBRCDLEN' characters.
+{
+   int lena = strlen(a);
+   int lenb = strlen(b);
+   int row[M];
+   for (int j = 0 ; j <= lenb ; j++) row[j] = j;
+   for (int i = 1 ; i <= lena ; i++) {
+      int diag = row[0];
+      row[0] = i;
+      for (int j = 1 ; j <= lenb ; j++) {
+         int sub = diag + (a[i-1] != b[j-1]);
+         int del = row[j] + 1;
+         int ins = row[j-1] + 1;
+         diag = row[j];
+         row[j] = sub < del ? (sub < ins ? sub : ins)
+                            : (del < ins ? del : ins);
+      }
+   }
+   return row[lenb];
+}
+
+
+void
+run_plan
+(
+   mtplan_t *mtplan,
+   const int verbose,
+   const int thrmax
+)
+// SYNOPSIS:
+//   Runs the jobs of the plan on 'thrmax' worker threads. The workers
+//   claim the jobs directly from the tries (see 'do_jobs()') so there
+//   is no scheduler thread for them to convoy on: the mutex of the
+//   plan is held only to claim or release a trie.
+{
+   pthread_t *threads = malloc(thrmax * sizeof(pthread_t));
+   mtworker_t *workers = malloc(thrmax * sizeof(mtworker_t));
+   edgebuf_t *ebufs = calloc(thrmax, sizeof(edgebuf_t));
+   if (threads == NULL || workers == NULL || ebufs == NULL) {
+      alert();
+      krash();
+   }
+
+   long ncores = sysconf(_SC_NPROCESSORS_ONLN);
+   int tau = mtplan->tries[0].jobs[0].tau;
+   double wall0 = STATS ? stats_now() : 0.0;
+
+   for (int t = 0 ; t < thrmax ; t++) {
+      workers[t].id = t;
+      workers[t].plan = mtplan;
+      workers[t].verbose = verbose;
+      workers[t].busy = 0.0;
+      workers[t].edges = ebufs + t;
+      // The hit tower is recycled over all the jobs of the worker:
+      // the stacks keep their high-water capacity, so after a warm
+      // up the queries push their hits without allocating.
+      workers[t].hits = new_tower(tau+1);
+      if (workers[t].hits == NULL) {
+         alert();
+         krash();
+      }
+      // Spread the starting positions of the workers over the
+      // tries so that they do not all compete for the same jobs.
+      workers[t].offset = (int) ((long) t * mtplan->ntries / thrmax);
+      if (pthread_create(threads + t, NULL, do_jobs, workers + t)) {
+         alert();
+         krash();
+      }
+      // Pin each worker to one core. The owner preference of
+      // 'do_jobs()' makes the jobs of a trie land mostly on the
+      // worker that built it, so pinning keeps the node caches of
+      // that trie warm on the same core and, on multi-socket
+      // machines, on the socket that holds its pages. This is a
+      // hint: failure to pin is not an error.
+      if (ncores > 0) {
+         cpu_set_t cpus;
+         CPU_ZERO(&cpus);
+         CPU_SET(t % ncores, &cpus);
+         pthread_setaffinity_np(threads[t], sizeof(cpu_set_t), &cpus);
+      }
+   }
+
+   for (int t = 0 ; t < thrmax ; t++) {
+      pthread_join(threads[t], NULL);
+   }
+
+   if (STATS) {
+      // Busy and idle time of the workers (idle time is spent
+      // waiting for a free trie in 'do_jobs()'), and high-water
+      // marks of the recycled hit towers and of the pebbles.
+      double wall = stats_now() - wall0;
+      for (int t = 0 ; t < thrmax ; t++) {
+         int hw = 0;
+         for (int j = 0 ; workers[t].hits[j] != TOWER_TOP ; j++) {
+            hw = max(hw, workers[t].hits[j]->nslots);
+         }
+         fprintf(stderr, "stats: worker %d busy %.3f s, idle %.3f s,"
+               " hit stack high-water %d\n", t, workers[t].busy,
+               wall - workers[t].busy, hw);
+      }
+      for (int i = 0 ; i < mtplan->ntries ; i++) {
+         ctrie_t *trie = mtplan->tries[i].jobs[0].trie;
+         int hw = 0;
+         for (int d = 0 ; trie->pebbles[d] != TOWER_TOP ; d++) {
+            hw = max(hw, trie->pebbles[d]->nslots);
+         }
+         fprintf(stderr, "stats: trie %d: %u nodes,"
+               " pebble high-water %d\n", i, trie->nnodes, hw);
+      }
+   }
+
+   // Merge the recorded matches into the match records of the
+   // sequences. The edges are partitioned on the address of the
+   // receiving sequence so that each record is updated by exactly
+   // one thread and no lock is needed.
+   edgemerge_t *margs = malloc(thrmax * sizeof(edgemerge_t));
+   if (margs == NULL) {
+      alert();
+      krash();
+   }
+   for (int t = 0 ; t < thrmax ; t++) {
+      margs[t].bufs   = ebufs;
+      margs[t].nbufs  = thrmax;
+      margs[t].tau    = tau;
+      margs[t].nparts = thrmax;
+      margs[t].part   = t;
+      if (pthread_create(threads + t, NULL, merge_matches, margs + t)) {
+         alert();
+         krash();
+      }
+   }
+   for (int t = 0 ; t < thrmax ; t++) {
+      pthread_join(threads[t], NULL);
+   }
+
+   for (int t = 0 ; t < thrmax ; t++) {
+      destroy_tower(workers[t].hits);
+      free(ebufs[t].edges);
+   }
+   free(ebufs);
+   free(margs);
+   free(threads);
+   free(workers);
+
+   return;
+
+}
+
+
+void *
+merge_matches
+(
+   void * args
+)
+// SYNOPSIS:
+//   Merge pass of the per-worker match buffers: pushes the
+//   recorded matches into the match records of the receiving
+//   sequences. Each thread handles the edges whose receiving
+//   sequence hashes to its partition and scans the buffers in
+//   worker order, so the records are updated without locks.
+{
+   edgemerge_t *m = (edgemerge_t *) args;
+   for (int b = 0 ; b < m->nbufs ; b++) {
+      edgebuf_t *eb = m->bufs + b;
+      for (size_t i = 0 ; i < eb->nedges ; i++) {
+         edge_t *e = eb->edges + i;
+         if ((int) (((uintptr_t) e->to >> 4) % m->nparts) != m->part) {
+            continue;
+         }
+         if (addmatch(e->to, e->from, e->dist, m->tau)) {
+            fprintf(stderr,
+                  "Please contact guillaume.filion@gmail.com "
+                  "for support with this issue.\n");
+            abort();
+         }
+      }
+   }
+   return NULL;
+}
+
+
+void *
+merge_assignments
+(
+   void * args
+)
+// SYNOPSIS:
+//   Merge pass of the reference mode: scans the per-worker
+//   candidate buffers and keeps the best reference of every query
+//   in its 'canonical' field ('sphere_d' receives the distance).
+//   The best match is the closest reference; ties are broken by
+//   the highest count, then by the lexicographically smallest
+//   sequence, so the assignments do not depend on the thread
+//   schedule. Partitioned like 'merge_matches()'.
+{
+   edgemerge_t *m = (edgemerge_t *) args;
+   for (int b = 0 ; b < m->nbufs ; b++) {
+      edgebuf_t *eb = m->bufs + b;
+      for (size_t i = 0 ; i < eb->nedges ; i++) {
+         edge_t *e = eb->edges + i;
+         if ((int) (((uintptr_t) e->to >> 4) % m->nparts) != m->part) {
+            continue;
+         }
+         useq_t *query = e->to;
+         useq_t *best = query->canonical;
+         if (best != NULL) {
+            if (e->dist > query->sphere_d) continue;
+            if (e->dist == query->sphere_d) {
+               if (e->from->count < best->count) continue;
+               if (e->from->count == best->count &&
+                     strcmp(e->from->seq, best->seq) >= 0) continue;
+            }
+         }
+         query->canonical = e->from;
+         query->sphere_d = e->dist;
+      }
+   }
+   return NULL;
+}
+
+
+void
+edge_append
+(
+   edgebuf_t * eb,
+   useq_t    * to,
+   useq_t    * from,
+   int         dist
+)
+// Records a match in the buffer of the calling worker. The
+// buffers are append-only and private to their worker, so no
+// lock is needed in the hit loop of 'do_query()'.
+{
+   if (eb->nedges >= eb->size) {
+      eb->size = eb->size == 0 ? 1024 : 2*eb->size;
+      eb->edges = realloc(eb->edges, eb->size * sizeof(edge_t));
+      if (eb->edges == NULL) {
+         alert();
+         krash();
+      }
+   }
+   eb->edges[eb->nedges].to   = to;
+   eb->edges[eb->nedges].from = from;
+   eb->edges[eb->nedges].dist = dist;
+   eb->nedges++;
+   return;
+}
+
+
+void *
+do_jobs
+(
+   void * args
+)
+// SYNOPSIS:
+//   Main loop of the worker threads. The worker scans the tries from
+//   its own starting position and claims the next job of the first
+//   free trie that still has pending jobs. Jobs of the same trie must
+//   run one at a time because searches write to the node caches and
+//   to the pebbles, so this is the finest schedulable grain.
+//
+//   The worker that claims the build job of a trie faults its node
+//   block, so the pages of the trie land on the memory of the core
+//   it is pinned to (first-touch policy). The trie records that
+//   worker as its owner and the claim is done in two passes: the
+//   first pass takes only tries owned by the worker (or not built
+//   yet), the second takes anything. On multi-socket machines this
+//   keeps the poucet descents of a trie on the socket that holds its
+//   memory; the fallback pass means a worker steals remote tries
+//   only when nothing local is runnable, so no thread ever idles on
+//   account of the placement.
+{
+   mtworker_t *w = (mtworker_t *) args;
+   mtplan_t *plan = w->plan;
+   const int njobs = plan->njobs;
+
+   pthread_mutex_lock(plan->mutex);
+   while (plan->jobsdone < njobs) {
+
+      // Claim the next job of a free trie, preferring the tries
+      // whose memory was faulted by this worker.
+      mttrie_t *mttrie = NULL;
+      mtjob_t  *job = NULL;
+      for (int pass = 0 ; pass < 2 && job == NULL ; pass++) {
+         for (int k = 0 ; k < plan->ntries ; k++) {
+            mttrie_t *it = plan->tries + (w->offset + k) % plan->ntries;
+            if (it->flag != TRIE_FREE || it->currentjob >= it->njobs) {
+               continue;
+            }
+            if (pass == 0 && it->owner >= 0 && it->owner != w->id) {
+               continue;
+            }
+            it->flag = TRIE_BUSY;
+            if (it->owner < 0) it->owner = w->id;
+            mttrie = it;
+            job = it->jobs + it->currentjob++;
+            break;
+         }
+      }
+
+      // Nothing to claim: the pending jobs are all on busy tries.
+      // Wait for a trie to be released.
+      if (job == NULL) {
+         pthread_cond_wait(plan->monitor, plan->mutex);
+         continue;
+      }
+
+      pthread_mutex_unlock(plan->mutex);
+      double tjob = STATS ? stats_now() : 0.0;
+      do_query(job, w->edges, w->hits);
+      if (STATS) w->busy += stats_now() - tjob;
+      pthread_mutex_lock(plan->mutex);
+
+      // Release the trie and signal the waiting workers.
+      mttrie->flag = mttrie->currentjob == mttrie->njobs ?
+         TRIE_DONE : TRIE_FREE;
+      plan->jobsdone++;
+      if (w->verbose) {
+         fprintf(stderr, "progress: %.2f%% \r",
+               100*(float)(plan->jobsdone)/njobs);
+      }
+      pthread_cond_broadcast(plan->monitor);
+
+   }
+   pthread_mutex_unlock(plan->mutex);
+
+   return NULL;
+
+}
+
+
+void
+do_query
+(
+   mtjob_t   * job,
+   edgebuf_t * eb,
+   gstack_t ** hits
+)
+{
+   // Unpack arguments.
+   gstack_t * useqS  = job->useqS;
+   ctrie_t  * trie   = job->trie;
+   lookup_t * lut    = job->lut;
+   const int  tau    = job->tau;
+
+   // Define a constant to help the compiler recognize
+   // that only one of the two cases will ever be used
+   // in the loop below.
+   const int bidir_match = (CLUSTERALG == SPHERES_CLUSTER || CLUSTERALG == COMPONENTS_CLUSTER);
+   useq_t * last_query = NULL;
+
+   // The sequences of a job all have the same length. When they
+   // are shorter than the trie, they are padded on the fly with
+   // the leading spaces that 'pad_useq()' used to write back into
+   // every sequence. Two buffers alternate because the insertions
+   // of a build job need the previous padded sequence as well.
+   const int qlen = strlen(((useq_t *) useqS->items[job->start])->seq);
+   const int npad = (int) trie->height - qlen;
+   char padbuf[2][M];
+   if (npad > 0) {
+      for (int b = 0 ; b < 2 ; b++) {
+         memset(padbuf[b], ' ', npad);
+         padbuf[b][npad + qlen] = '\0';
+      }
+   }
+
+   // State of the bulk insertions: the sequences of a build job
+   // come in lexicographic order, so each insertion descends from
+   // the longest common prefix with the previous one.
+   const char * prev_seq = NULL;
+   uint32_t spine[M];
+
+   // Local tally of the queries suppressed by the prefilter,
+   // merged in the global counters at the end of the job.
+   long ncalls = 0;
+   long nskips = 0;
+   long nhits = 0;
+   long visits0 = TRIE_VISITS;
+
+   for (int i = job->start ; i <= job->end ; i++) {
+      useq_t *query = (useq_t *) useqS->items[i];
+      int do_search = lut_search(lut, query, npad) == 1;
+      ncalls++;
+      nskips += !do_search;
+
+      // Pad the sequence to the height of the trie. The common
+      // pads shift the trailing depths by 'npad'.
+      const char *qseq = query->seq;
+      if (npad > 0 && (job->build || do_search)) {
+         char *buf = padbuf[i & 1];
+         memcpy(buf + npad, query->seq, qlen);
+         qseq = buf;
+      }
+
+      // Insert the new sequence in the lut and trie, but let
+      // the last pointer to NULL so that the query does not
+      // find itself upon search.
+      void **data = NULL;
+      if (job->build) {
+         if (lut_insert(lut, query, npad)) {
+            alert();
+            krash();
+         }
+         data = insert_string_ctrie_sorted(trie, qseq,
+               prev_seq, spine);
+         if (data == NULL || *data != NULL) {
+            alert();
+            krash();
+         }
+         prev_seq = qseq;
+      }
+
+      if (do_search) {
+         int trail = 0;
+         if (i < job->end) {
+            useq_t *next_query = (useq_t *) useqS->items[i+1];
+            // The 'while' condition is guaranteed to be false
+            // before the end of the 'char' arrays because all
+            // the queries have the same length and are different.
+            while (query->seq[trail] == next_query->seq[trail]) {
+               trail++;
+            }
+            trail += npad;
+         }
+
+         // Compute start height.
+         int start = 0;
+         if (last_query != NULL) {
+            while(query->seq[start] == last_query->seq[start]) start++;
+            start += npad;
+         }
+
+         // Clear hit stack. //
+         for (int j = 0 ; hits[j] != TOWER_TOP ; j++) {
+            hits[j]->nitems = 0;
+         }
+
+         // Search the trie. //
+         int err = search_ctrie(trie, qseq, tau, hits, start, trail);
+         if (err) {
+            alert();
+            krash();
+         }
+
+         for (int j = 0 ; hits[j] != TOWER_TOP ; j++) {
+            if (hits[j]->nitems > hits[j]->nslots) {
+               fprintf(stderr, "warning: incomplete search (%s)\n",
+                       query->seq);
+               break;
+            }
+         }
+
+         // Link matching pairs for clustering.
+         // Skip dist = 0, as this would be self. In reference mode
+         // the queries are never inserted, so exact matches are
+         // genuine hits and dist = 0 is included.
+         for (int dist = job->ref ? 0 : 1 ; dist < tau+1 ; dist++) {
+         nhits += hits[dist]->nitems;
+         for (int j = 0 ; j < hits[dist]->nitems ; j++) {
+
+            useq_t *match = (useq_t *) hits[dist]->items[j];
+            if (CHK_RECORD && !job->ref) {
+               // Raw pair for '--checkpoint': the parent/child
+               // orientation and the ratio filter are applied when
+               // the checkpoint is loaded, so a resumed run can
+               // cluster with different parameters. Matches are
+               // rare relative to searches, so one shared buffer
+               // under a lock is enough.
+               pthread_mutex_lock(&CHK_LOCK);
+               edge_append(&CHK_EDGES, query, match, dist);
+               pthread_mutex_unlock(&CHK_LOCK);
+            }
+            if (job->ref) {
+               // Record the candidate assignment; the best match
+               // per query is picked in 'merge_assignments()'.
+               edge_append(eb, query, match, dist);
+            }
+
+            else if (bidir_match) {
+               // Make a bidirectional match reference.
+               edge_append(eb, query, match, dist);
+               edge_append(eb, match, query, dist);
+            }
+
+            else {
+               // The parent is the sequence with highest count.
+               // For ties, parent is the query and child is the match.
+               // Matches are stored in child only (i.e. children
+               // know their parents).
+               useq_t *parent = match->count > query->count ? match : query;
+               useq_t *child  = match->count > query->count ? query : match;
+               // If clustering is done by message passing, do not link
+               // pair if counts are on the same order of magnitude.
+               int mincount = child->count;
+               int maxcount = parent->count;
+               if (maxcount < CLUSTER_RATIO * mincount) continue;
+	       // In case CLUSTER_RATIO is set to 1, set parent to the
+	       // lexicographically smaller. This will avoid circular
+	       // parent references that produce infinite loops when
+	       // clustering.
+	       if (maxcount == mincount) {
+		  if (strcmp(parent->seq, child->seq) > 0) {
+		     useq_t * t = parent;
+		     parent = child;
+		     child = t;
+		  }
+	       }
+               // Matches are stored in the child.
+               edge_append(eb, child, parent, dist);
+            }
+         }
+         }
+
+         last_query = query;
+
+      }
+
+      if (job->build) {
+         // Finally set the pointer of the inserted tail node.
+         *data = query;
+      }
+   }
+
+   __sync_fetch_and_add(&LUT_CALLS, ncalls);
+   __sync_fetch_and_add(&LUT_SKIPS, nskips);
+   __sync_fetch_and_add(&POUCET_VISITS, TRIE_VISITS - visits0);
+   __sync_fetch_and_add(&POUCET_HITS, nhits);
+
+   return;
+
+}
+
+
+void *
+query_ref_trie
+(
+   void * args
+)
+// Thread entry of the query phase of the reference mode: runs the
+// job of the worker on its private clone of the reference trie
+// (see 'starcode_ref()').
+{
+   refjob_t *r = (refjob_t *) args;
+   do_query(&r->job, r->edges, r->hits);
+   return NULL;
+}
+
+
+int
+query_in_trie
+(
+   int         i,
+   int         t,
+   const int * blen,
+   const int * sidx,
+   const int * snb,
+   int         tau
+)
+// SYNOPSIS:
+//   Schedule of the stratified query phase: returns 1 if block
+//   'i' must run as a query job in the trie of block 't'. Every
+//   eligible pair runs exactly once: a pair of different lengths
+//   runs in the trie of the longer block, and the blocks of a
+//   stratum run the circular schedule of odd order shown in the
+//   diagram above (the strata have an odd number of blocks for
+//   this reason), so a single stratum yields the jobs the plan
+//   has always produced. Pairs whose lengths differ by more than
+//   'tau' cannot match and are not scheduled at all.
+//
+//   'sidx' holds the index of every block within its stratum and
+//   'snb' the number of blocks of its stratum.
+{
+   if (i == t) return 0;
+   if (blen[i] > blen[t]) return 0;
+   if (blen[t] - blen[i] > tau) return 0;
+   if (blen[i] < blen[t]) return 1;
+   int n = snb[t];
+   int d = (sidx[i] - sidx[t] + n) % n;
+   return d >= 1 && d <= (n-1)/2;
+}
+
+
+mtplan_t *
+plan_mt
+(
+    int       tau,
+    int       medianlen,
+    int       ntries,
+    gstack_t *useqS
+)
+// SYNOPSIS:
+//   Builds the plan of the query phase over length-stratified
+//   tries. The sort is length-major, so the sequences of equal
+//   length form contiguous strata. Each stratum is split into an
+//   odd number of blocks in proportion of its size (for a total
+//   of about 'ntries' blocks) and each block gets a trie of its
+//   own. The first job of every trie builds it from its own
+//   block; the other jobs query the blocks that
+//   'query_in_trie()' assigns to it, which covers every eligible
+//   block pair exactly once. Within a stratum the blocks run the
+//   schedule shown below, where rows are query blocks, columns
+//   are tries, a circle (o) is a build job, a cross (x) a query
+//   job and a dot (.) no job -- it requires an odd number of
+//   blocks and covers each pair once.
+//
+//                            --- Tries ---
+//                            1  2  3  4  5
+//                         1  o  .  .  x  x
+//                         2  x  o  .  .  x
+//                         3  x  x  o  .  .
+//                         4  .  x  x  o  .
+//                         5  .  .  x  x  o
+//
+//   All the tries share the height of the longest stratum and
+//   'do_query()' pads the sequences on the fly, so the distances
+//   are computed in the same geometry as when 'pad_useq()' wrote
+//   the pads into every sequence (the width of the search band
+//   at a given depth depends on the depth itself, so the number
+//   of leading pads is part of the metric near the band limit).
+//   The pads of a block form a single shared path in its trie.
+//
+//   When all the sequences have the same length (as in the
+//   pipelines that pad explicitly), there is a single stratum
+//   and the plan degenerates to the 'ntries' blocks and the jobs
+//   it has always produced.
+{
+   int nitems = useqS->nitems;
+   useq_t **items = (useq_t **) useqS->items;
+
+   // Initialize plan.
+   mtplan_t *mtplan = malloc(sizeof(mtplan_t));
+   if (mtplan == NULL) {
+      alert();
+      krash();
+   }
+
+   // Initialize mutex. The matches are recorded in per-worker
+   // buffers (see 'edge_append()') so the only lock left is the
+   // scheduling mutex of the plan.
+   pthread_mutex_t *mutex = malloc(sizeof(pthread_mutex_t));
+   pthread_cond_t *monitor = malloc(sizeof(pthread_cond_t));
+   if (mutex == NULL || monitor == NULL) {
+      alert();
+      krash();
+   }
+   pthread_mutex_init(mutex, NULL);
+   pthread_cond_init(monitor,NULL);
+
+   // Length strata (contiguous after the length-major sort).
+   int nstrata = 1;
+   for (int i = 1 ; i < nitems ; i++) {
+      nstrata += strlen(items[i]->seq) != strlen(items[i-1]->seq);
+   }
+   int *sbound = malloc((nstrata+1) * sizeof(int));
+   if (sbound == NULL) {
+      alert();
+      krash();
+   }
+   sbound[0] = 0;
+   sbound[nstrata] = nitems;
+   for (int i = 1, s = 1 ; i < nitems ; i++) {
+      if (strlen(items[i]->seq) != strlen(items[i-1]->seq)) {
+         sbound[s++] = i;
+      }
+   }
+
+   // Split the strata into blocks, in proportion of their
+   // expected query cost rather than their size: a search visits
+   // nodes down to the depth of the sequences, so the weight of
+   // a stratum is its sequence count times its length. Real
+   // barcode data is skewed and a stratum can easily carry ten
+   // times the weight of another; splitting by cost keeps the
+   // jobs of the heavy strata short enough that the query phase
+   // does not end on a long single-threaded tail. Splitting a
+   // stratum beyond its weight share backfires: the blocks run
+   // in all pairs, so the searches per sequence grow with the
+   // number of blocks. The circular schedule of
+   // 'query_in_trie()' needs an odd number of blocks per
+   // stratum.
+   long totweight = 0;
+   long *weight = malloc(nstrata * sizeof(long));
+   if (weight == NULL) {
+      alert();
+      krash();
+   }
+   for (int s = 0 ; s < nstrata ; s++) {
+      long n = sbound[s+1] - sbound[s];
+      weight[s] = n * strlen(items[sbound[s]]->seq);
+      totweight += weight[s];
+   }
+   int B = 0;
+   int *nblocks = malloc(nstrata * sizeof(int));
+   if (nblocks == NULL) {
+      alert();
+      krash();
+   }
+   for (int s = 0 ; s < nstrata ; s++) {
+      int n = sbound[s+1] - sbound[s];
+      int nb = ntries;
+      if (nstrata > 1) {
+         nb = (int) ((long) ntries * weight[s] / totweight);
+      }
+      if (nb < 1) nb = 1;
+      if (nb > n) nb = n;
+      if (nb % 2 == 0) nb--;
+      nblocks[s] = nb;
+      B += nb;
+   }
+   free(weight);
+
+   // Boundaries, sequence lengths and stratum coordinates of the
+   // blocks.
+   int *bounds = malloc((B+1) * sizeof(int));
+   int *blen = malloc(B * sizeof(int));
+   int *sidx = malloc(B * sizeof(int));
+   int *snb = malloc(B * sizeof(int));
+   if (bounds == NULL || blen == NULL || sidx == NULL || snb == NULL) {
+      alert();
+      krash();
+   }
+   bounds[0] = 0;
+   for (int s = 0, t = 0 ; s < nstrata ; s++) {
+      int n = sbound[s+1] - sbound[s];
+      int len = strlen(items[sbound[s]]->seq);
+      int Q = n / nblocks[s];
+      int R = n % nblocks[s];
+      for (int b = 0 ; b < nblocks[s] ; b++) {
+         bounds[t+1] = bounds[t] + Q + (b < R);
+         blen[t] = len;
+         sidx[t] = b;
+         snb[t] = nblocks[s];
+         t++;
+      }
+   }
+
+   // Initialize 'mttries'.
+   mttrie_t *mttries = malloc(B * sizeof(mttrie_t));
+   if (mttries == NULL) {
+      alert();
+      krash();
+   }
+
+   // Common height of the tries (the length of the longest
+   // stratum).
+   int height = 0;
+   for (int t = 0 ; t < B ; t++) {
+      if (blen[t] > height) height = blen[t];
+   }
+
+   // Create the tries and their jobs.
+   int totjobs = 0;
+   for (int t = 0 ; t < B ; t++) {
+      int njobs = 1;
+      for (int i = 0 ; i < B ; i++) {
+         njobs += query_in_trie(i, t, blen, sidx, snb, tau);
+      }
+      // Presized trie; add one node for the root, which is not
+      // counted, and one per pad of the shared pad path.
+      long nnodes = count_trie_nodes(items, bounds[t], bounds[t+1]);
+      ctrie_t *local_trie = new_ctrie(height,
+            nnodes + 1 + (height - blen[t]),
+            bounds[t+1]-bounds[t]);
+      mtjob_t *jobs = malloc(njobs * sizeof(mtjob_t));
+      if (local_trie == NULL || jobs == NULL) {
+         alert();
+         krash();
+      }
+
+      // Allocate lookup struct.
+      lookup_t * local_lut = new_lookup(medianlen, height, tau);
+      if (local_lut == NULL) {
+         alert();
+         krash();
+      }
+
+      mttries[t].flag       = TRIE_FREE;
+      mttries[t].currentjob = 0;
+      mttries[t].njobs      = njobs;
+      mttries[t].owner      = -1;
+      mttries[t].jobs       = jobs;
+
+      // The build job comes first: the trie must exist before it
+      // is queried.
+      jobs[0] = (mtjob_t) {
+         .start = bounds[t],
+         .end   = bounds[t+1]-1,
+         .tau   = tau,
+         .build = 1,
+         .ref   = 0,
+         .useqS = useqS,
+         .trie  = local_trie,
+         .lut   = local_lut,
+      };
+      for (int i = 0, j = 1 ; i < B ; i++) {
+         if (!query_in_trie(i, t, blen, sidx, snb, tau)) continue;
+         jobs[j] = jobs[0];
+         jobs[j].start = bounds[i];
+         jobs[j].end   = bounds[i+1]-1;
+         jobs[j].build = 0;
+         j++;
+      }
+      totjobs += njobs;
+   }
+
+   free(sbound);
+   free(nblocks);
+   free(bounds);
+   free(blen);
+   free(sidx);
+   free(snb);
+
+   mtplan->ntries = B;
+   mtplan->njobs = totjobs;
+   mtplan->jobsdone = 0;
+   mtplan->mutex = mutex;
+   mtplan->monitor = monitor;
+   mtplan->tries = mttries;
+
+   return mtplan;
+
+}
+
+long
+count_trie_nodes
+(
+ useq_t ** seqs,
+ int     start,
+ int     end
+)
+{
+   int  seqlen = strlen(seqs[start]->seq) - 1;
+   long count = seqlen;
+   for (int i = start+1; i < end; i++) {
+      char * a = seqs[i-1]->seq;
+      char * b  = seqs[i]->seq;
+      int prefix = 0;
+      while (a[prefix] == b[prefix]) prefix++;
+      count += seqlen - prefix;
+   }
+   return count;
+}
+
+void
+connected_components
+(
+ useq_t * useq,
+ gstack_t ** cluster
+)
+{
+   // Flag claimed.
+   useq->canonical = useq;
+   // Add myself to cluster.
+   push(useq, cluster);
+   // Recursive call on edges.
+   if (useq->matches == NULL) return;
+   gstack_t * matches;
+   for (int j = 0;  (matches = useq->matches[j]) != TOWER_TOP; j++) {
+      for (int k = 0; k < matches->nitems; k++) {
+         useq_t * match = (useq_t *) matches->items[k];
+         if (match->canonical != NULL) continue;
+         connected_components(match, cluster);
+      }
+   }
+}
+
+gstack_t *
+compute_clusters
+(
+ gstack_t    * uSQ
+)
+{
+   gstack_t * clusters = new_gstack();
+   for (int i = 0; i < uSQ->nitems; i++) {
+      useq_t * useq = (useq_t *) uSQ->items[i];
+
+      // Check sequence flag.
+      if (useq->canonical != NULL) continue;
+
+      // Create new cluster.
+      gstack_t * cluster = new_gstack();
+
+      // Recursively gather connected components.
+      connected_components(useq, &cluster);
+
+      // Find centroid. (max: #counts THEN #edges).
+      // Count useq edges.
+      int edge_count = 0;
+      if (useq->matches != NULL) {
+         gstack_t * matches;
+         for (int j = 0; (matches = useq->matches[j]) != TOWER_TOP; j++)
+            edge_count += matches->nitems;
+      }
+
+      // Find centroid among cluster seqs.
+      size_t cluster_count = useq->count;
+      for (int k = 1; k < cluster->nitems; k++) {
+         useq_t * s = (useq_t *) cluster->items[k];
+         cluster_count += s->count;
+         // Select centroid by count.
+         if (s->count > useq->count) {
+            // Count centroid edges.
+            int cnt = 0;
+            gstack_t * matches;
+            for (int j = 0; (matches = s->matches[j]) != TOWER_TOP; j++)
+               cnt += matches->nitems;
+            // Store centroid at index 0.
+            cluster->items[0] = s;
+            cluster->items[k] = useq;
+            useq = s;
+            // Save centroid edge count.
+            edge_count = cnt;
+         }
+         // If same count, select by edge count.
+         else if (s->count == useq->count && s->matches != NULL) {
+            int cnt = 0;
+            gstack_t * matches;
+            for (int j = 0; (matches = s->matches[j]) != TOWER_TOP; j++)
+               cnt += matches->nitems;
+            if (cnt > edge_count) {
+               // Store centroid at index 0.
+               cluster->items[0] = s;
+               cluster->items[k] = useq;
+               useq = s;
+               // Save centroid edge count.
+               edge_count = cnt;
+
+            }
+         }
+      }
+      useq->count = cluster_count;
+      // Store cluster.
+      push(cluster, &clusters);
+   }
+
+   // Sort clusters by size (counts).
+   qsort(clusters->items, clusters->nitems, sizeof(gstack_t *), cluster_count);
+
+   return clusters;
+}
+
+
+void
+sphere_clustering
+(
+ gstack_t *useqS
+)
+{
+   // Sort in count order.
+   qsort(useqS->items, useqS->nitems, sizeof(useq_t *), count_order_spheres);
+
+   for (int i = 0 ; i < useqS->nitems ; i++) {
+      useq_t *useq = (useq_t *) useqS->items[i];
+      if (useq->canonical != NULL) continue;
+      useq->canonical = useq;
+      useq->sphere_c  = useq->count;
+      useq->sphere_d  = 0;
+      if (useq->matches == NULL) continue;
+      // Bidirectional edge references simplifie the algorithm.
+      // Directly proceed to claim neighbor counts.
+      gstack_t *matches;
+      for (int j = 0 ; (matches = useq->matches[j]) != TOWER_TOP ; j++) {
+         for (int k = 0 ; k < matches->nitems ; k++) {
+            useq_t *match = (useq_t *) matches->items[k];
+            // If a sequence has been already claimed, remove it from list.
+            if (match->canonical != NULL) {
+	       // Steal sequence from the other sphere if it is closer to this centroid.
+	       if (j < match->sphere_d) {
+		  // Update other sphere size.
+		  match->canonical->sphere_c -= match->count;
+	       } else {
+		  matches->items[k--] = matches->items[--matches->nitems];
+		  continue;
+	       }
+	    }		  
+	    // Claim the sequence.
+	    useq->sphere_c += match->count;
+	    match->canonical = useq;
+	    match->sphere_d = j;
+         }
+      }
+   }
+
+   return;
+
+}
+
+
+void *
+transfer_counts_batch
+(
+ void * arg
+)
+// SYNOPSIS:
+//   Parallel counterpart of 'transfer_counts_and_update_canonicals()'
+//   for one range of a count batch. All the sequences of a batch
+//   have the same count, so their parents (which have strictly
+//   higher counts when CLUSTER_RATIO is above 1) were resolved in
+//   an earlier batch and can be read without locking. Counts and
+//   sphere sizes of the canonicals are shared between ranges and
+//   are updated atomically.
+{
+   mprange_t *range = (mprange_t *) arg;
+   for (int i = range->from ; i < range->to ; i++) {
+      useq_t *u = range->items[i];
+
+      // If the read has no matches, it has no parent, so
+      // it is an ancestor and it must be canonical.
+      if (u->matches == NULL) {
+         u->canonical = u;
+         continue;
+      }
+
+      // Direct parents are the lowest nonempty match stratum.
+      gstack_t *matches;
+      for (int j = 0 ; (matches = u->matches[j]) != TOWER_TOP ; j++) {
+         if (matches->nitems > 0) break;
+      }
+
+      // Self canonical is the canonical of the first parent,
+      // unless parents have different canonicals (ambiguous).
+      useq_t *canonical = ((useq_t *) matches->items[0])->canonical;
+      for (int k = 1 ; k < matches->nitems ; k++) {
+         useq_t *match = (useq_t *) matches->items[k];
+         if (match->canonical == NULL || match->canonical != canonical) {
+            canonical = NULL;
+            break;
+         }
+      }
+
+      if (canonical) {
+         u->canonical = canonical;
+         __sync_fetch_and_add(&canonical->count, u->count);
+         u->count = 0;
+         __sync_fetch_and_add(&canonical->sphere_c, 1);
+      }
+      else {
+         u->sphere_d = 1;
+      }
+   }
+   return NULL;
+}
+
+
+void *
+replay_transfer_calls
+(
+ void * arg
+)
+// SYNOPSIS:
+//   The recursive 'transfer_counts_and_update_canonicals()' is
+//   called again on every direct parent by each of its children
+//   (plus once by the main loop). The repeated calls transfer
+//   nothing -- the count is zero by then -- but they increment the
+//   sphere size of the parent's canonical, which matters for the
+//   tie breaks of 'mp_resolve_ambiguous()'. Replay those extra
+//   increments, one per (child, direct parent) edge, skipping
+//   ancestors (which always return early) and ambiguous parents.
+{
+   mprange_t *range = (mprange_t *) arg;
+   for (int i = range->from ; i < range->to ; i++) {
+      useq_t *u = range->items[i];
+      if (u->matches == NULL) continue;
+      gstack_t *matches;
+      for (int j = 0 ; (matches = u->matches[j]) != TOWER_TOP ; j++) {
+         if (matches->nitems > 0) break;
+      }
+      for (int k = 0 ; k < matches->nitems ; k++) {
+         useq_t *parent = (useq_t *) matches->items[k];
+         if (parent->matches != NULL && parent->canonical != NULL) {
+            __sync_fetch_and_add(&parent->canonical->sphere_c, 1);
+         }
+      }
+   }
+   return NULL;
+}
+
+
+void
+message_passing_clustering
+(
+ gstack_t *useqS,
+ int       thrmax
+)
+{
+
+   int n = useqS->nitems;
+
+   // When CLUSTER_RATIO is 1 or less, linked pairs may have equal
+   // counts, in which case the count batches below are not a valid
+   // processing order: keep the recursive version.
+   if (CLUSTER_RATIO <= 1.0 || thrmax < 2 || n < 2) {
+      // Transfer counts to parents recursively.
+      for (int i = 0 ; i < n ; i++) {
+         useq_t *u = (useq_t *) useqS->items[i];
+         transfer_counts_and_update_canonicals(u);
+      }
+   }
+
+   else {
+      // Sort by decreasing count: parents always come before their
+      // children, so the sequences of a same-count batch can be
+      // resolved in parallel. Batch boundaries are computed before
+      // the counts start moving.
+      useq_t **byc = malloc(n * sizeof(useq_t *));
+      int *bounds = malloc((n+1) * sizeof(int));
+      pthread_t *tid = malloc(thrmax * sizeof(pthread_t));
+      mprange_t *ranges = malloc(thrmax * sizeof(mprange_t));
+      if (byc == NULL || bounds == NULL ||
+            tid == NULL || ranges == NULL) {
+         alert();
+         krash();
+      }
+      memcpy(byc, useqS->items, n * sizeof(useq_t *));
+      qsort(byc, n, sizeof(useq_t *), count_order);
+
+      int nbatches = 0;
+      bounds[0] = 0;
+      for (int i = 1 ; i < n ; i++) {
+         if (byc[i]->count != byc[i-1]->count) bounds[++nbatches] = i;
+      }
+      bounds[++nbatches] = n;
+
+      for (int b = 0 ; b < nbatches ; b++) {
+         int lo = bounds[b];
+         int hi = bounds[b+1];
+         // Small batches are not worth the thread traffic.
+         if (hi - lo < 4096) {
+            mprange_t whole = { .items = byc, .from = lo, .to = hi };
+            transfer_counts_batch(&whole);
+            continue;
+         }
+         for (int t = 0 ; t < thrmax ; t++) {
+            ranges[t] = (mprange_t) {
+               .items = byc,
+               .from = lo + (int) ((long) (hi-lo) * t / thrmax),
+               .to   = lo + (int) ((long) (hi-lo) * (t+1) / thrmax),
+            };
+            if (pthread_create(tid + t, NULL,
+                     transfer_counts_batch, ranges + t)) {
+               alert();
+               krash();
+            }
+         }
+         for (int t = 0 ; t < thrmax ; t++) pthread_join(tid[t], NULL);
+      }
+
+      // Replay the extra sphere size increments of the recursive
+      // version (see 'replay_transfer_calls()').
+      for (int t = 0 ; t < thrmax ; t++) {
+         ranges[t] = (mprange_t) {
+            .items = byc,
+            .from = (int) ((long) n * t / thrmax),
+            .to   = (int) ((long) n * (t+1) / thrmax),
+         };
+         if (pthread_create(tid + t, NULL,
+                  replay_transfer_calls, ranges + t)) {
+            alert();
+            krash();
+         }
+      }
+      for (int t = 0 ; t < thrmax ; t++) pthread_join(tid[t], NULL);
+
+      free(byc);
+      free(bounds);
+      free(tid);
+      free(ranges);
+   }
+
+   // Resolve ambiguous assignments. The selection depends on the
+   // counts accumulated by the previous resolutions, so this pass
+   // is order-sensitive and stays sequential. Ambiguous sequences
+   // are rare in practice.
+   for (int i = 0 ; i < n ; i++) {
+      useq_t *u = (useq_t *) useqS->items[i];
+      mp_resolve_ambiguous(u);
+   }
+
+
+   return;
+
+}
+
+
+int
+seqsort
+(
+ useq_t ** data,
+ int       numels,
+ int       thrmax
+)
+// SYNOPSIS:
+//   Sorts an array of 'useq_t' and merges identical sequences.
+//   The sort order is such that a < b if a is shorter than b or
+//   if a has the same length as b and lower lexical order. The
+//   sort is a most-significant-byte radix sort run within groups
+//   of sequences of the same length. The work consists of
+//   independent slices (length groups, then radix buckets) that
+//   are dispatched to 'thrmax' threads. When identical sequences
+//   are detected, they are merged into the earliest one, which
+//   receives their counts, and the others are destroyed (freed)
+//   and replaced by NULL.
+//
+// PARAMETERS:
+//   data:       an array of pointers to each element.
+//   numels:     number of elements, i.e. size of 'data'.
+//   thrmax: number of threads.
+//
+// RETURN:
+//   Number of unique elements.
+//
+// SIDE EFFECTS:
+//   Sorts 'data'. Pointers to repeated elements are set to NULL
+//   and moved after the unique elements.
+{
+
+   if (numels < 2) return numels;
+
+   useq_t ** aux = malloc(numels * sizeof(useq_t *));
+   int * lens = malloc(numels * sizeof(int));
+   if (aux == NULL || lens == NULL) {
+      alert();
+      krash();
+   }
+
+   // Counting sort on sequence length (the primary sort key).
+   int maxlen = 0;
+   for (int i = 0 ; i < numels ; i++) {
+      lens[i] = strlen(data[i]->seq);
+      if (lens[i] > maxlen) maxlen = lens[i];
+   }
+   int * offs = calloc(maxlen + 2, sizeof(int));
+   if (offs == NULL) {
+      alert();
+      krash();
+   }
+   for (int i = 0 ; i < numels ; i++) offs[lens[i]+1]++;
+   for (int l = 1 ; l <= maxlen+1 ; l++) offs[l] += offs[l-1];
+   memcpy(aux, data, numels * sizeof(useq_t *));
+   // The distribution is stable: sequences of equal length keep
+   // their input order, so the earliest of identical sequences
+   // comes first and survives the merge.
+   for (int i = 0 ; i < numels ; i++) data[offs[lens[i]]++] = aux[i];
+
+   // Restore the group start offsets shifted by the pass above.
+   for (int l = maxlen+1 ; l > 0 ; l--) offs[l] = offs[l-1];
+   offs[0] = 0;
+
+   // Create one task per length group.
+   radixsort_t rs = { .data = data, .aux = aux, .nexttask = 0 };
+   int taskcap = maxlen + 1 + 256;
+   rs.tasks = malloc(taskcap * sizeof(radixtask_t));
+   if (rs.tasks == NULL) {
+      alert();
+      krash();
+   }
+   rs.ntasks = 0;
+   for (int l = 0 ; l <= maxlen ; l++) {
+      int gsize = offs[l+1] - offs[l];
+      if (gsize < 1) continue;
+      radixtask_t task = { .start = offs[l], .size = gsize,
+         .pos = 0, .len = l };
+      rs.tasks[rs.ntasks++] = task;
+   }
+
+   // Split the biggest tasks one radix level ahead until there
+   // are enough of them to keep all the threads busy.
+   while (rs.ntasks < 8*thrmax) {
+      int big = -1;
+      for (int t = 0 ; t < rs.ntasks ; t++) {
+         if (rs.tasks[t].pos == rs.tasks[t].len) continue;
+         if (rs.tasks[t].size < 4096) continue;
+         if (big < 0 || rs.tasks[t].size > rs.tasks[big].size) big = t;
+      }
+      if (big < 0) break;
+      radixtask_t task = rs.tasks[big];
+      rs.tasks[big] = rs.tasks[--rs.ntasks];
+      if (rs.ntasks + 256 > taskcap) {
+         taskcap *= 2;
+         rs.tasks = realloc(rs.tasks, taskcap * sizeof(radixtask_t));
+         if (rs.tasks == NULL) {
+            alert();
+            krash();
+         }
+      }
+      int bucket[257];
+      radix_split(data, aux, task.start, task.size, task.pos, bucket);
+      for (int b = 0 ; b < 256 ; b++) {
+         int bsize = bucket[b+1] - bucket[b];
+         if (bsize < 1) continue;
+         radixtask_t sub = { .start = task.start + bucket[b],
+            .size = bsize, .pos = task.pos + 1, .len = task.len };
+         rs.tasks[rs.ntasks++] = sub;
+      }
+   }
+
+   // Either run threads or DIY. The tasks cover disjoint slices
+   // of 'data' (and of 'aux'), so the threads never collide.
+   if (thrmax > 1 && rs.ntasks > 1) {
+      int nthreads = thrmax < rs.ntasks ? thrmax : rs.ntasks;
+      pthread_t * tid = malloc(nthreads * sizeof(pthread_t));
+      if (tid == NULL) {
+         alert();
+         krash();
+      }
+      for (int t = 0 ; t < nthreads ; t++) {
+         if (pthread_create(tid+t, NULL, radix_do_tasks, &rs)) {
+            alert();
+            krash();
+         }
+      }
+      for (int t = 0 ; t < nthreads ; t++) pthread_join(tid[t], NULL);
+      free(tid);
+   }
+   else {
+      radix_do_tasks(&rs);
+   }
+
+   // Compact the unique sequences to the head of 'data' and
+   // pad the tail with NULLs.
+   int unique = 0;
+   for (int i = 0 ; i < numels ; i++) {
+      if (data[i] != NULL) data[unique++] = data[i];
+   }
+   memset(data + unique, 0, (numels - unique) * sizeof(useq_t *));
+
+   free(rs.tasks);
+   free(offs);
+   free(lens);
+   free(aux);
+
+   return unique;
+
+}
+
+
+void *
+radix_do_tasks
+(
+   void * arg
+)
+// Worker thread of 'seqsort': claims tasks from the shared list
+// with an atomic cursor and sorts the corresponding slices.
+{
+   radixsort_t * rs = (radixsort_t *) arg;
+   while (1) {
+      int t = __sync_fetch_and_add(&rs->nexttask, 1);
+      if (t >= rs->ntasks) break;
+      radixtask_t task = rs->tasks[t];
+      radix_sort_slice(rs->data, rs->aux, task.start, task.size,
+            task.pos, task.len);
+   }
+   return NULL;
+}
+
+
+void
+radix_sort_slice
+(
+   useq_t ** data,
+   useq_t ** aux,
+   int       start,
+   int       size,
+   int       pos,
+   int       len
+)
+// SYNOPSIS:
+//   Recursive part of 'seqsort'. Sorts 'data[start..start+size)',
+//   whose sequences all have length 'len' and share their first
+//   'pos' characters, by radix on the remaining characters, and
+//   merges identical sequences. Small slices are handed over to
+//   an insertion sort because the radix overhead is not worth it.
+//
+// SIDE EFFECTS:
+//   Sorts the slice; duplicates are destroyed and set to NULL.
+{
+
+   if (size < 2) return;
+
+   if (pos == len) {
+      // The sequences of the slice are all identical.
+      radix_merge_run(data, start, size);
+      return;
+   }
+
+   if (size < 32) {
+      radix_insertion(data, start, size, pos);
+      return;
+   }
+
+   int bucket[257];
+   radix_split(data, aux, start, size, pos, bucket);
+   for (int b = 0 ; b < 256 ; b++) {
+      int bsize = bucket[b+1] - bucket[b];
+      if (bsize < 2) continue;
+      radix_sort_slice(data, aux, start + bucket[b], bsize, pos+1, len);
+   }
+
+   return;
+
+}
+
+
+void
+radix_split
+(
+   useq_t ** data,
+   useq_t ** aux,
+   int       start,
+   int       size,
+   int       pos,
+   int     * bucket
+)
+// Distributes 'data[start..start+size)' in 256 buckets on the
+// character at position 'pos', using 'aux' as scratch space. The
+// distribution is stable. On return 'bucket[b]' is the offset of
+// bucket 'b' relative to 'start' ('bucket[256]' is 'size').
+{
+
+   int count[257] = {0};
+   for (int i = 0 ; i < size ; i++) {
+      count[(uint8_t) data[start+i]->seq[pos] + 1]++;
+   }
+   bucket[0] = 0;
+   for (int b = 1 ; b <= 256 ; b++) bucket[b] = bucket[b-1] + count[b];
+
+   memcpy(aux + start, data + start, size * sizeof(useq_t *));
+   memcpy(count, bucket, 257 * sizeof(int));
+   for (int i = 0 ; i < size ; i++) {
+      useq_t * u = aux[start+i];
+      data[start + count[(uint8_t) u->seq[pos]]++] = u;
+   }
+
+   return;
+
+}
+
+
+void
+radix_insertion
+(
+   useq_t ** data,
+   int       start,
+   int       size,
+   int       pos
+)
+// Insertion sort for the small slices of 'seqsort', comparing
+// the sequence suffixes from position 'pos' (the slices share
+// their first 'pos' characters and their length). The sort is
+// stable, then runs of identical sequences are merged into their
+// first element.
+{
+
+   useq_t ** slice = data + start;
+   for (int i = 1 ; i < size ; i++) {
+      useq_t * u = slice[i];
+      int j = i;
+      while (j > 0 && strcmp(slice[j-1]->seq + pos, u->seq + pos) > 0) {
+         slice[j] = slice[j-1];
+         j--;
+      }
+      slice[j] = u;
+   }
+
+   int head = 0;
+   for (int i = 1 ; i < size ; i++) {
+      if (strcmp(slice[head]->seq + pos, slice[i]->seq + pos) == 0) {
+         slice[head]->count += slice[i]->count;
+         transfer_useq_ids(slice[head], slice[i]);
+         destroy_useq(slice[i]);
+         slice[i] = NULL;
+      }
+      else {
+         head = i;
+      }
+   }
+
+   return;
+
+}
+
+
+void
+radix_merge_run
+(
+   useq_t ** data,
+   int       start,
+   int       size
+)
+// Merges a run of identical sequences into its first element,
+// which receives the counts and sequence ids of the others. The
+// others are destroyed and their pointers set to NULL.
+{
+
+   useq_t * first = data[start];
+   for (int i = 1 ; i < size ; i++) {
+      useq_t * dup = data[start+i];
+      first->count += dup->count;
+      transfer_useq_ids(first, dup);
+      destroy_useq(dup);
+      data[start+i] = NULL;
+   }
+
+   return;
+
+}
+
+
+useqhash_t *
+new_useqhash
+(void)
+{
+   useqhash_t *uh = calloc(1, sizeof(useqhash_t));
+   if (uh == NULL) return NULL;
+   uh->nslots = 1024;
+   uh->slots = calloc(uh->nslots, sizeof(useq_t *));
+   uh->useqS = new_gstack();
+   if (uh->slots == NULL || uh->useqS == NULL) {
+      free(uh->slots);
+      free(uh->useqS);
+      free(uh);
+      return NULL;
+   }
+   return uh;
+}
+
+
+gstack_t *
+destroy_useqhash
+(
+   useqhash_t * uh
+)
+// SYNOPSIS:
+//   Frees the hash table and returns its stack of unique sequences,
+//   which remains the property of the caller.
+{
+   gstack_t *useqS = uh->useqS;
+   free(uh->slots);
+   free(uh);
+   return useqS;
+}
+
+
+useq_t *
+useqhash_store
+(
+   useqhash_t * uh,
+   const char * seq,
+         size_t seqlen,
+   const char * info,
+         size_t ilen,
+         int    count
+)
+// SYNOPSIS:
+//   Records one input read in the hash table. The first occurrence
+//   of a sequence allocates a 'useq_t' (keeping its 'info'), repeat
+//   occurrences only bump the count and append the read id, so the
+//   readers allocate per unique sequence instead of per read.
+//
+// RETURN:
+//   The unique sequence holding the read.
+//
+// SIDE EFFECTS:
+//   May grow the slot array and the id list of the sequence. With
+//   '--max-mem' set, may first spill the table to a run file, in
+//   which case the sequences stored so far are freed.
+{
+
+   // Over the budget of '--max-mem': flush the unique sequences
+   // accumulated so far to a sorted run file (the runs are merged
+   // back by 'merge_spill_runs()'). The parse is single-threaded
+   // in this mode (see 'read_map_mt()').
+   if (MAX_MEM > 0 && uh->bytes > MAX_MEM) {
+      useqhash_spill(uh);
+   }
+
+   // FNV-1a over the capitalized sequence, so that the lookup
+   // agrees with the case folding of 'new_useq()'.
+   uint64_t h = 14695981039346656037ULL;
+   for (size_t i = 0 ; i < seqlen ; i++) {
+      h ^= (uint8_t) capitalize[(uint8_t) seq[i]];
+      h *= 1099511628211ULL;
+   }
+
+   // Grow at 50% load to keep the probe sequences short. The
+   // stored sequences are already capitalized and can be rehashed
+   // directly.
+   if (2 * (uh->nitems+1) > uh->nslots) {
+      size_t nslots = 2 * uh->nslots;
+      useq_t **slots = calloc(nslots, sizeof(useq_t *));
+      if (slots == NULL) {
+         alert();
+         krash();
+      }
+      for (size_t i = 0 ; i < uh->nslots ; i++) {
+         useq_t *v = uh->slots[i];
+         if (v == NULL) continue;
+         uint64_t g = 14695981039346656037ULL;
+         for (size_t j = 0 ; v->seq[j] != '\0' ; j++) {
+            g ^= (uint8_t) v->seq[j];
+            g *= 1099511628211ULL;
+         }
+         size_t t = g & (nslots-1);
+         while (slots[t] != NULL) t = (t+1) & (nslots-1);
+         slots[t] = v;
+      }
+      free(uh->slots);
+      uh->slots = slots;
+      uh->nslots = nslots;
+   }
+
+   // Linear probing.
+   size_t s = h & (uh->nslots-1);
+   useq_t *u;
+   while ((u = uh->slots[s]) != NULL) {
+      size_t i = 0;
+      while (i < seqlen && u->seq[i] != '\0' &&
+            u->seq[i] == capitalize[(uint8_t) seq[i]]) i++;
+      if (i == seqlen && u->seq[i] == '\0') break;
+      s = (s+1) & (uh->nslots-1);
+   }
+
+   if (u != NULL) {
+      // Seen before: merge the count and append the read id
+      // (capacity of the id list is the next power of two).
+      u->count += count;
+      if ((u->nids & (u->nids - 1)) == 0) {
+         int *seqid = realloc(u->seqid, 2*u->nids * sizeof(int));
+         if (seqid == NULL) {
+            alert();
+            krash();
+         }
+         u->seqid = seqid;
+      }
+      u->seqid[u->nids++] = ++uh->nreads;
+      uh->bytes += sizeof(int);
+      return u;
+   }
+
+   // First occurrence.
+   u = new_useq_len(count, seq, seqlen, info, ilen);
+   if (u == NULL) {
+      alert();
+      krash();
+   }
+   u->nids = 1;
+   u->seqid = malloc(sizeof(int));
+   if (u->seqid == NULL) {
+      alert();
+      krash();
+   }
+   u->seqid[0] = ++uh->nreads;
+   uh->slots[s] = u;
+   uh->nitems++;
+   push(u, &uh->useqS);
+   // Struct, sequence, id, plus the slot and the stack entry.
+   uh->bytes += sizeof(useq_t) + seqlen + 1 + ilen
+         + sizeof(int) + 2 * sizeof(void *);
+   return u;
+
+}
+
+
+void
+spill_useqS
+(
+   gstack_t * useqS
+)
+// SYNOPSIS:
+//   Writes the sequences of the stack to a sorted temporary run
+//   file for the '--max-mem' mode, destroys them and empties the
+//   stack. Each line of a run holds one unique sequence, its read
+//   count, the length of its id list and the list itself.
+//
+// SIDE EFFECTS:
+//   Pushes the run file on 'SPILL_RUNS' (created if needed). The
+//   temporary file is unlinked by the libc and disappears when
+//   closed.
+{
+
+   qsort(useqS->items, useqS->nitems, sizeof(useq_t *),
+         state_seq_order);
+
+   FILE *f = tmpfile();
+   if (f == NULL) {
+      alert();
+      krash();
+   }
+
+   for (int i = 0 ; i < useqS->nitems ; i++) {
+      useq_t *u = (useq_t *) useqS->items[i];
+      fprintf(f, "%s\t%d\t%u\t", u->seq, u->count, u->nids);
+      for (unsigned int k = 0 ; k < u->nids ; k++) {
+         fprintf(f, k+1 < u->nids ? "%d," : "%d\n", u->seqid[k]);
+      }
+      destroy_useq(u);
+   }
+   useqS->nitems = 0;
+
+   if (SPILL_RUNS == NULL) {
+      SPILL_RUNS = new_gstack();
+      if (SPILL_RUNS == NULL) {
+         alert();
+         krash();
+      }
+   }
+   push(f, &SPILL_RUNS);
+
+}
+
+
+void
+useqhash_spill
+(
+   useqhash_t * uh
+)
+// SYNOPSIS:
+//   Spills the unique sequences of the hash table to a run file
+//   and resets the table. The read counter is kept, so the ids
+//   keep increasing over the whole parse and the merged ids are
+//   the same as those of an in-memory parse.
+{
+
+   spill_useqS(uh->useqS);
+   memset(uh->slots, 0, uh->nslots * sizeof(useq_t *));
+   uh->nitems = 0;
+   uh->bytes = 0;
+
+}
+
+
+void
+spill_run_next
+(
+   spillrun_t * r
+)
+// SYNOPSIS:
+//   Advances the cursor to the next record of the run file and
+//   parses it in place. Sets 'seq' to NULL at the end of the run.
+{
+
+   ssize_t nread = getline(&r->line, &r->sz, r->file);
+   if (nread == -1) {
+      r->seq = NULL;
+      return;
+   }
+   if (r->line[nread-1] == '\n') r->line[nread-1] = '\0';
+
+   char *tab = strchr(r->line, '\t');
+   if (tab == NULL) {
+      alert();
+      krash();
+   }
+   *tab = '\0';
+   r->seq = r->line;
+   r->len = (int) (tab - r->line);
+
+   char *end;
+   r->count = (int) strtol(tab+1, &end, 10);
+   r->nids = (unsigned int) strtoul(end+1, &end, 10);
+   r->ids = end+1;
+
+}
+
+
+gstack_t *
+merge_spill_runs
+(
+   gstack_t * uSQ
+)
+// SYNOPSIS:
+//   Second half of the '--max-mem' mode. If the parse spilled run
+//   files, flushes the in-memory tail as the last run and merges
+//   all the runs back into 'uSQ' with a streaming multiway merge:
+//   at any time only one record per run is in memory. Each run is
+//   sorted and duplicate-free, so equal head records from several
+//   runs are combined by summing the counts and concatenating the
+//   id lists (in run order, which keeps the ids sorted because
+//   they increase over the parse).
+//
+// RETURN:
+//   The stack 'uSQ' with the merged unique sequences, in the
+//   order of 'seqsort()'.
+{
+
+   if (SPILL_RUNS == NULL || SPILL_RUNS->nitems == 0) return uSQ;
+
+   // The tail goes through the same path as the spilled chunks.
+   spill_useqS(uSQ);
+
+   int nruns = SPILL_RUNS->nitems;
+   spillrun_t *runs = calloc(nruns, sizeof(spillrun_t));
+   if (runs == NULL) {
+      alert();
+      krash();
+   }
+   for (int i = 0 ; i < nruns ; i++) {
+      runs[i].file = (FILE *) SPILL_RUNS->items[i];
+      rewind(runs[i].file);
+      spill_run_next(runs + i);
+   }
+
+   for (;;) {
+      // Find the smallest head record (ties resolved in favor of
+      // the earliest run, whose ids are the smallest).
+      int best = -1;
+      for (int i = 0 ; i < nruns ; i++) {
+         if (runs[i].seq == NULL) continue;
+         if (best < 0 || runs[i].len < runs[best].len ||
+               (runs[i].len == runs[best].len &&
+                strcmp(runs[i].seq, runs[best].seq) < 0)) {
+            best = i;
+         }
+      }
+      if (best < 0) break;
+
+      // Total count and ids over the runs with an equal head.
+      int count = 0;
+      unsigned int nids = 0;
+      for (int i = best ; i < nruns ; i++) {
+         if (runs[i].seq == NULL || runs[i].len != runs[best].len ||
+               strcmp(runs[i].seq, runs[best].seq) != 0) continue;
+         count += runs[i].count;
+         nids += runs[i].nids;
+      }
+
+      useq_t *u = new_useq_len(count, runs[best].seq,
+            runs[best].len, NULL, 0);
+      if (u == NULL) {
+         alert();
+         krash();
+      }
+      u->nids = nids;
+      u->seqid = malloc(nids * sizeof(int));
+      if (u->seqid == NULL) {
+         alert();
+         krash();
+      }
+
+      // Collect the ids and advance the matching runs. The heads
+      // are compared to the copy in 'u' because advancing a run
+      // invalidates its previous record (the sequences of the runs
+      // are already capitalized, so the copy is identical).
+      int ulen = runs[best].len;
+      unsigned int k = 0;
+      for (int i = best ; i < nruns ; i++) {
+         if (runs[i].seq == NULL || runs[i].len != ulen ||
+               strcmp(runs[i].seq, u->seq) != 0) continue;
+         for (char *p = runs[i].ids ; *p != '\0' ; ) {
+            u->seqid[k++] = (int) strtol(p, &p, 10);
+            if (*p == ',') p++;
+         }
+         spill_run_next(runs + i);
+      }
+
+      push(u, &uSQ);
+   }
+
+   for (int i = 0 ; i < nruns ; i++) {
+      fclose(runs[i].file);
+      free(runs[i].line);
+   }
+   free(runs);
+   free(SPILL_RUNS);
+   SPILL_RUNS = NULL;
+
+   return uSQ;
+
+}
+
+
+void
+read_rawseq
+(
+   FILE       * inputf,
+   useqhash_t * uh
+)
+{
+
+   ssize_t nread;
+   size_t nchar = M;
+   char copy[MAXBRCDLEN];
+   char *line = malloc(M * sizeof(char));
+   if (line == NULL) {
+      alert();
+      krash();
+   }
+
+   char *seq = NULL;
+   int count = 0;
+   int lineno = 0;
+
+   while ((nread = getline(&line, &nchar, inputf)) != -1) {
+      lineno++;
+      if (line[nread-1] == '\n') line[nread-1] = '\0';
+      if (sscanf(line, "%s\t%d", copy, &count) != 2) {
+         count = 1;
+         seq = line;
+      }
+      else {
+         seq = copy;
+      }
+      size_t seqlen = strlen(seq);
+      if (seqlen > MAXBRCDLEN) {
+         fprintf(stderr, "max sequence length exceeded (%d)\n",
+               MAXBRCDLEN);
+         fprintf(stderr, "offending sequence:\n%s\n", seq);
+         abort();
+      }
+      for (size_t i = 0 ; i < seqlen ; i++) {
+         if (!valid_DNA_char[(int)seq[i]]) {
+            fprintf(stderr, "invalid input\n");
+            fprintf(stderr, "offending sequence:\n%s\n", seq);
+            abort();
+         }
+      }
+      useqhash_store(uh, seq, seqlen, NULL, 0, count);
+   }
+
+   free(line);
+   return;
+
+}
+
+
+void
+read_fasta
+(
+   FILE       * inputf,
+   useqhash_t * uh
+)
+{
+
+   ssize_t nread;
+   size_t nchar = M;
+   char *line = malloc(M * sizeof(char));
+   if (line == NULL) {
+      alert();
+      krash();
+   }
+
+   char *header = NULL;
+   int lineno = 0;
+
+   int const readh = OUTPUTT == NRED_OUTPUT;
+   while ((nread = getline(&line, &nchar, inputf)) != -1) {
+      lineno++;
+      // Strip newline character.
+      if (line[nread-1] == '\n') line[nread-1] = '\0';
+
+      if (lineno %2 == 0) {
+         size_t seqlen = strlen(line);
+         if (seqlen > MAXBRCDLEN) {
+            fprintf(stderr, "max sequence length exceeded (%d)\n",
+                  MAXBRCDLEN);
+            fprintf(stderr, "offending sequence:\n%s\n", line);
+            abort();
+         }
+         for (size_t i = 0 ; i < seqlen ; i++) {
+            if (!valid_DNA_char[(int)line[i]]) {
+               fprintf(stderr, "invalid input\n");
+               fprintf(stderr, "offending sequence:\n%s\n", line);
+               abort();
+            }
+         }
+         useqhash_store(uh, line, seqlen, header,
+               header == NULL ? 0 : strlen(header), 1);
+         free(header);
+         header = NULL;
+      }
+      else if (readh) {
+         header = strdup(line);
+         if (header == NULL) {
+            alert();
+            krash();
+         }
+      }
    }
 
-   // Separate data and buffer (b specifies which is buffer).
-   useq_t ** l = (sortargs->b ? arg1.buf0 : arg1.buf1);
-   useq_t ** r = (sortargs->b ? arg2.buf0 : arg2.buf1);
-   useq_t ** buf = (sortargs->b ? arg1.buf1 : arg1.buf0);
+   free(line);
+   return;
+
+}
 
-   int i = 0;
-   int j = 0;
-   int idx = 0;
-   int cmp = 0;
-   int repeats = 0;
-
-   // Merge sets
-   while (i+j < sortargs->size) {
-      // Only NULLs at the end of the buffers.
-      if (j == arg2.size || r[j] == NULL) {
-         // Right buffer is exhausted. Copy left buffer...
-         memcpy(buf+idx, l+i, (arg1.size-i) * sizeof(useq_t *));
-         break;
+
+void
+read_fastq
+(
+   FILE       * inputf,
+   useqhash_t * uh
+)
+{
+
+   ssize_t nread;
+   size_t nchar = M;
+   char *line = malloc(M * sizeof(char));
+   if (line == NULL) {
+      alert();
+      krash();
+   }
+
+   char seq[M+1] = {0};
+   char header[M+1] = {0};
+   char info[2*M+2] = {0};
+   int lineno = 0;
+
+   int const readh = OUTPUTT == NRED_OUTPUT;
+   while ((nread = getline(&line, &nchar, inputf)) != -1) {
+      lineno++;
+      // Strip newline character.
+      if (line[nread-1] == '\n') line[nread-1] = '\0';
+
+      if (readh && lineno % 4 == 1) {
+         strncpy(header, line, M);
       }
-      if (i == arg1.size || l[i] == NULL) {
-         // ... or vice versa.
-         memcpy(buf+idx, r+j, (arg2.size-j) * sizeof(useq_t *));
-         break;
+      else if (lineno % 4 == 2) {
+         size_t seqlen = strlen(line);
+         if (seqlen > MAXBRCDLEN) {
+            fprintf(stderr, "max sequence length exceeded (%d)\n",
+                  MAXBRCDLEN);
+            fprintf(stderr, "offending sequence:\n%s\n", line);
+            abort();
+         }
+         for (size_t i = 0 ; i < seqlen ; i++) {
+            if (!valid_DNA_char[(int)line[i]]) {
+               fprintf(stderr, "invalid input\n");
+               fprintf(stderr, "offending sequence:\n%s\n", line);
+               abort();
+            }
+         }
+         strncpy(seq, line, M);
       }
-      if (l[i] == NULL && r[j] == NULL) break;
-
-      // Do the comparison.
-      useq_t *ul = (useq_t *) l[i];
-      useq_t *ur = (useq_t *) r[j];
-      int sl = strlen(ul->seq);
-      int sr = strlen(ur->seq);
-      if (sl == sr) cmp = strcmp(ul->seq, ur->seq);
-      else cmp = sl < sr ? -1 : 1;
-
-      if (cmp == 0) {
-         // Identical sequences, this is the "nuke" part.
-         // Add sequence counts.
-         ul->count += ur->count;
-         transfer_useq_ids(ul, ur);
-         destroy_useq(ur);
-         buf[idx++] = l[i++];
-         j++;
-         repeats++;
-      } 
-      else if (cmp < 0) buf[idx++] = l[i++];
-      else              buf[idx++] = r[j++];
+      else if (lineno % 4 == 0) {
+         if (readh) {
+            int status = snprintf(info, 2*M+2, "%s\n%s", header, line);
+            if (status < 0 || status > 2*M - 1) {
+               alert();
+               krash();
+            }
+         }
+         useqhash_store(uh, seq, strlen(seq), info, strlen(info), 1);
+      }
+   }
+
+   free(line);
+   return;
+
+}
+
+
+void
+read_PE_fastq
+(
+   FILE       * inputf1,
+   FILE       * inputf2,
+   useqhash_t * uh
+)
+{
+
+   char c1 = fgetc(inputf1);
+   char c2 = fgetc(inputf2);
+   if (c1 != '@' || c2 != '@') {
+      fprintf(stderr, "input not a pair of fastq files\n");
+      abort();
+   }
+   if (ungetc(c1, inputf1) == EOF || ungetc(c2, inputf2) == EOF) {
+      alert();
+      krash();
+   }
+
+   ssize_t nread;
+   size_t nchar = M;
+   char *line1 = malloc(M * sizeof(char));
+   char *line2 = malloc(M * sizeof(char));
+   if (line1 == NULL && line2 == NULL) {
+      alert();
+      krash();
+   }
+
+   char seq1[M] = {0};
+   char seq2[M] = {0};
+   char seq[2*M+8] = {0};
+   char header1[M] = {0};
+   char header2[M] = {0};
+   char info[4*M] = {0};
+   int lineno = 0;
+
+   int const readh = OUTPUTT == NRED_OUTPUT;
+   char sep[STARCODE_MAX_TAU+2] = {0};
+   memset(sep, '-', STARCODE_MAX_TAU+1);
+
+   while ((nread = getline(&line1, &nchar, inputf1)) != -1) {
+      lineno++;
+      // Strip newline character.
+      if (line1[nread-1] == '\n') line1[nread-1] = '\0';
+
+      // Read line from second file and strip newline.
+      if ((nread = getline(&line2, &nchar, inputf2)) == -1) {
+         fprintf(stderr, "non conformable paired-end fastq files\n");
+         abort();
+      }
+      if (line2[nread-1] == '\n') line2[nread-1] = '\0';
+
+      if (readh && lineno % 4 == 1) {
+         // No check that the headers match each other. At the
+         // time of this writing, there are already different
+         // formats to link paired-end record. We assume that
+         // the users know what they do.
+         strncpy(header1, line1, M);
+         strncpy(header2, line2, M);
+      }
+      else if (lineno % 4 == 2) {
+         size_t seqlen1 = strlen(line1);
+         size_t seqlen2 = strlen(line2);
+         if (seqlen1 > MAXBRCDLEN || seqlen2 > MAXBRCDLEN) {
+            fprintf(stderr, "max sequence length exceeded (%d)\n",
+                  MAXBRCDLEN);
+            fprintf(stderr, "offending sequences:\n%s\n%s\n",
+                  line1, line2);
+            abort();
+         }
+         for (size_t i = 0 ; i < seqlen1 ; i++) {
+            if (!valid_DNA_char[(int)line1[i]]) {
+               fprintf(stderr, "invalid input\n");
+               fprintf(stderr, "offending sequence:\n%s\n", line1);
+               abort();
+            }
+         }
+         for (size_t i = 0 ; i < seqlen2 ; i++) {
+            if (!valid_DNA_char[(int)line2[i]]) {
+               fprintf(stderr, "invalid input\n");
+               fprintf(stderr, "offending sequence:\n%s\n", line2);
+               abort();
+            }
+         }
+         strncpy(seq1, line1, M);
+         strncpy(seq2, line2, M);
+      }
+      else if (lineno % 4 == 0) {
+         if (readh) {
+            int scheck = snprintf(info, 4*M, "%s\n%s\n%s\n%s",
+                  header1, line1, header2, line2);
+            if (scheck < 0 || scheck > 4*M-1) {
+               alert();
+               krash();
+            }
+         }
+         else {
+            // No need for the headers, the 'info' member is
+            // used to hold a string representation of the pair.
+            int scheck = snprintf(info, 2*M, "%s/%s", seq1, seq2);
+            if (scheck < 0 || scheck > 2*M-1) {
+               alert();
+               krash();
+            }
+         }
+         int scheck = snprintf(seq, 2*M+8, "%s%s%s", seq1, sep, seq2);
+         if (scheck < 0 || scheck > 2*M+7) {
+            alert();
+            krash();
+         }
+         useqhash_store(uh, seq, strlen(seq), info, strlen(info), 1);
+      }
+   }
+
+   free(line1);
+   free(line2);
+   return;
+
+}
+
+
+char *
+map_file
+(
+   FILE   * inputf,
+   size_t * size
+)
+// SYNOPSIS:
+//   Maps the input file to memory for the zero-copy readers below.
+//
+// RETURN:
+//   The address of the mapping and its size, or 'NULL' when the
+//   input is not a regular file (e.g. a pipe), in which case the
+//   caller falls back on the line-based readers.
+{
+   struct stat st;
+   int fd = fileno(inputf);
+   if (fd < 0 || fstat(fd, &st) < 0) return NULL;
+   if (!S_ISREG(st.st_mode) || st.st_size == 0) return NULL;
+   char *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   if (buf == MAP_FAILED) return NULL;
+   // The file is scanned once from start to end.
+   madvise(buf, st.st_size, MADV_SEQUENTIAL);
+   *size = st.st_size;
+   return buf;
+}
+
+
+char *
+inflate_gz
+(
+   const char  * src,
+         size_t  srclen,
+         size_t * dstlen
+)
+// SYNOPSIS:
+//   Decompresses an in-memory gzip image to a malloc'ed buffer.
+//   Concatenated gzip members (as produced by bgzf or by appending
+//   gzip files) are inflated back to back.
+//
+// RETURN:
+//   The decompressed buffer and its size in 'dstlen'.
+{
+
+   z_stream strm = {0};
+   if (inflateInit2(&strm, 15+32) != Z_OK) {
+      alert();
+      krash();
+   }
+
+   size_t cap = 4*srclen + 1024;
+   char *dst = malloc(cap);
+   if (dst == NULL) {
+      alert();
+      krash();
+   }
+
+   // The zlib counters are 32 bits: feed input and output
+   // in chunks of at most 1 GB.
+   const size_t maxchunk = 1UL << 30;
+   size_t in_pos = 0;
+   size_t out_pos = 0;
+
+   for (;;) {
+      if (strm.avail_in == 0 && in_pos < srclen) {
+         size_t n = srclen - in_pos;
+         if (n > maxchunk) n = maxchunk;
+         strm.next_in = (Bytef *) (src + in_pos);
+         strm.avail_in = n;
+         in_pos += n;
+      }
+      if (out_pos == cap) {
+         cap *= 2;
+         char *tmp = realloc(dst, cap);
+         if (tmp == NULL) {
+            alert();
+            krash();
+         }
+         dst = tmp;
+      }
+      size_t avail = cap - out_pos;
+      if (avail > maxchunk) avail = maxchunk;
+      strm.next_out = (Bytef *) (dst + out_pos);
+      strm.avail_out = avail;
+      int status = inflate(&strm, Z_NO_FLUSH);
+      out_pos += avail - strm.avail_out;
+      if (status == Z_STREAM_END) {
+         if (strm.avail_in == 0 && in_pos >= srclen) break;
+         // Next gzip member.
+         if (inflateReset(&strm) != Z_OK) {
+            fprintf(stderr, "corrupted gzip input\n");
+            abort();
+         }
+      }
+      else if (status != Z_OK) {
+         fprintf(stderr, "corrupted gzip input\n");
+         abort();
+      }
+      else if (strm.avail_in == 0 && in_pos >= srclen) {
+         fprintf(stderr, "truncated gzip input\n");
+         abort();
+      }
+   }
+
+   inflateEnd(&strm);
+   *dstlen = out_pos;
+   return dst;
+
+}
+
+
+char *
+get_input_buffer
+(
+   FILE   * inputf,
+   size_t * size,
+   int    * mapped
+)
+// SYNOPSIS:
+//   Returns the whole input as a single buffer for the in-place
+//   parallel parser: the memory mapping itself for plain regular
+//   files ('mapped' set to 1), or a malloc'ed buffer with the
+//   inflated content for gzip input, whether seekable or not
+//   ('mapped' set to 0).
+//
+// RETURN:
+//   The buffer and its size, or 'NULL' when the input is an
+//   uncompressed stream (e.g. a pipe), in which case the caller
+//   falls back on the line-based readers.
+{
+
+   *mapped = 0;
+
+   char *buf = map_file(inputf, size);
+   if (buf != NULL) {
+      if (*size >= 2 && buf[0] == '\x1f' && buf[1] == '\x8b') {
+         size_t rawsize = *size;
+         char *out = inflate_gz(buf, rawsize, size);
+         munmap(buf, rawsize);
+         return out;
+      }
+      *mapped = 1;
+      return buf;
+   }
+
+   // Not a regular file. Peek one character for the gzip magic
+   // number (0x1f never occurs in text input).
+   int c = fgetc(inputf);
+   if (c != 0x1f) {
+      if (c != EOF && ungetc(c, inputf) == EOF) {
+         alert();
+         krash();
+      }
+      return NULL;
+   }
 
+   // Gzip stream: slurp it to memory, then decompress.
+   size_t cap = 1UL << 20;
+   size_t len = 1;
+   char *raw = malloc(cap);
+   if (raw == NULL) {
+      alert();
+      krash();
+   }
+   raw[0] = (char) c;
+   size_t nread;
+   while ((nread = fread(raw + len, 1, cap - len, inputf)) > 0) {
+      len += nread;
+      if (len == cap) {
+         cap *= 2;
+         char *tmp = realloc(raw, cap);
+         if (tmp == NULL) {
+            alert();
+            krash();
+         }
+         raw = tmp;
+      }
+   }
+   if (len < 2 || raw[1] != '\x8b') {
+      fprintf(stderr, "corrupted gzip input\n");
+      abort();
    }
 
-   // Accumulate repeats
-   sortargs->repeats = repeats + arg1.repeats + arg2.repeats;
-
-   // Pad with NULLS.
-   int offset = sortargs->size - sortargs->repeats;
-   memset(buf+offset, 0, sortargs->repeats*sizeof(useq_t *));
-   
-   return NULL;
+   char *out = inflate_gz(raw, len, size);
+   free(raw);
+   return out;
 
 }
 
 
-gstack_t *
-read_rawseq
+int
+next_map_line
 (
-   FILE     * inputf,
-   gstack_t * uSQ
+   const char  *  buf,
+         size_t   size,
+         size_t * pos,
+   const char  ** line,
+         size_t * len
 )
+// SYNOPSIS:
+//   Yields the next line of a mapped file as a pointer in the
+//   mapping plus a length, without the newline character. A missing
+//   newline on the last line is tolerated, like with 'getline()'.
+//
+// RETURN:
+//   1 if a line was produced, 0 at the end of the file.
 {
-
-   ssize_t nread;
-   size_t nchar = M;
-   char copy[MAXBRCDLEN];
-   char *line = malloc(M * sizeof(char));
-   if (line == NULL) {
-      alert();
-      krash();
+   if (*pos >= size) return 0;
+   const char *start = buf + *pos;
+   const char *nl = memchr(start, '\n', size - *pos);
+   if (nl == NULL) {
+      *len = size - *pos;
+      *pos = size;
+   }
+   else {
+      *len = nl - start;
+      *pos = (nl - buf) + 1;
    }
+   *line = start;
+   return 1;
+}
 
-   char *seq = NULL;
-   int count = 0;
-   int lineno = 0;
 
-   while ((nread = getline(&line, &nchar, inputf)) != -1) {
-      lineno++;
-      if (line[nread-1] == '\n') line[nread-1] = '\0';
-      if (sscanf(line, "%s\t%d", copy, &count) != 2) {
-         count = 1;
-         seq = line;
+void
+read_rawseq_map
+(
+   const char       * buf,
+         size_t       size,
+         useqhash_t * uh
+)
+// SYNOPSIS:
+//   Version of 'read_rawseq()' that parses the records in place from
+//   the mapped file, without 'getline()' buffer or extra copy.
+{
+
+   const char *line;
+   size_t len;
+   size_t pos = 0;
+
+   while (next_map_line(buf, size, &pos, &line, &len)) {
+      // Reproduce the parsing of sscanf(line, "%s\t%d", ...): the
+      // first token of the line, followed by an optional count.
+      const char *seq = line;
+      size_t seqlen = len;
+      int count = 1;
+      size_t b = 0;
+      while (b < len && isspace((unsigned char) line[b])) b++;
+      size_t e = b;
+      while (e < len && !isspace((unsigned char) line[e])) e++;
+      size_t p = e;
+      while (p < len && isspace((unsigned char) line[p])) p++;
+      long sign = 1;
+      if (p < len && (line[p] == '+' || line[p] == '-')) {
+         if (line[p] == '-') sign = -1;
+         p++;
       }
-      else {
-         seq = copy;
+      if (e > b && p < len && isdigit((unsigned char) line[p])) {
+         long value = 0;
+         while (p < len && isdigit((unsigned char) line[p])) {
+            value = 10*value + (line[p] - '0');
+            if (value > INT_MAX) value = INT_MAX;
+            p++;
+         }
+         count = (int) (sign * value);
+         seq = line + b;
+         seqlen = e - b;
       }
-      size_t seqlen = strlen(seq);
       if (seqlen > MAXBRCDLEN) {
          fprintf(stderr, "max sequence length exceeded (%d)\n",
                MAXBRCDLEN);
-         fprintf(stderr, "offending sequence:\n%s\n", seq);
+         fprintf(stderr, "offending sequence:\n%.*s\n",
+               (int) seqlen, seq);
          abort();
       }
       for (size_t i = 0 ; i < seqlen ; i++) {
          if (!valid_DNA_char[(int)seq[i]]) {
             fprintf(stderr, "invalid input\n");
-            fprintf(stderr, "offending sequence:\n%s\n", seq);
+            fprintf(stderr, "offending sequence:\n%.*s\n",
+                  (int) seqlen, seq);
             abort();
          }
       }
-      useq_t *new = new_useq(count, seq, NULL);
-      if (new == NULL) {
-	 alert();
-	 krash();
-      }
-      new->nids = 1;
-      new->seqid = malloc(sizeof(int));
-      if (new->seqid == NULL) {
-	 alert();
-	 krash();
-      }
-      new->seqid[0] = uSQ->nitems+1;
-      push(new, &uSQ);
+      useqhash_store(uh, seq, seqlen, NULL, 0, count);
    }
 
-   free(line);
-   return uSQ;
+   return;
 
 }
 
 
-gstack_t *
-read_fasta
+void
+read_fasta_map
 (
-   FILE     * inputf,
-   gstack_t * uSQ
+   const char       * buf,
+         size_t       size,
+         useqhash_t * uh
 )
+// SYNOPSIS:
+//   Version of 'read_fasta()' that parses the records in place from
+//   the mapped file. Headers and sequences are copied once, straight
+//   out of the mapping.
 {
 
-   ssize_t nread;
-   size_t nchar = M;
-   char *line = malloc(M * sizeof(char));
-   if (line == NULL) {
-      alert();
-      krash();
-   }
+   const char *line;
+   size_t len;
+   size_t pos = 0;
 
-   char *header = NULL;
+   const char *header = NULL;
+   size_t hlen = 0;
    int lineno = 0;
 
    int const readh = OUTPUTT == NRED_OUTPUT;
-   while ((nread = getline(&line, &nchar, inputf)) != -1) {
+   while (next_map_line(buf, size, &pos, &line, &len)) {
       lineno++;
-      // Strip newline character.
-      if (line[nread-1] == '\n') line[nread-1] = '\0';
 
-      if (lineno %2 == 0) {
-         size_t seqlen = strlen(line);
-         if (seqlen > MAXBRCDLEN) {
+      if (lineno % 2 == 0) {
+         if (len > MAXBRCDLEN) {
             fprintf(stderr, "max sequence length exceeded (%d)\n",
                   MAXBRCDLEN);
-            fprintf(stderr, "offending sequence:\n%s\n", line);
+            fprintf(stderr, "offending sequence:\n%.*s\n",
+                  (int) len, line);
             abort();
          }
-         for (size_t i = 0 ; i < seqlen ; i++) {
+         for (size_t i = 0 ; i < len ; i++) {
             if (!valid_DNA_char[(int)line[i]]) {
                fprintf(stderr, "invalid input\n");
-               fprintf(stderr, "offending sequence:\n%s\n", line);
+               fprintf(stderr, "offending sequence:\n%.*s\n",
+                     (int) len, line);
                abort();
             }
          }
-         useq_t *new = new_useq(1, line, header);
-	 if (new == NULL) {
-            alert();
-            krash();
-         }
-         new->nids = 1;
-	 new->seqid = malloc(sizeof(int));
-	 if (new->seqid == NULL) {
-	    alert();
-	    krash();
-	 }
-	 new->seqid[0] = uSQ->nitems+1;
-         push(new, &uSQ);
+         useqhash_store(uh, line, len, header, hlen, 1);
       }
       else if (readh) {
-         header = strdup(line);
-         if (header == NULL) {
-            alert();
-            krash();
-         }
+         header = line;
+         hlen = len;
       }
    }
 
-   free(line);
-   return uSQ;
+   return;
 
 }
 
 
-gstack_t *
-read_fastq
+void
+read_fastq_map
 (
-   FILE     * inputf,
-   gstack_t * uSQ
+   const char       * buf,
+         size_t       size,
+         useqhash_t * uh
 )
+// SYNOPSIS:
+//   Version of 'read_fastq()' that parses the records in place from
+//   the mapped file.
 {
 
-   ssize_t nread;
-   size_t nchar = M;
-   char *line = malloc(M * sizeof(char));
-   if (line == NULL) {
-      alert();
-      krash();
-   }
+   const char *line;
+   size_t len;
+   size_t pos = 0;
 
-   char seq[M+1] = {0};
-   char header[M+1] = {0};
+   const char *header = "";
+   size_t hlen = 0;
+   const char *seq = "";
+   size_t seqlen = 0;
    char info[2*M+2] = {0};
+   size_t ilen = 0;
    int lineno = 0;
 
    int const readh = OUTPUTT == NRED_OUTPUT;
-   while ((nread = getline(&line, &nchar, inputf)) != -1) {
+   while (next_map_line(buf, size, &pos, &line, &len)) {
       lineno++;
-      // Strip newline character.
-      if (line[nread-1] == '\n') line[nread-1] = '\0';
 
       if (readh && lineno % 4 == 1) {
-         strncpy(header, line, M);
+         header = line;
+         // Same truncation as the line-based reader.
+         hlen = len > M ? M : len;
       }
       else if (lineno % 4 == 2) {
-         size_t seqlen = strlen(line);
-         if (seqlen > MAXBRCDLEN) {
+         if (len > MAXBRCDLEN) {
             fprintf(stderr, "max sequence length exceeded (%d)\n",
                   MAXBRCDLEN);
-            fprintf(stderr, "offending sequence:\n%s\n", line);
+            fprintf(stderr, "offending sequence:\n%.*s\n",
+                  (int) len, line);
             abort();
          }
-         for (size_t i = 0 ; i < seqlen ; i++) {
+         for (size_t i = 0 ; i < len ; i++) {
             if (!valid_DNA_char[(int)line[i]]) {
                fprintf(stderr, "invalid input\n");
-               fprintf(stderr, "offending sequence:\n%s\n", line);
+               fprintf(stderr, "offending sequence:\n%.*s\n",
+                     (int) len, line);
                abort();
             }
          }
-         strncpy(seq, line, M);
+         seq = line;
+         seqlen = len;
       }
       else if (lineno % 4 == 0) {
          if (readh) {
-            int status = snprintf(info, 2*M+2, "%s\n%s", header, line);
-            if (status < 0 || status > 2*M - 1) {
+            // Same bound as the snprintf() of the line-based reader.
+            if (hlen + 1 + len > 2*M - 1) {
                alert();
                krash();
             }
+            memcpy(info, header, hlen);
+            info[hlen] = '\n';
+            memcpy(info + hlen + 1, line, len);
+            ilen = hlen + 1 + len;
          }
-         useq_t *new = new_useq(1, seq, info);
-	 if (new == NULL) {
-            alert();
-            krash();
-         }
-         new->nids = 1;
-	 new->seqid = malloc(sizeof(int));
-	 if (new->seqid == NULL) {
-	    alert();
-	    krash();
-	 }
-	 new->seqid[0] = uSQ->nitems+1;
-         push(new, &uSQ);
+         useqhash_store(uh, seq, seqlen, info, ilen, 1);
       }
    }
 
-   free(line);
-   return uSQ;
+   return;
 
 }
 
 
-gstack_t *
-read_PE_fastq
+void
+read_PE_fastq_map
 (
-   FILE     * inputf1,
-   FILE     * inputf2,
-   gstack_t * uSQ
+   const char       * buf1,
+         size_t       size1,
+   const char       * buf2,
+         size_t       size2,
+         useqhash_t * uh
 )
+// SYNOPSIS:
+//   Version of 'read_PE_fastq()' that parses the records of the two
+//   mapped files in lockstep, in place.
 {
 
-   char c1 = fgetc(inputf1);
-   char c2 = fgetc(inputf2);
-   if (c1 != '@' || c2 != '@') {
-      fprintf(stderr, "input not a pair of fastq files\n");
-      abort();
-   }
-   if (ungetc(c1, inputf1) == EOF || ungetc(c2, inputf2) == EOF) {
-      alert();
-      krash();
-   }
-
-   ssize_t nread;
-   size_t nchar = M;
-   char *line1 = malloc(M * sizeof(char));
-   char *line2 = malloc(M * sizeof(char));
-   if (line1 == NULL && line2 == NULL) {
-      alert();
-      krash();
-   }
-
-   char seq1[M] = {0};
-   char seq2[M] = {0};
+   const char *line1;
+   const char *line2;
+   size_t len1;
+   size_t len2;
+   size_t pos1 = 0;
+   size_t pos2 = 0;
+
+   const char *header1 = "";
+   const char *header2 = "";
+   size_t hlen1 = 0;
+   size_t hlen2 = 0;
+   const char *seq1 = "";
+   const char *seq2 = "";
+   size_t slen1 = 0;
+   size_t slen2 = 0;
    char seq[2*M+8] = {0};
-   char header1[M] = {0};
-   char header2[M] = {0};
    char info[4*M] = {0};
    int lineno = 0;
 
@@ -1643,94 +5840,325 @@ read_PE_fastq
    char sep[STARCODE_MAX_TAU+2] = {0};
    memset(sep, '-', STARCODE_MAX_TAU+1);
 
-   while ((nread = getline(&line1, &nchar, inputf1)) != -1) {
+   while (next_map_line(buf1, size1, &pos1, &line1, &len1)) {
       lineno++;
-      // Strip newline character.
-      if (line1[nread-1] == '\n') line1[nread-1] = '\0';
-
-      // Read line from second file and strip newline.
-      if ((nread = getline(&line2, &nchar, inputf2)) == -1) {
+      if (!next_map_line(buf2, size2, &pos2, &line2, &len2)) {
          fprintf(stderr, "non conformable paired-end fastq files\n");
          abort();
       }
-      if (line2[nread-1] == '\n') line2[nread-1] = '\0';
 
-      if (readh && lineno % 4 == 1) {
-         // No check that the headers match each other. At the
-         // time of this writing, there are already different
-         // formats to link paired-end record. We assume that
-         // the users know what they do.
-         strncpy(header1, line1, M);
-         strncpy(header2, line2, M);
+      if (readh && lineno % 4 == 1) {
+         // No check that the headers match each other (see the
+         // comment in 'read_PE_fastq()'). Same truncation as the
+         // line-based reader.
+         header1 = line1;
+         hlen1 = len1 > M ? M : len1;
+         header2 = line2;
+         hlen2 = len2 > M ? M : len2;
+      }
+      else if (lineno % 4 == 2) {
+         if (len1 > MAXBRCDLEN || len2 > MAXBRCDLEN) {
+            fprintf(stderr, "max sequence length exceeded (%d)\n",
+                  MAXBRCDLEN);
+            fprintf(stderr, "offending sequences:\n%.*s\n%.*s\n",
+                  (int) len1, line1, (int) len2, line2);
+            abort();
+         }
+         for (size_t i = 0 ; i < len1 ; i++) {
+            if (!valid_DNA_char[(int)line1[i]]) {
+               fprintf(stderr, "invalid input\n");
+               fprintf(stderr, "offending sequence:\n%.*s\n",
+                     (int) len1, line1);
+               abort();
+            }
+         }
+         for (size_t i = 0 ; i < len2 ; i++) {
+            if (!valid_DNA_char[(int)line2[i]]) {
+               fprintf(stderr, "invalid input\n");
+               fprintf(stderr, "offending sequence:\n%.*s\n",
+                     (int) len2, line2);
+               abort();
+            }
+         }
+         seq1 = line1;
+         slen1 = len1;
+         seq2 = line2;
+         slen2 = len2;
+      }
+      else if (lineno % 4 == 0) {
+         size_t ilen;
+         if (readh) {
+            // Same bound as the snprintf() of the line-based reader.
+            if (hlen1 + 1 + len1 + 1 + hlen2 + 1 + len2 > 4*M - 1) {
+               alert();
+               krash();
+            }
+            char *dst = info;
+            memcpy(dst, header1, hlen1);   dst += hlen1;
+            *dst++ = '\n';
+            memcpy(dst, line1, len1);      dst += len1;
+            *dst++ = '\n';
+            memcpy(dst, header2, hlen2);   dst += hlen2;
+            *dst++ = '\n';
+            memcpy(dst, line2, len2);      dst += len2;
+            ilen = dst - info;
+         }
+         else {
+            // No need for the headers, the 'info' member is
+            // used to hold a string representation of the pair.
+            if (slen1 + 1 + slen2 > 2*M - 1) {
+               alert();
+               krash();
+            }
+            memcpy(info, seq1, slen1);
+            info[slen1] = '/';
+            memcpy(info + slen1 + 1, seq2, slen2);
+            ilen = slen1 + 1 + slen2;
+         }
+         memcpy(seq, seq1, slen1);
+         memcpy(seq + slen1, sep, STARCODE_MAX_TAU+1);
+         memcpy(seq + slen1 + STARCODE_MAX_TAU+1, seq2, slen2);
+         size_t seqlen = slen1 + STARCODE_MAX_TAU+1 + slen2;
+         useqhash_store(uh, seq, seqlen, info, ilen, 1);
+      }
+   }
+
+   return;
+
+}
+
+
+size_t
+next_line_start
+(
+   const char  * buf,
+         size_t  size,
+         size_t  pos
+)
+// SYNOPSIS:
+//   Returns the offset of the first character after the next newline
+//   character, or 'size' if there is none.
+{
+   if (pos >= size) return size;
+   const char *nl = memchr(buf + pos, '\n', size - pos);
+   return nl == NULL ? size : (size_t) (nl - buf) + 1;
+}
+
+
+size_t
+next_record_start
+(
+   const char  * buf,
+         size_t  size,
+         size_t  pos
+)
+// SYNOPSIS:
+//   Advances past the (possibly partial) line at 'pos' to the start
+//   of the next record of the format at hand. Used to align the
+//   chunk boundaries of the parallel parser so that every chunk
+//   starts in phase with its record structure.
+//
+// RETURN:
+//   The offset of the next record start, or 'size'.
+{
+   pos = next_line_start(buf, size, pos);
+   if (FORMAT == RAW) {
+      // One record per line.
+      return pos;
+   }
+   if (FORMAT == FASTA) {
+      // Records start on a header line.
+      while (pos < size && buf[pos] != '>') {
+         pos = next_line_start(buf, size, pos);
+      }
+      return pos;
+   }
+   // FASTQ (single or paired-end): records start on a line with '@'
+   // followed by the '+' separator two lines down. A quality line
+   // may also start with '@', but then the check fails and the next
+   // candidate is the true header.
+   while (pos < size) {
+      if (buf[pos] == '@') {
+         size_t plus = next_line_start(buf, size,
+               next_line_start(buf, size, pos));
+         if (plus < size && buf[plus] == '+') return pos;
+      }
+      pos = next_line_start(buf, size, pos);
+   }
+   return size;
+}
+
+
+void *
+read_chunk_mt
+(
+   void * arg
+)
+// Thread dispatcher of 'read_map_mt()': parses one chunk with the
+// single-threaded in-place reader of the format at hand.
+{
+   readchunk_t *chunk = (readchunk_t *) arg;
+   if (FORMAT == RAW) {
+      read_rawseq_map(chunk->buf1, chunk->size1, chunk->uh);
+   }
+   else if (FORMAT == FASTA) {
+      read_fasta_map(chunk->buf1, chunk->size1, chunk->uh);
+   }
+   else if (FORMAT == FASTQ) {
+      read_fastq_map(chunk->buf1, chunk->size1, chunk->uh);
+   }
+   else if (FORMAT == PE_FASTQ) {
+      read_PE_fastq_map(chunk->buf1, chunk->size1,
+            chunk->buf2, chunk->size2, chunk->uh);
+   }
+   return NULL;
+}
+
+
+gstack_t *
+read_map_mt
+(
+   const char     * buf1,
+         size_t     size1,
+   const char     * buf2,
+         size_t     size2,
+         gstack_t * uSQ,
+         int        thrmax
+)
+// SYNOPSIS:
+//   Parses a mapped file (or a pair of mapped files for paired-end
+//   input) with several threads. The mapping is split into chunks
+//   aligned on record boundaries, each chunk is parsed by the
+//   in-place readers into a private hash table that merges the
+//   duplicates of the chunk on the fly, and the unique sequences
+//   are concatenated in file order. Duplicates spanning several
+//   chunks are merged later by 'seqsort()', so the result is
+//   identical to a sequential parse.
+//
+// RETURN:
+//   The stack 'uSQ' with the parsed sequences.
+{
+
+   // Do not spawn threads for less than 64 kB of input each.
+   int nchunks = thrmax > 1 ? thrmax : 1;
+   if (size1 / nchunks < 65536) {
+      nchunks = (int) (size1 / 65536) + 1;
+   }
+
+   // The spill of '--max-mem' writes to a shared stack of run
+   // files and numbers the ids globally: parse sequentially.
+   if (MAX_MEM > 0) nchunks = 1;
+
+   if (nchunks == 1) {
+      readchunk_t whole = {
+         .buf1 = buf1, .size1 = size1,
+         .buf2 = buf2, .size2 = size2,
+         .uh = new_useqhash(),
+      };
+      if (whole.uh == NULL) {
+         alert();
+         krash();
+      }
+      read_chunk_mt(&whole);
+      gstack_t *part = destroy_useqhash(whole.uh);
+      for (int i = 0 ; i < part->nitems ; i++) {
+         push(part->items[i], &uSQ);
+      }
+      free(part);
+      return uSQ;
+   }
+
+   size_t *b1 = malloc((nchunks+1) * sizeof(size_t));
+   size_t *b2 = malloc((nchunks+1) * sizeof(size_t));
+   readchunk_t *chunks = malloc(nchunks * sizeof(readchunk_t));
+   pthread_t *tid = malloc(nchunks * sizeof(pthread_t));
+   if (b1 == NULL || b2 == NULL || chunks == NULL || tid == NULL) {
+      alert();
+      krash();
+   }
+
+   b1[0] = 0;
+   b1[nchunks] = size1;
+   b2[0] = 0;
+   b2[nchunks] = size2;
+
+   if (FORMAT == PE_FASTQ) {
+      // The boundaries of the two files must point to the same
+      // record. Walk the first file line by line to the target
+      // offsets, rounded up to whole records (4 lines), then
+      // advance the second file by the same number of lines.
+      size_t off1 = 0;
+      size_t off2 = 0;
+      long lines1 = 0;
+      long lines2 = 0;
+      for (int t = 1 ; t < nchunks ; t++) {
+         size_t target = size1 / nchunks * t;
+         while (off1 < size1 && (off1 < target || lines1 % 4 != 0)) {
+            off1 = next_line_start(buf1, size1, off1);
+            lines1++;
+         }
+         b1[t] = off1;
+         while (lines2 < lines1 && off2 < size2) {
+            off2 = next_line_start(buf2, size2, off2);
+            lines2++;
+         }
+         b2[t] = off2;
+      }
+   }
+   else {
+      for (int t = 1 ; t < nchunks ; t++) {
+         size_t target = size1 / nchunks * t;
+         if (target < b1[t-1]) target = b1[t-1];
+         b1[t] = next_record_start(buf1, size1, target);
+         b2[t] = 0;
+      }
+   }
+
+   for (int t = 0 ; t < nchunks ; t++) {
+      chunks[t] = (readchunk_t) {
+         .buf1 = buf1 + b1[t], .size1 = b1[t+1] - b1[t],
+         .buf2 = buf2 == NULL ? NULL : buf2 + b2[t],
+         .size2 = b2[t+1] - b2[t],
+         .uh = new_useqhash(),
+      };
+      if (chunks[t].uh == NULL) {
+         alert();
+         krash();
       }
-      else if (lineno % 4 == 2) {
-         size_t seqlen1 = strlen(line1);
-         size_t seqlen2 = strlen(line2);
-         if (seqlen1 > MAXBRCDLEN || seqlen2 > MAXBRCDLEN) {
-            fprintf(stderr, "max sequence length exceeded (%d)\n",
-                  MAXBRCDLEN);
-            fprintf(stderr, "offending sequences:\n%s\n%s\n",
-                  line1, line2);
-            abort();
-         }
-         for (size_t i = 0 ; i < seqlen1 ; i++) {
-            if (!valid_DNA_char[(int)line1[i]]) {
-               fprintf(stderr, "invalid input\n");
-               fprintf(stderr, "offending sequence:\n%s\n", line1);
-               abort();
-            }
-         }
-         for (size_t i = 0 ; i < seqlen2 ; i++) {
-            if (!valid_DNA_char[(int)line2[i]]) {
-               fprintf(stderr, "invalid input\n");
-               fprintf(stderr, "offending sequence:\n%s\n", line2);
-               abort();
-            }
-         }
-         strncpy(seq1, line1, M);
-         strncpy(seq2, line2, M);
+      if (pthread_create(tid + t, NULL, read_chunk_mt, chunks + t)) {
+         alert();
+         krash();
       }
-      else if (lineno % 4 == 0) {
-         if (readh) {
-            int scheck = snprintf(info, 4*M, "%s\n%s\n%s\n%s",
-                  header1, line1, header2, line2);
-            if (scheck < 0 || scheck > 4*M-1) {
-               alert();
-               krash();
-            }
-         }
-         else {
-            // No need for the headers, the 'info' member is
-            // used to hold a string representation of the pair.
-            int scheck = snprintf(info, 2*M, "%s/%s", seq1, seq2);
-            if (scheck < 0 || scheck > 2*M-1) {
-               alert();
-               krash();
-            }
-         }
-         int scheck = snprintf(seq, 2*M+8, "%s%s%s", seq1, sep, seq2);
-         if (scheck < 0 || scheck > 2*M+7) {
-            alert();
-            krash();
-         }
-         useq_t *new = new_useq(1, seq, info);
-	 if (new == NULL) {
-            alert();
-            krash();
+   }
+
+   for (int t = 0 ; t < nchunks ; t++) {
+      pthread_join(tid[t], NULL);
+   }
+
+   // Concatenate the chunks in file order and renumber the
+   // sequence ids, which every chunk assigned from 1 in record
+   // order (the offset counts the records of the chunk, not its
+   // unique sequences).
+   int offset = 0;
+   for (int t = 0 ; t < nchunks ; t++) {
+      int nreads = chunks[t].uh->nreads;
+      gstack_t *part = destroy_useqhash(chunks[t].uh);
+      for (int i = 0 ; i < part->nitems ; i++) {
+         useq_t *u = (useq_t *) part->items[i];
+         for (unsigned int k = 0 ; k < u->nids ; k++) {
+            u->seqid[k] += offset;
          }
-         new->nids = 1;
-	 new->seqid = malloc(sizeof(int));
-	 if (new->seqid == NULL) {
-	    alert();
-	    krash();
-	 }
-	 new->seqid[0] = uSQ->nitems+1;
-         push(new, &uSQ);
+         push(u, &uSQ);
       }
+      offset += nreads;
+      free(part);
    }
 
-   free(line1);
-   free(line2);
+   free(b1);
+   free(b2);
+   free(chunks);
+   free(tid);
+
    return uSQ;
 
 }
@@ -1741,19 +6169,44 @@ read_file
 (
    FILE      * inputf1,
    FILE      * inputf2,
-   const int   verbose
+   const int   verbose,
+   const int   thrmax
 )
 {
 
-   if (inputf2 != NULL) FORMAT = PE_FASTQ;
-   else {
-      // Read first line of the file to guess format.
+   // Parse regular files and gzip input in place through a single
+   // buffer (the memory mapping itself, or the inflated content),
+   // with several threads when 'thrmax' allows. Uncompressed
+   // streams (pipes, fifos...) use the line-based readers.
+   if (inputf2 == NULL) {
+      size_t insize = 0;
+      int inmapped = 0;
+      char *inbuf = get_input_buffer(inputf1, &insize, &inmapped);
+
+      // Read first character of the input to guess format.
       // Store in global variable FORMAT.
-      char c = fgetc(inputf1);
-      switch(c) {
-         case EOF:
+      char c;
+      if (inbuf != NULL) {
+         if (insize == 0) {
+            // Empty file (after decompression).
+            free(inbuf);
+            return NULL;
+         }
+         c = inbuf[0];
+      }
+      else {
+         int peek = fgetc(inputf1);
+         if (peek == EOF) {
             // Empty file.
             return NULL;
+         }
+         if (ungetc(peek, inputf1) == EOF) {
+            alert();
+            krash();
+         }
+         c = peek;
+      }
+      switch(c) {
          case '>':
             FORMAT = FASTA;
             if (verbose) fprintf(stderr, "FASTA format detected\n");
@@ -1767,34 +6220,100 @@ read_file
             if (verbose) fprintf(stderr, "raw format detected\n");
       }
 
-      if (ungetc(c, inputf1) == EOF) {
+      gstack_t *uSQ = new_gstack();
+      if (uSQ == NULL) {
+         alert();
+         krash();
+      }
+
+      if (inbuf != NULL) {
+         uSQ = read_map_mt(inbuf, insize, NULL, 0, uSQ, thrmax);
+         if (inmapped) munmap(inbuf, insize);
+         else          free(inbuf);
+         return merge_spill_runs(uSQ);
+      }
+
+      // Line-based parsing through a per-file hash table that
+      // merges the duplicates on the fly.
+      useqhash_t *uh = new_useqhash();
+      if (uh == NULL) {
          alert();
          krash();
       }
+      if (FORMAT == RAW)        read_rawseq(inputf1, uh);
+      else if (FORMAT == FASTA) read_fasta(inputf1, uh);
+      else if (FORMAT == FASTQ) read_fastq(inputf1, uh);
+      gstack_t *part = destroy_useqhash(uh);
+      for (int i = 0 ; i < part->nitems ; i++) {
+         push(part->items[i], &uSQ);
+      }
+      free(part);
+      return merge_spill_runs(uSQ);
    }
 
+   // Paired-end input.
+   FORMAT = PE_FASTQ;
+
    gstack_t *uSQ = new_gstack();
    if (uSQ == NULL) {
       alert();
       krash();
    }
 
-   if (FORMAT == RAW)      return read_rawseq(inputf1, uSQ);
-   if (FORMAT == FASTA)    return read_fasta(inputf1, uSQ);
-   if (FORMAT == FASTQ)    return read_fastq(inputf1, uSQ);
-   if (FORMAT == PE_FASTQ) return read_PE_fastq(inputf1, inputf2, uSQ);
+   size_t insize1 = 0;
+   size_t insize2 = 0;
+   int inmapped1 = 0;
+   int inmapped2 = 0;
+   char *inbuf1 = get_input_buffer(inputf1, &insize1, &inmapped1);
+   char *inbuf2 = get_input_buffer(inputf2, &insize2, &inmapped2);
+   if (inbuf1 != NULL && inbuf2 != NULL) {
+      if (insize1 == 0 || insize2 == 0 ||
+            inbuf1[0] != '@' || inbuf2[0] != '@') {
+         fprintf(stderr, "input not a pair of fastq files\n");
+         abort();
+      }
+      uSQ = read_map_mt(inbuf1, insize1, inbuf2, insize2,
+            uSQ, thrmax);
+      if (inmapped1) munmap(inbuf1, insize1);
+      else           free(inbuf1);
+      if (inmapped2) munmap(inbuf2, insize2);
+      else           free(inbuf2);
+      return uSQ;
+   }
+   if (inbuf1 != NULL) {
+      if (inmapped1) munmap(inbuf1, insize1);
+      else           free(inbuf1);
+   }
+   if (inbuf2 != NULL) {
+      if (inmapped2) munmap(inbuf2, insize2);
+      else           free(inbuf2);
+   }
 
-   return NULL;
+   useqhash_t *uh = new_useqhash();
+   if (uh == NULL) {
+      alert();
+      krash();
+   }
+   read_PE_fastq(inputf1, inputf2, uh);
+   gstack_t *part = destroy_useqhash(uh);
+   for (int i = 0 ; i < part->nitems ; i++) {
+      push(part->items[i], &uSQ);
+   }
+   free(part);
+   return uSQ;
 
 }
 
 
 int
-pad_useq
+len_median
 (
    gstack_t * useqS,
    int      * median
 )
+// Returns the maximum sequence length and sets 'median' to the
+// median length. Factored out of 'pad_useq()' for the pipelines
+// that do not pad (see 'plan_mt()').
 {
 
    // Compute maximum length.
@@ -1807,8 +6326,57 @@ pad_useq
 
    // Alloc median bins. (Initializes to 0)
    int  * count = calloc((maxlen + 1), sizeof(int));
+   if (count == NULL) {
+      alert();
+      krash();
+   }
+   for (int i = 0 ; i < useqS->nitems ; i++) {
+      useq_t *u = useqS->items[i];
+      count[strlen(u->seq)]++;
+   }
+
+   // Compute median.
+   *median = 0;
+   int ccount = 0;
+   do {
+      ccount += count[++(*median)];
+   } while (ccount < useqS->nitems / 2);
+
+   free(count);
+   return maxlen;
+
+}
+
+
+int
+pad_useq
+(
+   gstack_t * useqS,
+   int      * median
+)
+{
+
+   int maxlen = len_median(useqS, median);
+   pad_useq_len(useqS, maxlen);
+   return maxlen;
+
+}
+
+
+void
+pad_useq_len
+(
+   gstack_t * useqS,
+   int        maxlen
+)
+// Pads the sequences with leading spaces to length 'maxlen' and
+// packs them (see 'pack_useq()'). Factored out of 'pad_useq()' so
+// that the reference mode can pad the references and the queries
+// to the common height of the tries.
+{
+
    char * spaces = malloc((maxlen + 1) * sizeof(char));
-   if (spaces == NULL || count == NULL) {
+   if (spaces == NULL) {
       alert();
       krash();
    }
@@ -1819,7 +6387,6 @@ pad_useq
    for (int i = 0 ; i < useqS->nitems ; i++) {
       useq_t *u = useqS->items[i];
       int len = strlen(u->seq);
-      count[len]++;
       if (len == maxlen) continue;
       // Create a new sequence with padding characters.
       char *padded = malloc((maxlen + 1) * sizeof(char));
@@ -1833,17 +6400,15 @@ pad_useq
       u->seq = padded;
    }
 
-   // Compute median.
-   *median = 0;
-   int ccount = 0;
-   do {
-      ccount += count[++(*median)];
-   } while (ccount < useqS->nitems / 2);
+   // Pack the padded sequences in 2-bit codes so that the k-mers
+   // of the lookup table can be extracted one word at a time
+   // (see 'seq2id_pack()').
+   for (int i = 0 ; i < useqS->nitems ; i++) {
+      pack_useq((useq_t *) useqS->items[i], maxlen);
+   }
 
-   // Free and return.
-   free(count);
    free(spaces);
-   return maxlen;
+   return;
 
 }
 
@@ -1870,6 +6435,10 @@ unpad_useq
       memcpy(unpadded, u->seq + pad, len - pad + 1);
       free(u->seq);
       u->seq = unpadded;
+      // The packed sequence encodes the padded version:
+      // it is stale from this point on.
+      free(u->pack);
+      u->pack = NULL;
    }
    return;
 }
@@ -2140,8 +6709,8 @@ new_lookup
 )
 {
 
-   lookup_t * lut = (lookup_t *) malloc(2*sizeof(int) + sizeof(int *) +
-         (tau+1)*sizeof(char *));
+   lookup_t * lut = (lookup_t *) malloc(sizeof(lookup_t) +
+         (tau+1)*sizeof(unsigned char *));
    if (lut == NULL) {
       alert();
       return NULL;
@@ -2155,21 +6724,27 @@ new_lookup
    lut->slen  = maxlen;
    lut->kmers = tau + 1;
    lut->klen  = malloc(lut->kmers * sizeof(int));
-   
+   lut->hash  = malloc(lut->kmers * sizeof(int));
+
    // Compute k-mer lengths.
    if (k > MAX_K_FOR_LOOKUP)
       for (int i = 0; i < tau + 1; i++) lut->klen[i] = MAX_K_FOR_LOOKUP;
    else
       for (int i = 0; i < tau + 1; i++) lut->klen[i] = k - (rem-- > 0);
 
-   // Allocate lookup tables.
+   // Allocate lookup tables. The k-mers longer than
+   // MAX_K_DIRECT_LOOKUP get a hashed table of the same size as
+   // the largest direct one (see 'lut_bit()').
    for (int i = 0; i < tau + 1; i++) {
-      lut->lut[i] = calloc(1 << max(0,(2*lut->klen[i] - 3)),
-            sizeof(char));
+      lut->hash[i] = lut->klen[i] > MAX_K_DIRECT_LOOKUP;
+      int nbytes = lut->hash[i] ?
+         1 << (2*MAX_K_DIRECT_LOOKUP - 3) :
+         1 << max(0,(2*lut->klen[i] - 3));
+      lut->lut[i] = calloc(nbytes, sizeof(char));
       if (lut->lut[i] == NULL) {
          while (--i >= 0) {
             free(lut->lut[i]);
-         }  
+         }
          free(lut);
          alert();
          return NULL;
@@ -2181,6 +6756,34 @@ new_lookup
 }
 
 
+int64_t
+lut_bit
+(
+   lookup_t * lut,
+   int        i,
+   int64_t    seqid
+)
+// SYNOPSIS:
+//   Returns the bit position of a k-mer id in table 'i' of the
+//   lookup. The tables of k-mers up to MAX_K_DIRECT_LOOKUP are
+//   exact bitmaps indexed by the id itself; the direct bitmap of
+//   longer k-mers would be too large (512 MB at k = 16) so their
+//   ids are hashed into a table of fixed size. Collisions only
+//   cause false positives, which cost a spurious trie search but
+//   never a missed match.
+{
+   if (!lut->hash[i]) return seqid;
+   // Finalizer of MurmurHash3 (64 bit version).
+   uint64_t h = (uint64_t) seqid;
+   h ^= h >> 33;
+   h *= 0xff51afd7ed558ccdULL;
+   h ^= h >> 33;
+   h *= 0xc4ceb9fe1a85ec53ULL;
+   h ^= h >> 33;
+   return (int64_t) (h & ((1 << (2*MAX_K_DIRECT_LOOKUP)) - 1));
+}
+
+
 void
 destroy_lookup
 (
@@ -2189,6 +6792,7 @@ destroy_lookup
 {
    for (int i = 0 ; i < lut->kmers ; i++) free(lut->lut[i]);
    free(lut->klen);
+   free(lut->hash);
    free(lut);
 }
 
@@ -2197,7 +6801,8 @@ int
 lut_search
 (
  lookup_t * lut,
- useq_t   * query
+ useq_t   * query,
+ int        npad
 )
 // SYNOPSIS:
 //   Perform of a lookup search of the query and determine whether
@@ -2205,10 +6810,18 @@ lut_search
 //   in the lookup table. If this is not the case, the trie search can
 //   be skipped because the query cannot have a match for the given
 //   tau.
-//   
+//
+//   'npad' is the number of leading pads of the query in the trie
+//   of the lookup (see 'do_query()'). The pads are implicit: the
+//   padding space and 'A' have the same 2-bit code, so a k-mer
+//   overlapping the pads has the id of its real suffix and a
+//   k-mer lying entirely in the pads has id 0, without building
+//   the padded string.
+//
 // ARGUMENTS:
 //   lut: the lookup table to search
 //   query: the query as a useq.
+//   npad: leading pads of the query in the trie of the lookup.
 //
 // RETURN:
 //   1 if any of the k-mers extracted from the query is in the
@@ -2218,6 +6831,8 @@ lut_search
 //   None.
 {
 
+   // Length used to pack the (unpadded) query.
+   int qlen = lut->slen - npad;
    // Start from the end of the sequence. This will avoid potential
    // misalignments on the first kmer due to insertions.
    int offset = lut->slen;
@@ -2225,13 +6840,32 @@ lut_search
    for (int i = lut->kmers - 1; i >= 0; i--) {
       offset -= lut->klen[i];
       for (int j = -(lut->kmers - 1 - i); j <= lut->kmers - 1 - i; j++) {
-         // If sequence contains 'N' seq2id will return -1.
-         int seqid = seq2id(query->seq + offset + j, lut->klen[i]);
-         // Make sure to never proceed passed the end of string.
-         if (seqid == -2) return -1;
+         // Position in the coordinates of the unpadded query.
+         int pos = offset + j - npad;
+         int klen = lut->klen[i];
+         if (pos < 0) {
+            klen += pos;
+            pos = 0;
+         }
+         int64_t seqid;
+         if (klen <= 0) {
+            // The k-mer lies entirely in the padding.
+            seqid = 0;
+         }
+         else if (query->pack != NULL) {
+            // If sequence contains 'N' seq2id_pack will return -1.
+            seqid = seq2id_pack(query, qlen, pos, klen);
+         }
+         else {
+            // If sequence contains 'N' seq2id will return -1.
+            seqid = seq2id(query->seq + pos, klen);
+            // Make sure to never proceed passed the end of string.
+            if (seqid == -2) return -1;
+         }
          if (seqid == -1) continue;
          // The lookup table proper is implemented as a bitmap.
-         if ((lut->lut[i][seqid/8] >> (seqid%8)) & 1) return 1;
+         int64_t bit = lut_bit(lut, i, seqid);
+         if ((lut->lut[i][bit/8] >> (bit%8)) & 1) return 1;
       }
    }
 
@@ -2244,8 +6878,12 @@ int
 lut_insert
 (
    lookup_t * lut,
-   useq_t   * query
+   useq_t   * query,
+   int        npad
 )
+// Mirror image of 'lut_search()': inserts the k-mers of the
+// sequence with the same implicit leading pads, so that the ids
+// are the ones the padded string would yield.
 {
 
    int seqlen = strlen(query->seq);
@@ -2253,10 +6891,29 @@ lut_insert
    int offset = lut->slen;
    for (int i = lut->kmers-1; i >= 0; i--) {
       offset -= lut->klen[i];
-      if (offset + lut->klen[i] > seqlen) continue;
-      int seqid = seq2id(query->seq + offset, lut->klen[i]);
+      // Position in the coordinates of the unpadded sequence.
+      int pos = offset - npad;
+      int klen = lut->klen[i];
+      if (pos < 0) {
+         klen += pos;
+         pos = 0;
+      }
+      if (pos + klen > seqlen) continue;
+      int64_t seqid;
+      if (klen <= 0) {
+         // The k-mer lies entirely in the padding.
+         seqid = 0;
+      }
+      else {
+         seqid = query->pack != NULL ?
+            seq2id_pack(query, seqlen, pos, klen) :
+            seq2id(query->seq + pos, klen);
+      }
       // The lookup table proper is implemented as a bitmap.
-      if (seqid >= 0) lut->lut[i][seqid/8] |= (1 << (seqid%8));
+      if (seqid >= 0) {
+         int64_t bit = lut_bit(lut, i, seqid);
+         lut->lut[i][bit/8] |= (1 << (bit%8));
+      }
       // Make sure to never proceed passed the end of string.
       else if (seqid == -2) return 1;
    }
@@ -2267,7 +6924,7 @@ lut_insert
 }
 
 
-int
+int64_t
 seq2id
 (
   char * seq,
@@ -2275,7 +6932,7 @@ seq2id
 )
 {
 
-   int seqid = 0;
+   int64_t seqid = 0;
    for (int i = 0; i < slen; i++) {
       // Padding spaces are substituted by 'A'. It does not hurt
       // anyway to generate some false positives.
@@ -2293,6 +6950,109 @@ seq2id
 }
 
 
+void
+pack_useq
+(
+   useq_t * u,
+   int      len
+)
+// SYNOPSIS:
+//   Encodes 'u->seq' (of length 'len') with the 2-bit code of
+//   'seq2id()' and stores the result in 'u->pack'. The layout is
+//   one word per 32 characters, with character 'i' at bits 2i
+//   and 2i+1 of its word, followed by a bitmap where bit 'i' is
+//   set if character 'i' has no 2-bit code (not A, C, G, T, or
+//   a padding space). Each section ends with one padding word so
+//   that extraction can safely read one word past the end.
+//
+// SIDE EFFECTS:
+//   Replaces 'u->pack' (the previous encoding is freed).
+{
+
+   int nc = (2*len + 63) / 64 + 1;
+   int ni = (len + 63) / 64 + 1;
+   uint64_t * pk = calloc(nc + ni, sizeof(uint64_t));
+   if (pk == NULL) {
+      alert();
+      krash();
+   }
+   uint64_t * iv = pk + nc;
+
+   for (int i = 0 ; i < len ; i++) {
+      uint64_t code = 0;
+      switch (u->seq[i]) {
+         case 'A': case 'a': case ' ':          break;
+         case 'C': case 'c':          code = 1; break;
+         case 'G': case 'g':          code = 2; break;
+         case 'T': case 't':          code = 3; break;
+         default: iv[i >> 6] |= 1ULL << (i & 63);
+      }
+      pk[i >> 5] |= code << (2*(i & 31));
+   }
+
+   free(u->pack);
+   u->pack = pk;
+
+   return;
+
+}
+
+
+int64_t
+seq2id_pack
+(
+   useq_t * u,
+   int      len,
+   int      offset,
+   int      klen
+)
+// SYNOPSIS:
+//   Packed counterpart of 'seq2id()': computes the id of the
+//   k-mer of length 'klen' starting at position 'offset' of the
+//   packed sequence, reading the 2-bit codes one word at a time
+//   instead of re-decoding the characters. 'len' is the length
+//   passed to 'pack_useq()'.
+//
+// RETURN:
+//   The k-mer id, identical to the one returned by 'seq2id()'
+//   on the plain sequence, or -1 if the k-mer contains a
+//   character without 2-bit code.
+{
+
+   const uint64_t * pk = u->pack;
+   const uint64_t * iv = pk + (2*len + 63) / 64 + 1;
+
+   // Reject k-mers overlapping a non-DNA character.
+   uint64_t bad = iv[offset >> 6] >> (offset & 63);
+   if ((offset & 63) + klen > 64) {
+      bad |= iv[(offset >> 6) + 1] << (64 - (offset & 63));
+   }
+   if (bad & ((1ULL << klen) - 1)) return -1;
+
+   // Extract the 2-bit codes of the k-mer.
+   int bit = 2*offset;
+   uint64_t w = pk[bit >> 6] >> (bit & 63);
+   if ((bit & 63) + 2*klen > 64) {
+      w |= pk[(bit >> 6) + 1] << (64 - (bit & 63));
+   }
+   uint32_t v = w & ((1ULL << (2*klen)) - 1);
+
+   // The extraction puts the first character of the k-mer in the
+   // low bits, whereas 'seq2id()' puts it in the high bits.
+   // Reverse the 2-bit fields so that both functions return the
+   // same ids and can share a lookup table.
+   v = ((v & 0x33333333) << 2) | ((v >> 2) & 0x33333333);
+   v = ((v & 0x0F0F0F0F) << 4) | ((v >> 4) & 0x0F0F0F0F);
+   v = ((v & 0x00FF00FF) << 8) | ((v >> 8) & 0x00FF00FF);
+   v = (v << 16) | (v >> 16);
+
+   // The id of a k-mer of 16 needs all 32 bits, so widen before
+   // the return to keep it clear of the negative sentinels.
+   return (int64_t) (v >> (2*(16 - klen)));
+
+}
+
+
 useq_t *
 new_useq
 (
@@ -2332,6 +7092,56 @@ new_useq
 }
 
 
+useq_t *
+new_useq_len
+(
+         int      count,
+   const char   * seq,
+         size_t   slen,
+   const char   * info,
+         size_t   ilen
+)
+// SYNOPSIS:
+//   Version of 'new_useq()' for strings that are not nul-terminated,
+//   used by the memory-mapped readers to copy the sequences straight
+//   out of the mapping.
+{
+   // Check input.
+   if (seq == NULL) return NULL;
+
+   useq_t *new = calloc(1, sizeof(useq_t));
+   if (new == NULL) {
+      alert();
+      krash();
+   }
+   new->seq = malloc(slen+1);
+   if (new->seq == NULL) {
+      alert();
+      krash();
+   }
+   for (size_t i = 0; i < slen; i++)
+      new->seq[i] = capitalize[(uint8_t)seq[i]];
+   new->seq[slen] = 0;
+   new->count = count;
+   new->nids  = 0;
+   new->sphere_c = 0;
+   new->sphere_d = 0;
+   new->seqid = NULL;
+   if (info != NULL) {
+      new->info = malloc(ilen+1);
+      if (new->info == NULL) {
+         alert();
+         krash();
+      }
+      memcpy(new->info, info, ilen);
+      new->info[ilen] = 0;
+   }
+
+   return new;
+
+}
+
+
 void
 destroy_useq
 (
@@ -2340,6 +7150,7 @@ destroy_useq
 {
    if (useq->matches != NULL) destroy_tower(useq->matches);
    if (useq->info != NULL) free(useq->info);
+   free(useq->pack);
    free(useq->seqid);
    free(useq->seq);
    free(useq);
@@ -54,7 +54,121 @@ int starcode(
          double parent_to_child,
    const int showclusters,
    const int showids,
-   const int outputt
+   const int outputt,
+   const int showstats,
+   const size_t max_mem,
+   FILE *chkf,
+   FILE *resumef
+);
+
+int starcode_umi(
+   FILE *inputf,
+   FILE *outputf,
+   const int umilen,
+   const int umitau,
+         int seqtau,
+   const int seqtrim,
+   const int verbose,
+         int thrmax,
+   const int clusteralg,
+         double parent_to_child,
+   const int showids
+);
+
+int starcode_ref(
+   FILE *reff,
+   FILE *queryf,
+   FILE *outputf,
+         int tau,
+   const int verbose,
+         int thrmax,
+   FILE *indexf,
+   const int saveindex
+);
+
+int starcode_inc(
+   FILE *statef,
+   FILE *inputf,
+   FILE *outputf,
+   FILE *newstatef,
+         int tau,
+   const int verbose,
+         int thrmax,
+         double parent_to_child,
+         double max_drift
+);
+
+int starcode_shard_prep(
+   FILE *inputf,
+   const char *dir,
+         int nshards,
+         int tau,
+   const int verbose,
+         int thrmax,
+         double parent_to_child
+);
+
+int starcode_shard_worker(
+   const char *dir,
+   const int ishard,
+   const int verbose
+);
+
+int starcode_shard_merge(
+   const char *dir,
+   FILE *outputf,
+   const int verbose,
+         int thrmax
+);
+
+// In-process API (libstarcode). Sequences are fed from memory with
+// 'starcode_add_sequence()', clustered with 'starcode_cluster()' and
+// the assignments are read back as structs, without going through
+// files. A context is single-use: once clustered it can only be
+// queried and freed.
+
+typedef struct starcode_ctx_t starcode_ctx_t;
+
+typedef struct starcode_result_t {
+   const char * seq;        // Unique sequence.
+   const char * canonical;  // Canonical sequence of its cluster.
+   int          count;      // Read count (canonicals carry the
+                            // total count of their cluster, as in
+                            // the command line output).
+   int          dist;       // Levenshtein distance to the canonical.
+   unsigned int nids;       // Number of entries of 'ids'.
+   const int  * ids;        // 1-based ids in feeding order.
+} starcode_result_t;
+
+starcode_ctx_t * starcode_ctx_new(void);
+
+void starcode_ctx_free(
+   starcode_ctx_t *ctx
+);
+
+int starcode_add_sequence(
+   starcode_ctx_t *ctx,
+   const char *seq,
+   size_t len,
+   int count
+);
+
+int starcode_cluster(
+   starcode_ctx_t *ctx,
+         int tau,
+         int thrmax,
+   const int clusteralg,
+         double parent_to_child
+);
+
+int starcode_nresults(
+   starcode_ctx_t *ctx
+);
+
+int starcode_result(
+   starcode_ctx_t *ctx,
+   int i,
+   starcode_result_t *result
 );
 
 #endif
@@ -21,14 +21,28 @@
 **
 */
 
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "trie.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define min(a,b) (((a) < (b)) ? (a) : (b))
 #define max(a,b) (((a) > (b)) ? (a) : (b))
 
 #define PAD 5              // Position of padding nodes.
 #define EOS -1             // End Of String, for 'dash()'.
 
+// Number of nodes of the first arena chunk. Chunks double
+// in size until 'ARENA_MAX_CHUNK' so that big tries are
+// carved from a handful of large allocations.
+#define ARENA_MIN_CHUNK 1024
+#define ARENA_MAX_CHUNK (1 << 20)
+
 // Translation tables between letters and numbers.
 static const char untranslate[7] = "NACGT N";
 // Translation table to insert nodes in the trie.
@@ -94,25 +108,195 @@ struct arg_t {
    int         seed_depth;
    int         height;
    int         err;
+   ctrie_t   * ctrie;
 };
 
+void     cdash (uint32_t, const int*, struct arg_t);
+void     cpoucet (uint32_t, int, struct arg_t);
+uint32_t ctrie_node (ctrie_t *);
 void     dash (node_t*, const int*, struct arg_t);
-void     destroy_from (node_t*, void(*)(void*), int, int, int);
+void     destroy_data_from (node_t*, void(*)(void*), int, int);
 int      get_height (trie_t*);
 void     init_pebbles (node_t*);
-node_t * insert (node_t *, int);
+void     init_trienode (node_t *);
+node_t * insert (node_t *, int, nodearena_t *);
 node_t * insert_wo_malloc (node_t *, int, node_t *);
+node_t * nodearena_node (nodearena_t *);
 node_t * new_trienode (void);
 void     poucet (node_t*, int, struct arg_t);
+int      recursive_count_cnodes (ctrie_t *, uint32_t, int, int);
 int      recursive_count_nodes (node_t * node, int, int);
 
 // Globals.
 int ERROR = 0;
 
+// Nodes visited by the poucet search of the calling thread. The
+// counter is thread-local because the workers search concurrently;
+// starcode merges it per job (see the --stats option).
+__thread long TRIE_VISITS = 0;
+
+gstack_t * const TOWER_TOP = NULL;
+
 int get_height(trie_t *trie) { return trie->info->height; }
 
 // ------  SEARCH FUNCTIONS ------ //
 
+#ifdef __SSE2__
+
+// The two arms of the L computed by 'poucet()' are recurrences of
+// the form x[k] = min(t[k], x[k-1]+1), where all the t[k] can be
+// computed independently. Adding the lane index turns them into
+// plain running minima:
+//
+//    x[k] = min over m <= k of (t[m] + k - m)
+//         = (min over m <= k of (t[m] - m)) + k
+//
+// so the band is processed in a handful of byte operations instead
+// of a loop with a carried dependency. The kernels below implement
+// this scheme for 'tau' up to 8 (the band fits in one register).
+
+static const unsigned char IDX[16] =
+   {0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15};
+static const unsigned char REVIDX[16] =
+   {15,14,13,12,11,10,9,8,7,6,5,4,3,2,1,0};
+
+
+static inline __m128i
+suffix_min_epu8
+(
+   __m128i w
+)
+// Running minimum from the highest to the lowest byte. The bytes
+// shifted in are set to 0xff, the identity for 'min'.
+{
+   const __m128i ff = _mm_set1_epi8((char) 0xff);
+   w = _mm_min_epu8(w, _mm_or_si128(_mm_srli_si128(w, 1),
+            _mm_slli_si128(ff, 15)));
+   w = _mm_min_epu8(w, _mm_or_si128(_mm_srli_si128(w, 2),
+            _mm_slli_si128(ff, 14)));
+   w = _mm_min_epu8(w, _mm_or_si128(_mm_srli_si128(w, 4),
+            _mm_slli_si128(ff, 12)));
+   w = _mm_min_epu8(w, _mm_or_si128(_mm_srli_si128(w, 8),
+            _mm_slli_si128(ff, 8)));
+   return w;
+}
+
+
+static inline __m128i
+prefix_min_epu8
+(
+   __m128i w
+)
+// Running minimum from the lowest to the highest byte.
+{
+   const __m128i ff = _mm_set1_epi8((char) 0xff);
+   w = _mm_min_epu8(w, _mm_or_si128(_mm_slli_si128(w, 1),
+            _mm_srli_si128(ff, 15)));
+   w = _mm_min_epu8(w, _mm_or_si128(_mm_slli_si128(w, 2),
+            _mm_srli_si128(ff, 14)));
+   w = _mm_min_epu8(w, _mm_or_si128(_mm_slli_si128(w, 4),
+            _mm_srli_si128(ff, 12)));
+   w = _mm_min_epu8(w, _mm_or_si128(_mm_slli_si128(w, 8),
+            _mm_srli_si128(ff, 8)));
+   return w;
+}
+
+
+static inline void
+compute_upper_arm
+(
+   const unsigned char * lcc,
+         uint32_t        path,
+         int             q,
+         int             maxa,
+         char          * common
+)
+// Computes the upper arm of the L, i.e. the cells 'common[0]' to
+// 'common[maxa-1]' of 'poucet()'. Lane j holds the cell written by
+// iteration a = j+1 of the scalar loop,
+//
+//    common[a-1] = min(pcache[a]+neq, pcache[a-1]+1, common[a]+1),
+//
+// where 'neq' compares the path nibble a-1 with the query. The
+// caller patches the cache copy for the "PAD exception".
+{
+   // Spread the 8 nibbles of 'path' into 8 bytes.
+   uint64_t z = path;
+   z = (z | (z << 16)) & 0x0000ffff0000ffffULL;
+   z = (z | (z << 8))  & 0x00ff00ff00ff00ffULL;
+   z = (z | (z << 4))  & 0x0f0f0f0f0f0f0f0fULL;
+
+   const __m128i one = _mm_set1_epi8(1);
+   __m128i nib = _mm_cvtsi64_si128((long long) z);
+   __m128i neq = _mm_add_epi8(one,
+         _mm_cmpeq_epi8(nib, _mm_set1_epi8((char) q)));
+   __m128i mm  = _mm_add_epi8(
+         _mm_loadu_si128((__m128i const *)(lcc+1)), neq);
+   __m128i ins = _mm_add_epi8(
+         _mm_loadu_si128((__m128i const *) lcc), one);
+
+   unsigned char tbuf[16];
+   _mm_storeu_si128((__m128i *) tbuf, _mm_min_epu8(mm, ins));
+   // The untouched cell 'common[maxa]' (equal to maxa+1) enters
+   // the scan as an extra lane; higher lanes are neutralized.
+   memset(tbuf + maxa, 0x7f, 16 - maxa);
+   tbuf[maxa] = maxa + 1;
+
+   __m128i idx = _mm_loadu_si128((__m128i const *) IDX);
+   __m128i w = _mm_add_epi8(
+         _mm_loadu_si128((__m128i const *) tbuf), idx);
+   unsigned char rbuf[16];
+   _mm_storeu_si128((__m128i *) rbuf,
+         _mm_sub_epi8(suffix_min_epu8(w), idx));
+   memcpy(common, rbuf, maxa);
+}
+
+
+static inline void
+compute_side_arm
+(
+   const unsigned char * lcc,
+   const unsigned char * q8,
+         int             i,
+         int             maxa,
+         char          * ccache
+)
+// Computes the horizontal arm of the L, i.e. the cells
+// 'ccache[-maxa]' to 'ccache[-1]' of 'poucet()'. Lane k holds the
+// cell 'ccache[k-maxa]' written by iteration a = maxa-k of the
+// scalar loop,
+//
+//    ccache[-a] = min(pcache[-a]+neq, pcache[1-a]+1, ccache[-a-1]+1),
+//
+// computed with the same (min,+) scan as 'compute_upper_arm()' but
+// taken from the left.
+{
+   const __m128i one = _mm_set1_epi8(1);
+   __m128i neq = _mm_add_epi8(one,
+         _mm_cmpeq_epi8(_mm_loadu_si128((__m128i const *) q8),
+            _mm_set1_epi8((char) i)));
+   __m128i mm = _mm_add_epi8(
+         _mm_loadu_si128((__m128i const *)(lcc - maxa)), neq);
+   __m128i ins = _mm_add_epi8(
+         _mm_loadu_si128((__m128i const *)(lcc - maxa + 1)), one);
+
+   unsigned char tbuf[16];
+   _mm_storeu_si128((__m128i *) tbuf, _mm_min_epu8(mm, ins));
+   // Left boundary of the band (the cell before 'ccache[-maxa]'
+   // is maxa+1).
+   if (tbuf[0] > maxa + 2) tbuf[0] = maxa + 2;
+
+   __m128i rev = _mm_loadu_si128((__m128i const *) REVIDX);
+   __m128i w = _mm_add_epi8(
+         _mm_loadu_si128((__m128i const *) tbuf), rev);
+   unsigned char rbuf[16];
+   _mm_storeu_si128((__m128i *) rbuf,
+         _mm_sub_epi8(prefix_min_epu8(w), rev));
+   memcpy(ccache - maxa, rbuf, maxa);
+}
+
+#endif
+
 int
 search
 (
@@ -282,6 +466,24 @@ poucet
    // The branch of the L that is identical among all children
    // is computed separately. It will be copied later.
    int32_t path = node->path;
+
+#ifdef __SSE2__
+   // Padded local copy of the cache so that the 16 byte loads of
+   // the kernels stay in bounds, and byte copy of the relevant
+   // part of the query. The copies are also patched to implement
+   // the "PAD exception" mentioned in the SYNOPSIS.
+   unsigned char lc[32] = {0};
+   memcpy(lc + 8 - TAU, node->cache, 2*TAU+1);
+   unsigned char *lcc = lc + 8;
+   unsigned char q8[16] = {0};
+   if (maxa > 0) {
+      for (int a = 1 ; a <= maxa ; a++) q8[maxa-a] = arg.query[depth-a];
+      if (arg.query[depth-1] == PAD) lcc[maxa] = 0;
+      if ((path & 15) == PAD) lcc[-maxa] = 0;
+      // Upper arm of the L (need the path).
+      compute_upper_arm(lcc, path, arg.query[depth], maxa, common);
+   }
+#else
    // Upper arm of the L (need the path).
    if (maxa > 0) {
       // Special initialization for first character. If the previous
@@ -297,6 +499,7 @@ poucet
          common[a-1] = min(mmatch, shift);
       }
    }
+#endif
 
    node_t *child;
    for (int i = 0 ; i < 6 ; i++) {
@@ -309,6 +512,12 @@ poucet
          local_cache + 9 : child->cache + TAU;
       memcpy(ccache+1, common, TAU * sizeof(char));
 
+#ifdef __SSE2__
+      // Horizontal arm of the L (need previous characters).
+      if (maxa > 0) {
+         compute_side_arm(lcc, q8, i, maxa, ccache);
+      }
+#else
       // Horizontal arm of the L (need previous characters).
       if (maxa > 0) {
          // See comment above for initialization.
@@ -323,6 +532,7 @@ poucet
             ccache[-a] = min(mmatch, shift);
          }
       }
+#endif
       // Center cell (need both arms to be computed).
       mmatch = pcache[0] + (i != arg.query[depth]);
       shift = min(ccache[-1], ccache[1]) + 1;
@@ -403,366 +613,1278 @@ dash
 }
 
 
-// ------  TRIE CONSTRUCTION AND DESTRUCTION  ------ //
-
-
-trie_t *
-new_trie
+int
+search_ctrie
 (
-   unsigned int  height
+         ctrie_t  *  trie,
+   const char     *  query,
+   const int         tau,
+         gstack_t ** hits,
+         int         start_depth,
+   const int         seed_depth
 )
-// SYNOPSIS:                                                              
-//   Front end trie constructor.                                          
-//                                                                        
-// PARAMETERS:                                                            
-//   height: the fixed depth of the leaves                                
-//                                                                        
-// RETURN:                                                                
-//   A pointer to trie root with meta information and no children.        
+// SYNOPSIS:
+//   Version of 'search()' for compact tries. The logic is identical,
+//   but the nodes are referred to by their index in the node block of
+//   the trie, which is also what the pebbles contain. See 'search()'
+//   for the description of the parameters and side effects.
 {
+   ERROR = 0;
 
-   if (height < 1) {
-      fprintf(stderr, "error: the minimum trie height is 1\n");
-      ERROR = __LINE__;
-      return NULL;
+   int height = trie->height;
+   if (tau > TAU) {
+      fprintf(stderr, "error: requested tau greater than %d\n", TAU);
+      return __LINE__;
    }
 
-   trie_t *trie = malloc(sizeof(trie_t));
-   if (trie == NULL) {
-      fprintf(stderr, "error: could not create trie\n");
-      ERROR = __LINE__;
-      return NULL;
+   int length = strlen(query);
+   if (length > height) {
+      fprintf(stderr, "error: query longer than allowed max\n");
+      return __LINE__;
    }
 
-   node_t *root = new_trienode();
-   if (root == NULL) {
-      fprintf(stderr, "error: could not create root\n");
-      ERROR = __LINE__;
-      free(trie);
-      return NULL;
+   // Reset the pebbles that will be overwritten.
+   start_depth = max(start_depth, 0);
+   for (int i = start_depth+1 ; i <= min(seed_depth, height) ; i++) {
+      trie->pebbles[i]->nitems = 0;
    }
 
-   info_t *info = malloc(sizeof(info_t));
-   if (info == NULL) {
-      fprintf(stderr, "error: could not create trie\n");
-      ERROR = __LINE__;
-      free(root);
-      free(trie);
-      return NULL;
+   // Translate the query string. The first 'char' is kept to store
+   // the length of the query, which shifts the array by 1 position.
+   int translated[M];
+   translated[0] = length;
+   translated[length+1] = EOS;
+   for (int i = max(0, start_depth-TAU) ; i < length ; i++) {
+      translated[i+1] = altranslate[(int) query[i]];
    }
 
-   // Set the values of the meta information.
-   info->height = height;
-   info->pebbles = new_tower(M);
+   // Set the search options.
+   struct arg_t arg = {
+      .hits    = hits,
+      .query   = translated,
+      .tau     = tau,
+      .pebbles = trie->pebbles,
+      .seed_depth    = seed_depth,
+      .height  = height,
+      .ctrie   = trie,
+   };
 
-   // Push the root to the ground level of 'pebbles'.
-   // This will be the only node at this level for
-   // the lifetime of the trie.
-   if (info->pebbles == NULL || push(root, info->pebbles)) {
-      fprintf(stderr, "error: could not create trie\n");
-      ERROR = __LINE__;
-      free(info);
-      free(root);
-      free(trie);
-      return NULL;
+   // Run recursive search from cached nodes.
+   gstack_t *pebbles = trie->pebbles[start_depth];
+   for (int i = 0 ; i < pebbles->nitems ; i++) {
+      uint32_t start_node = (uint32_t) (uintptr_t) pebbles->items[i];
+      cpoucet(start_node, start_depth + 1, arg);
    }
 
-   trie->root = root;
-   trie->info = info;
-
-   return trie;
+   // Return the error code of the process (the line of
+   // the last error) and 0 if everything went OK.
+   return check_trie_error_and_reset();
 
 }
 
 
-node_t *
-new_trienode
-(void)
-// SYNOPSIS:                                                              
-//   Back end constructor for a trie node. All values are initialized to  
-//   null, except the cache for dynamic programming which is initialized  
-//   as a root node.                                                      
-//                                                                        
-// RETURN:                                                                
-//   A pointer to trie node with no data and no children.                 
+void
+cpoucet
+(
+          uint32_t  node,
+   const  int       depth,
+   struct arg_t     arg
+)
+// SYNOPSIS:
+//   Version of 'poucet()' for compact tries. The dynamic programming
+//   is the same (see 'poucet()' for the detail, including the "PAD
+//   exception"), but children are resolved through the node block of
+//   the trie and pebbles receive node indices instead of pointers. At
+//   the height of the trie, the child slot refers to the data array so
+//   the data itself is pushed to the hits.
 {
 
-   node_t *node = calloc(1, sizeof(node_t));
-   if (node == NULL) {
-      fprintf(stderr, "error: could not create trie node\n");
-      ERROR = __LINE__;
-      return NULL;
-   }
-
-   // Initialize the cache. This is important for the
-   // dynamic programming algorithm.
-   const char init[] = {8,7,6,5,4,3,2,1,0,1,2,3,4,5,6,7,8};
-   memcpy(node->cache, init, 2*TAU+1);
-   return node;
-
-}
+   TRIE_VISITS++;
 
+   ctrie_t *trie = arg.ctrie;
+   // This makes it easier to distinguish the part that goes upward,
+   // with positive index and requiring the path, from the part that
+   // goes horizontally, with negative index and requiring previous
+   // characters of the query.
+   char *pcache = trie->nodes[node].cache + TAU;
+   // Risk of overflow at depth lower than 'tau'.
+   int maxa = min((depth-1), arg.tau);
 
-void **
-insert_string
-(
-         trie_t * trie,
-   const char   * string
-)
-// SYNOPSIS:                                                              
-//   Front end function to fill in a trie. Insert a string from root, or  
-//   simply return the node at the end of the string path if it already   
-//   exists.                                                              
-//                                                                        
-// RETURN:                                                                
-//   The leaf node in case of succes, 'NULL' otherwise.                   
-//                                                                        
-// NB: This function is not used by 'starcode()'.
-{
+   // Penalty for match/mismatch and insertion/deletion resepectively.
+   unsigned char mmatch;
+   unsigned char shift;
 
-   int i;
+   // Part of the cache that is shared between all the children.
+   char common[9] = {1,2,3,4,5,6,7,8,9};
 
-   int nchar = strlen(string);
-   if (nchar != get_height(trie)) {
-      fprintf(stderr, "error: can only insert string of length %d\n",
-            get_height(trie));
-      ERROR = __LINE__;
-      return NULL;
+   // The branch of the L that is identical among all children
+   // is computed separately. It will be copied later.
+   int32_t path = trie->nodes[node].path;
+
+#ifdef __SSE2__
+   // Same setup as in 'poucet()', see the comments there.
+   unsigned char lc[32] = {0};
+   memcpy(lc + 8 - TAU, trie->nodes[node].cache, 2*TAU+1);
+   unsigned char *lcc = lc + 8;
+   unsigned char q8[16] = {0};
+   if (maxa > 0) {
+      for (int a = 1 ; a <= maxa ; a++) q8[maxa-a] = arg.query[depth-a];
+      if (arg.query[depth-1] == PAD) lcc[maxa] = 0;
+      if ((path & 15) == PAD) lcc[-maxa] = 0;
+      // Upper arm of the L (need the path).
+      compute_upper_arm(lcc, path, arg.query[depth], maxa, common);
    }
-   
-   // Find existing path.
-   node_t *node = trie->root;
-   for (i = 0 ; i < nchar-1; i++) {
-      node_t *child;
-      int c = translate[(int) string[i]];
-      if ((child = (node_t *) node->child[c]) == NULL) {
-         break;
+#else
+   // Upper arm of the L (need the path).
+   if (maxa > 0) {
+      // See "PAD exception" in 'poucet()'.
+      mmatch = (arg.query[depth-1] == PAD ? 0 : pcache[maxa]) +
+                  ((path >> 4*(maxa-1) & 15) != arg.query[depth]);
+      shift = min(pcache[maxa-1], common[maxa]) + 1;
+      common[maxa-1] = min(mmatch, shift);
+      for (int a = maxa-1 ; a > 0 ; a--) {
+         mmatch = pcache[a] + ((path >> 4*(a-1) & 15) != arg.query[depth]);
+         shift = min(pcache[a-1], common[a]) + 1;
+         common[a-1] = min(mmatch, shift);
       }
-      node = child;
    }
+#endif
 
-   // Append more nodes.
-   for ( ; i < nchar-1 ; i++) {
-      int c = translate[(int) string[i]];
-      node = insert(node, c);
-      if (node == NULL) {
-         fprintf(stderr, "error: could not insert string\n");
-         ERROR = __LINE__;
-         return NULL;
-      }
-   }
+   for (int i = 0 ; i < 6 ; i++) {
+      // Skip if current node has no child at this position.
+      uint32_t child = trie->nodes[node].child[i];
+      if (child == 0) continue;
 
-   return node->child + translate[(int) string[nchar-1]];
+      // Same remark as for parent cache.
+      char local_cache[] = {9,8,7,6,5,4,3,2,1,0,1,2,3,4,5,6,7,8,9};
+      char *ccache = depth == arg.height ?
+         local_cache + 9 : trie->nodes[child].cache + TAU;
+      memcpy(ccache+1, common, TAU * sizeof(char));
 
-}
+#ifdef __SSE2__
+      // Horizontal arm of the L (need previous characters).
+      if (maxa > 0) {
+         compute_side_arm(lcc, q8, i, maxa, ccache);
+      }
+#else
+      // Horizontal arm of the L (need previous characters).
+      if (maxa > 0) {
+         // See "PAD exception" in 'poucet()'.
+         mmatch = ((path & 15) == PAD ? 0 : pcache[-maxa]) +
+                     (i != arg.query[depth-maxa]);
+         shift = min(pcache[1-maxa], maxa+1) + 1;
+         ccache[-maxa] = min(mmatch, shift);
+         for (int a = maxa-1 ; a > 0 ; a--) {
+            mmatch = pcache[-a] + (i != arg.query[depth-a]);
+            shift = min(pcache[1-a], ccache[-a-1]) + 1;
+            ccache[-a] = min(mmatch, shift);
+         }
+      }
+#endif
+      // Center cell (need both arms to be computed).
+      mmatch = pcache[0] + (i != arg.query[depth]);
+      shift = min(ccache[-1], ccache[1]) + 1;
+      ccache[0] = min(mmatch, shift);
 
+      // Stop searching if 'tau' is exceeded.
+      if (ccache[0] > arg.tau) continue;
 
-node_t *
-insert
-(
-   node_t * parent,
-   int      position
-)
-// SYNOPSIS:                                                              
-//   Back end function to construct tries. Append a child to an existing  
-//   node at specifieid position.                                         
-//   NO CHECKING IS PERFORMED to make sure that this does not overwrite   
-//   an existings node child (causing a memory leak) or that 'c' is an    
-//   integer less than 5. Since 'insert' is called exclusiverly by        
-//   'insert_string' after a call to 'find_path', this checking is not    
-//   required. If 'insert' is called in another context, this check has   
-//   to be performed.                                                     
-//                                                                        
+      // Reached height of the trie: it's a hit!
+      if (depth == arg.height) {
+         // 'child' refers to a slot of the data array. A slot
+         // still holding NULL belongs to a sequence whose data is
+         // set after its own search: skip it like the NULL child
+         // pointers of the plain trie.
+         void *data = trie->data[child-1];
+         if (data != NULL && push(data, arg.hits + ccache[0])) {
+            ERROR = __LINE__;
+         }
+         continue;
+      }
+
+      // Cache nodes in pebbles when trailing.
+      if (depth <= arg.seed_depth) {
+         if (push((void *) (uintptr_t) child, (arg.pebbles)+depth)) {
+            ERROR = __LINE__;
+         }
+      }
+
+      if (depth > arg.seed_depth) {
+         // Use 'cdash()' if no more mismatches allowed.
+         int can_dash = 1;
+         for (int a = -maxa ; a < maxa+1 ; a++) {
+            if (ccache[a] < arg.tau) {
+               can_dash = 0;
+               break;
+            }
+         }
+         if (can_dash) {
+            cdash(child, arg.query+depth+1, arg);
+            continue;
+         }
+      }
+
+      cpoucet(child, depth+1, arg);
+
+   }
+
+}
+
+
+void
+cdash
+(
+          uint32_t            node,
+   const  int      * restrict suffix,
+   struct arg_t               arg
+)
+// SYNOPSIS:
+//   Version of 'dash()' for compact tries. Checks whether the node has
+//   the given suffix and reports a hit if this is the case.
+{
+
+   ctrie_t *trie = arg.ctrie;
+   int c;
+
+   // Early return if the suffix path is broken. The slot of the
+   // last character of the suffix refers to the data array, but it
+   // is read after the loop exits so it is never used as an index
+   // in the node block.
+   while ((c = *suffix++) != EOS) {
+      if ((c > 4) || (node = trie->nodes[node].child[c]) == 0) return;
+   }
+
+   // End of query, push the data of the tail. A slot still
+   // holding NULL belongs to a sequence whose data is set after
+   // its own search (see 'cpoucet()').
+   void *data = trie->data[node-1];
+   if (data != NULL && push(data, arg.hits + arg.tau)) ERROR = __LINE__;
+
+   return;
+
+}
+
+
+// ------  TRIE CONSTRUCTION AND DESTRUCTION  ------ //
+
+
+// Chunks of the node arena. Nodes are carved in order from
+// 'nodes' and are never returned individually: the whole
+// chunk list is released by 'destroy_nodearena()'.
+struct nodechunk_t
+{
+   struct nodechunk_t * next;       // Next (older) chunk.
+   size_t               nnodes;     // Slots in the chunk.
+   size_t               used;       // Slots already carved.
+   node_t               nodes[];    // Node storage.
+};
+
+struct nodearena_t
+{
+   struct nodechunk_t * chunks;     // Current chunk (head of list).
+};
+
+
+nodearena_t *
+new_nodearena
+(void)
+// SYNOPSIS:
+//   Constructor for a node arena. Memory for the nodes is allocated
+//   lazily, on the first call to 'nodearena_node()'.
+//
+// RETURN:
+//   A pointer to an empty arena, or 'NULL' in case of failure.
+{
+   nodearena_t *arena = malloc(sizeof(nodearena_t));
+   if (arena == NULL) {
+      fprintf(stderr, "error: could not create node arena\n");
+      ERROR = __LINE__;
+      return NULL;
+   }
+   arena->chunks = NULL;
+   return arena;
+}
+
+
+node_t *
+nodearena_node
+(
+   nodearena_t * arena
+)
+// SYNOPSIS:
+//   Carve one node from the arena, allocating a new chunk if the
+//   current one is full. The node is initialized like the nodes
+//   returned by 'new_trienode()'.
+//
+// RETURN:
+//   A pointer to an initialized node, or 'NULL' in case of failure.
+{
+   struct nodechunk_t *chunk = arena->chunks;
+   if (chunk == NULL || chunk->used == chunk->nnodes) {
+      // Double the chunk size at every allocation so that the
+      // number of calls to 'malloc()' is logarithmic in the
+      // number of nodes of the trie.
+      size_t nnodes = chunk == NULL ?
+         ARENA_MIN_CHUNK : 2 * chunk->nnodes;
+      if (nnodes > ARENA_MAX_CHUNK) nnodes = ARENA_MAX_CHUNK;
+      struct nodechunk_t *new = malloc(sizeof(struct nodechunk_t) +
+            nnodes * sizeof(node_t));
+      if (new == NULL) {
+         fprintf(stderr, "error: could not create trie node\n");
+         ERROR = __LINE__;
+         return NULL;
+      }
+      new->next = chunk;
+      new->nnodes = nnodes;
+      new->used = 0;
+      arena->chunks = chunk = new;
+   }
+
+   node_t *node = chunk->nodes + chunk->used++;
+   init_trienode(node);
+   return node;
+}
+
+
+void
+destroy_nodearena
+(
+   nodearena_t * arena
+)
+// SYNOPSIS:
+//   Release all the nodes of the arena at once. This replaces the
+//   walk that freed the nodes of a trie one by one.
+{
+   struct nodechunk_t *chunk = arena->chunks;
+   while (chunk != NULL) {
+      struct nodechunk_t *next = chunk->next;
+      free(chunk);
+      chunk = next;
+   }
+   free(arena);
+}
+
+
+trie_t *
+new_trie
+(
+   unsigned int  height
+)
+// SYNOPSIS:                                                              
+//   Front end trie constructor.                                          
+//                                                                        
 // PARAMETERS:                                                            
-//   parent: the parent to append the node to                             
-//   position: the position of the child                                  
+//   height: the fixed depth of the leaves                                
 //                                                                        
 // RETURN:                                                                
-//   The appended child node in case of success, 'NULL' otherwise.        
+//   A pointer to trie root with meta information and no children.        
+{
+
+   if (height < 1) {
+      fprintf(stderr, "error: the minimum trie height is 1\n");
+      ERROR = __LINE__;
+      return NULL;
+   }
+
+   trie_t *trie = malloc(sizeof(trie_t));
+   if (trie == NULL) {
+      fprintf(stderr, "error: could not create trie\n");
+      ERROR = __LINE__;
+      return NULL;
+   }
+
+   nodearena_t *arena = new_nodearena();
+   if (arena == NULL) {
+      fprintf(stderr, "error: could not create trie\n");
+      ERROR = __LINE__;
+      free(trie);
+      return NULL;
+   }
+
+   node_t *root = nodearena_node(arena);
+   if (root == NULL) {
+      fprintf(stderr, "error: could not create root\n");
+      ERROR = __LINE__;
+      destroy_nodearena(arena);
+      free(trie);
+      return NULL;
+   }
+
+   info_t *info = malloc(sizeof(info_t));
+   if (info == NULL) {
+      fprintf(stderr, "error: could not create trie\n");
+      ERROR = __LINE__;
+      destroy_nodearena(arena);
+      free(trie);
+      return NULL;
+   }
+
+   // Set the values of the meta information.
+   info->height = height;
+   info->pebbles = new_tower(M);
+   info->arena = arena;
+
+   // Push the root to the ground level of 'pebbles'.
+   // This will be the only node at this level for
+   // the lifetime of the trie.
+   if (info->pebbles == NULL || push(root, info->pebbles)) {
+      fprintf(stderr, "error: could not create trie\n");
+      ERROR = __LINE__;
+      free(info);
+      destroy_nodearena(arena);
+      free(trie);
+      return NULL;
+   }
+
+   trie->root = root;
+   trie->info = info;
+
+   return trie;
+
+}
+
+
+node_t *
+new_trienode
+(void)
+// SYNOPSIS:
+//   Back end constructor for a standalone (malloc'ed) trie node. The
+//   nodes of a trie are carved from its arena instead.
+//
+// RETURN:
+//   A pointer to trie node with no data and no children.
+{
+
+   node_t *node = malloc(sizeof(node_t));
+   if (node == NULL) {
+      fprintf(stderr, "error: could not create trie node\n");
+      ERROR = __LINE__;
+      return NULL;
+   }
+
+   init_trienode(node);
+   return node;
+
+}
+
+
+void
+init_trienode
+(
+   node_t * node
+)
+// SYNOPSIS:
+//   Initialize a node to null values, except the cache for dynamic
+//   programming which is initialized as a root node.
+{
+
+   memset(node, 0, sizeof(node_t));
+
+   // Initialize the cache. This is important for the
+   // dynamic programming algorithm.
+   const char init[] = {8,7,6,5,4,3,2,1,0,1,2,3,4,5,6,7,8};
+   memcpy(node->cache, init, 2*TAU+1);
+
+}
+
+
+void **
+insert_string
+(
+         trie_t * trie,
+   const char   * string
+)
+// SYNOPSIS:                                                              
+//   Front end function to fill in a trie. Insert a string from root, or  
+//   simply return the node at the end of the string path if it already   
+//   exists.                                                              
+//                                                                        
+// RETURN:                                                                
+//   The leaf node in case of succes, 'NULL' otherwise.                   
 //                                                                        
 // NB: This function is not used by 'starcode()'.
+{
+
+   int i;
+
+   int nchar = strlen(string);
+   if (nchar != get_height(trie)) {
+      fprintf(stderr, "error: can only insert string of length %d\n",
+            get_height(trie));
+      ERROR = __LINE__;
+      return NULL;
+   }
+   
+   // Find existing path.
+   node_t *node = trie->root;
+   for (i = 0 ; i < nchar-1; i++) {
+      node_t *child;
+      int c = translate[(int) string[i]];
+      if ((child = (node_t *) node->child[c]) == NULL) {
+         break;
+      }
+      node = child;
+   }
+
+   // Append more nodes.
+   for ( ; i < nchar-1 ; i++) {
+      int c = translate[(int) string[i]];
+      node = insert(node, c, trie->info->arena);
+      if (node == NULL) {
+         fprintf(stderr, "error: could not insert string\n");
+         ERROR = __LINE__;
+         return NULL;
+      }
+   }
+
+   return node->child + translate[(int) string[nchar-1]];
+
+}
+
+
+node_t *
+insert
+(
+   node_t      * parent,
+   int           position,
+   nodearena_t * arena
+)
+// SYNOPSIS:
+//   Back end function to construct tries. Append a child to an existing
+//   node at specifieid position. The child is carved from the arena
+//   of the trie.
+//   NO CHECKING IS PERFORMED to make sure that this does not overwrite
+//   an existings node child (causing a memory leak) or that 'c' is an
+//   integer less than 5. Since 'insert' is called exclusiverly by
+//   'insert_string' after a call to 'find_path', this checking is not
+//   required. If 'insert' is called in another context, this check has
+//   to be performed.
+//
+// PARAMETERS:
+//   parent: the parent to append the node to
+//   position: the position of the child
+//   arena: the arena to carve the child from
+//
+// RETURN:
+//   The appended child node in case of success, 'NULL' otherwise.
+//
+// NB: This function is not used by 'starcode()'.
 {
    // Initilalize child node.
-   node_t *child = new_trienode();
+   node_t *child = nodearena_node(arena);
    if (child == NULL) {
       fprintf(stderr, "error: could not insert node\n");
       ERROR = __LINE__;
       return NULL;
    }
-   // Update child path and parent pointer.
-   child->path = (parent->path << 4) + position;
-   // Update parent node.
-   parent->child[position] = child;
+   // Update child path and parent pointer.
+   child->path = (parent->path << 4) + position;
+   // Update parent node.
+   parent->child[position] = child;
+
+   return child;
+
+}
+
+
+void **
+insert_string_wo_malloc
+(
+         trie_t  * trie,
+   const char    * string,
+         node_t ** from_addr
+)
+// TODO: document the function, explain that 'from_addr' is
+// incremented.
+// SYNOPSIS:                                                              
+//                                                                        
+// RETURN:                                                                
+{
+
+   int i;
+
+   int nchar = strlen(string);
+   if (nchar != get_height(trie)) {
+      fprintf(stderr, "error: can only insert string of length %d\n",
+            get_height(trie));
+      ERROR = __LINE__;
+      return NULL;
+   }
+   
+   // Find existing path.
+   node_t *node = trie->root;
+   for (i = 0 ; i < nchar-1; i++) {
+      node_t *child;
+      int c = translate[(int) string[i]];
+      if ((child = (node_t *) node->child[c]) == NULL) {
+         break;
+      }
+      node = child;
+   }
+
+   // Append more nodes.
+   for ( ; i < nchar-1 ; i++) {
+      int c = translate[(int) string[i]];
+      node = insert_wo_malloc(node, c, *from_addr);
+      (*from_addr)++; 
+   }
+
+   return node->child + translate[(int) string[nchar-1]];
+
+}
+
+node_t *
+insert_wo_malloc
+(
+   node_t * parent,
+   int      position,
+   node_t * at_address
+)
+// SYNOPSIS:                                                              
+//   Adds a child to the specified node without calling 'malloc()'.
+//   The data is copied at the addres given by the 'at_address'
+//   pointer.
+//   Checks whether the position to insert the node is free. If not,
+//   nothing is done and 'NULL' is returned.
+//                                                                        
+// PARAMETERS:                                                            
+//   parent: the parent node on which to add the child.
+//   position: a number from 0 to 5 indicating the rank of the child.
+//   at_address: the position in memory where to copy the child data.
+//                                                                        
+// RETURN:                                                                
+//   The address of the child node if the insert position is free,
+//   'NULL' otherwise.
+//
+// SIDE EFFECTS:
+//   Modifies the data pointed to by 'at_address'. Also modifies the
+//   parent node
+{
+
+   if (parent->child[position] != NULL) return NULL;
+   node_t *newnode = at_address; // for clarity
+
+   // Initialize child data.
+   init_trienode(newnode);
+   newnode->path = (parent->path << 4) + position;
+
+   parent->child[position] = newnode;
+
+   return newnode;
+
+}
+
+
+void
+destroy_trie
+(
+   trie_t * trie,
+   int      free_nodes,
+   void     (*destruct)(void *)
+)
+// SYNOPSIS:
+//   Front end function to recycle the memory allocated to a trie. Node
+//   data may or may not be recycled as well, depending on the destructor
+//   passed as argument. The nodes themselves belong to the arena of the
+//   trie (or to the caller for tries built with the "wo_malloc" path)
+//   so they are released in bulk, without walking the trie.
+//
+// PARAMETERS:
+//   trie: the trie to destroy
+//   free_nodes: kept for backward compatibility (ignored)
+//   destruct: a function with the same prototype as 'free()'
+//
+// RETURN:
+//   'void'.
+//
+// SIDE EFFECTS:
+//   Frees the memory allocated to the nodes of a trie, the meta-data
+//   associated to the root, and possibly the data associated to the tail
+//   nodes.
+{
+   (void) free_nodes;
+   // Free the milesones.
+   destroy_tower(trie->info->pebbles);
+   // The trie is walked only if the data of the tail nodes
+   // has to be destroyed. Otherwise teardown is a handful
+   // of calls to 'free()'.
+   if (destruct != NULL) {
+      destroy_data_from(trie->root, destruct, get_height(trie), 0);
+   }
+   destroy_nodearena(trie->info->arena);
+   trie->root = NULL;
+   free(trie->info);
+   free(trie);
+}
+
+
+void
+destroy_data_from
+(
+   node_t * node,
+   void     (*destruct)(void *),
+   int      maxdepth,
+   int      depth
+)
+// SYNOPSIS:
+//   Back end function to free the data associated to the tail nodes
+//   of a trie. The nodes themselves are not freed (they belong to the
+//   arena of the trie, or to the caller).
+//
+// RETURN:
+//   'void'.
+{
+   if (node != NULL) {
+      if (depth == maxdepth) {
+         (*destruct)(node);
+         return;
+      }
+      for (int i = 0 ; i < 6 ; i++) {
+         node_t * child = (node_t *) node->child[i];
+         destroy_data_from(child, destruct, maxdepth, depth+1);
+      }
+   }
+   return;
+}
+
+
+ctrie_t *
+new_ctrie
+(
+   unsigned int  height,
+   long          nnodes,
+   long          ndata
+)
+// SYNOPSIS:
+//   Front end constructor for a compact trie, an alternative to
+//   'new_trie()' where the children are 32 bit indices in a single
+//   node block instead of pointers. This about halves the memory
+//   per node, at the price of a cap of 4 billion nodes per trie.
+//
+// PARAMETERS:
+//   height: the fixed depth of the leaves
+//   nnodes: the expected number of nodes (presizes the node block)
+//   ndata: the expected number of strings (presizes the data array)
+//
+// RETURN:
+//   A pointer to an empty compact trie, or 'NULL' in case of failure.
+{
+
+   if (height < 1) {
+      fprintf(stderr, "error: the minimum trie height is 1\n");
+      ERROR = __LINE__;
+      return NULL;
+   }
+
+   // The blocks grow as needed, the hints only presize them.
+   if (nnodes < 1) nnodes = 1;
+   if (ndata < 1) ndata = 1;
+
+   ctrie_t *trie = malloc(sizeof(ctrie_t));
+   if (trie == NULL) {
+      fprintf(stderr, "error: could not create trie\n");
+      ERROR = __LINE__;
+      return NULL;
+   }
 
-   return child;
+   trie->nodes = malloc(nnodes * sizeof(cnode_t));
+   trie->data = malloc(ndata * sizeof(void *));
+   trie->pebbles = new_tower(M);
+   if (trie->nodes == NULL || trie->data == NULL ||
+         trie->pebbles == NULL) {
+      fprintf(stderr, "error: could not create trie\n");
+      ERROR = __LINE__;
+      if (trie->pebbles != NULL) destroy_tower(trie->pebbles);
+      free(trie->nodes);
+      free(trie->data);
+      free(trie);
+      return NULL;
+   }
+
+   trie->nnodes = 0;
+   trie->nslots = nnodes;
+   trie->ndata = 0;
+   trie->dslots = ndata;
+   trie->height = height;
+   trie->map = NULL;
+   trie->mapsize = 0;
+
+   // Create the root (it gets index 0 since the node block is
+   // empty) and push it to the ground level of 'pebbles'. This
+   // will be the only node at this level for the lifetime of
+   // the trie.
+   ctrie_node(trie);
+   if (push((void *) 0, trie->pebbles)) {
+      fprintf(stderr, "error: could not create trie\n");
+      ERROR = __LINE__;
+      destroy_tower(trie->pebbles);
+      free(trie->nodes);
+      free(trie->data);
+      free(trie);
+      return NULL;
+   }
+
+   return trie;
+
+}
+
+
+uint32_t
+ctrie_node
+(
+   ctrie_t * trie
+)
+// SYNOPSIS:
+//   Back end function to carve one node from the node block of a
+//   compact trie, doubling the block if it is full. The node is
+//   initialized like the nodes returned by 'new_trienode()'.
+//
+// RETURN:
+//   The index of the new node, or 0 (the root) in case of failure.
+{
+
+   if (trie->nnodes == trie->nslots) {
+      // The node block of a loaded trie belongs to the mapping
+      // of the index file: it cannot grow (see 'load_ctrie()').
+      if (trie->map != NULL) {
+         fprintf(stderr, "error: cannot grow a loaded trie\n");
+         ERROR = __LINE__;
+         return 0;
+      }
+      uint32_t nslots = 2 * trie->nslots;
+      cnode_t *ptr = realloc(trie->nodes, nslots * sizeof(cnode_t));
+      if (ptr == NULL) {
+         fprintf(stderr, "error: could not create trie node\n");
+         ERROR = __LINE__;
+         return 0;
+      }
+      trie->nodes = ptr;
+      trie->nslots = nslots;
+   }
+
+   cnode_t *node = trie->nodes + trie->nnodes;
+   memset(node->child, 0, sizeof(node->child));
+   node->path = 0;
+
+   // Initialize the cache. This is important for the
+   // dynamic programming algorithm.
+   const char init[] = {8,7,6,5,4,3,2,1,0,1,2,3,4,5,6,7,8};
+   memcpy(node->cache, init, 2*TAU+1);
+
+   return trie->nnodes++;
 
 }
 
 
 void **
-insert_string_wo_malloc
+insert_string_ctrie
 (
-         trie_t  * trie,
-   const char    * string,
-         node_t ** from_addr
+         ctrie_t * trie,
+   const char    * string
 )
-// TODO: document the function, explain that 'from_addr' is
-// incremented.
-// SYNOPSIS:                                                              
-//                                                                        
-// RETURN:                                                                
+// SYNOPSIS:
+//   Version of 'insert_string()' for compact tries. Insert a string
+//   from root, or simply return the data slot at the end of the
+//   string path if it already exists.
+//
+// RETURN:
+//   The address of the data slot of the string in case of success,
+//   'NULL' otherwise. The address is invalidated by later insertions
+//   so the caller must use it before inserting another string.
 {
 
    int i;
 
    int nchar = strlen(string);
-   if (nchar != get_height(trie)) {
+   if (nchar != (int) trie->height) {
       fprintf(stderr, "error: can only insert string of length %d\n",
-            get_height(trie));
+            (int) trie->height);
       ERROR = __LINE__;
       return NULL;
    }
-   
+
    // Find existing path.
-   node_t *node = trie->root;
-   for (i = 0 ; i < nchar-1; i++) {
-      node_t *child;
+   uint32_t node = 0;
+   for (i = 0 ; i < nchar-1 ; i++) {
       int c = translate[(int) string[i]];
-      if ((child = (node_t *) node->child[c]) == NULL) {
-         break;
-      }
+      uint32_t child = trie->nodes[node].child[c];
+      if (child == 0) break;
       node = child;
    }
 
    // Append more nodes.
    for ( ; i < nchar-1 ; i++) {
       int c = translate[(int) string[i]];
-      node = insert_wo_malloc(node, c, *from_addr);
-      (*from_addr)++; 
+      uint32_t child = ctrie_node(trie);
+      if (child == 0) {
+         fprintf(stderr, "error: could not insert string\n");
+         ERROR = __LINE__;
+         return NULL;
+      }
+      trie->nodes[child].path = (trie->nodes[node].path << 4) + c;
+      trie->nodes[node].child[c] = child;
+      node = child;
    }
 
-   return node->child + translate[(int) string[nchar-1]];
+   // The slot of the last character refers to the data array
+   // (index plus one, 0 meaning empty).
+   int c = translate[(int) string[nchar-1]];
+   uint32_t slot = trie->nodes[node].child[c];
+   if (slot == 0) {
+      if (trie->ndata == trie->dslots) {
+         uint32_t dslots = 2 * trie->dslots;
+         void **ptr = realloc(trie->data, dslots * sizeof(void *));
+         if (ptr == NULL) {
+            fprintf(stderr, "error: could not insert string\n");
+            ERROR = __LINE__;
+            return NULL;
+         }
+         trie->data = ptr;
+         trie->dslots = dslots;
+      }
+      trie->data[trie->ndata] = NULL;
+      slot = ++trie->ndata;
+      trie->nodes[node].child[c] = slot;
+   }
+
+   return trie->data + (slot-1);
 
 }
 
-node_t *
-insert_wo_malloc
+
+void **
+insert_string_ctrie_sorted
 (
-   node_t * parent,
-   int      position,
-   node_t * at_address
+         ctrie_t  * trie,
+   const char     * string,
+   const char     * prev,
+         uint32_t * spine
 )
-// SYNOPSIS:                                                              
-//   Adds a child to the specified node without calling 'malloc()'.
-//   The data is copied at the addres given by the 'at_address'
-//   pointer.
-//   Checks whether the position to insert the node is free. If not,
-//   nothing is done and 'NULL' is returned.
-//                                                                        
-// PARAMETERS:                                                            
-//   parent: the parent node on which to add the child.
-//   position: a number from 0 to 5 indicating the rank of the child.
-//   at_address: the position in memory where to copy the child data.
-//                                                                        
-// RETURN:                                                                
-//   The address of the child node if the insert position is free,
-//   'NULL' otherwise.
+// SYNOPSIS:
+//   Bulk insertion path of 'insert_string_ctrie()' for strings
+//   inserted in lexicographic order. The caller passes the string
+//   inserted just before ('NULL' for the first one) and a scratch
+//   array with at least the height of the trie entries, where this
+//   function maintains the node path of the last insertion. The
+//   descent starts from the longest common prefix with the previous
+//   string instead of the root, so building a trie from a sorted
+//   block touches every node a constant number of times.
 //
-// SIDE EFFECTS:
-//   Modifies the data pointed to by 'at_address'. Also modifies the
-//   parent node
+// RETURN:
+//   The address of the data slot of the string in case of success,
+//   'NULL' otherwise. The address is invalidated by later insertions
+//   so the caller must use it before inserting another string.
 {
 
-   if (parent->child[position] != NULL) return NULL;
-   node_t *newnode = at_address; // for clarity
+   int nchar = strlen(string);
+   if (nchar != (int) trie->height) {
+      fprintf(stderr, "error: can only insert string of length %d\n",
+            (int) trie->height);
+      ERROR = __LINE__;
+      return NULL;
+   }
 
-   // Initialize child data.
-   memset(newnode->child, 0, 6 * sizeof(void *));
-   newnode->path = (parent->path << 4) + position;
-   const char init[] = {8,7,6,5,4,3,2,1,0,1,2,3,4,5,6,7,8};
-   memcpy(newnode->cache, init, 2*TAU+1);
+   // Start from the longest common prefix with the previous
+   // string: 'spine[i]' holds the node reached after 'i'
+   // characters (the root for i = 0).
+   int i = 0;
+   if (prev != NULL) {
+      while (i < nchar-1 && string[i] == prev[i]) i++;
+   }
+   spine[0] = 0;
+   uint32_t node = spine[i];
 
-   parent->child[position] = newnode;
+   // Find existing path.
+   for ( ; i < nchar-1 ; i++) {
+      int c = translate[(int) string[i]];
+      uint32_t child = trie->nodes[node].child[c];
+      if (child == 0) break;
+      node = child;
+      spine[i+1] = child;
+   }
 
-   return newnode;
+   // Append more nodes.
+   for ( ; i < nchar-1 ; i++) {
+      int c = translate[(int) string[i]];
+      uint32_t child = ctrie_node(trie);
+      if (child == 0) {
+         fprintf(stderr, "error: could not insert string\n");
+         ERROR = __LINE__;
+         return NULL;
+      }
+      trie->nodes[child].path = (trie->nodes[node].path << 4) + c;
+      trie->nodes[node].child[c] = child;
+      node = child;
+      spine[i+1] = child;
+   }
+
+   // The slot of the last character refers to the data array
+   // (index plus one, 0 meaning empty).
+   int c = translate[(int) string[nchar-1]];
+   uint32_t slot = trie->nodes[node].child[c];
+   if (slot == 0) {
+      if (trie->ndata == trie->dslots) {
+         uint32_t dslots = 2 * trie->dslots;
+         void **ptr = realloc(trie->data, dslots * sizeof(void *));
+         if (ptr == NULL) {
+            fprintf(stderr, "error: could not insert string\n");
+            ERROR = __LINE__;
+            return NULL;
+         }
+         trie->data = ptr;
+         trie->dslots = dslots;
+      }
+      trie->data[trie->ndata] = NULL;
+      slot = ++trie->ndata;
+      trie->nodes[node].child[c] = slot;
+   }
+
+   return trie->data + (slot-1);
 
 }
 
 
 void
-destroy_trie
+destroy_ctrie
 (
-   trie_t * trie,
-   int      free_nodes,
-   void     (*destruct)(void *)
+   ctrie_t * trie,
+   void      (*destruct)(void *)
 )
-// SYNOPSIS:                                                              
-//   Front end function to recycle the memory allocated to a trie. Node   
-//   data may or may not be recycled as well, depending on the destructor 
-//   passed as argument. This function is essentially a wrapper for       
-//   'destroy_nodes_()', the only difference is that it      
-//   destroys the meta-data of the trie first.                            
-//                                                                        
-// PARAMETERS:                                                            
-//   trie: the trie to destroy                                            
-//   destruct: a function with the same prototype as 'free()'             
-//                                                                        
-// RETURN:                                                                
-//   'void'.                                                              
-//                                                                        
-// SIDE EFFECTS:                                                          
-//   Frees the memory allocated to the nodes of a trie, the meta-data     
-//   associated to the root, and possibly the data associated to the tail 
-//   nodes.                                                               
+// SYNOPSIS:
+//   Front end function to recycle the memory allocated to a compact
+//   trie. The data of the tails is stored in a dense array so no walk
+//   of the trie is required, even when a destructor is given.
+//
+// PARAMETERS:
+//   trie: the compact trie to destroy
+//   destruct: a function with the same prototype as 'free()'
 {
-   // Free the milesones.
-   destroy_tower(trie->info->pebbles);
-   destroy_from(trie->root, destruct, free_nodes, get_height(trie), 0);
-   if (!free_nodes) {
-      free(trie->root);
-      trie->root = NULL;
+   destroy_tower(trie->pebbles);
+   if (destruct != NULL) {
+      for (uint32_t i = 0 ; i < trie->ndata ; i++) {
+         if (trie->data[i] != NULL) (*destruct)(trie->data[i]);
+      }
    }
-   free(trie->info);
+   // The node block of a loaded trie belongs to the mapping of
+   // the index file (see 'load_ctrie()').
+   if (trie->map != NULL) munmap(trie->map, trie->mapsize);
+   else free(trie->nodes);
+   free(trie->data);
    free(trie);
 }
 
 
-void
-destroy_from
+// On-disk layout of a serialized compact trie: this header
+// followed by the node block (see 'save_ctrie()').
+static const char CTRIE_MAGIC[8] = "STCTRIE";
+struct ctriehdr_t {
+   char     magic[8];               // "STCTRIE\0".
+   uint32_t version;                // Format version (1).
+   uint32_t height;                 // Height of the trie.
+   uint32_t nnodes;                 // Nodes in the block.
+   uint32_t ndata;                  // Data slots of the tails.
+};
+typedef struct ctriehdr_t ctriehdr_t;
+
+
+int
+save_ctrie
 (
-   node_t * node,
-   void     (*destruct)(void *),
-   int      free_nodes,
-   int      maxdepth,
-   int      depth
+   ctrie_t * trie,
+   FILE    * f
 )
-// SYNOPSIS:                                                              
-//   Back end function to free the memory allocated on a trie. It should  
-//   not be called directly on a trie to prevent memory leaks (otherwise  
-//   the pebbles will not be freed).                                      
-//                                                                        
-// RETURN:                                                                
-//   'void'.                                                              
-//                                                                        
-// SIDE EFFECTS:                                                          
-//   Frees the memory allocated to the nodes of a trie, and possibly the  
-//   data associated to the tail nodes.                                   
-{  
-   if (node != NULL) {
-      if (depth == maxdepth) {
-         if (destruct != NULL) (*destruct)(node);
-         return;
-      }
-      for (int i = 0 ; i < 6 ; i++) {
-         node_t * child = (node_t *) node->child[i];
-         destroy_from(child, destruct, free_nodes, maxdepth, depth+1);
+// SYNOPSIS:
+//   Serializes a compact trie to a file. The node block uses 32 bit
+//   indices so it is position independent and is written almost
+//   verbatim; only the dynamic programming caches are reset to
+//   their initial state so that a loaded trie starts from a clean
+//   search state. The data array holds pointers of the caller and
+//   is not serialized: a loaded trie has empty data slots in
+//   insertion order (see 'load_ctrie()').
+//
+// RETURN:
+//   0 upon success, 1 upon failure (and 'ERROR' is set).
+{
+
+   ctriehdr_t hdr = {{0}};
+   memcpy(hdr.magic, CTRIE_MAGIC, 8);
+   hdr.version = 1;
+   hdr.height  = trie->height;
+   hdr.nnodes  = trie->nnodes;
+   hdr.ndata   = trie->ndata;
+   if (fwrite(&hdr, sizeof(ctriehdr_t), 1, f) != 1) {
+      fprintf(stderr, "error: could not write trie index\n");
+      ERROR = __LINE__;
+      return 1;
+   }
+
+   const char init[2*TAU+1] = {8,7,6,5,4,3,2,1,0,1,2,3,4,5,6,7,8};
+   cnode_t buf[512];
+   uint32_t done = 0;
+   while (done < trie->nnodes) {
+      uint32_t chunk = min(512, trie->nnodes - done);
+      memcpy(buf, trie->nodes + done, chunk * sizeof(cnode_t));
+      for (uint32_t i = 0 ; i < chunk ; i++) {
+         memcpy(buf[i].cache, init, 2*TAU+1);
       }
-      if (free_nodes) {
-         free(node);
-         node = NULL;
+      if (fwrite(buf, sizeof(cnode_t), chunk, f) != chunk) {
+         fprintf(stderr, "error: could not write trie index\n");
+         ERROR = __LINE__;
+         return 1;
       }
+      done += chunk;
    }
-   return;
+
+   if (fflush(f) != 0) {
+      fprintf(stderr, "error: could not write trie index\n");
+      ERROR = __LINE__;
+      return 1;
+   }
+
+   return 0;
+
+}
+
+
+ctrie_t *
+load_ctrie
+(
+   FILE * f
+)
+// SYNOPSIS:
+//   Loads a compact trie serialized by 'save_ctrie()'. The node
+//   block is memory mapped copy-on-write straight from the file:
+//   loading copies no node, concurrent processes share the clean
+//   pages through the page cache, and the searches can still write
+//   to the dynamic programming caches (only the pages they touch
+//   are duplicated). The data slots are empty and in insertion
+//   order: the caller rebinds them by inserting the original
+//   strings again, which returns the existing slots. A loaded trie
+//   cannot receive new strings.
+//
+// RETURN:
+//   A pointer to the loaded trie, or 'NULL' in case of failure
+//   (and 'ERROR' is set).
+{
+
+   struct stat st;
+   int fd = fileno(f);
+   if (fd < 0 || fstat(fd, &st) < 0) {
+      fprintf(stderr, "error: could not read trie index\n");
+      ERROR = __LINE__;
+      return NULL;
+   }
+   size_t size = st.st_size;
+   if (size < sizeof(ctriehdr_t)) {
+      fprintf(stderr, "error: corrupted trie index\n");
+      ERROR = __LINE__;
+      return NULL;
+   }
+
+   void *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+         MAP_PRIVATE, fd, 0);
+   if (map == MAP_FAILED) {
+      fprintf(stderr, "error: could not read trie index\n");
+      ERROR = __LINE__;
+      return NULL;
+   }
+
+   ctriehdr_t hdr;
+   memcpy(&hdr, map, sizeof(ctriehdr_t));
+   if (memcmp(hdr.magic, CTRIE_MAGIC, 8) != 0 || hdr.version != 1 ||
+         hdr.nnodes < 1 || hdr.height < 1 ||
+         size < sizeof(ctriehdr_t) + hdr.nnodes * sizeof(cnode_t)) {
+      fprintf(stderr, "error: corrupted trie index\n");
+      ERROR = __LINE__;
+      munmap(map, size);
+      return NULL;
+   }
+
+   ctrie_t *trie = malloc(sizeof(ctrie_t));
+   void **data = calloc(hdr.ndata > 0 ? hdr.ndata : 1, sizeof(void *));
+   gstack_t **pebbles = new_tower(M);
+   if (trie == NULL || data == NULL || pebbles == NULL ||
+         push((void *) 0, pebbles)) {
+      fprintf(stderr, "error: could not load trie\n");
+      ERROR = __LINE__;
+      if (pebbles != NULL) destroy_tower(pebbles);
+      free(data);
+      free(trie);
+      munmap(map, size);
+      return NULL;
+   }
+
+   trie->nodes   = (cnode_t *) ((char *) map + sizeof(ctriehdr_t));
+   trie->nnodes  = hdr.nnodes;
+   trie->nslots  = hdr.nnodes;
+   trie->data    = data;
+   trie->ndata   = hdr.ndata;
+   trie->dslots  = hdr.ndata > 0 ? hdr.ndata : 1;
+   trie->height  = hdr.height;
+   trie->pebbles = pebbles;
+   trie->map     = map;
+   trie->mapsize = size;
+
+   return trie;
+
+}
+
+
+ctrie_t *
+clone_ctrie
+(
+   ctrie_t * trie
+)
+// SYNOPSIS:
+//   Duplicates a compact trie. The node block uses 32 bit indices
+//   so it is position independent and the copy is a plain 'memcpy';
+//   the data slots are copied shallow (the clone refers to the same
+//   data as the original). Searches write to the node caches and to
+//   the pebbles, so threads that query the same set of strings
+//   concurrently must each work on their own clone.
+//
+// RETURN:
+//   A pointer to the clone, or 'NULL' in case of failure (and
+//   'ERROR' is set). The clone is heap allocated even when the
+//   original is a loaded trie, and it can grow. Destroy it with
+//   'destroy_ctrie()' and a 'NULL' destructor so that the shared
+//   data is freed only once.
+{
+
+   ctrie_t *clone = malloc(sizeof(ctrie_t));
+   if (clone == NULL) {
+      fprintf(stderr, "error: could not clone trie\n");
+      ERROR = __LINE__;
+      return NULL;
+   }
+
+   clone->nodes = malloc(trie->nnodes * sizeof(cnode_t));
+   clone->data = malloc(trie->dslots * sizeof(void *));
+   clone->pebbles = new_tower(M);
+   if (clone->nodes == NULL || clone->data == NULL ||
+         clone->pebbles == NULL ||
+         push((void *) 0, clone->pebbles)) {
+      fprintf(stderr, "error: could not clone trie\n");
+      ERROR = __LINE__;
+      if (clone->pebbles != NULL) destroy_tower(clone->pebbles);
+      free(clone->nodes);
+      free(clone->data);
+      free(clone);
+      return NULL;
+   }
+
+   memcpy(clone->nodes, trie->nodes, trie->nnodes * sizeof(cnode_t));
+   memcpy(clone->data, trie->data, trie->ndata * sizeof(void *));
+   clone->nnodes  = trie->nnodes;
+   clone->nslots  = trie->nnodes;
+   clone->ndata   = trie->ndata;
+   clone->dslots  = trie->dslots;
+   clone->height  = trie->height;
+   clone->map     = NULL;
+   clone->mapsize = 0;
+
+   return clone;
+
 }
 
 
@@ -914,3 +2036,20 @@ int recursive_count_nodes(node_t * node, int maxdepth, int depth) {
    }
    return count;
 }
+
+// Same snippets for compact tries.
+int count_cnodes(ctrie_t * trie) {
+   return recursive_count_cnodes(trie, 0, trie->height, 0);
+}
+
+int recursive_count_cnodes(ctrie_t *trie, uint32_t node, int maxdepth,
+      int depth) {
+   int count = 1;
+   for (int i = 0 ; i < 6 ; i++) {
+      uint32_t child = trie->nodes[node].child[i];
+      if (child == 0) continue;
+      count += depth < maxdepth - 1 ?
+         recursive_count_cnodes(trie, child, maxdepth, depth+1) : 1;
+   }
+   return count;
+}
@@ -38,14 +38,20 @@
 
 static const char BASES[8] = "ACGTN";
 
+struct cnode_t;
+struct ctrie_t;
 struct gstack_t;
 struct info_t;
 struct node_t;
+struct nodearena_t;
 struct trie_t;
 
+typedef struct cnode_t cnode_t;
+typedef struct ctrie_t ctrie_t;
 typedef struct gstack_t gstack_t;
 typedef struct info_t info_t;
 typedef struct node_t node_t;
+typedef struct nodearena_t nodearena_t;
 typedef struct trie_t trie_t;
 
 // Global constants.
@@ -54,19 +60,32 @@ typedef struct trie_t trie_t;
 #define MAXBRCDLEN 1023     // Maximum barcode length.
 #define GSTACK_INIT_SIZE 16 // Initial slots of 'gstack'.
 
-gstack_t * const TOWER_TOP;
+extern gstack_t * const TOWER_TOP;
+extern __thread long TRIE_VISITS;
 
 int         check_trie_error_and_reset (void);
+ctrie_t  *  clone_ctrie (ctrie_t *);
+int         count_cnodes (ctrie_t*);
 int         count_nodes (trie_t*);
+void        destroy_ctrie (ctrie_t*, void(*)(void *));
+void        destroy_nodearena (nodearena_t *);
 void        destroy_tower (gstack_t **);
 void        destroy_trie (trie_t*, int, void(*)(void *));
+void     ** insert_string_ctrie (ctrie_t *, const char *);
+void     ** insert_string_ctrie_sorted (ctrie_t *, const char *,
+                  const char *, uint32_t *);
 void     ** insert_string_wo_malloc (trie_t *, const char *, node_t **);
 void     ** insert_string (trie_t*, const char*);
+ctrie_t  *  load_ctrie (FILE *);
+ctrie_t  *  new_ctrie (unsigned int, long, long);
 gstack_t *  new_gstack (void);
+nodearena_t * new_nodearena (void);
 gstack_t ** new_tower (int);
 trie_t   *  new_trie (unsigned int);
 int         push (void*, gstack_t**);
+int         save_ctrie (ctrie_t *, FILE *);
 int         search (trie_t*, const char*, int, gstack_t**, int, int);
+int         search_ctrie (ctrie_t*, const char*, int, gstack_t**, int, int);
 
 struct trie_t
 {
@@ -82,6 +101,35 @@ struct node_t
    char       cache[2*TAU+1];       // Dynamic programming space.
 };
 
+// Compact version of 'node_t'. Children are 32 bit indices in the
+// node block of a 'ctrie_t' instead of pointers (0 means that there
+// is no child), which about halves the memory per node.
+struct cnode_t
+{
+   uint32_t   child[6];             // Array of 6 children indices.
+   uint32_t   path;                 // Encoded path end to the node.
+   char       cache[2*TAU+1];       // Dynamic programming space.
+};
+
+// Compact version of 'trie_t'. The nodes live in a single block
+// where the root has index 0. The slots of the last characters of
+// the inserted strings refer to the 'data' array (index plus one,
+// 0 meaning empty) instead of holding a pointer.
+struct ctrie_t
+{
+   cnode_t      * nodes;            // Node block (node 0 is the root).
+   uint32_t       nnodes;           // Nodes in use.
+   uint32_t       nslots;           // Allocated node slots.
+   void        ** data;             // Data of the tail nodes.
+   uint32_t       ndata;            // Data slots in use.
+   uint32_t       dslots;           // Allocated data slots.
+   unsigned int   height;           // Critical depth with all hits.
+   gstack_t    ** pebbles;          // White pebbles for the search.
+   void         * map;              // Mapping of a loaded trie
+                                    // (NULL if heap-allocated).
+   size_t         mapsize;          // Size of the mapping.
+};
+
 struct gstack_t
 {
    int       nslots;                // Stack size.
@@ -93,6 +141,7 @@ struct info_t
 {
    unsigned int         height;     // Critical depth with all hits.
    struct   gstack_t ** pebbles;    // White pebbles for the search.
+   struct   nodearena_t * arena;    // Node storage of the trie.
 };
 
 #endif
@@ -1,10 +1,14 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <time.h>
 #include <errno.h>
+#include <pthread.h>
 #include <cairo.h>
 #include <cairo-pdf.h>
+#include <cairo-svg.h>
 #include <execinfo.h>
 #include <signal.h>
 #include <unistd.h>
@@ -86,7 +90,10 @@ int main(int argc, const char *argv[])
    ball_list[7]->root = ball_list[4];
    /* End test code */
 
-   force_directed_drawing(n_balls, ball_list);
+   // The extension of the output file selects the surface
+   // (.svg for SVG, anything else for PDF).
+   const char * fname = argc > 1 ? argv[1] : "example_starcode_image.pdf";
+   force_directed_drawing(n_balls, ball_list, fname);
 
    return 0;
 }
@@ -94,8 +101,9 @@ int main(int argc, const char *argv[])
 void
 force_directed_drawing
 (
-   int       n_balls,
-   ball_t ** ball_list
+   int          n_balls,
+   ball_t    ** ball_list,
+   const char * fname
 )
 {
    // Initialize ball positions.
@@ -128,10 +136,16 @@ force_directed_drawing
    int offset[2] = { 0, 0 };
    resize_canvas(canvas_size, n_stars, star_list, offset);
    cairo_surface_t * surface;
-   surface = cairo_pdf_surface_create(
-         "example_starcode_image.pdf", canvas_size[0], canvas_size[1]);
+   size_t flen = strlen(fname);
+   if (flen > 4 && strcmp(fname + flen - 4, ".svg") == 0) {
+      surface = cairo_svg_surface_create(
+            fname, canvas_size[0], canvas_size[1]);
+   } else {
+      surface = cairo_pdf_surface_create(
+            fname, canvas_size[0], canvas_size[1]);
+   }
    cairo_t * cr = cairo_create(surface);
-   draw_cairo_env(cr, n_balls, ball_list, offset);
+   draw_cairo_env(cr, n_balls, ball_list, offset, canvas_size);
    cairo_surface_finish(surface);
 }
 
@@ -248,6 +262,9 @@ compute_force
    double x_dist = ball2->position[0] - ball1->position[0];
    double y_dist = ball2->position[1] - ball1->position[1];
    double v_norm = norm(x_dist, y_dist);
+   // Coincident balls have no direction to push: leave them to the
+   // repulsion of the others instead of producing nan coordinates.
+   if (v_norm == 0.0) return;
    double force;
    if (force_type == 0) {
       force = elastic(v_norm);
@@ -282,13 +299,187 @@ move_ball
    return norm(x_movement, y_movement);
 }
 
+int
+compar_root
+(
+   const void * elem1,
+   const void * elem2
+)
+{
+   ball_t * ball1 = *(ball_t **) elem1;
+   ball_t * ball2 = *(ball_t **) elem2;
+   if (ball1->root == ball2->root) return 0;
+   return (ball1->root < ball2->root) ? -1 : 1;
+}
+
+int
+qtree_node
+(
+   qtree_t * qtree,
+   double    x_center,
+   double    y_center,
+   double    half
+)
+{
+   if (qtree->n_nodes >= qtree->n_slots) {
+      qtree->n_slots = qtree->n_slots ? 2 * qtree->n_slots : 256;
+      qtree->nodes =
+         realloc(qtree->nodes, qtree->n_slots * sizeof(qnode_t));
+      if (qtree->nodes == NULL) {
+         fprintf(stderr, "Error in qtree realloc: %s\n", strerror(errno));
+         exit(1);
+      }
+   }
+   qnode_t * node = qtree->nodes + qtree->n_nodes;
+   memset(node, 0, sizeof(qnode_t));
+   node->center[0] = x_center;
+   node->center[1] = y_center;
+   node->half = half;
+   return qtree->n_nodes++;
+}
+
 void
-physics_loop
+qtree_descend
 (
-   int       n_balls,
+   qtree_t * qtree,
+   int       i,
+   ball_t  * ball
+)
+{
+   // Quadrant of the ball in the cell (x then y).
+   int q = (ball->position[0] > qtree->nodes[i].center[0]) +
+       2 * (ball->position[1] > qtree->nodes[i].center[1]);
+   if (qtree->nodes[i].children[q] == 0) {
+      double half = qtree->nodes[i].half / 2;
+      double x_center =
+         qtree->nodes[i].center[0] + (q & 1 ? half : -half);
+      double y_center =
+         qtree->nodes[i].center[1] + (q & 2 ? half : -half);
+      // May realloc the pool: no pointer is kept across the call.
+      int child = qtree_node(qtree, x_center, y_center, half);
+      qtree->nodes[i].children[q] = child;
+   }
+   qtree_insert(qtree, qtree->nodes[i].children[q], ball);
+}
+
+void
+qtree_insert
+(
+   qtree_t * qtree,
+   int       i,
+   ball_t  * ball
+)
+{
+   qnode_t * node = qtree->nodes + i;
+   node->mass += ball->size;
+   node->com[0] += ball->size * ball->position[0];
+   node->com[1] += ball->size * ball->position[1];
+   node->count++;
+   // A cell with a single ball keeps it without subdividing.
+   if (node->count == 1) {
+      node->ball = ball;
+      return;
+   }
+   if (node->count == 2) {
+      // The cell was a leaf: push the resident ball down too.
+      ball_t * resident = node->ball;
+      node->ball = NULL;
+      // Coincident balls cannot be separated by subdivision:
+      // move the new one somewhere else in the cell (staying
+      // inside it guarantees that the subdivision terminates).
+      while (ball->position[0] == resident->position[0] &&
+             ball->position[1] == resident->position[1]) {
+         double r1 = rand_r(&qtree->seed) / (double) RAND_MAX - 0.5;
+         double r2 = rand_r(&qtree->seed) / (double) RAND_MAX - 0.5;
+         ball->position[0] = node->center[0] + r1 * node->half;
+         ball->position[1] = node->center[1] + r2 * node->half;
+      }
+      qtree_descend(qtree, i, resident);
+   }
+   qtree_descend(qtree, i, ball);
+}
+
+void
+qtree_build
+(
+   qtree_t * qtree,
+   ball_t ** ball_list,
+   int       n_balls
+)
+{
+   // Bounding square of the balls.
+   double x_max = -INFINITY;
+   double x_min =  INFINITY;
+   double y_max = -INFINITY;
+   double y_min =  INFINITY;
+   for (int i = 0; i < n_balls; i++) {
+      ball_t * ball = ball_list[i];
+      if (ball->position[0] > x_max) x_max = ball->position[0];
+      if (ball->position[0] < x_min) x_min = ball->position[0];
+      if (ball->position[1] > y_max) y_max = ball->position[1];
+      if (ball->position[1] < y_min) y_min = ball->position[1];
+   }
+   double half = ((x_max - x_min) > (y_max - y_min) ?
+         (x_max - x_min) : (y_max - y_min)) / 2;
+   if (half <= 0.0) half = 1e-6;
+   qtree->n_nodes = 0;
+   int root = qtree_node(qtree,
+         (x_min + x_max) / 2, (y_min + y_max) / 2, half);
+   for (int i = 0; i < n_balls; i++) {
+      qtree_insert(qtree, root, ball_list[i]);
+   }
+}
+
+void
+qtree_repulsion
+(
+   qtree_t * qtree,
+   int       i,
+   ball_t  * ball
+)
+{
+   qnode_t * node = qtree->nodes + i;
+   double force;
+   double x_dist;
+   double y_dist;
+   if (node->count == 1) {
+      if (node->ball == ball) return;
+      x_dist = node->ball->position[0] - ball->position[0];
+      y_dist = node->ball->position[1] - ball->position[1];
+      double v_norm = norm(x_dist, y_dist);
+      force = electric(ball, node->ball, v_norm);
+      ball->force[0] += -force * x_dist / v_norm;
+      ball->force[1] += -force * y_dist / v_norm;
+      return;
+   }
+   x_dist = node->com[0] / node->mass - ball->position[0];
+   y_dist = node->com[1] / node->mass - ball->position[1];
+   double v_norm = norm(x_dist, y_dist);
+   // The cell is far enough: repulse from its center of mass. A
+   // ball always fails this test for the cells that contain it,
+   // so it never repulses itself.
+   if (2 * node->half < BH_THETA * v_norm) {
+      double ke = 5.0e1;
+      force = ke * ball->size * node->mass / pow(v_norm, 2);
+      ball->force[0] += -force * x_dist / v_norm;
+      ball->force[1] += -force * y_dist / v_norm;
+      return;
+   }
+   for (int q = 0; q < 4; q++) {
+      if (node->children[q]) {
+         qtree_repulsion(qtree, node->children[q], ball);
+      }
+   }
+}
+
+void
+star_physics
+(
+   qtree_t * qtree,
    ball_t ** ball_list,
+   int       n_balls,
    int       moves,
-   double  * movement_list
+   double  * movements
 )
 {
    for (int k = 0; k < moves; k++) {
@@ -297,26 +488,114 @@ physics_loop
          ball_list[i]->force[0] = 0.0;
          ball_list[i]->force[1] = 0.0;
       }
-      // Compute the forces among the balls.
+      // Compute the elastic forces along the bonds...
       for (int i = 0; i < n_balls; i++) {
          ball_t * ball = ball_list[i];
-         // Compute elastic... 
          for (int j = 0; j < ball->n_children; j++) {
             compute_force(ball, ball->children[j], 0);
          }
-         // ...and electric forces.
-         for (int k = i+1; k < n_balls; k++) {
-            // Isolate the physics of different stars.
-            if (ball->root == ball_list[k]->root) {
-               compute_force(ball, ball_list[k], 1);
-            }
+      }
+      // ...and the electric forces through the quadtree: each
+      // ball gathers the repulsion of the others in O(log n)
+      // instead of the all-pairs O(n).
+      if (n_balls > 1) {
+         qtree_build(qtree, ball_list, n_balls);
+         for (int i = 0; i < n_balls; i++) {
+            qtree_repulsion(qtree, 0, ball_list[i]);
          }
       }
-      movement_list[k] = 0.0;
       for (int i = 0; i < n_balls; i++) {
-         movement_list[k] += move_ball(ball_list[i]);
+         movements[k] += move_ball(ball_list[i]);
+      }
+   }
+}
+
+void *
+physics_chunk
+(
+   void * args
+)
+{
+   chunk_t * chunk = (chunk_t *) args;
+   // The quadtree is recycled over the stars of the chunk.
+   qtree_t qtree = { 0 };
+   qtree.seed = chunk->from + 1;
+   for (int g = chunk->from; g < chunk->to; g++) {
+      star_physics(&qtree, chunk->balls + chunk->bounds[g],
+            chunk->bounds[g+1] - chunk->bounds[g],
+            chunk->moves, chunk->movements);
+   }
+   free(qtree.nodes);
+   return NULL;
+}
+
+void
+physics_loop
+(
+   int       n_balls,
+   ball_t ** ball_list,
+   int       moves,
+   double  * movement_list
+)
+{
+   // The physics of different stars is isolated, so the stars are
+   // independent simulations: group the balls by star and give each
+   // worker thread a slice of the groups to run in full.
+   ball_t ** balls = malloc(n_balls * sizeof(ball_t *));
+   int * bounds = malloc((n_balls + 1) * sizeof(int));
+   if (balls == NULL || bounds == NULL) {
+      fprintf(stderr, "Error in physics malloc: %s\n", strerror(errno));
+      exit(1);
+   }
+   memcpy(balls, ball_list, n_balls * sizeof(ball_t *));
+   qsort(balls, n_balls, sizeof(ball_t *), compar_root);
+   int n_groups = 0;
+   bounds[0] = 0;
+   for (int i = 1; i < n_balls; i++) {
+      if (balls[i]->root != balls[i-1]->root) bounds[++n_groups] = i;
+   }
+   bounds[++n_groups] = n_balls;
+
+   int n_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+   if (n_threads < 1) n_threads = 1;
+   if (n_threads > n_groups) n_threads = n_groups;
+
+   pthread_t * threads = malloc(n_threads * sizeof(pthread_t));
+   chunk_t * chunks = malloc(n_threads * sizeof(chunk_t));
+   double * movements = calloc((size_t) n_threads * moves,
+         sizeof(double));
+   if (threads == NULL || chunks == NULL || movements == NULL) {
+      fprintf(stderr, "Error in physics malloc: %s\n", strerror(errno));
+      exit(1);
+   }
+   for (int t = 0; t < n_threads; t++) {
+      chunks[t].from = (int) ((long) t * n_groups / n_threads);
+      chunks[t].to = (int) ((long) (t+1) * n_groups / n_threads);
+      chunks[t].moves = moves;
+      chunks[t].bounds = bounds;
+      chunks[t].balls = balls;
+      chunks[t].movements = movements + (size_t) t * moves;
+      if (pthread_create(threads + t, NULL, physics_chunk, chunks + t)) {
+         fprintf(stderr, "Error in pthread_create: %s\n", strerror(errno));
+         exit(1);
       }
    }
+   for (int t = 0; t < n_threads; t++) {
+      pthread_join(threads[t], NULL);
+   }
+
+   for (int k = 0; k < moves; k++) {
+      movement_list[k] = 0.0;
+      for (int t = 0; t < n_threads; t++) {
+         movement_list[k] += movements[(size_t) t * moves + k];
+      }
+   }
+
+   free(movements);
+   free(chunks);
+   free(threads);
+   free(bounds);
+   free(balls);
 }
 
 void
@@ -525,6 +804,9 @@ draw_edges
    for (int j = 0; j < ball->n_children; j++) {
       double child_x_pos = ball->children[j]->position[0] - offset[0];
       double child_y_pos = ball->children[j]->position[1] - offset[1];
+      // Skip the bonds that fall within one pixel.
+      if ((int) x_pos == (int) child_x_pos &&
+          (int) y_pos == (int) child_y_pos) continue;
       cairo_set_line_width(cr, 1);
       cairo_set_source_rgb(cr, 0, 0, 0);
       cairo_move_to(cr, x_pos, y_pos);
@@ -562,16 +844,49 @@ draw_cairo_env
    cairo_t * cr,
    int       n_balls,
    ball_t ** ball_list,
-   int     * offset
+   int     * offset,
+   int     * canvas_size
 )
 {
    // Paint the background.
    cairo_set_source_rgb(cr, 1, 1, 1);
    cairo_paint(cr);
+   // Level of detail: balls below LOD_RADIUS would be invisible
+   // specks, and with millions of clusters they dominate the file
+   // size. Bin them on a one-pixel grid and draw one cell each.
+   int nx = canvas_size[0];
+   int ny = canvas_size[1];
+   int * bins = calloc((size_t) nx * ny, sizeof(int));
+   if (bins == NULL) {
+      fprintf(stderr, "Error in bins calloc: %s\n", strerror(errno));
+      exit(1);
+   }
    for (int i = 0; i < n_balls; i++) {
       ball_t * ball = ball_list[i];
-      // And then the graphs.
+      if (sqrt(ball->size / PI) < LOD_RADIUS) {
+         int x_bin = (int) (ball->position[0] - offset[0]);
+         int y_bin = (int) (ball->position[1] - offset[1]);
+         if (x_bin < 0) x_bin = 0;
+         if (x_bin >= nx) x_bin = nx - 1;
+         if (y_bin < 0) y_bin = 0;
+         if (y_bin >= ny) y_bin = ny - 1;
+         bins[(size_t) y_bin * nx + x_bin]++;
+         continue;
+      }
+      // The visible graphs are drawn as before.
       draw_edges(cr, ball, offset);
       draw_circles(cr, ball, offset);
    }
+   // Draw the occupied cells, darker where the balls pile up.
+   for (int y = 0; y < ny; y++) {
+      for (int x = 0; x < nx; x++) {
+         int count = bins[(size_t) y * nx + x];
+         if (count == 0) continue;
+         double shade = 0.85 / (1.0 + log(count));
+         cairo_set_source_rgb(cr, shade, shade, shade);
+         cairo_rectangle(cr, x, y, 1, 1);
+         cairo_fill(cr);
+      }
+   }
+   free(bins);
 }
@@ -4,11 +4,19 @@
 #define CANVAS_SIZE 600.0
 #define RAND_FACTOR CANVAS_SIZE / RAND_MAX
 #define PI 3.141592653589793238462643383279502884L
+#define BH_THETA 0.5 // Opening angle of the quadtree cells.
+#define LOD_RADIUS 0.5 // Balls below this radius (pixels) are binned.
 
 struct ball_t;
+struct chunk_t;
+struct qnode_t;
+struct qtree_t;
 struct star_t;
 
 typedef struct ball_t ball_t;
+typedef struct chunk_t chunk_t;
+typedef struct qnode_t qnode_t;
+typedef struct qtree_t qtree_t;
 typedef struct star_t star_t;
 
 struct ball_t {
@@ -27,7 +35,38 @@ struct star_t {
    double   radius;          // distance to most distant ball + its radius
 };
 
-void      force_directed_drawing(int, ball_t **);
+// Cell of the Barnes-Hut quadtree. Children are indices in the node
+// pool of the tree (0 means no child, the root is never a child).
+struct qnode_t {
+   double   center[2];   // (x,y) center of the cell
+   double   half;        // half side of the cell
+   double   mass;        // total size of the balls in the cell
+   double   com[2];      // mass-weighted sum of ball positions
+   int      count;       // # of balls in the cell
+   int      children[4]; // indices of the sub-cells (0 = none)
+   ball_t * ball;        // the ball, when the cell holds only one
+};
+
+// Pool-allocated quadtree, rebuilt at every iteration but keeping
+// its high-water capacity over the stars of a worker thread.
+struct qtree_t {
+   qnode_t      * nodes;
+   int            n_nodes;
+   int            n_slots;
+   unsigned int   seed; // for the nudge of coincident balls
+};
+
+// Slice of the star groups handled by one worker thread.
+struct chunk_t {
+   int       from;      // first group of the slice
+   int       to;        // one past the last group
+   int       moves;
+   int     * bounds;    // group j spans bounds[j] to bounds[j+1]
+   ball_t ** balls;     // balls sorted by star
+   double  * movements; // private movement sums of the thread
+};
+
+void      force_directed_drawing(int, ball_t **, const char *);
 //ball_t ** list_balls(FILE *, int *);
 //ball_t ** new_ball(char *);
 double    norm(double, double);
@@ -36,12 +75,20 @@ double    elastic(double);
 void      compute_force(ball_t *, ball_t *, int);
 double    move_ball(ball_t *);
 void      physics_loop(int, ball_t **, int, double *);
+void *    physics_chunk(void *);
+void      star_physics(qtree_t *, ball_t **, int, int, double *);
+int       qtree_node(qtree_t *, double, double, double);
+void      qtree_build(qtree_t *, ball_t **, int);
+void      qtree_insert(qtree_t *, int, ball_t *);
+void      qtree_descend(qtree_t *, int, ball_t *);
+void      qtree_repulsion(qtree_t *, int, ball_t *);
 void      regression(int, double *, double *);
 int       compar(const void *, const void *);
+int       compar_root(const void *, const void *);
 star_t ** list_stars(int, ball_t **, int *);
 void      spiralize_displacements(int, star_t **, int *);
 void      move_stars(int, int, ball_t **, star_t **);
 void      resize_canvas(int *, int, star_t **, int *);
-void      draw_cairo_env(cairo_t *, int, ball_t **, int *);
+void      draw_cairo_env(cairo_t *, int, ball_t **, int *, int *);
 void      draw_edges(cairo_t *, ball_t *, int *);
 void      draw_circles(cairo_t *, ball_t *, int *);
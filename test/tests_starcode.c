@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "unittest.h"
 #include "starcode.c"
 
@@ -485,6 +486,22 @@ test_starcode_7
       destroy_lookup(lut);
    }
 
+   // Lengths that need the widest k-mers: they are capped at
+   // MAX_K_FOR_LOOKUP and the tables of the k-mers longer than
+   // MAX_K_DIRECT_LOOKUP are hashed.
+   int expected_wide_klen[][4] = {
+      {14,14,14,14},
+      {14,14,14,15},
+      {14,14,15,15},
+      {14,15,15,15},
+      {15,15,15,15},
+      {15,15,15,16},
+      {15,15,16,16},
+      {15,16,16,16},
+      {16,16,16,16},
+      {16,16,16,16},
+   };
+
    for (int i = 0 ; i < 10 ; i++) {
       lookup_t * lut = new_lookup(59+i, 59+i, 3);
       test_assert_critical(lut != NULL);
@@ -492,7 +509,9 @@ test_starcode_7
       test_assert(lut->slen == 59+i);
       test_assert_critical(lut->klen != NULL);
       for (int j = 0 ; j < 4 ; j++) {
-         test_assert(lut->klen[j] == MAX_K_FOR_LOOKUP);
+         test_assert(lut->klen[j] == expected_wide_klen[i][j]);
+         test_assert(lut->hash[j] ==
+               (expected_wide_klen[i][j] > MAX_K_DIRECT_LOOKUP));
       }
       destroy_lookup(lut);
    }
@@ -558,49 +577,49 @@ test_starcode_9
    // Insert a too short string (nothing happens).
    useq_t *u = new_useq(0, "", NULL);
    test_assert_critical(u != NULL);
-   test_assert(lut_insert(lut, u) == 0);
+   test_assert(lut_insert(lut, u, 0) == 0);
    destroy_useq(u);
 
    // Insert the following k-mers: ACG|TAGC|GCTA|TAGC|GATCA
    u = new_useq(0, "ACGTAGCGCTATAGCGATCA", NULL);
    test_assert_critical(u != NULL);
-   test_assert(lut_insert(lut, u) == 0);
-   test_assert(lut_search(lut, u) == 1);
+   test_assert(lut_insert(lut, u, 0) == 0);
+   test_assert(lut_search(lut, u, 0) == 1);
    destroy_useq(u);
 
    u = new_useq(0, "CGTAGCGCTATAGCGATCAA", NULL);
    test_assert_critical(u != NULL);
-   test_assert(lut_search(lut, u) == 1);
+   test_assert(lut_search(lut, u, 0) == 1);
    destroy_useq(u);
 
    u = new_useq(0, "AAAATAGCGCCCCCCCCCCC", NULL);
    test_assert_critical(u != NULL);
-   test_assert(lut_search(lut, u) == 1);
+   test_assert(lut_search(lut, u, 0) == 1);
    destroy_useq(u);
 
    u = new_useq(0, "CCCCCCCCCCCCCCCGATCA", NULL);
    test_assert_critical(u != NULL);
-   test_assert(lut_search(lut, u) == 1);
+   test_assert(lut_search(lut, u, 0) == 1);
    destroy_useq(u);
 
    u = new_useq(0, "CCCCCGCTACCCCCCCCCCC", NULL);
    test_assert_critical(u != NULL);
-   test_assert(lut_search(lut, u) == 1);
+   test_assert(lut_search(lut, u, 0) == 1);
    destroy_useq(u);
 
    u = new_useq(0, "TAGCAAAAAAAAAAAAAAAA", NULL);
    test_assert_critical(u != NULL);
-   test_assert(lut_search(lut, u) == 1);
+   test_assert(lut_search(lut, u, 0) == 1);
    destroy_useq(u);
 
    u = new_useq(0, "CCCCCCCCCCCCCCGATCAC", NULL);
    test_assert_critical(u != NULL);
-   test_assert(lut_search(lut, u) == 0);
+   test_assert(lut_search(lut, u, 0) == 0);
    destroy_useq(u);
 
    u = new_useq(0, "AAAAAAAAAAAAAAAAAAAA", NULL);
    test_assert_critical(u != NULL);
-   test_assert(lut_search(lut, u) == 0);
+   test_assert(lut_search(lut, u, 0) == 0);
    destroy_useq(u);
 
    destroy_lookup(lut);
@@ -616,8 +635,8 @@ test_starcode_9
          seq[j] = untranslate[(int)(1 + 4*drand48())];
       } 
       u = new_useq(0, seq, NULL);
-      test_assert(lut_insert(lut, u) == 0);
-      test_assert(lut_search(lut, u) == 1);
+      test_assert(lut_insert(lut, u, 0) == 0);
+      test_assert(lut_search(lut, u, 0) == 1);
       destroy_useq(u);
    }
 
@@ -634,7 +653,7 @@ test_starcode_9
       }
       u = new_useq(0, seq, NULL);
       test_assert_critical(u != NULL);
-      test_assert(lut_insert(lut, u) == 0);
+      test_assert(lut_insert(lut, u, 0) == 0);
       destroy_useq(u);
    }
 
@@ -648,8 +667,9 @@ test_starcode_9
    lut = new_lookup(64, 64, 3);
    test_assert_critical(lut != NULL);
    for (int i = 0 ; i < 4 ; i++) {
-      // MAX_K_FOR_LOOKUP
-      test_assert_critical(lut->klen[i] == 14);
+      // Longer than MAX_K_DIRECT_LOOKUP: stored in hashed tables.
+      test_assert_critical(lut->klen[i] == 15 + (i == 3));
+      test_assert_critical(lut->hash[i] == 1);
    }
    for (int i = 0 ; i < 4096 ; i++) {
       char seq[65] = {0};
@@ -659,7 +679,7 @@ test_starcode_9
       } 
       u = new_useq(0, seq, NULL);
       test_assert_critical(u != NULL);
-      test_assert(lut_insert(lut, u) == 0);
+      test_assert(lut_insert(lut, u, 0) == 0);
       destroy_useq(u);
    }
 
@@ -703,51 +723,33 @@ test_starcode_10
 // Test 'read_file()'
 {
 
+   // The readers merge duplicate reads on the fly (see the hash
+   // table of 'useqhash_store()'), so 'read_file()' returns the
+   // unique sequences in order of first occurrence, with counts
+   // and one sequence id per read.
    const char * expected[] = {
    "AGGGCTTACAAGTATAGGCC",
    "TGCGCCAAGTACGATTTCCG",
    "CCTCATTATTTGTCGCAATG",
-   "AGGGCTTACAAGTATAGGCC",
-   "AGGGCTTACAAGTATAGGCC",
-   "GGGAGCCCACAGTAAGCGAA",
    "GGGAGCCCACAGTAAGCGAA",
    "TAGCCTGGTGCGACTGTCAT",
-   "TAGCCTGGTGCGACTGTCAT",
    "GGAAGCCCACAGCAAGCGAA",
-   "TGCGCCAAGTACGATTTCCG",
-   "GGGAGCCCACAGTAAGCGAA",
    "AGGGGTTACAAGTCTAGGCC",
-   "CCTCATTATTTGTCGCAATG",
-   "GGGAGCCCACAGTAAGCGAA",
-   "TAGCCTGGTGCGACTGTCAT",
-   "AGGGCTTACAAGTATAGGCC",
-   "TGCGCCAAGTACGATTTCCG",
-   "CCTCATTATTTGTCGCAATG",
-   "AGGGCTTACAAGTATAGGCC",
-   "TAGCCTGGTGCGACTGTCAT",
-   "AGGGCTTACAAGTATAGGCC",
    "TGCGCCAAGTAAGAATTCCG",
-   "GGGAGCCCACAGTAAGCGAA",
-   "GGGAGCCCACAGTAAGCGAA",
-   "TGCGCCAAGTACGATTTCCG",
-   "CCTCATTATTTGTCGCAATG",
-   "TAGCCTGGTGCGACTGTCAT",
-   "TGCGCCAAGTACGATTTCCG",
-   "CCTCATTATTTGTCGCAATG",
-   "CCTCATTATTTGTCGCAATG",
    "CCTCATTATTTACCGCAATG",
-   "TAGCCTGGTGCGACTGTCAT",
-   "TGCGCCAAGTACGATTTCCG",
    "TAACCTGGTGCGACTGTTAT",
    };
 
-   // Read raw file.
+   const int expected_count[] = {6,6,6,6,6,1,1,1,1,1};
+
+   // Read raw file (35 reads, 10 unique sequences).
    FILE *f = fopen("test_file.txt", "r");
-   gstack_t *useqS = read_file(f, NULL, 0);
-   test_assert(useqS->nitems == 35);
+   gstack_t *useqS = read_file(f, NULL, 0, 1);
+   test_assert(useqS->nitems == 10);
    for (int i = 0 ; i < useqS->nitems ; i++) {
       useq_t * u = (useq_t *) useqS->items[i];
-      test_assert(u->count == 1);
+      test_assert(u->count == expected_count[i]);
+      test_assert(u->nids == (unsigned int) expected_count[i]);
       test_assert(strcmp(u->seq, expected[i]) == 0);
    }
 
@@ -758,13 +760,15 @@ test_starcode_10
    free(useqS);
    fclose(f);
 
-   // Read fasta file.
+   const int fasta_count[] = {3,1,1};
+
+   // Read fasta file (5 records, 3 unique sequences).
    f = fopen("test_file.fasta", "r");
-   useqS = read_file(f, NULL, 0);
-   test_assert(useqS->nitems == 5);
+   useqS = read_file(f, NULL, 0, 1);
+   test_assert(useqS->nitems == 3);
    for (int i = 0 ; i < useqS->nitems ; i++) {
       useq_t * u = (useq_t *) useqS->items[i];
-      test_assert(u->count == 1);
+      test_assert(u->count == fasta_count[i]);
       test_assert(strcmp(u->seq, expected[i]) == 0);
    }
 
@@ -775,13 +779,13 @@ test_starcode_10
    free(useqS);
    fclose(f);
 
-   // Read fastq file.
+   // Read fastq file (5 records, 3 unique sequences).
    f = fopen("test_file1.fastq", "r");
-   useqS = read_file(f, NULL, 0);
-   test_assert(useqS->nitems == 5);
+   useqS = read_file(f, NULL, 0, 1);
+   test_assert(useqS->nitems == 3);
    for (int i = 0 ; i < useqS->nitems ; i++) {
       useq_t * u = (useq_t *) useqS->items[i];
-      test_assert(u->count == 1);
+      test_assert(u->count == fasta_count[i]);
       test_assert(strcmp(u->seq, expected[i]) == 0);
    }
 
@@ -796,26 +800,23 @@ test_starcode_10
       "AGGGCTTACAAGTATAGGCC---------AAGGGCTTACAAGTATAGGC",
       "TGCGCCAAGTACGATTTCCG---------ATGCGCCAAGTACGATTTCC",
       "CCTCATTATTTGTCGCAATG---------ACCTCATTATTTGTCGCAAT",
-      "AGGGCTTACAAGTATAGGCC---------AAGGGCTTACAAGTATAGGC",
-      "AGGGCTTACAAGTATAGGCC---------AAGGGCTTACAAGTATAGGC",
    };
 
    char *PE_fastq_headers[] = {
       "AGGGCTTACAAGTATAGGCC/AAGGGCTTACAAGTATAGGC",
       "TGCGCCAAGTACGATTTCCG/ATGCGCCAAGTACGATTTCC",
       "CCTCATTATTTGTCGCAATG/ACCTCATTATTTGTCGCAAT",
-      "AGGGCTTACAAGTATAGGCC/AAGGGCTTACAAGTATAGGC",
-      "AGGGCTTACAAGTATAGGCC/AAGGGCTTACAAGTATAGGC",
    };
 
-   // Read paired-end fastq file.
+   // Read paired-end fastq file (5 pairs, 3 unique pairs). The
+   // 'info' of a unique pair is the one of its first occurrence.
    FILE *f1 = fopen("test_file1.fastq", "r");
    FILE *f2 = fopen("test_file2.fastq", "r");
-   useqS = read_file(f1, f2, 0);
-   test_assert(useqS->nitems == 5);
+   useqS = read_file(f1, f2, 0, 1);
+   test_assert(useqS->nitems == 3);
    for (int i = 0 ; i < useqS->nitems ; i++) {
       useq_t * u = (useq_t *) useqS->items[i];
-      test_assert(u->count == 1);
+      test_assert(u->count == fasta_count[i]);
       test_assert(strcmp(u->seq, PE_expected[i]) == 0);
       test_assert(strcmp(u->info, PE_fastq_headers[i]) == 0);
    }
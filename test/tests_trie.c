@@ -26,6 +26,26 @@ render
    return string;
 }
 
+char *
+crender
+(
+   ctrie_t  * trie,
+   uint32_t   node,
+   char     * string,
+   int        depth
+)
+{
+   for (int i = 0 ; i < 6 ; i++) {
+      uint32_t child = trie->nodes[node].child[i];
+      if (child == 0) continue;
+      *string++ = untranslate[i];
+      // The slots of the last characters refer to the data array.
+      if (depth == (int) trie->height - 1) continue;
+      string = crender(trie, child, string, depth+1);
+   }
+   return string;
+}
+
 
 //  Test setup function  //
 
@@ -168,8 +188,11 @@ test_base_2
    node_t *root = new_trienode();
    test_assert_critical(root != NULL);
 
+   nodearena_t *arena = new_nodearena();
+   test_assert_critical(arena != NULL);
+
    for (int i = 0 ; i < 6 ; i++) {
-      node_t *node = insert(root, i);
+      node_t *node = insert(root, i, arena);
       test_assert_critical(node != NULL);
       for (int j = 0 ; j < 6 ; j++) {
          test_assert(node->child[j] == NULL);
@@ -182,8 +205,8 @@ test_base_2
       test_assert(root->child[i] == node);
    }
 
-   // Destroy manually.
-   for (int i = 0 ; i < 6 ; i++) free(root->child[i]);
+   // The nodes belong to the arena.
+   destroy_nodearena(arena);
    free(root);
 
 }
@@ -1362,6 +1385,396 @@ test_search
 }
 
 
+void
+test_compact
+(void)
+// Build a compact trie with the same strings as 'setup()' and check
+// that 'search_ctrie()' returns the same hits as 'search()'.
+{
+
+   const char *string[24] = {
+   "AAAAAAAAAAAAAAAAAAAA",
+   "AAAAAAAAAANAAAAAAAAA",
+   "NAAAAAAAAAAAAAAAAAAN",
+   "NNAAAAAAAAAAAAAAAANN",
+   "AAAAAAAAAAAAAAAAAAAT",
+   "TAAAAAAAAAAAAAAAAAAA",
+   "GGATTAGATCACCGCTTTCG",
+   "TTGGTATATGTCATAGAAAT",
+   "TTCGGAGCGACTAATATAGG",
+   "CGAGGCGTATAGTGTTTCCA",
+   "ATGCTAGGGTACTCGATAAC",
+   "CATACAGTATTCGACTAAGG",
+   "TGGAGATGATGAAGAAGACC",
+   "GGGAGACTTTTCCAGGGTAT",
+   "TCATTGTGATAGCTCGTAAC",
+   " GGATATCAAGGGTTACTAG",
+   " AAAAAAAAAAAAAAAAAAA",
+   "            AAAAAAAA",
+   "            NNNNNNNN",
+   "                   A",
+   "                   N",
+   "                    ",
+   "GGGAGAC----CCAGGGTAT",
+   "GGGAGAC----GCAGGGTAT",
+   };
+
+   // Small hints to exercise the growth of the blocks.
+   ctrie_t * trie = new_ctrie(20, 2, 2);
+   test_assert_critical(trie != NULL);
+
+   for (int i = 0 ; i < 24 ; i++) {
+      void **data = insert_string_ctrie(trie, string[i]);
+      test_assert_critical(data != NULL);
+      test_assert(*data == NULL);
+      // Set node data to self (non 'NULL').
+      *data = &LEAF_NODE;
+   }
+
+   // Inserting an existing string returns its data slot.
+   void **data = insert_string_ctrie(trie, string[0]);
+   test_assert_critical(data != NULL);
+   test_assert(*data == &LEAF_NODE);
+
+   // The structure is the same as the one built by 'setup()'.
+   char trie_rendering[] =
+   "NNAAAAAAAAAAAAAAAANN"
+    "AAAAAAAAAAAAAAAAAAN"
+   "AAAAAAAAAANAAAAAAAAA"
+             "AAAAAAAAAA"
+                      "T"
+    "TGCTAGGGTACTCGATAAC"
+   "CATACAGTATTCGACTAAGG"
+    "GAGGCGTATAGTGTTTCCA"
+   "GGATTAGATCACCGCTTTCG"
+     "GAGACNNNNCCAGGGTAT"
+              "GCAGGGTAT"
+          "TTTTCCAGGGTAT"
+   "TAAAAAAAAAAAAAAAAAAA"
+    "CATTGTGATAGCTCGTAAC"
+    "GGAGATGATGAAGAAGACC"
+    "TCGGAGCGACTAATATAGG"
+     "GGTATATGTCATAGAAAT"
+   " AAAAAAAAAAAAAAAAAAA"
+    "GGATATCAAGGGTTACTAG"
+    "           NNNNNNNN"
+               "AAAAAAAA"
+               "       N"
+                      "A"
+                      " ";
+
+   char * trie_buff = calloc(512, sizeof(char));
+   test_assert_critical(trie_buff != NULL);
+   crender(trie, 0, trie_buff, 0);
+   test_assert(strcmp(trie_rendering, trie_buff) == 0);
+   test_assert(count_cnodes(trie) == 360);
+   free(trie_buff);
+
+   gstack_t **hits = new_tower(4);
+   test_assert_critical(hits != NULL);
+
+   // Same queries and hit counts as in 'test_search()'. //
+
+   int err = search_ctrie(trie, "AAAAAAAAAAAAAAAAAAAA", 3, hits, 0, 18);
+   test_assert(err == 0);
+   test_assert(check_trie_error_and_reset() == 0);
+   test_assert(hits[0]->nitems == 1);
+   test_assert(hits[1]->nitems == 4);
+   test_assert(hits[2]->nitems == 1);
+   test_assert(hits[3]->nitems == 0);
+
+   reset_gstack(hits);
+   err = search_ctrie(trie, "AAAAAAAAAAAAAAAAAATA", 3, hits, 18, 3);
+   test_assert(err == 0);
+   test_assert(check_trie_error_and_reset() == 0);
+   test_assert(hits[0]->nitems == 0);
+   test_assert(hits[1]->nitems == 2);
+   test_assert(hits[2]->nitems == 3);
+   test_assert(hits[3]->nitems == 1);
+
+   reset_gstack(hits);
+   err = search_ctrie(trie, "AAAGAAAAAAAAAAAAAATA", 3, hits, 3, 15);
+   test_assert(err == 0);
+   test_assert(check_trie_error_and_reset() == 0);
+   test_assert(hits[0]->nitems == 0);
+   test_assert(hits[1]->nitems == 0);
+   test_assert(hits[2]->nitems == 2);
+   test_assert(hits[3]->nitems == 3);
+
+   reset_gstack(hits);
+   err = search_ctrie(trie, "AAAGAAAAAAAAAAAGACTG", 3, hits, 15, 15);
+   test_assert(err == 0);
+   test_assert(check_trie_error_and_reset() == 0);
+   test_assert(hits[0]->nitems == 0);
+   test_assert(hits[1]->nitems == 0);
+   test_assert(hits[2]->nitems == 0);
+   test_assert(hits[3]->nitems == 0);
+
+   reset_gstack(hits);
+   err = search_ctrie(trie, "AAAGAAAAAAAAAAAAAAAA", 3, hits, 15, 0);
+   test_assert(err == 0);
+   test_assert(check_trie_error_and_reset() == 0);
+   test_assert(hits[0]->nitems == 0);
+   test_assert(hits[1]->nitems == 2);
+   test_assert(hits[2]->nitems == 3);
+   test_assert(hits[3]->nitems == 1);
+
+   reset_gstack(hits);
+   err = search_ctrie(trie, "TAAAAAAAAAAAAAAAAAAA", 3, hits, 0, 19);
+   test_assert(err == 0);
+   test_assert(check_trie_error_and_reset() == 0);
+   test_assert(hits[0]->nitems == 1);
+   test_assert(hits[1]->nitems == 2);
+   test_assert(hits[2]->nitems == 3);
+   test_assert(hits[3]->nitems == 0);
+
+   reset_gstack(hits);
+   err = search_ctrie(trie, "TAAAAAAAAAAAAAAAAAAG", 3, hits, 19, 0);
+   test_assert(err == 0);
+   test_assert(check_trie_error_and_reset() == 0);
+   test_assert(hits[0]->nitems == 0);
+   test_assert(hits[1]->nitems == 1);
+   test_assert(hits[2]->nitems == 4);
+   test_assert(hits[3]->nitems == 1);
+
+   reset_gstack(hits);
+   err = search_ctrie(trie, " AAAAAAAAAAAAAAAAAAA", 3, hits, 0, 1);
+   test_assert(err == 0);
+   test_assert(check_trie_error_and_reset() == 0);
+   test_assert(hits[0]->nitems == 1);
+   test_assert(hits[1]->nitems == 4);
+   test_assert(hits[2]->nitems == 1);
+   test_assert(hits[3]->nitems == 0);
+
+   reset_gstack(hits);
+   err = search_ctrie(trie, "   ATGCTAGGGTACTCGAT", 3, hits, 0, 1);
+   test_assert(err == 0);
+   test_assert(check_trie_error_and_reset() == 0);
+   test_assert(hits[0]->nitems == 0);
+   test_assert(hits[1]->nitems == 0);
+   test_assert(hits[2]->nitems == 0);
+   test_assert(hits[3]->nitems == 1);
+
+   reset_gstack(hits);
+   err = search_ctrie(trie, " AAAAAAAAAAAAAAAAAAT", 3, hits, 1, 0);
+   test_assert(err == 0);
+   test_assert(check_trie_error_and_reset() == 0);
+   test_assert(hits[0]->nitems == 0);
+   test_assert(hits[1]->nitems == 2);
+   test_assert(hits[2]->nitems == 4);
+   test_assert(hits[3]->nitems == 0);
+
+   reset_gstack(hits);
+   err = search_ctrie(trie, "ATGCTAGGGTACTCGATAAC", 0, hits, 0, 0);
+   test_assert(err == 0);
+   test_assert(check_trie_error_and_reset() == 0);
+   test_assert(hits[0]->nitems == 1);
+   test_assert(hits[1]->nitems == 0);
+   test_assert(hits[2]->nitems == 0);
+   test_assert(hits[3]->nitems == 0);
+
+   reset_gstack(hits);
+   err = search_ctrie(trie, "NAAAAAAAAAAAAAAAAAAN", 2, hits, 0, 1);
+   test_assert(err == 0);
+   test_assert(check_trie_error_and_reset() == 0);
+   test_assert(hits[0]->nitems == 0);
+   test_assert(hits[1]->nitems == 0);
+   test_assert(hits[2]->nitems == 5);
+   test_assert(hits[3]->nitems == 0);
+
+   // Check error messages.
+   redirect_stderr();
+   err = search_ctrie(trie, "AAAAAAAAAAAAAAAAAAAAA", 3, hits, 0, 0);
+   unredirect_stderr();
+   test_assert(err > 0);
+   test_assert_stderr("error: query longer than allowed max\n");
+
+   redirect_stderr();
+   err = search_ctrie(trie, " TGCTAGGGTACTCGATAAC", 9, hits, 0, 0);
+   unredirect_stderr();
+   test_assert(err > 0);
+   test_assert_stderr("error: requested tau greater than 8\n");
+
+   redirect_stderr();
+   data = insert_string_ctrie(trie, "AAAAAAAAAAAAAAAAAAAAA");
+   unredirect_stderr();
+   test_assert(data == NULL);
+   test_assert(check_trie_error_and_reset() > 0);
+   test_assert_stderr("error: can only insert string of length 20\n");
+
+   destroy_tower(hits);
+   destroy_ctrie(trie, NULL);
+
+}
+
+
+void
+test_save_load
+(void)
+// Round trip of 'save_ctrie()' / 'load_ctrie()': the loaded trie
+// returns the same hits as the original, its data slots come back
+// empty in insertion order, and it cannot grow.
+{
+
+   const char *string[6] = {
+   "AAAAAAAAAAAAAAAAAAAA",
+   "AAAAAAAAAANAAAAAAAAA",
+   "GGATTAGATCACCGCTTTCG",
+   " GGATATCAAGGGTTACTAG",
+   "GGGAGAC----CCAGGGTAT",
+   "AAAAAAAAAAAAAAAAAAAT",
+   };
+
+   ctrie_t * trie = new_ctrie(20, 2, 2);
+   test_assert_critical(trie != NULL);
+   for (int i = 0 ; i < 6 ; i++) {
+      void **data = insert_string_ctrie(trie, string[i]);
+      test_assert_critical(data != NULL);
+      *data = (void *) (string + i);
+   }
+
+   FILE *f = tmpfile();
+   test_assert_critical(f != NULL);
+   test_assert(save_ctrie(trie, f) == 0);
+   rewind(f);
+
+   ctrie_t * loaded = load_ctrie(f);
+   test_assert_critical(loaded != NULL);
+   fclose(f);
+
+   test_assert(loaded->height == trie->height);
+   test_assert(loaded->nnodes == trie->nnodes);
+   test_assert(loaded->ndata == trie->ndata);
+
+   // The data slots are empty, in insertion order, and re-inserting
+   // the strings returns them without growing the trie.
+   for (int i = 0 ; i < 6 ; i++) {
+      void **data = insert_string_ctrie(loaded, string[i]);
+      test_assert_critical(data != NULL);
+      test_assert(data == loaded->data + i);
+      test_assert(*data == NULL);
+      *data = (void *) (string + i);
+   }
+   test_assert(loaded->nnodes == trie->nnodes);
+
+   // New strings cannot be inserted in a loaded trie.
+   redirect_stderr();
+   void **data = insert_string_ctrie(loaded, "TTTTTTTTTTTTTTTTTTTT");
+   unredirect_stderr();
+   test_assert(data == NULL);
+   test_assert(check_trie_error_and_reset() > 0);
+   test_assert_stderr("error: cannot grow a loaded trie\n"
+         "error: could not insert string\n");
+
+   // The loaded trie returns the same hits as the original.
+   gstack_t **hits1 = new_tower(4);
+   gstack_t **hits2 = new_tower(4);
+   test_assert_critical(hits1 != NULL && hits2 != NULL);
+
+   const char *query[3] = {
+   "AAAAAAAAAAAAAAAAAAAA",
+   "GGGAGACTTTTCCAGGGTAT",
+   " GGATATCAAGGGTTACTAG",
+   };
+   for (int q = 0 ; q < 3 ; q++) {
+      reset_gstack(hits1);
+      reset_gstack(hits2);
+      test_assert(search_ctrie(trie, query[q], 3, hits1, 0, 0) == 0);
+      test_assert(search_ctrie(loaded, query[q], 3, hits2, 0, 0) == 0);
+      for (int d = 0 ; d < 4 ; d++) {
+         test_assert(hits1[d]->nitems == hits2[d]->nitems);
+         for (int j = 0 ; j < hits1[d]->nitems ; j++) {
+            test_assert(hits1[d]->items[j] == hits2[d]->items[j]);
+         }
+      }
+   }
+
+   destroy_tower(hits1);
+   destroy_tower(hits2);
+   destroy_ctrie(trie, NULL);
+   destroy_ctrie(loaded, NULL);
+
+}
+
+
+void
+test_sorted_insert
+(void)
+// 'insert_string_ctrie_sorted()' builds the same trie as
+// 'insert_string_ctrie()' when the strings come in lexicographic
+// order.
+{
+
+   // Sorted by 'strcmp()' (space < '-' < DNA letters).
+   const char *string[10] = {
+   "                    ",
+   "                   A",
+   "            AAAAAAAA",
+   " AAAAAAAAAAAAAAAAAAA",
+   "AAAAAAAAAAAAAAAAAAAA",
+   "AAAAAAAAAANAAAAAAAAA",
+   "GGGAGAC----CCAGGGTAT",
+   "GGGAGAC----GCAGGGTAT",
+   "GGGAGACTTTTCCAGGGTAT",
+   "TAAAAAAAAAAAAAAAAAAA",
+   };
+
+   ctrie_t * trie = new_ctrie(20, 2, 2);
+   ctrie_t * bulk = new_ctrie(20, 2, 2);
+   test_assert_critical(trie != NULL && bulk != NULL);
+
+   uint32_t spine[20];
+   for (int i = 0 ; i < 10 ; i++) {
+      void **data = insert_string_ctrie(trie, string[i]);
+      test_assert_critical(data != NULL);
+      *data = &LEAF_NODE;
+      data = insert_string_ctrie_sorted(bulk, string[i],
+            i > 0 ? string[i-1] : NULL, spine);
+      test_assert_critical(data != NULL);
+      test_assert(data == bulk->data + i);
+      test_assert(*data == NULL);
+      *data = &LEAF_NODE;
+   }
+
+   // Re-inserting the last string returns its data slot.
+   void **data = insert_string_ctrie_sorted(bulk, string[9],
+         string[9], spine);
+   test_assert_critical(data != NULL);
+   test_assert(*data == &LEAF_NODE);
+
+   test_assert(bulk->nnodes == trie->nnodes);
+   test_assert(bulk->ndata == trie->ndata);
+
+   // Same rendering, so the same structure.
+   char * buff1 = calloc(512, sizeof(char));
+   char * buff2 = calloc(512, sizeof(char));
+   test_assert_critical(buff1 != NULL && buff2 != NULL);
+   crender(trie, 0, buff1, 0);
+   crender(bulk, 0, buff2, 0);
+   test_assert(strcmp(buff1, buff2) == 0);
+   free(buff1);
+   free(buff2);
+
+   // Same hits as well.
+   gstack_t **hits1 = new_tower(4);
+   gstack_t **hits2 = new_tower(4);
+   test_assert_critical(hits1 != NULL && hits2 != NULL);
+   test_assert(search_ctrie(trie, "AAAAAAAAAAAAAAAAAAAA",
+            3, hits1, 0, 0) == 0);
+   test_assert(search_ctrie(bulk, "AAAAAAAAAAAAAAAAAAAA",
+            3, hits2, 0, 0) == 0);
+   for (int d = 0 ; d < 4 ; d++) {
+      test_assert(hits1[d]->nitems == hits2[d]->nitems);
+   }
+
+   destroy_tower(hits1);
+   destroy_tower(hits2);
+   destroy_ctrie(trie, NULL);
+   destroy_ctrie(bulk, NULL);
+
+}
+
+
 void
 test_mem_1
 (void)
@@ -1670,6 +2083,9 @@ const test_case_t test_cases_trie[] = {
       {"trie/base/8", test_base_8},
       {"errmsg",      test_errmsg},
       {"search",      test_search},
+      {"compact",     test_compact},
+      {"saveload",    test_save_load},
+      {"sortedinsert", test_sorted_insert},
       {"mem/1",       test_mem_1},
       {"mem/2",       test_mem_2},
       {"mem/3",       test_mem_3},